@@ -13,16 +13,20 @@
 #include "../../kv_msg.h"
 #include "../../kv_ring.h"
 #include "../../utils/ditto_wrapper.h"
-#include "../../utils/timing.h"
 #include "../../utils/uthash.h"
+#include "spdk/env.h"
 struct {
     uint32_t ssd_num;
     uint32_t worker_num;
     uint32_t storage_stride;
     uint32_t thread_num;
     uint32_t concurrent_io_num, copy_concurrency;
-    uint32_t set_batch;
+    uint32_t set_batch, set_batch_bytes, set_budget_us;
     uint32_t ring_num, vid_per_ssd, rpl_num;
+    uint32_t checkpoint_period_s;
+    uint32_t max_value_size, value_buf_num;
+    uint32_t multi_msg_size;
+    uint32_t srq_depth;
     char json_config_file[1024];
     char server_conf_file[1024];
     char etcd_ip[32];
@@ -31,6 +35,8 @@ struct {
     char local_port[16];
     bool ditto;
     bool ours;
+    bool recover;
+    bool key_index;
 
 } opt = {.ssd_num = 4,
          .worker_num = 4,
@@ -39,13 +45,22 @@ struct {
          .concurrent_io_num = 2048,
          .copy_concurrency = 32,
          .set_batch = 1,
+         .set_batch_bytes = 65536,
+         .set_budget_us = 200,
          .ring_num = 128,
          .vid_per_ssd = 128,
          .rpl_num = 1,
+         .checkpoint_period_s = KV_DATA_STORE_CHECKPOINT_PERIOD / 1000000,
+         .max_value_size = 1U << 20,
+         .value_buf_num = 8,
+         .multi_msg_size = 16384,
+         .srq_depth = 0,
          .json_config_file = "server.config.json",
          .server_conf_file = "app/leed/ditto/experiments/configs/server_conf_sample.json",
          .ditto = false,
          .ours = false,
+         .recover = false,
+         .key_index = false,
          .etcd_ip = "127.0.0.1",
          .etcd_port = "2379",
          .local_ip = "10.3.4.6",
@@ -61,6 +76,8 @@ static void help(void) {
     printf("  -i <io_num>      Set the maximum number of concurrent I/Os: %u\n", opt.concurrent_io_num);
     printf("  -I <copy_concur> Set the copy concurrency: %u\n", opt.copy_concurrency);
     printf("  -b <set_batch>   Set the batch size of set buffers: %u\n", opt.set_batch);
+    printf("  -B <batch_bytes> Set the maximum number of value bytes in a set buffer: %u\n", opt.set_batch_bytes);
+    printf("  -u <budget_us>   Set the latency budget of buffered sets in microseconds: %u\n", opt.set_budget_us);
     printf("  -T <thread_num>  Set the number of threads for handling RDMA requests: %u\n", opt.thread_num);
     printf("  -s <etcd_ip>     Set the etcd's IP: %s\n", opt.etcd_ip);
     printf("  -P <etcd_port>   Set the etcd's port: %s\n", opt.etcd_port);
@@ -69,11 +86,21 @@ static void help(void) {
     printf("  -m <vid_per_ssd> Set the number of VID per SSD (must be same within a cluster): %u\n", opt.vid_per_ssd);
     printf("  -R <rpl_num>     Set the number of replica (must be same within a cluster): %u\n", opt.rpl_num);
     printf("  -C <ditto/ours>  Enable caching\n");
+    printf("  -k <period_s>    Set the checkpoint period of the data stores in seconds, 0 to disable: %u\n",
+           opt.checkpoint_period_s);
+    printf("  -K               Recover the data stores from their last checkpoint, else by scanning their bucket log\n");
+    printf("  -v <value_size>  Set the maximum value size, the values larger than a block are moved by RDMA READ/WRITE: %u\n",
+           opt.max_value_size);
+    printf("  -V <buf_num>     Set the number of buffers for these values per worker: %u\n", opt.value_buf_num);
+    printf("  -O               Keep an ordered index of the keys of the data stores, for the scans\n");
+    printf("  -M <msg_size>    Set the maximum size of the multi-op messages of the clients: %u\n", opt.multi_msg_size);
+    printf("  -q <srq_depth>   Set the number of request buffers of each RDMA thread, 0 for its share of -i plus half: %u\n",
+           opt.srq_depth);
 }
 
 static void get_options(int argc, char **argv) {
     int ch;
-    while ((ch = getopt(argc, argv, "hr:d:S:c:f:i:T:s:P:l:p:m:R:I:b:C:")) != -1) switch (ch) {
+    while ((ch = getopt(argc, argv, "hr:d:S:c:f:i:T:s:P:l:p:m:R:I:b:B:u:C:k:KV:v:OM:q:")) != -1) switch (ch) {
             case 'd':
                 opt.ssd_num = atol(optarg);
                 break;
@@ -95,6 +122,12 @@ static void get_options(int argc, char **argv) {
             case 'b':
                 opt.set_batch = atol(optarg);
                 break;
+            case 'B':
+                opt.set_batch_bytes = atol(optarg);
+                break;
+            case 'u':
+                opt.set_budget_us = atol(optarg);
+                break;
             case 'T':
                 opt.thread_num = atol(optarg);
                 break;
@@ -116,6 +149,27 @@ static void get_options(int argc, char **argv) {
             case 'R':
                 opt.rpl_num = atol(optarg);
                 break;
+            case 'k':
+                opt.checkpoint_period_s = atol(optarg);
+                break;
+            case 'K':
+                opt.recover = true;
+                break;
+            case 'v':
+                opt.max_value_size = atol(optarg);
+                break;
+            case 'V':
+                opt.value_buf_num = atol(optarg);
+                break;
+            case 'O':
+                opt.key_index = true;
+                break;
+            case 'M':
+                opt.multi_msg_size = atol(optarg);
+                break;
+            case 'q':
+                opt.srq_depth = atol(optarg);
+                break;
             case 'C':
                 if (strcmp(optarg, "ditto") == 0) {
                     opt.ditto = true;
@@ -143,19 +197,34 @@ struct set_buffer {
     uint8_t key_length[SET_CTX_BUFFER_SIZE];
     uint8_t *value[SET_CTX_BUFFER_SIZE];
     uint32_t value_length[SET_CTX_BUFFER_SIZE];
+    uint32_t expire[SET_CTX_BUFFER_SIZE];
     struct io_ctx *io[SET_CTX_BUFFER_SIZE];
     uint32_t buffer_size;
-    struct timeval active;
+    uint64_t batch_bytes;  // value log offset of the next value, relative to the batch
+    uint64_t oldest_tsc;
 };
 
+// group commit: a set buffer is flushed when it is full, when its oldest set has waited for the latency
+// budget, or as soon as its data store has nothing else in flight.
+enum { FLUSH_FULL, FLUSH_BUDGET, FLUSH_IDLE, FLUSH_REASONS };
+#define BATCH_HIST_SIZE 8  // power-of-two buckets of batch sizes, up to SET_CTX_BUFFER_SIZE
+
 struct worker_t {
     struct kv_storage storage[MAX_STORAGE_STRIDE];
     struct kv_data_store data_store[MAX_STORAGE_STRIDE];
     struct set_buffer set_buffer[MAX_STORAGE_STRIDE];
+    void *buf_poller;
+    uint32_t recovering;
+    uint64_t batch_hist[BATCH_HIST_SIZE];
+    uint64_t flushes[FLUSH_REASONS];
+    // the values of the messages with KV_MSG_EXT_VALUE are staged in these buffers, the ios wait for a free one.
+    kv_rdma_mr *value_bufs;
+    uint32_t free_value_bufs;
+    STAILQ_HEAD(, io_ctx) value_waiters;
 } * workers;
 
 kv_rdma_handle server;
-kv_rdma_mrs_handle server_mrs;
+kv_rdma_mrs_handle server_mrs, value_mrs, copy_mrs;
 
 struct io_ctx {
     void *req_h;
@@ -174,27 +243,65 @@ struct io_ctx {
     uint8_t key_length[SET_CTX_BUFFER_SIZE];
     uint8_t *value[SET_CTX_BUFFER_SIZE];
     uint32_t value_length[SET_CTX_BUFFER_SIZE];
+    uint32_t expire[SET_CTX_BUFFER_SIZE];
     struct io_ctx *io[SET_CTX_BUFFER_SIZE];
     uint64_t value_offset[SET_CTX_BUFFER_SIZE];
     uint64_t bucket_id[SET_CTX_BUFFER_SIZE];
     struct kv_bucket_segment seg[SET_CTX_BUFFER_SIZE];
     uint32_t buffer_size;
+    kv_rdma_mr value_buf;
+    bool value_staged;
+    uint32_t scan_len;                 // the bytes of records packed by a scan or a multi-get
+    struct kv_rdma_remote_buf remote;  // the buffer of the sender
+    kv_rdma_mr copy_mr;                // of copy_mrs, for the copies by this io of values too large for the message
+    kv_rdma_mr copy_value;             // copy_mr while it holds the value of the copy
+    struct multi_op *ops;              // of a KV_MSG_MULTI, answered once ops_left drops to 0
+    uint32_t ops_left;
+    STAILQ_ENTRY(io_ctx) next;
+};
+
+// an op of a KV_MSG_MULTI, served straight by its data store: the ring only passes the ops with nothing to forward.
+struct multi_op {
+    struct io_ctx *io;
+    struct kv_msg *msg;
+    uint32_t worker_id;
+    uint32_t storage_id;
+    uint32_t room;
+    kv_data_store_ctx ds_ctx;
 };
+static __thread struct kv_freelist multi_ops;  // arrays of KV_MSG_MULTI_MAX_OPS
 
 struct kv_mempool *io_pool, *copy_pool;
 struct kv_ds_queue ds_queue;
 
-static void *buf_poller = NULL;
-
 // #define WORKER_INDEX ((self - workers) * opt.storage_stride + i)
 #define WORKER_INDEX (i * MAX_SSD_WORKERS + (self - workers))
 
 static void worker_stop(void *arg) {
     struct worker_t *self = arg;
+    struct kv_storage_pool_stats stats;
+    kv_storage_pool_stats(&stats);
+    printf("worker %zu DMA buffer pool hits/misses: 512B %lu/%lu, 4KB %lu/%lu, 64KB %lu/%lu, oversized %lu\n",
+           (size_t)(self - workers), stats.hits[0], stats.misses[0], stats.hits[1], stats.misses[1], stats.hits[2],
+           stats.misses[2], stats.oversized);
+    printf("worker %zu set batch sizes:", (size_t)(self - workers));
+    for (uint32_t b = 0; b < BATCH_HIST_SIZE; ++b) printf(" %u-%u: %lu", 1u << b, (2u << b) - 1, self->batch_hist[b]);
+    printf(", flushes full/budget/idle: %lu/%lu/%lu\n", self->flushes[FLUSH_FULL], self->flushes[FLUSH_BUDGET],
+           self->flushes[FLUSH_IDLE]);
+    kv_app_poller_unregister(&self->buf_poller);
+    kv_free(self->value_bufs);
     for (uint32_t i = 0; i < MAX_STORAGE_STRIDE; ++i) {
         if (WORKER_INDEX >= opt.ssd_num) {
             break;
         }
+        struct kv_data_store *ds = &self->data_store[i];
+        struct kv_value_log_stats *log_stats = &ds->value_log.stats;
+        printf("data store %u value log stalls id log/victim: %lu/%lu, space waits: %lu, write fails: %lu, "
+               "admission throttles: %lu, compaction deferrals: %lu\n",
+               ds->ds_id, log_stats->id_log_stalls, log_stats->victim_stalls, log_stats->space_waits,
+               log_stats->write_fails, ds_queue.cost_model[ds->ds_id].throttles, ds->io_sched.deferrals);
+        printf("data store %u write amplification: %lf, %lu segments compacted, %lu given back\n", ds->ds_id,
+               kv_value_log_write_amplification(log_stats), log_stats->gc_segments, log_stats->gc_aborts);
         kv_data_store_fini(&self->data_store[i]);
         kv_storage_fini(&self->storage[i]);
     }
@@ -225,6 +332,104 @@ static void buffered_send_response(void *arg) {
     }
 }
 
+// --- values moved by RDMA READ/WRITE ---
+static void io_start(void *arg);
+static inline uint8_t *io_value(struct io_ctx *io) {
+    return io->value_buf ? kv_rdma_get_value_buf(io->value_buf) : KV_MSG_VALUE(io->msg);
+}
+// a TTL is relative to the data store of each replica, whose clocks may differ by a little.
+static inline uint32_t io_expire(struct worker_t *self, struct io_ctx *io) {
+    return io->msg->flags & KV_MSG_TTL ? kv_data_store_expire(&self->data_store[io->storage_id], io->msg->ttl) : 0;
+}
+static inline uint32_t ext_value_room(struct io_ctx *io) {
+    return io->remote.length < opt.max_value_size ? io->remote.length : opt.max_value_size;
+}
+// a scan or a multi-get responds with records, which go to the buffer of the client when it describes one.
+static inline bool has_records(uint32_t type) { return type == KV_MSG_SCAN || type == KV_MSG_MGET; }
+static inline bool is_ext_value(struct kv_msg *msg) {
+    if (has_records(msg->type)) return ((struct kv_msg_scan *)KV_MSG_VALUE(msg))->records.length != 0;
+    return (msg->flags & KV_MSG_EXT_VALUE) &&
+           (msg->type == KV_MSG_SET || msg->type == KV_MSG_BUFFERED_SET || msg->type == KV_MSG_GET);
+}
+
+static void value_buf_put(struct worker_t *self, struct io_ctx *io) {
+    if (io->value_buf == NULL) return;
+    struct io_ctx *waiter = STAILQ_FIRST(&self->value_waiters);
+    if (waiter) {
+        STAILQ_REMOVE_HEAD(&self->value_waiters, next);
+        waiter->value_buf = io->value_buf;
+        kv_app_send(waiter->worker_id, io_start, waiter);
+    } else {
+        self->value_bufs[self->free_value_bufs++] = io->value_buf;
+    }
+    io->value_buf = NULL;
+}
+
+static void abort_cb(void *arg) {
+    struct io_ctx *io = arg;
+    kv_app_send(io->server_thread, send_response, io);
+}
+// fails an io with type before it reaches its data store.
+static void io_fail(struct io_ctx *io, uint8_t type) {
+    value_buf_put(workers + io->worker_id, io);
+    io->msg->type = type;
+    io->msg->value_len = 0;
+    kv_ring_forward(io->fwd_ctx, NULL, false, abort_cb, io);
+}
+static void io_abort(void *arg) { io_fail(arg, KV_MSG_ERR); }
+
+static void ext_value_read_cb(bool success, void *arg) {
+    struct io_ctx *io = arg;
+    io->value_staged = true;
+    kv_app_send(io->worker_id, success ? io_start : io_abort, io);
+}
+
+// Called by io_start until the value of the io is staged: the io first waits for a value buffer, then the value of a
+// set is read from the sender.
+static bool ext_value_stage(struct worker_t *self, struct io_ctx *io) {
+    if (io->value_buf == NULL) {
+        bool is_read = io->msg->type == KV_MSG_GET || has_records(io->msg->type);
+        io->remote = has_records(io->msg->type) ? ((struct kv_msg_scan *)KV_MSG_VALUE(io->msg))->records
+                                                : *(struct kv_rdma_remote_buf *)KV_MSG_VALUE(io->msg);
+        if (opt.value_buf_num == 0 || (!is_read && io->msg->value_len > ext_value_room(io))) {
+            io_abort(io);
+            return false;
+        }
+        if (self->free_value_bufs == 0) {
+            STAILQ_INSERT_TAIL(&self->value_waiters, io, next);
+            return false;
+        }
+        io->value_buf = self->value_bufs[--self->free_value_bufs];
+    }
+    if (io->msg->type == KV_MSG_GET || has_records(io->msg->type) || io->value_staged) return true;
+    kv_rdma_read_remote(io->req_h, io->value_buf, kv_rdma_get_value_buf(io->value_buf), &io->remote,
+                        io->msg->value_len, ext_value_read_cb, io);
+    return false;
+}
+
+static void ext_value_written(void *arg) {
+    struct io_ctx *io = arg;
+    value_buf_put(workers + io->worker_id, io);
+    kv_app_send(io->server_thread, send_response, io);
+}
+static void ext_value_write_cb(bool success, void *arg) {
+    struct io_ctx *io = arg;
+    if (!success) io->msg->type = KV_MSG_ERR;
+    if (has_records(io->msg_type))
+        ((struct kv_msg_scan *)KV_MSG_VALUE(io->msg))->records.length = io->scan_len;
+    else
+        *(struct kv_rdma_remote_buf *)KV_MSG_VALUE(io->msg) = io->remote;
+    kv_app_send(io->worker_id, ext_value_written, io);
+}
+
+// a value is copied to another node in a message, or in a buffer registered for it when it does not fit.
+static void copy_value_remote(struct io_ctx *io) {
+    if (io->copy_value == NULL) return;
+    io->msg->flags |= KV_MSG_EXT_VALUE;
+    kv_rdma_fill_remote_buf(io->copy_value, kv_rdma_get_value_buf(io->copy_value), io->copy_buf->val_len,
+                            (struct kv_rdma_remote_buf *)KV_MSG_VALUE(io->msg));
+}
+
 static void forward_cb(void *arg) {
     struct io_ctx *io = arg;
     if (io->in_copy_pool) {
@@ -236,6 +441,7 @@ static void forward_cb(void *arg) {
             // retry
             io->msg->type = KV_MSG_SET;
             io->msg->value_len = io->copy_buf->val_len;
+            copy_value_remote(io);
             kv_ring_forward(io->fwd_ctx, io->req, io->in_copy_pool, forward_cb, io);
         } else {
             fprintf(stderr, "kv_server: copy forward failed.\n");
@@ -254,6 +460,18 @@ static void forward_cb(void *arg) {
     } else if (io->msg_type == KV_MSG_DEL) {
         kv_data_store_del_commit(io->ds_ctx, io->msg->type == KV_MSG_OK);
     }
+    struct worker_t *self = workers + io->worker_id;
+    if (io->msg_type == KV_MSG_BUFFERED_SET) {
+        for (uint32_t i = 0; i < io->buffer_size; ++i) value_buf_put(self, io->io[i]);
+    } else if (io->value_buf && (io->msg_type == KV_MSG_GET || has_records(io->msg_type)) &&
+               io->msg->type == KV_MSG_OK) {
+        // the value goes to the buffer of the client before the response.
+        kv_rdma_write_remote(io->req_h, io->value_buf, kv_rdma_get_value_buf(io->value_buf), &io->remote,
+                             has_records(io->msg_type) ? io->scan_len : io->msg->value_len, ext_value_write_cb, io);
+        return;
+    } else {
+        value_buf_put(self, io);
+    }
     kv_app_send(io->server_thread, io->msg_type == KV_MSG_BUFFERED_SET ? buffered_send_response : send_response, arg);
 }
 
@@ -265,7 +483,8 @@ static void io_fini(bool success, void *arg) {
     }
     struct kv_data_store *ds = (workers + io->worker_id)->data_store + io->storage_id;
     if (!success) {
-        io->msg->type = KV_MSG_ERR;
+        // a GET of a key not stored leaves no value, as in a KV_MSG_MULTI.
+        io->msg->type = io->msg_type == KV_MSG_GET && io->msg->value_len == 0 ? KV_MSG_NOT_FOUND : KV_MSG_ERR;
         kv_ring_forward(io->fwd_ctx, NULL, false, forward_cb, io);
         return;
     }
@@ -281,23 +500,61 @@ static void io_fini(bool success, void *arg) {
 
     if (io->need_forward == false) {  // is the last node
         if (io->msg->type == KV_MSG_SET) io->msg->value_len = 0;
+        if (io->msg->type == KV_MSG_MGET) {
+            struct kv_msg_scan *mget = (struct kv_msg_scan *)KV_MSG_VALUE(io->msg);
+            mget->more = mget->more || mget->num < io->buffer_size;
+        }
+        if (has_records(io->msg->type))
+            io->msg->value_len = sizeof(struct kv_msg_scan) + (io->value_buf ? 0 : io->scan_len);
         io->msg->type = KV_MSG_OK;
+    } else if (io->value_buf) {
+        // the next node moves the value from the buffer of this one.
+        kv_rdma_fill_remote_buf(io->value_buf, kv_rdma_get_value_buf(io->value_buf), ext_value_room(io),
+                                (struct kv_rdma_remote_buf *)KV_MSG_VALUE(io->msg));
     }
     kv_ring_forward(io->fwd_ctx, io->need_forward ? io->req : NULL, io->in_copy_pool, forward_cb, io);
 }
 
+// the last buffered io carries the batch, so that it is not responded before the batch completes.
+static void set_buffer_flush(struct worker_t *self, uint32_t storage_id, uint32_t reason) {
+    struct set_buffer *set_buffer = self->set_buffer + storage_id;
+    struct io_ctx *io = set_buffer->io[set_buffer->buffer_size - 1];
+    self->batch_hist[31 - __builtin_clz(set_buffer->buffer_size)]++;
+    self->flushes[reason]++;
+    for (uint32_t i = 0; i < set_buffer->buffer_size; ++i) {
+        io->key[i] = set_buffer->key[i];
+        io->key_length[i] = set_buffer->key_length[i];
+        io->value[i] = set_buffer->value[i];
+        io->value_length[i] = set_buffer->value_length[i];
+        io->expire[i] = set_buffer->expire[i];
+        io->io[i] = set_buffer->io[i];
+    }
+    io->buffer_size = set_buffer->buffer_size;
+    io->ds_ctx = kv_data_store_buffered_set(&self->data_store[storage_id], io->key, io->key_length, io->value,
+                                            io->value_length, io->expire, io->value_offset, io->bucket_id, io->seg,
+                                            set_buffer->buffer_size, io_fini, io);
+    set_buffer->buffer_size = 0;
+    set_buffer->batch_bytes = 0;
+}
+
 static void io_start(void *arg) {
     struct io_ctx *io = arg;
     struct worker_t *self = workers + io->worker_id;
     struct set_buffer *set_buffer = self->set_buffer + io->storage_id;
     io->need_forward = false;
+    if ((io->msg->type == KV_MSG_SET || io->msg->type == KV_MSG_BUFFERED_SET) && io->msg->value_len > opt.max_value_size) {
+        // refused before a value buffer is taken, the value log is not sized for it.
+        io_fail(io, KV_MSG_TOO_LARGE);
+        return;
+    }
+    if (is_ext_value(io->msg) && !ext_value_stage(self, io)) return;
     switch (io->msg->type) {
         case KV_MSG_DEL:
         case KV_MSG_SET:
             if (io->vnode_type == KV_RING_VNODE) kv_data_store_dirty(&self->data_store[io->storage_id], KV_MSG_KEY(io->msg), io->msg->key_len);
             if (io->msg->type == KV_MSG_SET)
                 io->ds_ctx = kv_data_store_set(&self->data_store[io->storage_id], KV_MSG_KEY(io->msg), io->msg->key_len,
-                                               KV_MSG_VALUE(io->msg), io->msg->value_len, io_fini, arg);
+                                               io_value(io), io->msg->value_len, io_expire(self, io), io_fini, arg);
             else {
                 assert(io->msg->value_len == 0);
                 io->ds_ctx = kv_data_store_delete(&self->data_store[io->storage_id], KV_MSG_KEY(io->msg), io->msg->key_len, io_fini, arg);
@@ -305,27 +562,19 @@ static void io_start(void *arg) {
             break;
         case KV_MSG_BUFFERED_SET:
             assert(set_buffer->buffer_size < opt.set_batch);
+            if (set_buffer->buffer_size && set_buffer->batch_bytes + io->msg->value_len > opt.set_batch_bytes)
+                set_buffer_flush(self, io->storage_id, FLUSH_FULL);
+            if (set_buffer->buffer_size == 0) set_buffer->oldest_tsc = spdk_get_ticks();
             set_buffer->key[set_buffer->buffer_size] = KV_MSG_KEY(io->msg);
             set_buffer->key_length[set_buffer->buffer_size] = io->msg->key_len;
-            set_buffer->value[set_buffer->buffer_size] = KV_MSG_VALUE(io->msg);
+            set_buffer->value[set_buffer->buffer_size] = io_value(io);
             set_buffer->value_length[set_buffer->buffer_size] = io->msg->value_len;
+            set_buffer->expire[set_buffer->buffer_size] = io_expire(self, io);
             set_buffer->io[set_buffer->buffer_size] = io;
             set_buffer->buffer_size++;
-            gettimeofday(&set_buffer->active, NULL);
-            if (set_buffer->buffer_size == opt.set_batch) {
-                for (uint32_t i = 0; i < opt.set_batch; ++i) {
-                    io->key[i] = set_buffer->key[i];
-                    io->key_length[i] = set_buffer->key_length[i];
-                    io->value[i] = set_buffer->value[i];
-                    io->value_length[i] = set_buffer->value_length[i];
-                    io->io[i] = set_buffer->io[i];
-                    io->buffer_size = set_buffer->buffer_size;
-                }
-                io->ds_ctx = kv_data_store_buffered_set(&self->data_store[io->storage_id], io->key, io->key_length, io->value,
-                                                        io->value_length, io->value_offset, io->bucket_id, io->seg,
-                                                        set_buffer->buffer_size, io_fini, arg);
-                set_buffer->buffer_size = 0;
-            }
+            set_buffer->batch_bytes = kv_value_log_next_offset(set_buffer->batch_bytes, io->msg->value_len);
+            if (set_buffer->buffer_size == opt.set_batch || set_buffer->batch_bytes >= opt.set_batch_bytes)
+                set_buffer_flush(self, io->storage_id, FLUSH_FULL);
             break;
         case KV_MSG_META_GET:
             *(struct kv_bucket_meta*)KV_MSG_VALUE(io->msg) = kv_bucket_meta_get(&self->data_store[io->storage_id].bucket_log, *(uint64_t *)KV_MSG_KEY(io->msg) >> (64 - self->data_store[io->storage_id].log_bucket_num));
@@ -353,10 +602,50 @@ static void io_start(void *arg) {
                         io->msg->slot_id = ret;
                     }
                 }
-                kv_data_store_get(&self->data_store[io->storage_id], KV_MSG_KEY(io->msg), io->msg->key_len, KV_MSG_VALUE(io->msg),
+                // bounded by the room in the message, or in the buffer of the client.
+                io->msg->value_len = io->value_buf ? ext_value_room(io) : self->storage[io->storage_id].block_size;
+                kv_data_store_get(&self->data_store[io->storage_id], KV_MSG_KEY(io->msg), io->msg->key_len, io_value(io),
                                   &io->msg->value_len, NULL, io_fini, arg);
             }
             break;
+        case KV_MSG_SCAN: {
+            struct kv_data_store *ds = &self->data_store[io->storage_id];
+            struct kv_msg_scan *scan = (struct kv_msg_scan *)KV_MSG_VALUE(io->msg);
+            if (ds->key_index == NULL) {
+                io_fini(false, arg);
+                break;
+            }
+            // the records follow the scan in the message, or go to the buffer of the client.
+            io->scan_len = io->value_buf ? ext_value_room(io)
+                                         : self->storage[io->storage_id].block_size - sizeof(struct kv_msg_scan);
+            kv_data_store_scan(ds, KV_MSG_KEY(io->msg), io->msg->key_len, scan->exclusive, scan->end,
+                               io->value_buf ? io_value(io) : KV_MSG_SCAN_RECORDS(io->msg), &io->scan_len, &scan->num,
+                               &scan->more, io_fini, arg);
+            break;
+        }
+        case KV_MSG_MGET: {
+            struct kv_msg_scan *mget = (struct kv_msg_scan *)KV_MSG_VALUE(io->msg);
+            struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)KV_MSG_SCAN_RECORDS(io->msg);
+            // the keys of the vnode, which come first, as many as the io holds.
+            for (io->buffer_size = 0; io->buffer_size < mget->num && io->buffer_size < SET_CTX_BUFFER_SIZE &&
+                                      kv_key_prefix(record->data) <= mget->end;
+                 io->buffer_size++, record = kv_data_store_scan_next(record)) {
+                io->key[io->buffer_size] = record->data;
+                io->key_length[io->buffer_size] = record->key_length;
+            }
+            if (io->buffer_size == 0) {
+                io_fini(false, arg);
+                break;
+            }
+            mget->more = io->buffer_size < mget->num;
+            mget->num = io->buffer_size;
+            io->scan_len = io->value_buf ? ext_value_room(io)
+                                         : self->storage[io->storage_id].block_size - sizeof(struct kv_msg_scan);
+            kv_data_store_multi_get(&self->data_store[io->storage_id], io->key, io->key_length, &mget->num,
+                                    io->value_buf ? io_value(io) : KV_MSG_SCAN_RECORDS(io->msg), &io->scan_len,
+                                    io_fini, arg);
+            break;
+        }
         case KV_MSG_TEST:
             io_fini(true, io);
             break;
@@ -364,6 +653,89 @@ static void io_start(void *arg) {
             assert(false);
     }
 }
+// --- multi-op requests ---
+static void multi_put(struct io_ctx *io) {
+    if (--io->ops_left) return;
+    kv_freelist_put(&multi_ops, io->ops);
+    io->msg->type = KV_MSG_OK;
+    kv_ring_forward(io->fwd_ctx, NULL, false, send_response, io);
+}
+static void multi_op_done(void *arg) {
+    struct multi_op *x = arg;
+    x->msg->q_info = ds_queue.q_info[x->worker_id];
+    multi_put(x->io);
+}
+// a GET that fails leaves no value if it missed, and the length of the value if it lacked room: it is sent again alone.
+static void multi_op_fini(bool success, void *arg) {
+    struct multi_op *x = arg;
+    if (x->msg->type == KV_MSG_SET) {
+        kv_data_store_set_commit(x->ds_ctx, success);
+    } else if (x->msg->type == KV_MSG_DEL) {
+        kv_data_store_del_commit(x->ds_ctx, success);
+    }
+    if (opt.ours && x->msg->type != KV_MSG_GET) packed_server_invalidate_key(KV_MSG_KEY(x->msg), x->msg->key_len);
+    if (success) {
+        if (x->msg->type != KV_MSG_GET) x->msg->value_len = 0;
+        x->msg->type = KV_MSG_OK;
+    } else {
+        if (x->msg->type != KV_MSG_GET)
+            x->msg->type = KV_MSG_ERR;
+        else if (x->msg->value_len == 0)
+            x->msg->type = KV_MSG_NOT_FOUND;
+        else
+            x->msg->type = x->msg->value_len > x->room ? KV_MSG_OUTDATED : KV_MSG_ERR;
+        x->msg->value_len = 0;
+    }
+    kv_app_send(x->io->server_thread, multi_op_done, x);
+}
+static void multi_op_start(void *arg) {
+    struct multi_op *x = arg;
+    struct worker_t *self = workers + x->worker_id;
+    struct kv_data_store *ds = &self->data_store[x->storage_id];
+    struct kv_msg *msg = x->msg;
+    switch (msg->type) {
+        case KV_MSG_GET:
+            msg->value_len = x->room;
+            kv_data_store_get(ds, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg), &msg->value_len, NULL, multi_op_fini, x);
+            break;
+        case KV_MSG_SET:
+            x->ds_ctx = kv_data_store_set(ds, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg), msg->value_len,
+                                          msg->flags & KV_MSG_TTL ? kv_data_store_expire(ds, msg->ttl) : 0, multi_op_fini, x);
+            break;
+        case KV_MSG_DEL:
+            x->ds_ctx = kv_data_store_delete(ds, KV_MSG_KEY(msg), msg->key_len, multi_op_fini, x);
+            break;
+        default:
+            assert(false);
+    }
+}
+// the ops go to the workers of their data stores at once, the message is answered when the last one is done. A SET is
+// written straight from its room, the block of slack past the largest message covers the whole blocks the value log
+// writes.
+static void multi_start(struct io_ctx *io) {
+    struct kv_msg_multi *multi = (struct kv_msg_multi *)KV_MSG_VALUE(io->msg);
+    struct kv_msg *op = KV_MSG_MULTI_OPS(io->msg);
+    bool fits = KV_MSG_SIZE(io->msg) <= opt.multi_msg_size;
+    io->ops = kv_freelist_get(&multi_ops, sizeof(struct multi_op) * KV_MSG_MULTI_MAX_OPS);
+    io->ops_left = 1;
+    for (uint32_t i = 0; i < multi->num; i++, op = kv_msg_multi_next(multi, op)) {
+        if (!fits || i >= KV_MSG_MULTI_MAX_OPS ||
+            (op->type == KV_MSG_GET ? multi->room == 0 : op->value_len > multi->room))
+            op->type = KV_MSG_OUTDATED;
+        if (op->type == KV_MSG_OUTDATED) {
+            op->value_len = 0;
+            op->cost = 0;
+            continue;
+        }
+        struct multi_op *x = io->ops + i;
+        *x = (struct multi_op){io, op, op->ds_id % MAX_SSD_WORKERS, op->ds_id / MAX_SSD_WORKERS, multi->room, NULL};
+        op->cost = kv_ds_queue_cost(&ds_queue, x->worker_id, kv_msg_ds_op(op));
+        io->ops_left++;
+        kv_app_send(x->worker_id, multi_op_start, x);
+    }
+    multi_put(io);
+}
+
 struct server_copy_ctx {
     struct kv_ring_copy_info *info;
     bool is_start;
@@ -413,62 +785,68 @@ static void handler(void *req_h, kv_rdma_mr req, void *fwd_ctx, bool has_next_no
     io->in_copy_pool = false;
     io->vnode_type = vnode_type;
     io->msg_type = io->msg->type;
+    io->value_buf = NULL;
+    io->value_staged = false;
+    // the client charges its next requests to the data store with it, the ops of a KV_MSG_MULTI carry their own.
+    io->msg->cost = io->msg_type == KV_MSG_MULTI ? 0 : kv_ds_queue_cost(&ds_queue, io->worker_id, kv_msg_ds_op(io->msg));
+    if (io->msg_type == KV_MSG_MULTI) {
+        multi_start(io);
+        return;
+    }
     kv_app_send(io->worker_id, io_start, io);
 }
 
-static void buffer_poller_impl(void *arg) {
+static int set_buffer_poller(void *arg) {
     struct worker_t *self = arg;
+    uint64_t now = spdk_get_ticks(), budget = opt.set_budget_us * kv_ds_ticks_per_us();
     for (uint32_t i = 0; i < MAX_STORAGE_STRIDE; ++i) {
         struct set_buffer *set_buffer = self->set_buffer + i;
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        double duration = timeval_diff(&set_buffer->active, &now);
-        if (duration > 1.0 / 1000.0 && set_buffer->buffer_size > 0) {
-            struct io_ctx *io = set_buffer->io[set_buffer->buffer_size - 1];
-            struct worker_t *self = workers + io->worker_id;
-            assert(self == arg);
-            for (uint32_t i = 0; i < set_buffer->buffer_size; ++i) {
-                io->key[i] = set_buffer->key[i];
-                io->key_length[i] = set_buffer->key_length[i];
-                io->value[i] = set_buffer->value[i];
-                io->value_length[i] = set_buffer->value_length[i];
-                io->io[i] = set_buffer->io[i];
-                io->buffer_size = set_buffer->buffer_size;
-            }
-            io->ds_ctx = kv_data_store_buffered_set(&self->data_store[i], io->key, io->key_length, io->value,
-                                                    io->value_length, io->value_offset, io->bucket_id, io->seg,
-                                                    set_buffer->buffer_size, io_fini, io);
-            set_buffer->buffer_size = 0;
-        }
-    }
-}
-
-static int buffer_poller(void *arg) {
-    for (size_t i = 0; i < opt.worker_num; i++) {
-        kv_app_send(i, buffer_poller_impl, workers + i);
+        if (set_buffer->buffer_size == 0) continue;
+        struct kv_ds_q_info q_info = ds_queue.q_info[self->data_store[i].ds_id];
+        if (q_info.size == 0)
+            set_buffer_flush(self, i, FLUSH_IDLE);
+        else if (now - set_buffer->oldest_tsc > budget)
+            set_buffer_flush(self, i, FLUSH_BUDGET);
     }
     return 0;
 }
 
 static void ring_init_cb(void *arg) {
     copy_pool = kv_mempool_create(opt.copy_concurrency * 2, sizeof(struct io_ctx));
-    server_mrs = kv_rdma_alloc_bulk(server, KV_RDMA_MR_SERVER, workers[0].storage[0].block_size + sizeof(struct kv_msg) + KV_MAX_KEY_LENGTH, opt.copy_concurrency * 2);
+    server_mrs = kv_rdma_alloc_bulk(server, KV_RDMA_MR_SERVER, workers[0].storage[0].block_size + sizeof(struct kv_msg) + KV_MSG_MAX_KEY_SIZE, opt.copy_concurrency * 2);
+    // registered once, a copied value is read from the data store straight into the buffer of its io.
+    copy_mrs = kv_rdma_alloc_bulk(server, KV_RDMA_MR_VALUE, opt.max_value_size + workers[0].storage[0].block_size,
+                                  opt.copy_concurrency * 2);
     for (size_t i = 0; i < opt.copy_concurrency * 2; i++) {
         struct io_ctx *io = kv_mempool_get(copy_pool);
         io->req = kv_rdma_mrs_get(server_mrs, i);
+        io->copy_mr = kv_rdma_mrs_get(copy_mrs, i);
         kv_mempool_put(copy_pool, io);
     }
+    if (opt.value_buf_num == 0) return;
+    // a value log write takes a block more than the value.
+    value_mrs = kv_rdma_alloc_bulk(server, KV_RDMA_MR_VALUE, opt.max_value_size + workers[0].storage[0].block_size,
+                                   opt.worker_num * opt.value_buf_num);
+    for (size_t i = 0; i < opt.worker_num; i++) {
+        workers[i].value_bufs = kv_calloc(opt.value_buf_num, sizeof(kv_rdma_mr));
+        for (size_t j = 0; j < opt.value_buf_num; j++)
+            workers[i].value_bufs[j] = kv_rdma_mrs_get(value_mrs, i * opt.value_buf_num + j);
+        workers[i].free_value_bufs = opt.value_buf_num;
+    }
 }
 static uint32_t io_cnt;
 uint64_t log_bucket_num = 48;
 static void ring_init(void *arg) {
     if (--io_cnt) return;
-    buf_poller = kv_app_poller_register(buffer_poller, NULL, 1000);
     server = kv_ring_init(opt.etcd_ip, opt.etcd_port, opt.thread_num, NULL, NULL);
     io_pool = kv_mempool_create(opt.concurrent_io_num, sizeof(struct io_ctx));
+    // the request buffers take a message with a block of value, or a multi-op message with a block of slack.
+    uint32_t block_size = workers[0].storage[0].block_size;
+    uint32_t max_msg_sz = sizeof(struct kv_msg) + KV_MSG_MAX_KEY_SIZE + block_size;
+    if (opt.multi_msg_size + block_size > max_msg_sz) max_msg_sz = opt.multi_msg_size + block_size;
+    kv_rdma_set_srq_depth(server, opt.srq_depth);
     kv_ring_server_init(opt.local_ip, opt.local_port, opt.ring_num, opt.vid_per_ssd, opt.ssd_num, opt.rpl_num,
-                        log_bucket_num, opt.concurrent_io_num, sizeof(struct kv_msg) + KV_MAX_KEY_LENGTH + workers[0].storage[0].block_size,
-                        handler, NULL, ring_init_cb, NULL);
+                        log_bucket_num, opt.concurrent_io_num, max_msg_sz, handler, NULL, ring_init_cb, NULL);
     kv_ring_register_copy_cb(ring_copy_cb, NULL);
 }
 
@@ -486,16 +864,40 @@ static void copy_get_buf(uint8_t *key, uint8_t key_len, struct kv_data_store_cop
     io->msg->key_len = key_len;
     kv_memcpy(KV_MSG_KEY(io->msg), key, key_len);
     io->msg->value_len = buf->val_len;
-    buf->val_buf = KV_MSG_VALUE(io->msg);
-    buf->ctx = io;
+    io->msg->flags = 0;
+    if (buf->expire) {  // the copy lives as long as the item left
+        uint32_t now = workers[io->worker_id].data_store[0].bucket_log.clock();
+        io->msg->flags = KV_MSG_TTL;
+        io->msg->ttl = buf->expire > now ? buf->expire - now : 1;
+    }
+    io->value_buf = NULL;
     io->copy_buf = buf;
+    io->copy_value = NULL;
+    uint32_t block_size = workers[io->worker_id].storage[0].block_size;
+    if (buf->val_len > block_size) {
+        assert(buf->val_len <= opt.max_value_size);
+        io->copy_value = io->copy_mr;
+        copy_value_remote(io);
+        buf->val_buf = kv_rdma_get_value_buf(io->copy_value);
+    } else {
+        buf->val_buf = KV_MSG_VALUE(io->msg);
+    }
+    buf->ctx = io;
 }
 
 static void signal_handler(int signal_number) {
-    if (buf_poller) kv_app_poller_unregister(&buf_poller);
     kv_ring_fini(ring_fini_cb, NULL);
 }
 
+static void worker_recover_cb(bool success, void *arg) {
+    struct worker_t *self = arg;
+    if (!success) {
+        fprintf(stderr, "worker %ld: the recovery of a data store has failed.\n", self - workers);
+        exit(-1);
+    }
+    if (--self->recovering == 0) kv_app_send(opt.worker_num, ring_init, NULL);
+}
+
 static void worker_init(void *arg) {
     struct worker_t *self = arg;
     if (self == workers) {
@@ -509,11 +911,23 @@ static void worker_init(void *arg) {
         kv_storage_init(&self->storage[i], WORKER_INDEX);
         uint64_t bucket_num = KV_NUM_ITEMS / KV_ITEM_PER_BUCKET / opt.ssd_num;
         uint64_t value_log_block_num = self->storage[i].num_blocks * 0.95 - 2 * bucket_num;
-        kv_data_store_init(&self->data_store[i], &self->storage[i], 0, bucket_num, log_bucket_num, value_log_block_num, 512, &ds_queue, WORKER_INDEX);
+        kv_data_store_init(&self->data_store[i], &self->storage[i], 0, bucket_num, log_bucket_num, value_log_block_num, opt.max_value_size, 512,
+                           &ds_queue, WORKER_INDEX);
         kv_data_store_copy_init(&self->data_store[i], copy_get_buf, NULL, opt.copy_concurrency / opt.ssd_num, io_fini);
+        if (opt.key_index) kv_data_store_index_init(&self->data_store[i]);
+        self->data_store[i].checkpoint_period = opt.checkpoint_period_s * 1000000ULL;
+    }
+    self->buf_poller = kv_app_poller_register(set_buffer_poller, self, 0);
+    STAILQ_INIT(&self->value_waiters);
+    // the ring is joined once the data stores have been recovered.
+    self->recovering = 1;
+    for (uint32_t i = 0; opt.recover && i < MAX_STORAGE_STRIDE && WORKER_INDEX < opt.ssd_num; ++i) {
+        self->recovering++;
+        kv_data_store_recover(&self->data_store[i], worker_recover_cb, self);
     }
-    kv_app_send(opt.worker_num, ring_init, NULL);
+    worker_recover_cb(true, self);
 }
+
 #define KEY_PER_BKT_SEGMENT (KV_ITEM_PER_BUCKET)
 // memory usage per key: 5/KEY_PER_BKT_SEGMENT bytes
 int main(int argc, char **argv) {
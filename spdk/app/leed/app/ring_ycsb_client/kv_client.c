@@ -10,6 +10,7 @@
 
 #include "../../kv_app.h"
 #include "../../kv_data_store.h"
+#include "../../kv_memory.h"
 #include "../../kv_msg.h"
 #include "../../kv_ring.h"
 #include "../../utils/city.h"
@@ -35,6 +36,7 @@ struct {
     char memcached_ip[32];
     bool ditto;
     bool ours;
+    uint32_t multi_msg_size;
     int breakdown_stage;
 } opt = {.num_items = 100000000,
          .operation_cnt = 512,
@@ -53,6 +55,7 @@ struct {
          .memcached_ip = "10.1.4.6",
          .ditto = false,
          .ours = false,
+         .multi_msg_size = 0,
          .breakdown_stage = 3,
          .seq_read = false,
          .seq_write = false,
@@ -80,11 +83,13 @@ static void help(void) {
     printf("  -F               Perform fill operations\n");
     printf("  -C <ditto/ours>  Enable caching\n");
     printf("  -B <breakdown_stage> 0: baseline, 1: w/ offloaded read, 2: w/ inline cache, 3: w/ batched write\n");
+    printf("  -M <msg_size>    Pack the requests of a producer going to the same server into multi-op messages of up to\n"
+           "                   msg_size bytes, at most the -M of the servers: %u (off)\n", opt.multi_msg_size);
 }
 
 static void get_options(int argc, char **argv) {
     int ch;
-    while ((ch = getopt(argc, argv, "htr:v:d:P:c:i:p:s:m:T:w:f:I:x:RWFDC:B:")) != -1) switch (ch) {
+    while ((ch = getopt(argc, argv, "htr:v:d:P:c:i:p:s:m:T:w:f:I:x:RWFDC:B:M:")) != -1) switch (ch) {
             case 'w':
                 strcpy(opt.workload_file, optarg);
                 break;
@@ -140,6 +145,9 @@ static void get_options(int argc, char **argv) {
             case 'F':
                 opt.fill = true;
                 break;
+            case 'M':
+                opt.multi_msg_size = atol(optarg);
+                break;
             case 'C':
                 if (strcmp(optarg, "ditto") == 0) {
                     opt.ditto = true;
@@ -158,10 +166,12 @@ static void get_options(int argc, char **argv) {
 
 struct io_buffer_t {
     kv_rdma_mr req, resp;
+    kv_rdma_mr value;  // NULL while the values fit in the messages
     uint32_t worker_id;
     uint32_t producer_id;
     bool read_modify_write, is_finished, ditto_fill, ditto_clear;
     uint32_t retry_cnt;
+    uint32_t scan_left;  // the records a YCSB scan still wants
     struct timeval io_start;
     kv_data_store_ctx ds_ctx;
 } * io_buffers;
@@ -179,6 +189,10 @@ struct producer_t {
     double latency_sum;
     uint32_t io_per_record;
     _Atomic uint64_t counter;  // for real time thourghput
+    // the requests ready in this round of the producer, dispatched together by its poller
+    struct kv_ring_req *pending;
+    uint32_t pending_num;
+    void *poller;
 } * producers;
 
 static void *tp_poller = NULL;
@@ -195,7 +209,7 @@ enum {
     DEL,
 } state = INIT;
 kv_rdma_handle rdma;
-kv_rdma_mrs_handle req_mrs, resp_mrs;
+kv_rdma_mrs_handle req_mrs, resp_mrs, value_mrs;
 kv_ycsb_handle workloads[64];
 
 static void worker_stop(void *arg) {
@@ -205,13 +219,21 @@ static void worker_stop(void *arg) {
     kv_app_stop(0);
 }
 static void thread_stop(void *arg) { kv_app_stop(0); }
+static void producer_stop(void *arg) {
+    struct producer_t *p = arg;
+    if (p->poller) kv_app_poller_unregister(&p->poller);
+    free(p->pending);
+    kv_app_stop(0);
+}
 static void ring_fini_cb(void *arg) {
     for (size_t i = 0; i < opt.ssd_num; i++) kv_app_send(i, worker_stop, workers + i);
-    for (size_t i = 0; i < opt.thread_num + opt.producer_num; i++) kv_app_send(opt.ssd_num + i, thread_stop, NULL);
+    for (size_t i = 0; i < opt.thread_num; i++) kv_app_send(opt.ssd_num + i, thread_stop, NULL);
+    for (size_t i = 0; i < opt.producer_num; i++) kv_app_send(opt.ssd_num + opt.thread_num + i, producer_stop, producers + i);
 }
 static void stop(void) {
     kv_rdma_free_bulk(req_mrs);
     kv_rdma_free_bulk(resp_mrs);
+    if (value_mrs) kv_rdma_free_bulk(value_mrs);
     if (tp_poller) kv_app_poller_unregister(&tp_poller);
     kv_ring_fini(ring_fini_cb, NULL);
 }
@@ -224,6 +246,16 @@ static int double_cmp(const void *_a, const void *_b) {
 static void test(void *arg);
 static void io_start(void *arg);
 static void meta_get_cb(void *arg);
+static int producer_poller(void *arg) {
+    struct producer_t *p = arg;
+    uint32_t num = p->pending_num;
+    p->pending_num = 0;
+    if (opt.multi_msg_size)
+        kv_ring_dispatch_multi(p->pending, num);
+    else
+        kv_ring_dispatch_batch(p->pending, num);
+    return num;
+}
 static void test_fini(void *arg) {  // always running on producer 0
     static uint64_t total_io = 0;
     static uint32_t io_per_record = 0;
@@ -243,14 +275,35 @@ static void test_fini(void *arg) {  // always running on producer 0
     }
     switch (state) {
         case INIT:
-            assert(opt.value_size <= workers[0].storage.block_size);
-            req_mrs = kv_rdma_alloc_bulk(rdma, KV_RDMA_MR_REQ, workers[0].storage.block_size + sizeof(struct kv_msg) + KV_MAX_KEY_LENGTH, opt.concurrent_io_num);
+            req_mrs = kv_rdma_alloc_bulk(rdma, KV_RDMA_MR_REQ, workers[0].storage.block_size + sizeof(struct kv_msg) + KV_MSG_MAX_KEY_SIZE, opt.concurrent_io_num);
             resp_mrs =
-                kv_rdma_alloc_bulk(rdma, KV_RDMA_MR_RESP, workers[0].storage.block_size + sizeof(struct kv_msg) + KV_MAX_KEY_LENGTH, opt.concurrent_io_num);
+                kv_rdma_alloc_bulk(rdma, KV_RDMA_MR_RESP, workers[0].storage.block_size + sizeof(struct kv_msg) + KV_MSG_MAX_KEY_SIZE, opt.concurrent_io_num);
             for (size_t i = 0; i < opt.concurrent_io_num; i++) {
                 io_buffers[i].req = kv_rdma_mrs_get(req_mrs, i);
                 io_buffers[i].resp = kv_rdma_mrs_get(resp_mrs, i);
             }
+            // the values larger than a block are read and written by the servers in a registered buffer of each io.
+            if (opt.value_size > workers[0].storage.block_size) {
+                if (opt.ditto || opt.ours) {
+                    fprintf(stderr, "kv_client: the caches only hold values that fit in a message.\n");
+                    exit(-1);
+                }
+                value_mrs = kv_rdma_alloc_bulk(rdma, KV_RDMA_MR_VALUE, opt.value_size, opt.concurrent_io_num);
+                for (size_t i = 0; i < opt.concurrent_io_num; i++) io_buffers[i].value = kv_rdma_mrs_get(value_mrs, i);
+            }
+            printf("value size: %u B, %s\n", opt.value_size, value_mrs ? "moved by RDMA READ/WRITE" : "in the messages");
+            if (opt.multi_msg_size) {
+                // the caches need the servers to answer each GET alone.
+                if (opt.ditto || opt.ours) {
+                    fprintf(stderr, "kv_client: the multi-op messages do not go with the caches.\n");
+                    exit(-1);
+                }
+                kv_ring_multi_init(opt.multi_msg_size, opt.value_size, opt.concurrent_io_num / opt.thread_num + 1);
+            }
+            for (size_t i = 0; i < opt.producer_num; i++) {
+                producers[i].pending = calloc(opt.concurrent_io_num / opt.producer_num, sizeof(struct kv_ring_req));
+                kv_app_poller_register_on(opt.ssd_num + opt.thread_num + i, producer_poller, producers + i, 0, &producers[i].poller);
+            }
             printf("rdma client initialized in %lf s.\n", timeval_diff(&tv_start, &tv_end));
             if (opt.fill) {
                 total_io = opt.num_items;
@@ -304,10 +357,64 @@ static void test_fini(void *arg) {  // always running on producer 0
     gettimeofday(&tv_start, NULL);
 }
 
+// where the value of a SET or a GET goes: in the message, or in the value buffer of the io that the message describes.
+static inline uint8_t *io_value(struct io_buffer_t *io, struct kv_msg *msg) {
+    if (io->value == NULL) {
+        msg->flags = 0;
+        return KV_MSG_VALUE(msg);
+    }
+    uint8_t *buf = kv_rdma_get_value_buf(io->value);
+    msg->flags = KV_MSG_EXT_VALUE;
+    kv_rdma_fill_remote_buf(io->value, buf, opt.value_size, (struct kv_rdma_remote_buf *)KV_MSG_VALUE(msg));
+    return buf;
+}
+
+// --- scan ---
+// A scan is served vnode by vnode: each response ends at the range of its vnode or at the room of the records, and the
+// scan goes on past its last record, or from the next vnode, until it has the records it wants.
+static inline void scan_prepare(struct io_buffer_t *io, struct kv_msg *msg, bool exclusive) {
+    struct kv_msg_scan *scan = (struct kv_msg_scan *)KV_MSG_VALUE(msg);
+    msg->type = KV_MSG_SCAN;
+    msg->flags = 0;
+    msg->value_len = sizeof(struct kv_msg_scan);
+    *scan = (struct kv_msg_scan){0, io->scan_left, exclusive};
+    if (io->value) kv_rdma_fill_remote_buf(io->value, kv_rdma_get_value_buf(io->value), opt.value_size, &scan->records);
+}
+
+// false once the scan is done.
+static bool scan_next(struct io_buffer_t *io) {
+    struct kv_msg *resp = (struct kv_msg *)kv_rdma_get_resp_buf(io->resp);
+    struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(io->req);
+    struct kv_msg_scan *scan = (struct kv_msg_scan *)KV_MSG_VALUE(resp);
+    io->scan_left -= scan->num;
+    if (io->scan_left == 0) return false;
+    if (scan->more) {
+        struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)(
+            io->value ? kv_rdma_get_value_buf(io->value) : KV_MSG_SCAN_RECORDS(resp));
+        if (scan->num == 0) return false;
+        for (uint32_t i = 1; i < scan->num; ++i) record = kv_data_store_scan_next(record);
+        msg->key_len = record->key_length;
+        kv_memcpy(KV_MSG_KEY(msg), record->data, record->key_length);
+        scan_prepare(io, msg, true);
+        return true;
+    }
+    if (scan->end == UINT64_MAX) return false;
+    // the first key of the next vnode: no key is below its 64-bit prefix alone.
+    uint64_t start = scan->end + 1;
+    msg->key_len = sizeof(uint64_t);
+    kv_memcpy(KV_MSG_KEY(msg), &start, sizeof(uint64_t));
+    scan_prepare(io, msg, false);
+    return true;
+}
+
 static inline void do_transaction(struct io_buffer_t *io, struct kv_msg *msg) {
     msg->key_len = 16;
-    enum kv_ycsb_operation op = kv_ycsb_next(workloads[io->producer_id], false, KV_MSG_KEY(msg), KV_MSG_VALUE(msg));
+    enum kv_ycsb_operation op = kv_ycsb_next(workloads[io->producer_id], false, KV_MSG_KEY(msg), msg->key_len, io_value(io, msg));
     switch (op) {
+        case YCSB_SCAN:
+            io->scan_left = kv_ycsb_scan_length(workloads[io->producer_id]);
+            scan_prepare(io, msg, false);
+            break;
         case YCSB_READMODIFYWRITE:
             io->read_modify_write = true;
         // fall through
@@ -325,6 +432,12 @@ static inline void do_transaction(struct io_buffer_t *io, struct kv_msg *msg) {
     }
 }
 
+// each io of a producer is pending at most once, so pending has room for all of them.
+static inline void producer_dispatch(struct io_buffer_t *io, kv_ring_cb cb) {
+    struct producer_t *p = producers + io->producer_id;
+    p->pending[p->pending_num++] = (struct kv_ring_req){io->req, io->resp, kv_rdma_get_resp_buf(io->resp), cb, io};
+}
+
 static void test(void *arg) {
     struct io_buffer_t *io = arg;
     struct producer_t *p = io ? producers + io->producer_id : producers;
@@ -354,7 +467,14 @@ static void test(void *arg) {
         if (p->start_io % p->io_per_record == 0) {
             latency_records[p->start_io / p->io_per_record] = latency;
         }
-        if (((struct kv_msg *)kv_rdma_get_resp_buf(io->resp))->type != KV_MSG_OK) {
+        uint8_t resp_type = ((struct kv_msg *)kv_rdma_get_resp_buf(io->resp))->type;
+        if (resp_type == KV_MSG_TOO_LARGE) {
+            fprintf(stderr, "io fail: the value of %u B is larger than the server takes. \n", opt.value_size);
+            exit(-1);
+        } else if (resp_type == KV_MSG_NOT_FOUND) {
+            fprintf(stderr, "io fail: key not found. \n");
+            exit(-1);
+        } else if (resp_type != KV_MSG_OK) {
             fprintf(stderr, "io fail. \n");
             exit(-1);
         } else if (io->read_modify_write) {
@@ -364,7 +484,10 @@ static void test(void *arg) {
             io->read_modify_write = false;
             io->ditto_fill = false;
             io->ditto_clear = true;
-            kv_ring_dispatch(io->req, io->resp, kv_rdma_get_resp_buf(io->resp), test, io);
+            producer_dispatch(io, test);
+            return;
+        } else if (io->scan_left && scan_next(io)) {
+            producer_dispatch(io, test);
             return;
         }
     }
@@ -378,25 +501,28 @@ static void test(void *arg) {
     struct kv_msg *msg = (struct kv_msg *) kv_rdma_get_req_buf(io->req);
     if (io->retry_cnt == 0) {
         io->read_modify_write = false;
+        io->scan_left = 0;
         switch (state) {
             case SEQ_WRITE:
             case FILL:
                 msg->type = KV_MSG_SET;
                 msg->key_len = 16;
                 msg->value_len = opt.value_size;
-                kv_ycsb_next(workloads[0], true, KV_MSG_KEY(msg), KV_MSG_VALUE(msg));
+                kv_ycsb_next(workloads[0], true, KV_MSG_KEY(msg), msg->key_len, io_value(io, msg));
                 break;
             case SEQ_READ:
                 msg->type = KV_MSG_GET;
                 msg->key_len = 16;
                 msg->value_len = 0;
-                kv_ycsb_next(workloads[0], true, KV_MSG_KEY(msg), NULL);
+                io_value(io, msg);
+                kv_ycsb_next(workloads[0], true, KV_MSG_KEY(msg), msg->key_len, NULL);
                 break;
             case DEL:
                 msg->type = KV_MSG_DEL;
                 msg->key_len = 16;
                 msg->value_len = 0;
-                kv_ycsb_next(workloads[0], true, KV_MSG_KEY(msg), NULL);
+                msg->flags = 0;
+                kv_ycsb_next(workloads[0], true, KV_MSG_KEY(msg), msg->key_len, NULL);
                 break;
             case TRANSACTION:
                 do_transaction(io, msg);
@@ -435,7 +561,7 @@ static void test(void *arg) {
         if (ret != 0 || msg->value_len == 0) {
             io->ditto_fill = true;
             io->ditto_clear = false;
-            kv_ring_dispatch(io->req, io->resp, kv_rdma_get_resp_buf(io->resp), msg->type == KV_MSG_META_GET ? meta_get_cb : test, io);
+            producer_dispatch(io, msg->type == KV_MSG_META_GET ? meta_get_cb : test);
         } else {
             io->ditto_fill = false;
             io->ditto_clear = false;
@@ -447,7 +573,7 @@ static void test(void *arg) {
         if (opt.ours && opt.breakdown_stage == 3 && msg->type == KV_MSG_SET) {
             msg->type = KV_MSG_BUFFERED_SET;
         }
-        kv_ring_dispatch(io->req, io->resp, kv_rdma_get_resp_buf(io->resp), test, io);
+        producer_dispatch(io, test);
     }
 }
 
@@ -475,6 +601,7 @@ static void io_start(void *arg) {
     struct worker_t *self = workers + io->worker_id;
     struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_resp_buf(io->resp);
     assert(msg->type == KV_MSG_GET);
+    msg->value_len = self->storage.block_size;
     kv_data_store_get(&self->data_store, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg), &msg->value_len, (struct kv_bucket_meta *)KV_MSG_VALUE(msg), io_fini, arg);
 }
 
@@ -526,7 +653,8 @@ static void worker_init(void *arg) {
     kv_storage_init(&self->storage, self - workers);
     uint64_t bucket_num = KV_NUM_ITEMS / KV_ITEM_PER_BUCKET / opt.ssd_num;
     uint64_t value_log_block_num = self->storage.num_blocks * 0.95 - 2 * bucket_num;
-    kv_data_store_init(&self->data_store, &self->storage, 0, bucket_num, log_bucket_num, value_log_block_num, 512, &ds_queue, self - workers);
+    kv_data_store_init(&self->data_store, &self->storage, 0, bucket_num, log_bucket_num, value_log_block_num, opt.value_size, 512,
+                       &ds_queue, self - workers);
     kv_app_send(opt.ssd_num + opt.thread_num, test, NULL);
 }
 
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,14 +10,17 @@
 
 #include "../../kv_app.h"
 #include "../../kv_data_store.h"
+#include "../../kv_memory.h"
 #include "../../kv_msg.h"
 #include "../../utils/city.h"
 #include "../../utils/ditto_wrapper.h"
 #include "../../utils/timing.h"
 #include "../../ycsb/kv_ycsb.h"
+#define MGET_BATCH_MAX 128
 struct {
     uint64_t num_items, operation_cnt;
     uint32_t value_size;
+    uint32_t key_size;
     uint32_t ssd_num;
     uint32_t producer_num;
     uint32_t concurrent_io_num;
@@ -26,12 +31,23 @@ struct {
     char memcached_ip[32];
     bool ditto;
     bool ours;
-
+    bool lookup_bench;
+    uint64_t meta_bench_buckets;
+    bool alloc_bench;
+    enum kv_value_log_gc_policy gc_policy;
+    bool io_sched, io_sched_compare;
+    uint32_t value_log_fill;
+    bool key_index;
+    uint32_t mget_batch;
+    bool compress;
+    enum { VALUE_YCSB, VALUE_TEXT, VALUE_RANDOM } value_content;
+    uint32_t ttl;
 } opt = {.num_items = 1024,
          .operation_cnt = 512,
          .ssd_num = 2,
          .producer_num = 1,
          .value_size = 1024,
+         .key_size = 16,
          .concurrent_io_num = 32,
          .json_config_file = "config.json",
          .workload_file = "workloada.spec",
@@ -42,7 +58,20 @@ struct {
          .seq_read = false,
          .seq_write = false,
          .del = false,
-         .fill = false};
+         .fill = false,
+         .lookup_bench = false,
+         .meta_bench_buckets = 0,
+         .alloc_bench = false,
+         .gc_policy = KV_VALUE_LOG_GC_COST_BENEFIT,
+         .io_sched = true,
+         .io_sched_compare = false,
+         .value_log_fill = 0,
+         .key_index = false,
+         .mget_batch = 0,
+         .compress = false,
+         .value_content = VALUE_YCSB,
+         .ttl = 0};
+static const char *value_contents[] = {"ycsb", "text", "random"};
 static void help(void) {
     printf("Program options:\n");
     printf("  -h               Display this help message\n");
@@ -58,11 +87,29 @@ static void help(void) {
     printf("  -D               Perform delete operations\n");
     printf("  -F               Perform fill operations\n");
     printf("  -C <ditto/ours>  Enable caching\n");
+    printf("  -L               Run the in-bucket lookup microbenchmark and exit\n");
+    printf("  -M <bucket_num>  Run the bucket meta table microbenchmark with bucket_num buckets and exit\n");
+    printf("  -A               Run the operation context allocation microbenchmark and exit\n");
+    printf("  -G <cost-benefit/fifo> Set the value log compaction policy: %s\n",
+           opt.gc_policy == KV_VALUE_LOG_GC_FIFO ? "fifo" : "cost-benefit");
+    printf("  -S <on/off/both> Pace the compaction by the I/O scheduler, both runs the transactions with then without it: %s\n",
+           opt.io_sched_compare ? "both" : opt.io_sched ? "on" : "off");
+    printf("  -V <fill_percent> Size the value log so that the loaded items fill fill_percent%% of it: %u\n", opt.value_log_fill);
+    printf("  -k <key_size>    Set the key size, keys longer than %u bytes, %u with a TTL, are stored in the value log: %u\n",
+           KV_MAX_KEY_LENGTH, KV_ITEM_KEY_ROOM, opt.key_size);
+    printf("  -O               Keep an ordered index of the keys of the data stores, for the scans of the workload\n");
+    printf("  -g <batch>       Make the sequential reads multi-gets of batch keys of one data store, up to %u: %u\n",
+           MGET_BATCH_MAX, opt.mget_batch);
+    printf("  -z               Compress the values stored when it pays off\n");
+    printf("  -v <ycsb/text/random> Set the content of the values written, text compresses, random does not: %s\n",
+           value_contents[opt.value_content]);
+    printf("  -t <ttl>         Make the items written expire after ttl seconds, the gets of expired items miss: %u\n",
+           opt.ttl);
     return;
 }
 static void get_options(int argc, char **argv) {
     int ch;
-    while ((ch = getopt(argc, argv, "hd:w:c:f:i:P:m:RWFDC:")) != -1) switch (ch) {
+    while ((ch = getopt(argc, argv, "hd:w:c:f:i:P:m:RWFDC:LM:AG:S:V:k:Og:zv:t:")) != -1) switch (ch) {
             case 'w':
                 strcpy(opt.workload_file, optarg);
                 break;
@@ -96,6 +143,74 @@ static void get_options(int argc, char **argv) {
             case 'F':
                 opt.fill = true;
                 break;
+            case 'L':
+                opt.lookup_bench = true;
+                break;
+            case 'M':
+                opt.meta_bench_buckets = atoll(optarg);
+                break;
+            case 'A':
+                opt.alloc_bench = true;
+                break;
+            case 'G':
+                if (strcmp(optarg, "cost-benefit") == 0) {
+                    opt.gc_policy = KV_VALUE_LOG_GC_COST_BENEFIT;
+                } else if (strcmp(optarg, "fifo") == 0) {
+                    opt.gc_policy = KV_VALUE_LOG_GC_FIFO;
+                } else {
+                    help();
+                    exit(-1);
+                }
+                break;
+            case 'S':
+                if (strcmp(optarg, "on") == 0 || strcmp(optarg, "both") == 0) {
+                    opt.io_sched = true;
+                    opt.io_sched_compare = strcmp(optarg, "both") == 0;
+                } else if (strcmp(optarg, "off") == 0) {
+                    opt.io_sched = opt.io_sched_compare = false;
+                } else {
+                    help();
+                    exit(-1);
+                }
+                break;
+            case 'V':
+                opt.value_log_fill = atol(optarg);
+                if (opt.value_log_fill == 0 || opt.value_log_fill > 100) {
+                    help();
+                    exit(-1);
+                }
+                break;
+            case 'k':
+                opt.key_size = atol(optarg);
+                if (opt.key_size < KV_MIN_KEY_LENGTH || opt.key_size > UINT8_MAX) {
+                    help();
+                    exit(-1);
+                }
+                break;
+            case 'O':
+                opt.key_index = true;
+                break;
+            case 'g':
+                opt.mget_batch = atol(optarg);
+                if (opt.mget_batch > MGET_BATCH_MAX) {
+                    help();
+                    exit(-1);
+                }
+                break;
+            case 'z':
+                opt.compress = true;
+                break;
+            case 't':
+                opt.ttl = atol(optarg);
+                break;
+            case 'v':
+                for (opt.value_content = VALUE_YCSB; opt.value_content <= VALUE_RANDOM; opt.value_content++)
+                    if (strcmp(optarg, value_contents[opt.value_content]) == 0) break;
+                if (opt.value_content > VALUE_RANDOM) {
+                    help();
+                    exit(-1);
+                }
+                break;
             case 'C':
                 if (strcmp(optarg, "ditto") == 0) {
                     opt.ditto = true;
@@ -115,6 +230,9 @@ static void get_options(int argc, char **argv) {
 struct worker {
     struct kv_storage storage;
     struct kv_data_store data_store;
+    struct kv_storage_io_stats io_base;  // at the start of the current phase
+    uint64_t keys_read;
+    uint64_t get_misses;  // of the expired items
 } * workers;
 
 struct producer {
@@ -130,10 +248,42 @@ struct io_buffer_t {
     bool read_modify_write, is_finished, ditto_fill;
     struct timeval io_start;
     kv_data_store_ctx ds_ctx;
+    uint8_t *scan_buf;
+    uint32_t scan_len;
+    uint32_t scan_left;  // the records a YCSB scan still wants
+    uint8_t *mget_key[MGET_BATCH_MAX];
+    uint8_t mget_key_length[MGET_BATCH_MAX];
 };
 struct io_buffer_t *io_buffers;
 struct kv_ds_queue ds_queue;
 
+// a scan packs up to this many records at once, and goes on past the last of them for the rest.
+#define SCAN_BUF_RECORDS 16
+// the records of a scan or a multi-get.
+static inline uint32_t scan_buf_size(void) {
+    uint32_t records = opt.mget_batch > SCAN_BUF_RECORDS ? opt.mget_batch : SCAN_BUF_RECORDS;
+    return records * kv_data_store_scan_record_size(opt.key_size, opt.value_size);
+}
+// A YCSB value repeats a single character, which any codec squeezes to nothing. A text value is made of words drawn
+// from a small vocabulary, so that it compresses about as well as text does; a random value does not compress at all.
+#define VALUE_WORD_NUM 64
+static __thread uint64_t value_seed = 0x9E3779B97F4A7C15ULL;
+static inline uint64_t value_random(void) {
+    value_seed ^= value_seed << 13;
+    value_seed ^= value_seed >> 7;
+    value_seed ^= value_seed << 17;
+    return value_seed;
+}
+static void value_fill(uint8_t *value, uint32_t value_length) {
+    if (opt.value_content == VALUE_YCSB) return;
+    for (uint32_t i = 0; i < value_length; i += sizeof(uint64_t)) {
+        uint64_t word = value_random();
+        // the words of the vocabulary are the seeds of a fixed generator.
+        if (opt.value_content == VALUE_TEXT) word = (word % VALUE_WORD_NUM + 1) * 0x9E3779B97F4A7C15ULL;
+        kv_memcpy(value + i, &word, value_length - i < sizeof(uint64_t) ? value_length - i : sizeof(uint64_t));
+    }
+}
+static inline uint32_t key_worker(uint8_t *key) { return (*(uint64_t *)key >> (64 - 3)) % opt.ssd_num; }
 #define LATENCY_MAX_RECORD 0x100000  // 1M
 static double latency_records[LATENCY_MAX_RECORD];
 
@@ -151,14 +301,58 @@ kv_ycsb_handle workload;
 
 static void worker_stop(void *arg) {
     struct worker *self = arg;
+    struct kv_storage_pool_stats stats;
+    kv_storage_pool_stats(&stats);
+    printf("worker %zu DMA buffer pool hits/misses: 512B %lu/%lu, 4KB %lu/%lu, 64KB %lu/%lu, oversized %lu\n",
+           (size_t)(self - workers), stats.hits[0], stats.misses[0], stats.hits[1], stats.misses[1], stats.hits[2],
+           stats.misses[2], stats.oversized);
+    struct kv_value_log_stats *log_stats = &self->data_store.value_log.stats;
+    printf("worker %zu value log stalls id log/victim: %lu/%lu, space waits: %lu, write fails: %lu, "
+           "admission throttles: %lu, compaction deferrals: %lu\n",
+           (size_t)(self - workers), log_stats->id_log_stalls, log_stats->victim_stalls, log_stats->space_waits,
+           log_stats->write_fails, ds_queue.cost_model[self - workers].throttles, self->data_store.io_sched.deferrals);
+    printf("worker %zu write amplification: %lf (user %lu B, compaction %lu B), %lu segments compacted, %lu given back\n",
+           (size_t)(self - workers), kv_value_log_write_amplification(log_stats), log_stats->user_bytes,
+           log_stats->gc_bytes, log_stats->gc_segments, log_stats->gc_aborts);
+    struct kv_storage_io_stats io_stats;
+    kv_storage_io_stats(&io_stats);
+    uint64_t reads = io_stats.reads - self->io_base.reads, read_bytes = io_stats.read_bytes - self->io_base.read_bytes;
+    printf("worker %zu read %lu keys with %lu storage reads of %lu B: %lf reads, %lf B per key\n",
+           (size_t)(self - workers), self->keys_read, reads, read_bytes,
+           self->keys_read ? (double)reads / self->keys_read : 0, self->keys_read ? (double)read_bytes / self->keys_read : 0);
+    struct kv_value_log_codec_stats *codec_stats = &self->data_store.value_log.codec_stats;
+    uint64_t tried = codec_stats->compressed + codec_stats->raw;
+    if (tried)
+        printf("worker %zu compression: %lu of %lu values, %lu -> %lu B (%lf), %lf cycles per value, %lf cycles per decompression\n",
+               (size_t)(self - workers), codec_stats->compressed, tried, codec_stats->value_bytes,
+               codec_stats->record_bytes, (double)codec_stats->record_bytes / codec_stats->value_bytes,
+               (double)codec_stats->compress_tsc / tried,
+               codec_stats->decompressed ? (double)codec_stats->decompress_tsc / codec_stats->decompressed : 0);
+    if (opt.ttl)
+        printf("worker %zu expiry: %lu items dropped by the compactions, %lu of %lu gets missed\n", (size_t)(self - workers),
+               self->data_store.bucket_log.expired, self->get_misses, self->keys_read);
     kv_data_store_fini(&self->data_store);
     kv_storage_fini(&self->storage);
     kv_app_stop(0);
 }
 static void producer_stop(void *arg) { kv_app_stop(0); }
+// the reads of the storage are counted from the start of the phase.
+static void io_stats_reset(void *arg) {
+    struct worker *self = arg;
+    kv_storage_io_stats(&self->io_base);
+    self->keys_read = 0;
+    self->get_misses = 0;
+}
+static void io_sched_disable(void *arg) {
+    struct worker *self = arg;
+    self->data_store.io_sched.enabled = false;
+}
 
 static void stop(void) {
-    for (size_t i = 0; i < opt.concurrent_io_num; i++) kv_storage_free(io_buffers[i].msg);
+    for (size_t i = 0; i < opt.concurrent_io_num; i++) {
+        kv_storage_free(io_buffers[i].msg);
+        kv_storage_free(io_buffers[i].scan_buf);
+    }
     free(io_buffers);
     for (size_t i = 0; i < opt.ssd_num; i++) kv_app_send(i, worker_stop, workers + i);
     for (size_t i = 0; i < opt.producer_num; i++) kv_app_send(opt.ssd_num + i, producer_stop, NULL);
@@ -167,6 +361,10 @@ static void stop(void) {
 static void test(void *arg);
 static void io_fini(bool success, void *arg) {
     struct io_buffer_t *io = arg;
+    if (!success && opt.ttl && io->msg->type == KV_MSG_GET && io->msg->value_len == 0) {
+        workers[io->worker_id].get_misses++;
+        success = true;
+    }
     if (!success) {
         fprintf(stderr, "io fail. \n");
         exit(-1);
@@ -175,6 +373,10 @@ static void io_fini(bool success, void *arg) {
         kv_data_store_set_commit(io->ds_ctx, true);
     } else if (io->msg->type == KV_MSG_DEL) {
         kv_data_store_del_commit(io->ds_ctx, true);
+    } else if (io->msg->type == KV_MSG_GET) {
+        workers[io->worker_id].keys_read++;
+    } else if (io->msg->type == KV_MSG_SCAN || io->msg->type == KV_MSG_MGET) {
+        workers[io->worker_id].keys_read += ((struct kv_msg_scan *)KV_MSG_VALUE(io->msg))->num;
     }
     if (!opt.ditto || state == FILL) {
         io->msg->type = success ? KV_MSG_OK : KV_MSG_ERR;
@@ -188,8 +390,8 @@ static void io_start(void *arg) {
     struct kv_msg *msg = io->msg;
     switch (msg->type) {
         case KV_MSG_SET:
-            io->ds_ctx = kv_data_store_set(&self->data_store, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg), msg->value_len, io_fini,
-                                           arg);
+            io->ds_ctx = kv_data_store_set(&self->data_store, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg), msg->value_len,
+                                           kv_data_store_expire(&self->data_store, opt.ttl), io_fini, arg);
             break;
         case KV_MSG_GET:
             kv_data_store_get(&self->data_store, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg), &msg->value_len, NULL, io_fini,
@@ -198,6 +400,27 @@ static void io_start(void *arg) {
         case KV_MSG_DEL:
             io->ds_ctx = kv_data_store_delete(&self->data_store, KV_MSG_KEY(msg), msg->key_len, io_fini, arg);
             break;
+        case KV_MSG_SCAN: {
+            // within the data store of the first key.
+            struct kv_msg_scan *scan = (struct kv_msg_scan *)KV_MSG_VALUE(msg);
+            io->scan_len = scan_buf_size();
+            kv_data_store_scan(&self->data_store, KV_MSG_KEY(msg), msg->key_len, scan->exclusive, UINT64_MAX,
+                               io->scan_buf, &io->scan_len, &scan->num, &scan->more, io_fini, arg);
+            break;
+        }
+        case KV_MSG_MGET: {
+            // the keys are packed in the buffer of the records, which may overwrite them.
+            struct kv_msg_scan *mget = (struct kv_msg_scan *)KV_MSG_VALUE(msg);
+            struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)io->scan_buf;
+            for (uint32_t i = 0; i < mget->num; ++i, record = kv_data_store_scan_next(record)) {
+                io->mget_key[i] = record->data;
+                io->mget_key_length[i] = record->key_length;
+            }
+            io->scan_len = scan_buf_size();
+            kv_data_store_multi_get(&self->data_store, io->mget_key, io->mget_key_length, &mget->num, io->scan_buf,
+                                    &io->scan_len, io_fini, arg);
+            break;
+        }
         case INIT:
             assert(false);
     }
@@ -223,15 +446,18 @@ static void test_fini(void *arg) {  // always running on producer 0
     }
     if (total_io) {
         qsort(latency_records, total_io / io_per_record, sizeof(double), double_cmp);
+        printf("99%%  tail latency: %lf us\n", latency_records[(uint32_t)(total_io * 0.99 / io_per_record)] * 1000000);
         printf("99.9%%  tail latency: %lf us\n", latency_records[(uint32_t)(total_io * 0.999 / io_per_record)] * 1000000);
         printf("average latency: %lf us\n", latency_sum * 1000000 / total_io);
     }
     switch (state) {
         case INIT:
             io_buffers = calloc(opt.concurrent_io_num, sizeof(struct io_buffer_t));
-            for (size_t i = 0; i < opt.concurrent_io_num; i++)
+            for (size_t i = 0; i < opt.concurrent_io_num; i++) {
                 io_buffers[i].msg = kv_storage_malloc(&workers[0].storage,
-                                                      opt.value_size + sizeof(struct kv_msg) + 16 + workers[0].storage.block_size);
+                                                      opt.value_size + sizeof(struct kv_msg) + _KV_MSG_ALIGN(opt.key_size) + workers[0].storage.block_size);
+                io_buffers[i].scan_buf = kv_storage_malloc(&workers[0].storage, scan_buf_size());
+            }
             printf("ycsb client initialized in %lf s.\n", timeval_diff(&tv_start, &tv_end));
             if (opt.fill) {
                 total_io = opt.num_items;
@@ -257,6 +483,9 @@ static void test_fini(void *arg) {  // always running on producer 0
             return;
         case SEQ_READ:
             printf("SEQ_READ rate: %lf\n", ((double)opt.operation_cnt / timeval_diff(&tv_start, &tv_end)));
+            if (opt.mget_batch)
+                printf("SEQ_READ key rate: %lf (multi-gets of %u keys)\n",
+                       ((double)opt.operation_cnt * opt.mget_batch / timeval_diff(&tv_start, &tv_end)), opt.mget_batch);
             stop();
             return;
         case DEL:
@@ -264,10 +493,20 @@ static void test_fini(void *arg) {  // always running on producer 0
             stop();
             return;
         case TRANSACTION:
-            printf("TRANSACTION rate: %lf\n", ((double)opt.operation_cnt / timeval_diff(&tv_start, &tv_end)));
+            printf("TRANSACTION rate: %lf (compaction scheduler %s, %u B keys)\n",
+                   ((double)opt.operation_cnt / timeval_diff(&tv_start, &tv_end)),
+                   opt.io_sched ? "on" : "off", opt.key_size);
+            if (opt.io_sched_compare && opt.io_sched) {
+                // run the transactions again on the same, by now nearly full, logs without the scheduler.
+                opt.io_sched = false;
+                for (size_t i = 0; i < opt.ssd_num; i++) kv_app_send(i, io_sched_disable, workers + i);
+                total_io = opt.operation_cnt;
+                break;
+            }
             stop();
             return;
     }
+    for (size_t i = 0; i < opt.ssd_num; i++) kv_app_send(i, io_stats_reset, workers + i);
     for (size_t i = 0; i < opt.concurrent_io_num; i++) io_buffers[i].is_finished = false;
     io_per_record = (uint32_t)ceil(((double)total_io) / LATENCY_MAX_RECORD);
     uint64_t io_per_producer = total_io / opt.producer_num;
@@ -284,10 +523,55 @@ static void test_fini(void *arg) {  // always running on producer 0
     producers[opt.producer_num - 1].end_io = total_io;
     gettimeofday(&tv_start, NULL);
 }
+static inline void scan_prepare(struct io_buffer_t *io, struct kv_msg *msg, bool exclusive) {
+    msg->type = KV_MSG_SCAN;
+    msg->value_len = sizeof(struct kv_msg_scan);
+    *(struct kv_msg_scan *)KV_MSG_VALUE(msg) = (struct kv_msg_scan){0, io->scan_left, exclusive};
+}
+// false once the scan is done.
+static bool scan_next(struct io_buffer_t *io) {
+    struct kv_msg_scan *scan = (struct kv_msg_scan *)KV_MSG_VALUE(io->msg);
+    io->scan_left -= scan->num;
+    if (io->scan_left == 0 || !scan->more || scan->num == 0) return false;
+    struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)io->scan_buf;
+    for (uint32_t i = 1; i < scan->num; ++i) record = kv_data_store_scan_next(record);
+    io->msg->key_len = record->key_length;
+    kv_memcpy(KV_MSG_KEY(io->msg), record->data, record->key_length);
+    scan_prepare(io, io->msg, true);
+    return true;
+}
+
+// a multi-get of opt.mget_batch keys of the data store of the first one: the keys of the other data stores are skipped.
+static void mget_prepare(struct io_buffer_t *io, struct kv_msg *msg) {
+    msg->type = KV_MSG_MGET;
+    msg->key_len = opt.key_size;
+    msg->value_len = sizeof(struct kv_msg_scan);
+    *(struct kv_msg_scan *)KV_MSG_VALUE(msg) = (struct kv_msg_scan){UINT64_MAX, opt.mget_batch};
+    struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)io->scan_buf;
+    for (uint32_t i = 0; i < opt.mget_batch;) {
+        record->value_length = 0;
+        record->key_length = opt.key_size;
+        kv_ycsb_next(workload, true, record->data, record->key_length, NULL);
+        if (i == 0) kv_memcpy(KV_MSG_KEY(msg), record->data, record->key_length);
+        if (i == 0 || key_worker(record->data) == key_worker(KV_MSG_KEY(msg))) {
+            record = kv_data_store_scan_next(record);
+            ++i;
+        }
+    }
+}
+
 static inline void do_transaction(struct io_buffer_t *io, struct kv_msg *msg) {
-    msg->key_len = 16;
-    enum kv_ycsb_operation op = kv_ycsb_next(workload, false, KV_MSG_KEY(msg), KV_MSG_VALUE(msg));
+    msg->key_len = opt.key_size;
+    enum kv_ycsb_operation op = kv_ycsb_next(workload, false, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg));
     switch (op) {
+        case YCSB_SCAN:
+            if (!opt.key_index) {
+                fprintf(stderr, "ycsb_benchmark: the scans of the workload need the key index (-O).\n");
+                exit(-1);
+            }
+            io->scan_left = kv_ycsb_scan_length(workload);
+            scan_prepare(io, msg, false);
+            break;
         case YCSB_READMODIFYWRITE:
             io->read_modify_write = true;
         // fall through
@@ -299,6 +583,7 @@ static inline void do_transaction(struct io_buffer_t *io, struct kv_msg *msg) {
         case YCSB_INSERT:
             msg->type = KV_MSG_SET;
             msg->value_len = opt.value_size;
+            value_fill(KV_MSG_VALUE(msg), msg->value_len);
             break;
         default:
             assert(false);
@@ -313,7 +598,7 @@ static void test(void *arg) {
                 if (io->ditto_fill) {
                     ditto_set(io->producer_id, KV_MSG_KEY(io->msg), io->msg->key_len, KV_MSG_VALUE(io->msg), io->msg->value_len);
                 }
-            } else {
+            } else if (io->msg->type != KV_MSG_SCAN && io->msg->type != KV_MSG_MGET) {
                 ditto_set(io->producer_id, KV_MSG_KEY(io->msg), io->msg->key_len, KV_MSG_VALUE(io->msg), 0);
             }
             io->msg->type = KV_MSG_OK;
@@ -334,6 +619,9 @@ static void test(void *arg) {
             io->read_modify_write = false;
             kv_app_send(io->worker_id, io_start, io);
             return;
+        } else if (io->scan_left && scan_next(io)) {
+            kv_app_send(io->worker_id, io_start, io);
+            return;
         }
     }
     if (p->start_io == p->end_io) {
@@ -343,26 +631,32 @@ static void test(void *arg) {
         return;
     }
     io->read_modify_write = false;
+    io->scan_left = 0;
     struct kv_msg *msg = io->msg;
     switch (state) {
         case SEQ_WRITE:
         case FILL:
             msg->type = KV_MSG_SET;
-            msg->key_len = 16;
+            msg->key_len = opt.key_size;
             msg->value_len = opt.value_size;
-            kv_ycsb_next(workload, true, KV_MSG_KEY(msg), KV_MSG_VALUE(msg));
+            kv_ycsb_next(workload, true, KV_MSG_KEY(msg), msg->key_len, KV_MSG_VALUE(msg));
+            value_fill(KV_MSG_VALUE(msg), msg->value_len);
             break;
         case SEQ_READ:
+            if (opt.mget_batch) {
+                mget_prepare(io, msg);
+                break;
+            }
             msg->type = KV_MSG_GET;
-            msg->key_len = 16;
+            msg->key_len = opt.key_size;
             msg->value_len = 0;
-            kv_ycsb_next(workload, true, KV_MSG_KEY(msg), NULL);
+            kv_ycsb_next(workload, true, KV_MSG_KEY(msg), msg->key_len, NULL);
             break;
         case DEL:
             msg->type = KV_MSG_DEL;
-            msg->key_len = 16;
+            msg->key_len = opt.key_size;
             msg->value_len = 0;
-            kv_ycsb_next(workload, true, KV_MSG_KEY(msg), NULL);
+            kv_ycsb_next(workload, true, KV_MSG_KEY(msg), msg->key_len, NULL);
             break;
         case TRANSACTION:
             do_transaction(io, msg);
@@ -373,7 +667,7 @@ static void test(void *arg) {
     io->is_finished = true;
     p->start_io++;
     gettimeofday(&io->io_start, NULL);
-    io->worker_id = (*(uint64_t *)KV_MSG_KEY(msg) >> (64 - 3)) % opt.ssd_num;
+    io->worker_id = key_worker(KV_MSG_KEY(msg));
     if (io->msg->type == KV_MSG_GET) {
         assert(state != FILL);
         int ret;
@@ -403,10 +697,178 @@ static void worker_init(void *arg) {
     while ((1ULL << log_bucket_num) >= opt.num_items / KEY_PER_BKT_SEGMENT) log_bucket_num--;
     ++log_bucket_num;
     uint64_t value_log_block_num = self->storage.num_blocks * 0.95 - 2 * bucket_num;
-    kv_data_store_init(&self->data_store, &self->storage, 0, bucket_num, log_bucket_num, value_log_block_num, 512, &ds_queue, self - workers);
+    if (opt.value_log_fill) {
+        // a SET takes whole blocks of the value log, a long key included.
+        uint64_t item_size = opt.value_size + (kv_key_in_log(opt.key_size, opt.ttl) ? kv_long_key_size(opt.key_size) : 0);
+        uint64_t item_blks = (item_size + self->storage.block_size - 1) / self->storage.block_size;
+        uint64_t fill_blks = opt.num_items / opt.ssd_num * item_blks * 100 / opt.value_log_fill;
+        if (fill_blks < value_log_block_num) value_log_block_num = fill_blks;
+    }
+    kv_data_store_init(&self->data_store, &self->storage, 0, bucket_num, log_bucket_num, value_log_block_num, opt.value_size, 512,
+                       &ds_queue, self - workers);
+    self->data_store.value_log.gc_policy = opt.gc_policy;
+    self->data_store.value_log.compress = opt.compress;
+    self->data_store.io_sched.enabled = opt.io_sched;
+    if (opt.key_index) kv_data_store_index_init(&self->data_store);
     kv_app_send(opt.ssd_num, test, NULL);
 }
 
+// --- in-bucket lookup microbenchmark ---
+#define LOOKUP_BENCH_ROUNDS 1000000
+#define LOOKUP_BENCH_KEY_LEN 16
+static struct kv_item *lookup_scan(struct kv_bucket_segment *seg, uint8_t *key, uint8_t key_length) {
+    struct kv_bucket_chain_entry *ce;
+    TAILQ_FOREACH(ce, &seg->chain, entry) {
+        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket)
+            for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item)
+                if (item->key_length == key_length && !kv_memcmp8(item->key, key, key_length)) return item;
+    }
+    return NULL;
+}
+
+static void lookup_benchmark(void) {
+    static const uint8_t chain_lengths[] = {1, 4, 16};
+    for (size_t c = 0; c < sizeof(chain_lengths) / sizeof(chain_lengths[0]); c++) {
+        uint8_t len = chain_lengths[c];
+        uint32_t item_num = len * KV_ITEM_PER_BUCKET;
+        struct kv_bucket *buckets = calloc(len, sizeof(struct kv_bucket));
+        uint8_t(*keys)[LOOKUP_BENCH_KEY_LEN] = malloc(2 * item_num * LOOKUP_BENCH_KEY_LEN);
+        for (uint32_t i = 0; i < 2 * item_num * LOOKUP_BENCH_KEY_LEN; i++) keys[0][i] = random();
+        for (uint32_t i = 0; i < item_num; i++) {
+            struct kv_bucket *bucket = buckets + i / KV_ITEM_PER_BUCKET;
+            struct kv_item *item = bucket->items + i % KV_ITEM_PER_BUCKET;
+            bucket->chain_length = len;
+            bucket->chain_index = i / KV_ITEM_PER_BUCKET;
+            item->key_length = LOOKUP_BENCH_KEY_LEN;
+            kv_memcpy(item->key, keys[i], LOOKUP_BENCH_KEY_LEN);
+        }
+        // keys[item_num, 2 * item_num) are not in the chain
+        struct kv_bucket_segment seg;
+        struct kv_bucket_chain_entry ce = {buckets, len, true};
+        kv_bucket_seg_init(&seg, 0);
+        TAILQ_INSERT_TAIL(&seg.chain, &ce, entry);
+        kv_bucket_seg_tags(&seg);
+
+        uint64_t found = 0, cycles[4];
+        for (uint32_t miss = 0; miss < 2; miss++) {
+            uint64_t start = rdtsc();
+            for (uint32_t i = 0; i < LOOKUP_BENCH_ROUNDS; i++)
+                found += lookup_scan(&seg, keys[miss * item_num + i * 7919 % item_num], LOOKUP_BENCH_KEY_LEN) != NULL;
+            cycles[miss] = rdtsc() - start;
+            start = rdtsc();
+            for (uint32_t i = 0; i < LOOKUP_BENCH_ROUNDS; i++)
+                found += kv_bucket_seg_find(&seg, keys[miss * item_num + i * 7919 % item_num], LOOKUP_BENCH_KEY_LEN) != NULL;
+            cycles[2 + miss] = rdtsc() - start;
+        }
+        assert(found == 2 * LOOKUP_BENCH_ROUNDS);
+        printf("chain length %u: hit %.1lf -> %.1lf cycles/lookup, miss %.1lf -> %.1lf cycles/lookup (memcmp scan -> tag match)\n",
+               len, (double)cycles[0] / LOOKUP_BENCH_ROUNDS, (double)cycles[2] / LOOKUP_BENCH_ROUNDS,
+               (double)cycles[1] / LOOKUP_BENCH_ROUNDS, (double)cycles[3] / LOOKUP_BENCH_ROUNDS);
+        TAILQ_REMOVE(&seg.chain, &ce, entry);
+        kv_free(seg.tags);
+        free(keys);
+        free(buckets);
+    }
+}
+
+// --- bucket meta table microbenchmark ---
+static uint64_t rss_bytes(void) {
+    uint64_t size = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void meta_benchmark(uint64_t bucket_num) {
+    // the same layout as the benchmark workers: about KV_ITEM_PER_BUCKET keys per bucket id.
+    uint64_t log_bucket_num = 1;
+    while ((1ULL << log_bucket_num) < bucket_num) log_bucket_num++;
+    uint64_t id_mask = (1ULL << log_bucket_num) - 1, lookup_num = 10 * bucket_num;
+    struct kv_bucket_log bucket_log;
+    struct timeval tv0, tv1;
+    uint64_t rss = rss_bytes();
+    kv_bucket_meta_init(&bucket_log);
+    gettimeofday(&tv0, NULL);
+    for (uint64_t i = 0; i < bucket_num; i++)
+        kv_bucket_meta_put(&bucket_log, CityHash64((char *)&i, sizeof(i)) & id_mask, (struct kv_bucket_meta){1, i});
+    gettimeofday(&tv1, NULL);
+    printf("meta put: %lf Mops/s, RSS +%.1lf MB\n", bucket_num / timeval_diff(&tv0, &tv1) / 1e6,
+           (double)(rss_bytes() - rss) / (1 << 20));
+    uint64_t found = 0;
+    gettimeofday(&tv0, NULL);
+    for (uint64_t i = 0; i < lookup_num; i++) {
+        uint64_t n = i % bucket_num;
+        found += kv_bucket_meta_get(&bucket_log, CityHash64((char *)&n, sizeof(n)) & id_mask).chain_length;
+    }
+    gettimeofday(&tv1, NULL);
+    printf("meta get: %lf Mops/s, %lu found\n", lookup_num / timeval_diff(&tv0, &tv1) / 1e6, found);
+    kv_bucket_meta_fini(&bucket_log);
+}
+
+// --- operation context allocation microbenchmark ---
+#define ALLOC_BENCH_ROUNDS 10000000
+#define ALLOC_BENCH_INFLIGHT 256  // contexts held by in-flight operations
+static __thread struct kv_freelist list;
+
+// the contexts of kv_ring are allocated by one thread and freed by another: this one frees what main allocates.
+static void *volatile alloc_ring[ALLOC_BENCH_INFLIGHT];
+static volatile uint64_t alloc_prod, alloc_cons;
+static void *alloc_remote_free(void *arg) {
+    while (alloc_cons < ALLOC_BENCH_ROUNDS) {
+        if (alloc_cons == __atomic_load_n(&alloc_prod, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+            continue;
+        }
+        kv_freelist_put(&list, alloc_ring[alloc_cons % ALLOC_BENCH_INFLIGHT]);
+        __atomic_store_n(&alloc_cons, alloc_cons + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+static void alloc_cross_thread(size_t size) {
+    pthread_t t;
+    alloc_prod = alloc_cons = 0;
+    uint64_t misses = list.misses, start = rdtsc();
+    pthread_create(&t, NULL, alloc_remote_free, NULL);
+    for (uint32_t i = 0; i < ALLOC_BENCH_ROUNDS; i++) {
+        while (alloc_prod - __atomic_load_n(&alloc_cons, __ATOMIC_ACQUIRE) >= ALLOC_BENCH_INFLIGHT) sched_yield();
+        alloc_ring[alloc_prod % ALLOC_BENCH_INFLIGHT] = kv_freelist_get(&list, size);
+        __atomic_store_n(&alloc_prod, alloc_prod + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(t, NULL);
+    printf("%zu bytes freed by another thread: %.1lf cycles/op, %.2lf%% of the gets from malloc\n", size,
+           (double)(rdtsc() - start) / ALLOC_BENCH_ROUNDS, 100.0 * (list.misses - misses) / ALLOC_BENCH_ROUNDS);
+    kv_freelist_clear(&list);
+}
+
+static void alloc_benchmark(void) {
+    // about the sizes of a queue entry, a get/delete context and a set context.
+    static const size_t sizes[] = {48, 160, 768};
+    void *inflight[ALLOC_BENCH_INFLIGHT] = {NULL};
+    for (size_t c = 0; c < sizeof(sizes) / sizeof(sizes[0]); c++) {
+        uint64_t cycles[2];
+        for (uint32_t use_list = 0; use_list < 2; use_list++) {
+            uint64_t start = rdtsc();
+            for (uint32_t i = 0; i < ALLOC_BENCH_ROUNDS; i++) {
+                void **p = inflight + i % ALLOC_BENCH_INFLIGHT;
+                if (*p) use_list ? kv_freelist_put(&list, *p) : kv_free(*p);
+                *p = use_list ? kv_freelist_get(&list, sizes[c]) : kv_malloc(sizes[c]);
+                *(volatile uint8_t *)*p = i;
+            }
+            cycles[use_list] = rdtsc() - start;
+            for (uint32_t i = 0; i < ALLOC_BENCH_INFLIGHT; i++) {
+                use_list ? kv_freelist_put(&list, inflight[i]) : kv_free(inflight[i]);
+                inflight[i] = NULL;
+            }
+            kv_freelist_clear(&list);
+        }
+        printf("%zu bytes: malloc/free %.1lf -> kv_freelist %.1lf cycles/op\n", sizes[c],
+               (double)cycles[0] / ALLOC_BENCH_ROUNDS, (double)cycles[1] / ALLOC_BENCH_ROUNDS);
+        alloc_cross_thread(sizes[c]);
+    }
+}
+
 int main(int argc, char **argv) {
 #ifdef NDEBUG
     printf("NDEBUG\n");
@@ -414,6 +876,18 @@ int main(int argc, char **argv) {
     printf("DEBUG (low performance)\n");
 #endif
     get_options(argc, argv);
+    if (opt.lookup_bench) {
+        lookup_benchmark();
+        return 0;
+    }
+    if (opt.meta_bench_buckets) {
+        meta_benchmark(opt.meta_bench_buckets);
+        return 0;
+    }
+    if (opt.alloc_bench) {
+        alloc_benchmark();
+        return 0;
+    }
     if (opt.ditto) ditto_init(opt.producer_num, 1, opt.client_conf_file, opt.memcached_ip);
     if (opt.ours) packed_init(opt.producer_num, 1, opt.client_conf_file, opt.memcached_ip);
     struct kv_app_task *task = calloc(opt.ssd_num + opt.producer_num, sizeof(struct kv_app_task));
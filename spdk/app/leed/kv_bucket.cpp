@@ -3,8 +3,11 @@
 #include <cstdio>
 #include <list>
 #include <map>
+#include <set>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 extern "C" {
 #include "kv_app.h"
 #include "kv_bucket_log.h"
@@ -18,23 +21,118 @@ using namespace std;
 #define META_BLOCK_MASK (META_BLOCK_SIZE - 1ull)
 struct meta_block {
     struct kv_bucket_meta meta[META_BLOCK_SIZE];
+    uint8_t *tags[META_BLOCK_SIZE];  // chain_length * KV_ITEM_PER_BUCKET fingerprint tags of each bucket
     uint32_t non_empty_blks;
 };
-typedef unordered_map<uint64_t, meta_block> meta_map;
+
+// open addressing with linear probing. A slot is 16 bytes, so a probe sequence usually stays in one cache line.
+// The meta blocks are allocated in fixed-size chunks and never move, the slots only store their indexes.
+#define META_SLOT_EMPTY UINT64_MAX
+#define META_TABLE_INIT_SHIFT 10
+#define META_CHUNK_SHIFT 10
+#define META_CHUNK_SIZE (1u << META_CHUNK_SHIFT)
+struct meta_slot {
+    uint64_t key;
+    uint32_t block;
+};
+struct meta_table {
+    struct meta_slot *slots;
+    uint32_t shift;  // capacity = 1 << shift
+    uint64_t size;
+    vector<meta_block *> chunks;
+    vector<uint32_t> free_blocks;
+};
+
+static inline uint64_t meta_home(struct meta_table *table, uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ull) >> (64 - table->shift);
+}
+static inline uint64_t meta_mask(struct meta_table *table) { return (1ull << table->shift) - 1; }
+static inline meta_block *meta_block_at(struct meta_table *table, uint32_t block) {
+    return table->chunks[block >> META_CHUNK_SHIFT] + (block & (META_CHUNK_SIZE - 1));
+}
+
+static void meta_slots_alloc(struct meta_table *table, uint32_t shift) {
+    table->shift = shift;
+    table->slots = (struct meta_slot *)kv_malloc(sizeof(struct meta_slot) << shift);
+    for (uint64_t i = 0; i < 1ull << shift; ++i) table->slots[i].key = META_SLOT_EMPTY;
+}
+
+static void meta_grow(struct meta_table *table) {
+    struct meta_slot *old = table->slots;
+    uint64_t old_capacity = 1ull << table->shift;
+    meta_slots_alloc(table, table->shift + 1);
+    for (uint64_t i = 0; i < old_capacity; ++i) {
+        if (old[i].key == META_SLOT_EMPTY) continue;
+        uint64_t j = meta_home(table, old[i].key);
+        while (table->slots[j].key != META_SLOT_EMPTY) j = (j + 1) & meta_mask(table);
+        table->slots[j] = old[i];
+    }
+    kv_free(old);
+}
+
+static meta_block *meta_find(struct meta_table *table, uint64_t key) {
+    for (uint64_t i = meta_home(table, key);; i = (i + 1) & meta_mask(table)) {
+        if (table->slots[i].key == key) return meta_block_at(table, table->slots[i].block);
+        if (table->slots[i].key == META_SLOT_EMPTY) return nullptr;
+    }
+}
+
+static meta_block *meta_insert(struct meta_table *table, uint64_t key) {
+    if ((table->size + 1) * 4 > 3ull << table->shift) meta_grow(table);
+    if (table->free_blocks.empty()) {
+        uint32_t base = table->chunks.size() << META_CHUNK_SHIFT;
+        table->chunks.push_back((meta_block *)kv_malloc(sizeof(meta_block) * META_CHUNK_SIZE));
+        for (uint32_t i = META_CHUNK_SIZE; i > 0; --i) table->free_blocks.push_back(base + i - 1);
+    }
+    uint64_t i = meta_home(table, key);
+    while (table->slots[i].key != META_SLOT_EMPTY) i = (i + 1) & meta_mask(table);
+    table->slots[i] = {key, table->free_blocks.back()};
+    table->free_blocks.pop_back();
+    table->size++;
+    meta_block *block = meta_block_at(table, table->slots[i].block);
+    *block = {{}, {}, 0};
+    return block;
+}
+
+static void meta_erase(struct meta_table *table, uint64_t key) {
+    uint64_t i = meta_home(table, key), mask = meta_mask(table);
+    while (table->slots[i].key != key) i = (i + 1) & mask;
+    table->free_blocks.push_back(table->slots[i].block);
+    table->size--;
+    // backward shift deletion, no tombstones are left behind.
+    for (uint64_t j = (i + 1) & mask; table->slots[j].key != META_SLOT_EMPTY; j = (j + 1) & mask) {
+        uint64_t home = meta_home(table, table->slots[j].key);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i].key = META_SLOT_EMPTY;
+}
+
 void kv_bucket_meta_init(struct kv_bucket_log *self) {
-    self->meta = new meta_map();
+    struct meta_table *table = new meta_table();
+    meta_slots_alloc(table, META_TABLE_INIT_SHIFT);
+    self->meta = table;
 }
 void kv_bucket_meta_fini(struct kv_bucket_log *self) {
-    delete (meta_map *)self->meta;
+    struct meta_table *table = (struct meta_table *)self->meta;
+    for (uint64_t i = 0; i < 1ull << table->shift; ++i) {
+        if (table->slots[i].key == META_SLOT_EMPTY) continue;
+        meta_block *block = meta_block_at(table, table->slots[i].block);
+        for (uint64_t j = 0; j < META_BLOCK_SIZE; ++j) kv_free(block->tags[j]);
+    }
+    for (auto chunk : table->chunks) kv_free(chunk);
+    kv_free(table->slots);
+    delete table;
 }
 
 struct kv_bucket_meta kv_bucket_meta_get(struct kv_bucket_log *self, uint64_t bucket_id) {
-    meta_map *meta = (meta_map *)self->meta;
-    auto p = meta->find(bucket_id >> META_BLOCK_SHIFT);
-    if (p == meta->end()) {
+    meta_block *block = meta_find((struct meta_table *)self->meta, bucket_id >> META_BLOCK_SHIFT);
+    if (block == nullptr) {
         return {0, 0};
     } else {
-        return p->second.meta[bucket_id & META_BLOCK_MASK];
+        return block->meta[bucket_id & META_BLOCK_MASK];
     }
 }
 static inline bool is_meta_empty(const struct kv_bucket_meta &data) {
@@ -42,31 +140,72 @@ static inline bool is_meta_empty(const struct kv_bucket_meta &data) {
 }
 
 void kv_bucket_meta_put(struct kv_bucket_log *self, uint64_t bucket_id, struct kv_bucket_meta data) {
-    meta_map *meta = (meta_map *)self->meta;
-    auto p = meta->find(bucket_id >> META_BLOCK_SHIFT);
-    if (p == meta->end()) {
+    struct meta_table *table = (struct meta_table *)self->meta;
+    meta_block *block = meta_find(table, bucket_id >> META_BLOCK_SHIFT);
+    if (block == nullptr) {
         if (is_meta_empty(data)) return;
-        (*meta)[bucket_id >> META_BLOCK_SHIFT] = {{}, 0};
-        p = meta->find(bucket_id >> META_BLOCK_SHIFT);
+        block = meta_insert(table, bucket_id >> META_BLOCK_SHIFT);
     }
-    bool empty = is_meta_empty(p->second.meta[bucket_id & META_BLOCK_MASK]);
-    p->second.meta[bucket_id & META_BLOCK_MASK] = data;
+    bool empty = is_meta_empty(block->meta[bucket_id & META_BLOCK_MASK]);
+    block->meta[bucket_id & META_BLOCK_MASK] = data;
     if (is_meta_empty(data)) {
-        if (--p->second.non_empty_blks == 0) {
-            meta->erase(p);
+        kv_free(block->tags[bucket_id & META_BLOCK_MASK]);
+        block->tags[bucket_id & META_BLOCK_MASK] = nullptr;
+        if (--block->non_empty_blks == 0) {
+            meta_erase(table, bucket_id >> META_BLOCK_SHIFT);
         }
     } else if (empty) {
-        p->second.non_empty_blks++;
+        block->non_empty_blks++;
+    }
+}
+
+uint8_t *kv_bucket_meta_tags(struct kv_bucket_log *self, uint64_t bucket_id) {
+    meta_block *block = meta_find((struct meta_table *)self->meta, bucket_id >> META_BLOCK_SHIFT);
+    return block == nullptr ? nullptr : block->tags[bucket_id & META_BLOCK_MASK];
+}
+
+// the tags must describe the buckets the current meta points to.
+void kv_bucket_meta_put_tags(struct kv_bucket_log *self, uint64_t bucket_id, const uint8_t *tags) {
+    meta_block *block = meta_find((struct meta_table *)self->meta, bucket_id >> META_BLOCK_SHIFT);
+    if (block == nullptr) return;
+    uint8_t *&dst = block->tags[bucket_id & META_BLOCK_MASK];
+    size_t size = block->meta[bucket_id & META_BLOCK_MASK].chain_length * KV_ITEM_PER_BUCKET;
+    if (tags == nullptr || size == 0) {
+        kv_free(dst);
+        dst = nullptr;
+        return;
+    }
+    dst = (uint8_t *)kv_realloc(dst, size);
+    kv_memcpy(dst, tags, size);
+}
+
+uint64_t kv_bucket_meta_dump(struct kv_bucket_log *self, struct kv_bucket_meta_record *records) {
+    struct meta_table *table = (struct meta_table *)self->meta;
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < 1ull << table->shift; ++i) {
+        if (table->slots[i].key == META_SLOT_EMPTY) continue;
+        meta_block *block = meta_block_at(table, table->slots[i].block);
+        for (uint64_t j = 0; j < META_BLOCK_SIZE; ++j) {
+            if (is_meta_empty(block->meta[j])) continue;
+            if (records)
+                records[n] = {table->slots[i].key << META_BLOCK_SHIFT | j, block->meta[j].bucket_offset,
+                              block->meta[j].chain_length, {}};
+            n++;
+        }
     }
+    return n;
 }
 
 // --- bucket lock ---
 
+struct lock_ctx;
+typedef list<struct lock_ctx *> wait_list;
 struct lock_ctx {
     struct kv_bucket_segments *segs;
     uint32_t io_cnt;
     kv_task_cb cb;
     void *cb_arg;
+    vector<pair<uint64_t, wait_list::iterator>> waits;  // positions in the wait lists of its buckets
 };
 
 struct lock_segment {
@@ -77,18 +216,31 @@ struct lock_segment {
 struct bucket_lock {
     unordered_set<uint64_t> locked;
     unordered_map<uint64_t, struct lock_segment> segments;
-    list<struct lock_ctx *> queue;
+    // FIFO of the waiting requests per bucket, a request waits on all of its buckets.
+    unordered_map<uint64_t, wait_list> waiters;
 };
 
+static void wait_remove(struct bucket_lock *lock, struct lock_ctx *ctx) {
+    for (auto &w : ctx->waits) {
+        auto p = lock->waiters.find(w.first);
+        p->second.erase(w.second);
+        if (p->second.empty()) lock->waiters.erase(p);
+    }
+    ctx->waits.clear();
+}
+
 static inline void segment_move(struct kv_bucket_segment *src, struct kv_bucket_segment *dst) {
     assert(dst->bucket_id == src->bucket_id);
     assert(TAILQ_EMPTY(&dst->chain) && dst->empty && !dst->dirty);
     assert(!src->empty && !src->dirty);
+    assert(dst->tags == nullptr);
     struct kv_bucket_chain_entry *chain_entry;
     while ((chain_entry = TAILQ_FIRST(&src->chain)) != NULL) {
         TAILQ_REMOVE(&src->chain, chain_entry, entry);
         TAILQ_INSERT_TAIL(&dst->chain, chain_entry, entry);
     }
+    dst->tags = src->tags;
+    src->tags = nullptr;
     src->empty = true;
     dst->empty = false;
 }
@@ -152,9 +304,10 @@ void kv_bucket_lock(struct kv_bucket_log *self, struct kv_bucket_segments *segs,
     struct bucket_lock *lock = (struct bucket_lock *)self->bucket_lock;
     struct lock_ctx *ctx = new lock_ctx{.segs = segs, .io_cnt = 0, .cb = cb, .cb_arg = cb_arg};
     if (try_lock(self, ctx) == false) {
-        lock->queue.push_back(ctx);
         struct kv_bucket_segment *seg;
         TAILQ_FOREACH(seg, segs, entry) {
+            wait_list &w = lock->waiters[seg->bucket_id];
+            ctx->waits.push_back({seg->bucket_id, w.insert(w.end(), ctx)});
             if (lock->segments.find(seg->bucket_id) == lock->segments.end()) {
                 // prefetch the bucket segment
                 lock->segments[seg->bucket_id] = {seg, nullptr};
@@ -171,25 +324,46 @@ void kv_bucket_unlock(struct kv_bucket_log *self, struct kv_bucket_segments *seg
         auto &lock_seg = lock->segments[seg->bucket_id];
         assert(lock_seg.seg == seg);
         lock->locked.erase(seg->bucket_id);
-        for (auto p = lock->queue.begin(); p != lock->queue.end(); ++p)
-            TAILQ_FOREACH(i, (*p)->segs, entry) {
-                if (i->bucket_id == seg->bucket_id && seg->dirty == false) {
-                    segment_move(seg, i);
-                    lock_seg.seg = i;
-                    goto next_seg;
-                }
+        auto w = lock->waiters.find(seg->bucket_id);
+        if (w != lock->waiters.end() && seg->dirty == false) {
+            // hand the segment over to the first waiter of this bucket.
+            TAILQ_FOREACH(i, w->second.front()->segs, entry) {
+                if (i->bucket_id == seg->bucket_id) break;
             }
-        lock->segments.erase(seg->bucket_id);
-        kv_bucket_seg_cleanup(self, seg);
-    next_seg:;
+            segment_move(seg, i);
+            lock_seg.seg = i;
+        } else {
+            lock->segments.erase(seg->bucket_id);
+            kv_bucket_seg_cleanup(self, seg);
+        }
     }
 
-    for (auto p = lock->queue.begin(); p != lock->queue.end();)
-        if (try_lock(self, *p)) {
-            p = lock->queue.erase(p);
-        } else {
-            ++p;
+    // only the waiters of the released buckets may become lockable.
+    TAILQ_FOREACH(seg, segs, entry) {
+        auto w = lock->waiters.find(seg->bucket_id);
+        if (w == lock->waiters.end()) continue;
+        for (auto p = w->second.begin(); p != w->second.end(); ++p) {
+            struct lock_ctx *ctx = *p;
+            if (lockable(lock, ctx->segs)) {
+                // the ctx may be freed by try_lock, and no one else can lock this bucket after it.
+                wait_remove(lock, ctx);
+                try_lock(self, ctx);
+                break;
+            }
         }
+    }
+}
+
+bool kv_bucket_is_putting(struct kv_bucket_log *self, uint64_t bucket_id) {
+    struct bucket_lock *lock = (struct bucket_lock *)self->bucket_lock;
+    if (lock->locked.find(bucket_id) == lock->locked.end()) return false;
+    auto p = lock->segments.find(bucket_id);
+    return p != lock->segments.end() && p->second.seg->pending != nullptr;
+}
+
+bool kv_bucket_is_locked(struct kv_bucket_log *self, uint64_t bucket_id) {
+    struct bucket_lock *lock = (struct bucket_lock *)self->bucket_lock;
+    return lock->segments.find(bucket_id) != lock->segments.end();
 }
 
 void kv_bucket_lock_init(struct kv_bucket_log *self) {
@@ -206,7 +380,10 @@ typedef map<key_t_, uint32_t> key_set;
 
 static inline key_t_ key_to_array(uint8_t *key, uint8_t key_length) {
     key_t_ _key({0});
-    kv_memcpy(_key.data(), key, key_length);
+    if (kv_is_long_key(key_length))
+        kv_long_key_fingerprint(_key.data(), key, key_length);
+    else
+        kv_memcpy(_key.data(), key, key_length);
     return _key;
 }
 
@@ -237,4 +414,53 @@ kv_bucket_key_set kv_bucket_key_set_init(void) {
 
 void kv_bucket_key_set_fini(kv_bucket_key_set set) {
     delete (key_set *)set;
-}
\ No newline at end of file
+}
+// --- key index ---
+// keys are at least KV_MIN_KEY_LENGTH bytes long, so every key has its 64-bit prefix.
+struct key_index_less {
+    bool operator()(const string &a, const string &b) const {
+        uint64_t pa = kv_key_prefix((const uint8_t *)a.data()), pb = kv_key_prefix((const uint8_t *)b.data());
+        if (pa != pb) return pa < pb;
+        return a.compare(sizeof(uint64_t), string::npos, b, sizeof(uint64_t), string::npos) < 0;
+    }
+};
+typedef set<string, key_index_less> key_index;
+
+void kv_bucket_key_index_add(kv_bucket_key_index index, uint8_t *key, uint8_t key_length) {
+    ((key_index *)index)->emplace((char *)key, key_length);
+}
+
+void kv_bucket_key_index_del(kv_bucket_key_index index, uint8_t *key, uint8_t key_length) {
+    ((key_index *)index)->erase(string((char *)key, key_length));
+}
+
+static void key_index_erase(key_index *index, uint64_t start, uint64_t end, bool to_last) {
+    auto i = index->lower_bound(string((char *)&start, sizeof(start)));
+    while (i != index->end() && (to_last || kv_key_prefix((const uint8_t *)i->data()) < end)) i = index->erase(i);
+}
+
+void kv_bucket_key_index_del_range(kv_bucket_key_index _index, uint64_t start, uint64_t end) {
+    key_index *index = (key_index *)_index;
+    if (start < end) {
+        key_index_erase(index, start, end, false);
+    } else if (start > end) {
+        key_index_erase(index, start, 0, true);
+        key_index_erase(index, 0, end, false);
+    }
+}
+
+bool kv_bucket_key_index_next(kv_bucket_key_index _index, uint8_t *key, uint8_t *key_length, bool exclusive) {
+    key_index *index = (key_index *)_index;
+    string _key((char *)key, *key_length);
+    auto i = exclusive ? index->upper_bound(_key) : index->lower_bound(_key);
+    if (i == index->end()) return false;
+    kv_memcpy(key, i->data(), i->size());
+    *key_length = i->size();
+    return true;
+}
+
+uint64_t kv_bucket_key_index_size(kv_bucket_key_index index) { return ((key_index *)index)->size(); }
+
+kv_bucket_key_index kv_bucket_key_index_init(void) { return new key_index(); }
+
+void kv_bucket_key_index_fini(kv_bucket_key_index index) { delete (key_index *)index; }
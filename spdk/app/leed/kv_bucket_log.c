@@ -4,14 +4,57 @@
 #include <stdio.h>
 #include <sys/queue.h>
 #include <sys/uio.h>
+#include <time.h>
 
 #include "kv_app.h"
 #include "kv_circular_log.h"
+#include "kv_ds_queue.h"
 #include "kv_memory.h"
 
+static void seg_tags_snapshot(struct kv_bucket_log *self, struct kv_bucket_segment *seg, struct kv_bucket_meta meta);
+static __thread struct kv_freelist chain_entries;
+
+// --- pending puts ---
+// The puts appended but not committed yet, in the order of the log. The replay of a checkpoint starts at the oldest
+// one, as the meta does not point to its buckets yet.
+struct pending_put {
+    uint32_t offset, tail;  // the offset of its first bucket and the tail stamp before it
+    uint32_t seg_num;       // segments not committed or cleaned up yet
+    STAILQ_ENTRY(pending_put)
+    entry;
+};
+static __thread struct kv_freelist pending_puts;
+
+static void pending_put_end(struct kv_bucket_log *self, struct kv_bucket_segment *seg) {
+    if (seg->pending == NULL) return;
+    seg->pending->seg_num--;
+    seg->pending = NULL;
+    struct pending_put *put;
+    while ((put = STAILQ_FIRST(&self->pending_puts)) != NULL && put->seg_num == 0) {
+        STAILQ_REMOVE_HEAD(&self->pending_puts, entry);
+        kv_freelist_put(&pending_puts, put);
+    }
+}
+
+static void pending_put_start(struct kv_bucket_log *self, struct kv_bucket_segments *segs) {
+    struct pending_put *put = kv_freelist_get(&pending_puts, sizeof(struct pending_put));
+    *put = (struct pending_put){(uint32_t)self->log.tail, self->tail, 0};
+    struct kv_bucket_segment *seg;
+    TAILQ_FOREACH(seg, segs, entry) {
+        pending_put_end(self, seg);
+        seg->pending = put;
+        put->seg_num++;
+    }
+    STAILQ_INSERT_TAIL(&self->pending_puts, put, entry);
+}
+
 // --- compact ---
+// The compaction starts once the log has less than COMPACTION_TRIGGER empty blocks. The scheduler paces it and
+// bounds the windows in flight by COMPACTION_CONCURRENCY, but no longer once the log is down to COMPACTION_FLOOR.
 #define COMPACTION_CONCURRENCY 4
 #define COMPACTION_LENGTH 512
+#define COMPACTION_TRIGGER (COMPACTION_LENGTH * COMPACTION_CONCURRENCY * 6)
+#define COMPACTION_FLOOR (COMPACTION_LENGTH * COMPACTION_CONCURRENCY * 2)
 static void compact_move_head(struct kv_bucket_log *self) {
     struct kv_bucket *bucket;
     uint32_t i;
@@ -29,7 +72,30 @@ struct compact_ctx {
     struct kv_bucket_log *self;
     uint32_t compact_head, len;
     struct kv_bucket_segments segments;
+    // the items cleared as expired, in the order of the segments. The ones past the room wait for the next pass.
+    uint32_t expired_num;
+    struct compact_expired {
+        uint64_t bucket_id;
+        struct kv_item *slot;  // in the fetch buffer, restored if the chain is not committed
+        struct kv_item item;
+    } expired[COMPACTION_LENGTH];
 };
+static __thread struct kv_freelist compact_ctxs, compact_segs;
+
+// the chain is about to be rewritten anyway, the expired items are left out of it as holes.
+static void compact_expire(struct compact_ctx *ctx, struct kv_bucket_segment *seg, uint32_t now) {
+    struct kv_bucket_chain_entry *ce;
+    TAILQ_FOREACH(ce, &seg->chain, entry) {
+        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket)
+            for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item) {
+                if (KV_EMPTY_ITEM(item) || !kv_item_expired(item, now)) continue;
+                if (ctx->expired_num == COMPACTION_LENGTH) return;
+                ctx->expired[ctx->expired_num++] = (struct compact_expired){seg->bucket_id, item, *item};
+                item->key_length = 0;
+                kv_bucket_item_tag_update(seg, item);
+            }
+    }
+}
 
 static void compact_write_cb(bool success, void *arg) {
     if (!success) {
@@ -40,27 +106,53 @@ static void compact_write_cb(bool success, void *arg) {
     struct compact_ctx *ctx = arg;
     struct kv_bucket_log *self = ctx->self;
     struct kv_bucket_segment *seg;
+    uint32_t expired = 0;
     while ((seg = TAILQ_FIRST(&ctx->segments)) != NULL) {
         TAILQ_REMOVE(&ctx->segments, seg, entry);
         struct kv_bucket_meta meta = kv_bucket_meta_get(self, seg->bucket_id);
-        if ((self->log.size - ctx->compact_head + meta.bucket_offset) % self->log.size < ctx->len && meta.chain_length != 0) {
+        uint32_t first = expired;
+        while (expired < ctx->expired_num && ctx->expired[expired].bucket_id == seg->bucket_id) expired++;
+        bool committed = (self->log.size - ctx->compact_head + meta.bucket_offset) % self->log.size < ctx->len &&
+                         meta.chain_length != 0;
+        // a bucket locked since has been read before its expired items were cleared: it is left to the next pass, as
+        // a bucket being put is, lest the copy of the lock holder bring them back.
+        if (committed && expired != first && kv_bucket_is_locked(self, seg->bucket_id)) committed = false;
+        if (committed) {
             seg->dirty = true;
             kv_bucket_seg_commit(self, seg);
         }
+        for (uint32_t i = first; i < expired; i++) {
+            if (!committed) {
+                *ctx->expired[i].slot = ctx->expired[i].item;
+                continue;
+            }
+            self->expired++;
+            if (self->expire_cb) self->expire_cb(&ctx->expired[i].item, self->expire_arg);
+        }
         kv_bucket_seg_cleanup(self, seg);
-        kv_free(seg);
+        kv_freelist_put(&compact_segs, seg);
     }
     compact_move_head(self);
-    kv_free(arg);
+    // the next pass starts over from the head, at the buckets skipped while they were being put.
+    if (--self->compacting == 0) self->compact_head = self->log.head;
+    kv_freelist_put(&compact_ctxs, ctx);
 }
 
 static void compact(struct kv_bucket_log *self) {
-    if (kv_circular_log_empty_space(&self->log) >= COMPACTION_LENGTH * COMPACTION_CONCURRENCY * 6) return;
-    if ((self->log.size - self->log.head + self->compact_head) % self->log.size > COMPACTION_LENGTH * COMPACTION_CONCURRENCY) return;
-    struct compact_ctx *ctx = kv_malloc(sizeof(struct compact_ctx));
+    uint64_t empty_space = kv_circular_log_empty_space(&self->log);
+    if (empty_space >= COMPACTION_TRIGGER) return;
+    uint32_t pressure = empty_space <= COMPACTION_FLOOR ? KV_DS_IO_SHARE_UNIT
+                                                        : (COMPACTION_TRIGGER - empty_space) * KV_DS_IO_SHARE_UNIT /
+                                                              (COMPACTION_TRIGGER - COMPACTION_FLOOR);
+    uint32_t concurrency = kv_ds_io_sched_bound(self->io_sched, pressure, COMPACTION_CONCURRENCY);
+    if ((self->log.size - self->log.head + self->compact_head) % self->log.size > COMPACTION_LENGTH * concurrency) return;
+    if (!kv_ds_io_sched_acquire(self->io_sched, pressure, COMPACTION_LENGTH)) return;
+    struct compact_ctx *ctx = kv_freelist_get(&compact_ctxs, sizeof(struct compact_ctx));
     ctx->self = self;
     ctx->compact_head = self->compact_head;
+    ctx->expired_num = 0;
     TAILQ_INIT(&ctx->segments);
+    uint32_t now = self->clock ? self->clock() : 0;
 
     struct kv_bucket *bucket;
     for (ctx->len = 0; ctx->len < COMPACTION_LENGTH; ctx->len += bucket->chain_length) {
@@ -69,27 +161,38 @@ static void compact(struct kv_bucket_log *self) {
         assert(bucket->chain_index == 0 && bucket->chain_length);
 
         struct kv_bucket_meta meta = kv_bucket_meta_get(self, bucket->id);
-        if (meta.chain_length != 0 && meta.bucket_offset == bucket_offset) {
+        // a copy appended after an uncommitted put of the same bucket would be replayed as its latest version.
+        if (meta.chain_length != 0 && meta.bucket_offset == bucket_offset && !kv_bucket_is_putting(self, bucket->id)) {
             struct iovec iov[2];
             kv_circular_log_fetch(&self->log, meta.bucket_offset, meta.chain_length, iov);
-            struct kv_bucket_segment *seg = kv_malloc(sizeof(*seg));
+            struct kv_bucket_segment *seg = kv_freelist_get(&compact_segs, sizeof(*seg));
             kv_bucket_seg_init(seg, bucket->id);
             seg->empty = false;
+            seg_tags_snapshot(self, seg, meta);
             for (size_t i = 0; i < 2 && iov[i].iov_len != 0; i++) {
-                struct kv_bucket_chain_entry *chain_entry = kv_malloc(sizeof(*chain_entry));
+                struct kv_bucket_chain_entry *chain_entry = kv_freelist_get(&chain_entries, sizeof(*chain_entry));
                 chain_entry->len = iov[i].iov_len;
                 chain_entry->bucket = iov[i].iov_base;
                 chain_entry->pre_alloc_bucket = true;
                 TAILQ_INSERT_TAIL(&seg->chain, chain_entry, entry);
             }
+            // the chain of a locked bucket may be shared with the operation holding it.
+            if (now && !kv_bucket_is_locked(self, bucket->id)) compact_expire(ctx, seg, now);
             TAILQ_INSERT_TAIL(&ctx->segments, seg, entry);
         }
     }
     self->compact_head = (self->compact_head + ctx->len) % self->log.size;
+    self->compacting++;
     kv_bucket_seg_put_bulk(self, &ctx->segments, compact_write_cb, ctx);
 }
 
 // --- init & fini ---
+uint32_t kv_bucket_wall_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
 void kv_bucket_log_init(struct kv_bucket_log *self, struct kv_storage *storage, uint64_t base, uint64_t size) {
     size = size > COMPACTION_LENGTH << 4 ? size : COMPACTION_LENGTH << 4;
     assert(storage->block_size == sizeof(struct kv_bucket));
@@ -97,11 +200,18 @@ void kv_bucket_log_init(struct kv_bucket_log *self, struct kv_storage *storage,
 
     kv_circular_log_init(&self->log, storage, base, size * 4, 0, 0, COMPACTION_LENGTH * COMPACTION_CONCURRENCY * 4, 256);
     self->size = self->log.size << 1;
+    STAILQ_INIT(&self->pending_puts);
+    self->clock = kv_bucket_wall_clock;
     kv_bucket_meta_init(self);
     kv_bucket_lock_init(self);
 }
 
 void kv_bucket_log_fini(struct kv_bucket_log *self) {
+    struct pending_put *put;
+    while ((put = STAILQ_FIRST(&self->pending_puts)) != NULL) {
+        STAILQ_REMOVE_HEAD(&self->pending_puts, entry);
+        kv_freelist_put(&pending_puts, put);
+    }
     kv_bucket_meta_fini(self);
     kv_bucket_lock_fini(self);
     kv_circular_log_fini(&self->log);
@@ -126,14 +236,18 @@ static void kv_bucket_log_writev(struct kv_bucket_log *self, struct iovec *bucke
 bool kv_bucket_alloc_extra(struct kv_bucket_log *self, struct kv_bucket_segment *seg) {
     uint8_t length = TAILQ_EMPTY(&seg->chain) ? 0 : TAILQ_FIRST(&seg->chain)->bucket->chain_length;
     if (length == 0x7F) return false;
-    struct kv_bucket_chain_entry *ce = kv_malloc(sizeof(*ce));
-    ce->len = 1;
-    ce->bucket = kv_storage_zblk_alloc(self->log.storage, ce->len);
+    struct kv_bucket_chain_entry *ce = kv_freelist_get(&chain_entries, sizeof(*ce));
+    ce->len = ce->buf_len = 1;
+    ce->bucket = kv_storage_pool_zmalloc(self->log.storage, sizeof(struct kv_bucket));
     ce->pre_alloc_bucket = false;
     TAILQ_INSERT_TAIL(&seg->chain, ce, entry);
 
     ce->bucket->id = seg->bucket_id;
     ce->bucket->chain_index = length;
+    if (seg->tags) {
+        seg->tags = kv_realloc(seg->tags, (length + 1) * KV_ITEM_PER_BUCKET);
+        kv_memset(seg->tags + length * KV_ITEM_PER_BUCKET, KV_TAG_EMPTY, KV_ITEM_PER_BUCKET);
+    }
     length++;
     TAILQ_FOREACH(ce, &seg->chain, entry) {
         for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket) {
@@ -152,10 +266,11 @@ void kv_bucket_free_extra(struct kv_bucket_segment *seg) {
     } else {
         TAILQ_REMOVE(&seg->chain, ce, entry);
         if (!ce->pre_alloc_bucket)
-            kv_storage_free(ce->bucket);
-        kv_free(ce);
+            kv_storage_pool_free(ce->bucket, ce->buf_len * sizeof(struct kv_bucket));
+        kv_freelist_put(&chain_entries, ce);
     }
     length--;
+    if (seg->tags) kv_memset(seg->tags + length * KV_ITEM_PER_BUCKET, KV_TAG_EMPTY, KV_ITEM_PER_BUCKET);
     TAILQ_FOREACH(ce, &seg->chain, entry) {
         for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket) {
             bucket->chain_length = length;
@@ -187,6 +302,8 @@ static inline void verify_buckets(struct kv_bucket_log *self, struct kv_bucket_s
 void kv_bucket_seg_init(struct kv_bucket_segment *seg, uint64_t bucket_id) {
     TAILQ_INIT(&seg->chain);
     seg->bucket_id = bucket_id;
+    seg->tags = NULL;
+    seg->pending = NULL;
     seg->dirty = false;
     seg->empty = true;
 }
@@ -197,6 +314,7 @@ struct segment_get_ctx {
     kv_circular_log_io_cb cb;
     void *cb_arg;
 };
+static __thread struct kv_freelist segment_get_ctxs;
 static void segment_get_cb(bool success, void *arg) {
     struct segment_get_ctx *ctx = arg;
     struct kv_bucket_meta meta = kv_bucket_meta_get(ctx->self, ctx->seg->bucket_id);
@@ -206,26 +324,32 @@ static void segment_get_cb(bool success, void *arg) {
         // someone has committed this bucket during the circular_log_read.
         struct kv_bucket *bucket = TAILQ_FIRST(&ctx->seg->chain)->bucket;
         ctx->seg->offset = meta.bucket_offset;
+        kv_free(ctx->seg->tags);
+        ctx->seg->tags = NULL;
+        seg_tags_snapshot(ctx->self, ctx->seg, meta);
         kv_circular_log_read(&ctx->self->log, meta.bucket_offset, bucket, meta.chain_length, segment_get_cb, ctx);
         return;
     } else {
         ctx->seg->empty = false;
     }
     if (ctx->cb) ctx->cb(success, ctx->cb_arg);
-    kv_free(arg);
+    kv_freelist_put(&segment_get_ctxs, ctx);
 }
 
 void kv_bucket_seg_get(struct kv_bucket_log *self, struct kv_bucket_segment *seg, struct kv_bucket_meta *meta_ptr, bool strict, kv_circular_log_io_cb cb, void *cb_arg) {
     struct kv_bucket_meta meta = meta_ptr ? *meta_ptr : kv_bucket_meta_get(self, seg->bucket_id);
     if (meta.chain_length != 0) {
-        struct segment_get_ctx *ctx = kv_malloc(sizeof(*ctx));
+        struct segment_get_ctx *ctx = kv_freelist_get(&segment_get_ctxs, sizeof(*ctx));
         *ctx = (struct segment_get_ctx){self, seg, strict, cb, cb_arg};
-        struct kv_bucket_chain_entry *chain_entry = kv_malloc(sizeof(*chain_entry));
-        chain_entry->len = meta.chain_length;
-        chain_entry->bucket = kv_storage_blk_alloc(self->log.storage, chain_entry->len);
+        struct kv_bucket_chain_entry *chain_entry = kv_freelist_get(&chain_entries, sizeof(*chain_entry));
+        chain_entry->len = chain_entry->buf_len = meta.chain_length;
+        chain_entry->bucket = kv_storage_pool_malloc(self->log.storage, chain_entry->len * sizeof(struct kv_bucket));
         chain_entry->pre_alloc_bucket = false;
         TAILQ_INSERT_HEAD(&seg->chain, chain_entry, entry);
         seg->offset = meta.bucket_offset;
+        struct kv_bucket_meta cur = meta_ptr ? kv_bucket_meta_get(self, seg->bucket_id) : meta;
+        if (cur.chain_length == meta.chain_length && cur.bucket_offset == meta.bucket_offset)
+            seg_tags_snapshot(self, seg, meta);
         kv_circular_log_read(&self->log, meta.bucket_offset, chain_entry->bucket, meta.chain_length, segment_get_cb, ctx);
     } else {
         seg->empty = false;
@@ -233,6 +357,113 @@ void kv_bucket_seg_get(struct kv_bucket_log *self, struct kv_bucket_segment *seg
     }
 }
 
+// --- bulk get ---
+// The chains are read in the order of the log. A run of chains at most GET_BULK_GAP buckets apart is read by a
+// single I/O, straight into the buffers of their segments, the gaps into a scratch buffer shared by the run.
+#define GET_BULK_GAP 4U
+#define GET_BULK_LENGTH 128U  // buckets read by one I/O, at most
+struct seg_get_bulk_ctx {
+    uint32_t pending;
+    bool success;
+    kv_circular_log_io_cb cb;
+    void *cb_arg;
+};
+struct seg_get_run_ctx {
+    struct kv_bucket_log *self;
+    struct seg_get_bulk_ctx *bulk;
+    struct kv_bucket_segment **segs;
+    uint32_t n;
+    struct kv_bucket *gap;
+};
+struct seg_get_pos {
+    uint32_t pos;  // the distance from the head of the log
+    struct kv_bucket_segment *seg;
+    struct kv_bucket_meta meta;
+};
+static int seg_get_pos_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct seg_get_pos *)a)->pos, y = ((const struct seg_get_pos *)b)->pos;
+    return x < y ? -1 : x > y;
+}
+
+static void seg_get_bulk_done(bool success, void *arg) {
+    struct seg_get_bulk_ctx *bulk = arg;
+    bulk->success = bulk->success && success;
+    if (--bulk->pending) return;
+    if (bulk->cb) bulk->cb(bulk->success, bulk->cb_arg);
+    kv_free(bulk);
+}
+
+static void seg_get_run_cb(bool success, void *arg) {
+    struct seg_get_run_ctx *run = arg;
+    // each segment is checked as by a strict kv_bucket_seg_get, which reads it again if it has moved meanwhile.
+    for (uint32_t i = 0; i < run->n; ++i) {
+        struct segment_get_ctx *ctx = kv_freelist_get(&segment_get_ctxs, sizeof(*ctx));
+        *ctx = (struct segment_get_ctx){run->self, run->segs[i], true, seg_get_bulk_done, run->bulk};
+        segment_get_cb(success, ctx);
+    }
+    if (run->gap) kv_storage_pool_free(run->gap, GET_BULK_GAP * sizeof(struct kv_bucket));
+    kv_free(run->segs);
+    kv_free(run);
+}
+
+static void seg_get_run(struct kv_bucket_log *self, struct seg_get_bulk_ctx *bulk, struct seg_get_pos *pos,
+                        uint32_t n) {
+    struct seg_get_run_ctx *run = kv_malloc(sizeof(*run));
+    *run = (struct seg_get_run_ctx){self, bulk, kv_calloc(n, sizeof(struct kv_bucket_segment *)), n, NULL};
+    struct iovec iov[2 * n];
+    uint32_t iov_i = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        struct kv_bucket_segment *seg = pos[i].seg;
+        if (i && pos[i].pos > pos[i - 1].pos + pos[i - 1].meta.chain_length) {
+            if (!run->gap) run->gap = kv_storage_pool_malloc(self->log.storage, GET_BULK_GAP * sizeof(struct kv_bucket));
+            iov[iov_i++] = (struct iovec){run->gap, pos[i].pos - pos[i - 1].pos - pos[i - 1].meta.chain_length};
+        }
+        struct kv_bucket_chain_entry *chain_entry = kv_freelist_get(&chain_entries, sizeof(*chain_entry));
+        chain_entry->len = chain_entry->buf_len = pos[i].meta.chain_length;
+        chain_entry->bucket = kv_storage_pool_malloc(self->log.storage, chain_entry->len * sizeof(struct kv_bucket));
+        chain_entry->pre_alloc_bucket = false;
+        TAILQ_INSERT_HEAD(&seg->chain, chain_entry, entry);
+        seg->offset = pos[i].meta.bucket_offset;
+        seg_tags_snapshot(self, seg, pos[i].meta);
+        iov[iov_i++] = (struct iovec){chain_entry->bucket, chain_entry->len};
+        run->segs[i] = seg;
+    }
+    kv_circular_log_readv(&self->log, pos[0].meta.bucket_offset, iov, iov_i, seg_get_run_cb, run);
+}
+
+void kv_bucket_seg_get_bulk(struct kv_bucket_log *self, struct kv_bucket_segments *segs, kv_circular_log_io_cb cb,
+                            void *cb_arg) {
+    struct kv_bucket_segment *seg;
+    uint32_t n = 0;
+    TAILQ_FOREACH(seg, segs, entry) n++;
+    struct seg_get_pos *pos = kv_calloc(n ? n : 1, sizeof(struct seg_get_pos));
+    uint32_t i = 0;
+    TAILQ_FOREACH(seg, segs, entry) {
+        struct kv_bucket_meta meta = kv_bucket_meta_get(self, seg->bucket_id);
+        if (meta.chain_length == 0) {
+            seg->empty = false;
+            continue;
+        }
+        uint32_t distance = (self->log.size + meta.bucket_offset - self->log.head) % self->log.size;
+        pos[i++] = (struct seg_get_pos){distance, seg, meta};
+    }
+    n = i;
+    qsort(pos, n, sizeof(struct seg_get_pos), seg_get_pos_cmp);
+    struct seg_get_bulk_ctx *bulk = kv_malloc(sizeof(*bulk));
+    *bulk = (struct seg_get_bulk_ctx){n + 1, true, cb, cb_arg};
+    for (uint32_t start = 0, end; start < n; start = end) {
+        uint32_t last = pos[start].pos + pos[start].meta.chain_length;
+        for (end = start + 1; end < n; ++end) {
+            uint32_t next = pos[end].pos + pos[end].meta.chain_length;
+            if (pos[end].pos > last + GET_BULK_GAP || next - pos[start].pos > GET_BULK_LENGTH) break;
+            last = next;
+        }
+        seg_get_run(self, bulk, pos + start, end - start);
+    }
+    kv_free(pos);
+    seg_get_bulk_done(true, bulk);
+}
+
 static inline void iov_append(struct iovec *iov, uint32_t *iov_i, void *iov_base, size_t iov_len) {
     if (*iov_i == 0 || (struct kv_bucket *)iov[*iov_i - 1].iov_base + iov[*iov_i - 1].iov_len != iov_base)
         iov[(*iov_i)++] = (struct iovec){iov_base, iov_len};
@@ -263,6 +494,7 @@ void kv_bucket_seg_put_bulk(struct kv_bucket_log *self, struct kv_bucket_segment
             iov_append(buckets, &iov_i, chain_entry->bucket, chain_entry->len);
         }
     }
+    pending_put_start(self, segs);
     kv_bucket_log_writev(self, buckets, iov_i, cb, cb_arg);
 }
 
@@ -274,19 +506,20 @@ void kv_bucket_seg_put(struct kv_bucket_log *self, struct kv_bucket_segment *seg
 }
 
 void kv_bucket_seg_cleanup(struct kv_bucket_log *self, struct kv_bucket_segment *seg) {
+    pending_put_end(self, seg);
     struct kv_bucket_chain_entry *chain_entry;
     while ((chain_entry = TAILQ_FIRST(&seg->chain)) != NULL) {
         TAILQ_REMOVE(&seg->chain, chain_entry, entry);
         if (!chain_entry->pre_alloc_bucket)
-            kv_storage_free(chain_entry->bucket);
-        kv_free(chain_entry);
+            kv_storage_pool_free(chain_entry->bucket, chain_entry->buf_len * sizeof(struct kv_bucket));
+        kv_freelist_put(&chain_entries, chain_entry);
     }
+    kv_free(seg->tags);
+    seg->tags = NULL;
     seg->empty = true;
 }
 
-static bool is_empty_seg(struct kv_bucket_segment *seg) {
-    if (TAILQ_EMPTY(&seg->chain)) return true;
-    struct kv_bucket *first_bucket = TAILQ_FIRST(&seg->chain)->bucket;
+static bool is_empty_chain(struct kv_bucket *first_bucket) {
     if (first_bucket->chain_length > 1) return false;
     for (struct kv_item *item = first_bucket->items; item - first_bucket->items < KV_ITEM_PER_BUCKET; ++item)
         if (!KV_EMPTY_ITEM(item))
@@ -294,6 +527,10 @@ static bool is_empty_seg(struct kv_bucket_segment *seg) {
     return true;
 }
 
+static bool is_empty_seg(struct kv_bucket_segment *seg) {
+    return TAILQ_EMPTY(&seg->chain) || is_empty_chain(TAILQ_FIRST(&seg->chain)->bucket);
+}
+
 void kv_bucket_seg_commit(struct kv_bucket_log *self, struct kv_bucket_segment *seg) {
     struct kv_bucket_chain_entry *chain_entry;
     TAILQ_FOREACH(chain_entry, &seg->chain, entry) {
@@ -306,6 +543,440 @@ void kv_bucket_seg_commit(struct kv_bucket_log *self, struct kv_bucket_segment *
     } else {
         struct kv_bucket_meta meta = {TAILQ_FIRST(&seg->chain)->bucket->chain_length, seg->offset};
         kv_bucket_meta_put(self, seg->bucket_id, meta);
+        kv_bucket_meta_put_tags(self, seg->bucket_id, seg->tags);
     }
     seg->dirty = false;
-}
\ No newline at end of file
+    pending_put_end(self, seg);
+}
+
+// --- fingerprint tags ---
+// copy the committed tags of the buckets that meta points to, the segment builds them itself if there is none.
+static void seg_tags_snapshot(struct kv_bucket_log *self, struct kv_bucket_segment *seg, struct kv_bucket_meta meta) {
+    assert(seg->tags == NULL);
+    uint8_t *tags = kv_bucket_meta_tags(self, seg->bucket_id);
+    if (tags == NULL) return;
+    seg->tags = kv_malloc(meta.chain_length * KV_ITEM_PER_BUCKET);
+    kv_memcpy(seg->tags, tags, meta.chain_length * KV_ITEM_PER_BUCKET);
+}
+
+uint8_t *kv_bucket_seg_tags(struct kv_bucket_segment *seg) {
+    if (seg->tags || TAILQ_EMPTY(&seg->chain)) return seg->tags;
+    seg->tags = kv_malloc(TAILQ_FIRST(&seg->chain)->bucket->chain_length * KV_ITEM_PER_BUCKET);
+    struct kv_bucket_chain_entry *ce;
+    TAILQ_FOREACH(ce, &seg->chain, entry) {
+        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket) {
+            uint8_t *tags = seg->tags + bucket->chain_index * KV_ITEM_PER_BUCKET;
+            for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item)
+                tags[item - bucket->items] = KV_EMPTY_ITEM(item) ? KV_TAG_EMPTY : kv_item_tag(item->key, item->key_length);
+        }
+    }
+    return seg->tags;
+}
+
+uint8_t *kv_bucket_item_tag(struct kv_bucket_segment *seg, struct kv_item *item) {
+    uint8_t *tags = kv_bucket_seg_tags(seg);
+    struct kv_bucket_chain_entry *ce;
+    TAILQ_FOREACH(ce, &seg->chain, entry) {
+        if ((uint8_t *)item < (uint8_t *)ce->bucket || (uint8_t *)item >= (uint8_t *)(ce->bucket + ce->len)) continue;
+        struct kv_bucket *bucket = ce->bucket + ((uint8_t *)item - (uint8_t *)ce->bucket) / sizeof(struct kv_bucket);
+        return tags + bucket->chain_index * KV_ITEM_PER_BUCKET + (item - bucket->items);
+    }
+    assert(false);
+    return NULL;
+}
+
+void kv_bucket_item_tag_update(struct kv_bucket_segment *seg, struct kv_item *item) {
+    *kv_bucket_item_tag(seg, item) = KV_EMPTY_ITEM(item) ? KV_TAG_EMPTY : kv_item_tag(item->key, item->key_length);
+}
+
+struct kv_item *kv_bucket_seg_find(struct kv_bucket_segment *seg, uint8_t *key, uint8_t key_length) {
+    return kv_bucket_seg_find_next(seg, key, key_length, NULL);
+}
+
+struct kv_item *kv_bucket_seg_find_next(struct kv_bucket_segment *seg, uint8_t *key, uint8_t key_length,
+                                        struct kv_item *prev) {
+    uint8_t *tags = kv_bucket_seg_tags(seg), tag = kv_item_tag(key, key_length);
+    uint8_t len = kv_item_key_length(key_length);
+    struct kv_bucket_chain_entry *ce;
+    TAILQ_FOREACH(ce, &seg->chain, entry) {
+        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len;) {
+            uint32_t n = bucket - ce->bucket + 1 < ce->len ? 2 : 1;
+            uint32_t mask = kv_tag_match(tags + bucket->chain_index * KV_ITEM_PER_BUCKET, tag, n);
+            for (; mask; mask &= mask - 1) {
+                uint32_t i = __builtin_ctz(mask);
+                struct kv_item *item = bucket[i / KV_ITEM_PER_BUCKET].items + i % KV_ITEM_PER_BUCKET;
+                if (prev) {
+                    if (item == prev) prev = NULL;
+                    continue;
+                }
+                if (item->key_length == key_length && !kv_memcmp8(item->key, key, len)) return item;
+            }
+            bucket += n;
+        }
+    }
+    return NULL;
+}
+// --- checkpoint & recovery ---
+void kv_bucket_log_checkpoint(struct kv_bucket_log *self, struct kv_bucket_log_checkpoint *checkpoint) {
+    *checkpoint = (struct kv_bucket_log_checkpoint){self->log.head, self->log.tail, self->head, self->tail,
+                                                     (uint32_t)self->log.tail, self->tail};
+    struct pending_put *put = STAILQ_FIRST(&self->pending_puts);
+    if (put == NULL) return;
+    if ((self->log.size - self->log.head + put->offset) % self->log.size <= kv_circular_log_length(&self->log)) {
+        checkpoint->replay_offset = put->offset;
+        checkpoint->replay_tail = put->tail;
+    } else {
+        // the compaction has moved the head past the put, its buckets are not referenced by the meta anyway.
+        checkpoint->replay_offset = (uint32_t)self->log.head;
+        checkpoint->replay_tail = self->head;
+    }
+}
+
+// --- log reader ---
+// Reads length blocks of the log from base in chunks of READ_LENGTH blocks, READ_DEPTH chunks in flight. A chunk is
+// read with the 0x7F blocks that follow it, so that every chain starting in it is whole in the buffer. The chunks are
+// handed to chunk_cb in the order of the log if ordered is set, else as they complete; chunk_cb returns false to
+// stop the reads, and done_cb is called once none is in flight any more.
+#define READ_LENGTH 1024U
+#define READ_DEPTH 16U
+#define READ_BUF_BLKS (READ_LENGTH + 0x7FU)
+typedef bool (*log_reader_chunk_cb)(void *arg, struct kv_bucket *buckets, uint64_t offset, uint64_t n);
+typedef void (*log_reader_done_cb)(void *arg, bool success);
+struct log_reader;
+struct log_chunk {
+    struct log_reader *reader;
+    struct kv_bucket *buf;
+    uint64_t offset, n;
+    uint32_t io_cnt;
+    bool success;
+};
+struct log_reader {
+    struct kv_bucket_log *self;
+    uint64_t base, length;
+    uint64_t next, ready;  // the first chunk not read yet, the next chunk to hand in order
+    uint32_t in_flight;
+    bool ordered, stopped, success;
+    log_reader_chunk_cb chunk_cb;
+    log_reader_done_cb done_cb;
+    void *arg;
+    struct kv_bucket *buf;
+    struct log_chunk chunks[READ_DEPTH];
+};
+
+static void log_chunk_cb(bool success, void *arg);
+static void log_reader_read(struct log_reader *reader, struct log_chunk *chunk) {
+    struct kv_bucket_log *self = reader->self;
+    uint64_t blk = (reader->base + reader->next) % self->log.size;
+    uint64_t n = READ_BUF_BLKS < self->log.size ? READ_BUF_BLKS : self->log.size;
+    uint64_t n0 = self->log.size - blk < n ? self->log.size - blk : n;
+    chunk->offset = reader->next;
+    chunk->n = n;
+    chunk->io_cnt = n0 < n ? 2 : 1;
+    chunk->success = true;
+    reader->next += READ_LENGTH;
+    reader->in_flight++;
+    kv_storage_read_blocks(self->log.storage, chunk->buf, 0, self->log.base + blk, n0, log_chunk_cb, chunk);
+    if (n0 < n) kv_storage_read_blocks(self->log.storage, chunk->buf + n0, 0, self->log.base, n - n0, log_chunk_cb, chunk);
+}
+
+static void log_reader_hand(struct log_reader *reader, struct log_chunk *chunk) {
+    if (!chunk->success) reader->success = false;
+    if (!reader->success || (!reader->stopped && !reader->chunk_cb(reader->arg, chunk->buf, chunk->offset, chunk->n)))
+        reader->stopped = true;
+    if (!reader->stopped && reader->next < reader->length) log_reader_read(reader, chunk);
+}
+
+static void log_chunk_cb(bool success, void *arg) {
+    struct log_chunk *chunk = arg;
+    struct log_reader *reader = chunk->reader;
+    chunk->success = chunk->success && success;
+    if (--chunk->io_cnt) return;
+    reader->in_flight--;
+    if (reader->ordered) {
+        // the chunks are read again in the same slots, so the slot of the next chunk to hand is known.
+        while (reader->ready < reader->next) {
+            chunk = reader->chunks + reader->ready / READ_LENGTH % READ_DEPTH;
+            if (chunk->io_cnt || chunk->offset != reader->ready) break;
+            reader->ready += READ_LENGTH;
+            log_reader_hand(reader, chunk);
+        }
+    } else {
+        log_reader_hand(reader, chunk);
+    }
+    if (reader->in_flight == 0) reader->done_cb(reader->arg, reader->success);
+}
+
+static void log_reader_init(struct log_reader *reader, struct kv_bucket_log *self, log_reader_chunk_cb chunk_cb,
+                            log_reader_done_cb done_cb, void *arg) {
+    *reader = (struct log_reader){.self = self, .chunk_cb = chunk_cb, .done_cb = done_cb, .arg = arg};
+    reader->buf = kv_storage_blk_alloc(self->log.storage, READ_DEPTH * READ_BUF_BLKS);
+    for (uint32_t i = 0; i < READ_DEPTH; i++) reader->chunks[i] = (struct log_chunk){reader, reader->buf + i * READ_BUF_BLKS};
+}
+
+static void log_reader_fini(struct log_reader *reader) { kv_storage_free(reader->buf); }
+
+static void log_reader_start(struct log_reader *reader, uint64_t base, uint64_t length, bool ordered) {
+    reader->base = base;
+    reader->length = length;
+    reader->next = reader->ready = 0;
+    reader->ordered = ordered;
+    reader->stopped = false;
+    reader->success = true;
+    for (uint32_t i = 0; i < READ_DEPTH && reader->next < length; i++) log_reader_read(reader, reader->chunks + i);
+    if (reader->in_flight == 0) reader->done_cb(reader->arg, true);
+}
+
+// the length of the chain at buckets if it is complete and has been written during the lap replayed, else 0.
+static uint32_t replay_chain_length(struct kv_bucket_log *self, struct kv_bucket *buckets, uint64_t n, uint32_t stamp) {
+    uint32_t len = buckets->chain_length;
+    if (buckets->chain_index != 0 || len == 0 || len > n) return 0;
+    for (uint32_t i = 0; i < len; i++) {
+        struct kv_bucket *bucket = buckets + i;
+        if (bucket->id != buckets->id || bucket->chain_index != i || bucket->chain_length != len ||
+            bucket->tail != (stamp + i) % self->size)
+            return 0;
+    }
+    return len;
+}
+
+// --- replay ---
+#define REPLAY_GAP (64U << 10)  // the replay ends after this many blocks without a complete chain
+#define REPLAY_BATCH 256U       // chains appended again at a time
+struct replay_ctx {
+    struct kv_bucket_log *self;
+    struct kv_bucket_log_checkpoint checkpoint;
+    kv_bucket_log_replay_cb replay_cb;
+    kv_circular_log_io_cb cb;
+    void *cb_arg;
+    struct log_reader reader;
+    // from replay_offset: the first block not parsed yet, the end of the chains before the first hole and the end of
+    // the last chain.
+    uint64_t offset, end, last;
+    uint32_t head;
+    bool broken, reporting;
+    struct kv_bucket_segments segs, batch;
+};
+
+static void replay_finish(struct replay_ctx *ctx, bool success) {
+    struct kv_bucket_segment *seg;
+    while ((seg = TAILQ_FIRST(&ctx->segs)) != NULL) {
+        TAILQ_REMOVE(&ctx->segs, seg, entry);
+        kv_bucket_seg_cleanup(ctx->self, seg);
+        kv_free(seg);
+    }
+    log_reader_fini(&ctx->reader);
+    if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+    kv_free(ctx);
+}
+
+// Once the log is contiguous again, it is read a second time to report the chains the meta still points to: an
+// older copy of a bucket may reference values the compaction has freed since.
+static void replay_report(struct replay_ctx *ctx) {
+    struct kv_bucket_log *self = ctx->self;
+    ctx->reporting = true;
+    ctx->offset = 0;
+    if (ctx->replay_cb == NULL)
+        replay_finish(ctx, true);
+    else
+        log_reader_start(&ctx->reader, ctx->checkpoint.replay_offset,
+                         (self->size + self->tail - ctx->checkpoint.replay_tail) % self->size, true);
+}
+static void replay_append(struct replay_ctx *ctx);
+static void replay_append_cb(bool success, void *arg) {
+    struct replay_ctx *ctx = arg;
+    struct kv_bucket_segment *seg;
+    while ((seg = TAILQ_FIRST(&ctx->batch)) != NULL) {
+        TAILQ_REMOVE(&ctx->batch, seg, entry);
+        if (success) {
+            seg->dirty = true;
+            kv_bucket_seg_commit(ctx->self, seg);
+        }
+        kv_bucket_seg_cleanup(ctx->self, seg);
+        kv_free(seg);
+    }
+    if (success)
+        replay_append(ctx);
+    else
+        replay_finish(ctx, false);
+}
+
+static void replay_append(struct replay_ctx *ctx) {
+    struct kv_bucket_segment *seg;
+    for (uint32_t i = 0; i < REPLAY_BATCH && (seg = TAILQ_FIRST(&ctx->segs)) != NULL; i++) {
+        TAILQ_REMOVE(&ctx->segs, seg, entry);
+        TAILQ_INSERT_TAIL(&ctx->batch, seg, entry);
+    }
+    if (TAILQ_EMPTY(&ctx->batch))
+        replay_report(ctx);
+    else
+        kv_bucket_seg_put_bulk(ctx->self, &ctx->batch, replay_append_cb, ctx);
+}
+
+static void replay_load_cb(bool success, void *arg) {
+    struct replay_ctx *ctx = arg;
+    if (success)
+        replay_append(ctx);
+    else
+        replay_finish(ctx, false);
+}
+
+static void replay_done(struct replay_ctx *ctx) {
+    struct kv_bucket_log *self = ctx->self;
+    uint32_t head = ctx->checkpoint.head, tail = (ctx->checkpoint.replay_tail + ctx->end) % self->size;
+    // the newest chain tells how far the compaction had moved the head, unless it is older than the checkpoint.
+    if (ctx->end && (self->size + ctx->head - head) % self->size <= (self->size + tail - head) % self->size)
+        head = ctx->head;
+    self->head = head;
+    self->tail = tail;
+    self->compact_head = head % self->log.size;
+    kv_circular_log_recover(&self->log, head % self->log.size, tail % self->log.size, replay_load_cb, ctx);
+}
+
+static void replay_chain(struct replay_ctx *ctx, struct kv_bucket *buckets, uint64_t distance) {
+    struct kv_bucket_log *self = ctx->self;
+    uint32_t len = buckets->chain_length;
+    ctx->last = distance + len;
+    if (!ctx->broken) {
+        ctx->end = distance + len;
+        ctx->head = buckets->head;
+        struct kv_bucket_meta meta = {len, (ctx->checkpoint.replay_offset + distance) % self->log.size};
+        kv_bucket_meta_put(self, buckets->id, is_empty_chain(buckets) ? (struct kv_bucket_meta){0, 0} : meta);
+        kv_bucket_meta_put_tags(self, buckets->id, NULL);
+        return;
+    }
+    // past a hole, the chain is appended again once the cursors have been recovered.
+    struct kv_bucket_segment *seg = kv_malloc(sizeof(struct kv_bucket_segment));
+    kv_bucket_seg_init(seg, buckets->id);
+    struct kv_bucket_chain_entry *chain_entry = kv_freelist_get(&chain_entries, sizeof(*chain_entry));
+    chain_entry->len = chain_entry->buf_len = len;
+    chain_entry->bucket = kv_storage_pool_malloc(self->log.storage, len * sizeof(struct kv_bucket));
+    chain_entry->pre_alloc_bucket = false;
+    kv_memcpy(chain_entry->bucket, buckets, len * sizeof(struct kv_bucket));
+    TAILQ_INSERT_TAIL(&seg->chain, chain_entry, entry);
+    seg->empty = false;
+    TAILQ_INSERT_TAIL(&ctx->segs, seg, entry);
+}
+
+static void replay_report_chain(struct replay_ctx *ctx, struct kv_bucket *buckets, uint64_t distance) {
+    struct kv_bucket_log *self = ctx->self;
+    struct kv_bucket_meta meta = kv_bucket_meta_get(self, buckets->id);
+    if (meta.chain_length == buckets->chain_length && meta.bucket_offset == (ctx->checkpoint.replay_offset + distance) % self->log.size)
+        ctx->replay_cb(buckets, ctx->cb_arg);
+}
+
+static bool replay_chunk_cb(void *arg, struct kv_bucket *buckets, uint64_t offset, uint64_t n) {
+    struct replay_ctx *ctx = arg;
+    struct kv_bucket_log *self = ctx->self;
+    uint64_t end = offset + READ_LENGTH < ctx->reader.length ? offset + READ_LENGTH : ctx->reader.length;
+    // the chains are parsed in the order of the log, from the end of the last one.
+    while (ctx->offset < end) {
+        if (!ctx->reporting && ctx->offset > ctx->last + REPLAY_GAP) return false;
+        struct kv_bucket *chain = buckets + (ctx->offset - offset);
+        uint32_t stamp = (ctx->checkpoint.replay_tail + ctx->offset + 1) % self->size;
+        uint32_t len = replay_chain_length(self, chain, offset + n - ctx->offset, stamp);
+        if (len == 0) {
+            ctx->broken = true;
+            ctx->offset++;
+            continue;
+        }
+        if (ctx->reporting)
+            replay_report_chain(ctx, chain, ctx->offset);
+        else
+            replay_chain(ctx, chain, ctx->offset);
+        ctx->offset += len;
+    }
+    return true;
+}
+
+static void replay_read_done(void *arg, bool success) {
+    struct replay_ctx *ctx = arg;
+    if (!success) {
+        fprintf(stderr, "kv_bucket_log_recover: IO error.\n");
+        replay_finish(ctx, false);
+    } else if (ctx->reporting) {
+        replay_finish(ctx, true);
+    } else {
+        replay_done(ctx);
+    }
+}
+
+void kv_bucket_log_recover(struct kv_bucket_log *self, struct kv_bucket_log_checkpoint *checkpoint,
+                           kv_bucket_log_replay_cb replay_cb, kv_circular_log_io_cb cb, void *cb_arg) {
+    assert(kv_circular_log_length(&self->log) == 0 && STAILQ_EMPTY(&self->pending_puts));
+    struct replay_ctx *ctx = kv_malloc(sizeof(struct replay_ctx));
+    *ctx = (struct replay_ctx){.self = self, .checkpoint = *checkpoint, .replay_cb = replay_cb, .cb = cb, .cb_arg = cb_arg};
+    TAILQ_INIT(&ctx->segs);
+    TAILQ_INIT(&ctx->batch);
+    log_reader_init(&ctx->reader, self, replay_chunk_cb, replay_read_done, ctx);
+    log_reader_start(&ctx->reader, checkpoint->replay_offset, self->log.size - 1, true);
+}
+
+// --- scan ---
+// The newest chain of the log tells where its head and tail were. The chunks are parsed as they complete, a chain
+// running from one into the next is skipped by the latter, its buckets having a non-zero chain index.
+struct scan_ctx {
+    struct kv_bucket_log *self;
+    kv_bucket_log_replay_cb replay_cb;
+    kv_circular_log_io_cb cb;
+    void *cb_arg;
+    struct log_reader reader;
+    uint32_t head, tail;  // the stamps of the newest chain
+    bool found;
+};
+
+// the stamps of the log lie within a lap of its tail.
+static inline bool is_newer_stamp(struct kv_bucket_log *self, uint32_t a, uint32_t b) {
+    uint32_t d = (self->size + a - b) % self->size;
+    return d != 0 && d < self->log.size;
+}
+
+static bool scan_chunk_cb(void *arg, struct kv_bucket *buckets, uint64_t offset, uint64_t n) {
+    struct scan_ctx *ctx = arg;
+    struct kv_bucket_log *self = ctx->self;
+    uint64_t end = offset + READ_LENGTH < self->log.size ? offset + READ_LENGTH : self->log.size;
+    for (uint64_t i = offset; i < end;) {
+        struct kv_bucket *chain = buckets + (i - offset);
+        uint32_t len = 0;
+        // a bucket written at i has the tail stamp i + 1 of either of the last two laps.
+        if (chain->chain_index == 0 && chain->tail % self->log.size == (i + 1) % self->log.size)
+            len = replay_chain_length(self, chain, offset + n - i, chain->tail);
+        if (len == 0) {
+            i++;
+            continue;
+        }
+        uint32_t tail = (chain->tail + len - 1) % self->size;
+        if (!ctx->found || is_newer_stamp(self, tail, ctx->tail)) {
+            ctx->tail = tail;
+            ctx->head = chain->head;
+            ctx->found = true;
+        }
+        i += len;
+    }
+    return true;
+}
+
+static void scan_done(void *arg, bool success) {
+    struct scan_ctx *ctx = arg;
+    struct kv_bucket_log *self = ctx->self;
+    log_reader_fini(&ctx->reader);
+    if (!success) fprintf(stderr, "kv_bucket_log_scan: IO error.\n");
+    if (!success || !ctx->found) {
+        // an empty log has nothing to replay.
+        if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+        kv_free(ctx);
+        return;
+    }
+    struct kv_bucket_log_checkpoint checkpoint = {ctx->head % self->log.size, ctx->tail % self->log.size, ctx->head,
+                                                  ctx->tail, ctx->head % self->log.size, ctx->head};
+    kv_bucket_log_recover(self, &checkpoint, ctx->replay_cb, ctx->cb, ctx->cb_arg);
+    kv_free(ctx);
+}
+
+void kv_bucket_log_scan(struct kv_bucket_log *self, kv_bucket_log_replay_cb replay_cb, kv_circular_log_io_cb cb,
+                        void *cb_arg) {
+    assert(kv_circular_log_length(&self->log) == 0 && STAILQ_EMPTY(&self->pending_puts));
+    struct scan_ctx *ctx = kv_malloc(sizeof(struct scan_ctx));
+    *ctx = (struct scan_ctx){.self = self, .replay_cb = replay_cb, .cb = cb, .cb_arg = cb_arg};
+    log_reader_init(&ctx->reader, self, scan_chunk_cb, scan_done, ctx);
+    log_reader_start(&ctx->reader, 0, self->log.size, false);
+}
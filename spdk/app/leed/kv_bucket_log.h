@@ -1,6 +1,10 @@
 #ifndef _KV_BUCKET_LOG_H_
 #define _KV_BUCKET_LOG_H_
+#include <string.h>
 #include <sys/queue.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include "kv_circular_log.h"
 
@@ -12,11 +16,17 @@
 
 typedef void (*kv_task_cb)(void *);
 typedef void *kv_bucket_key_set;
+typedef void *kv_bucket_key_index;
 struct kv_item {
     uint8_t key_length;
     uint8_t key[KV_MAX_KEY_LENGTH];
     uint32_t value_length;
-    uint64_t value_offset : 48;
+    uint64_t value_offset : 46;
+// codecs of the value, see kv_value_log_compress:
+#define KV_CODEC_NONE 0
+#define KV_CODEC_LZ 1
+    uint64_t codec : 1;
+    uint64_t key_in_log : 1;  // a key of at most KV_MAX_KEY_LENGTH bytes stored like a long one, see kv_key_in_log
 #define KV_EMPTY_ITEM(item) (!(item)->key_length)
 } __attribute__((packed));
 
@@ -32,9 +42,91 @@ struct kv_bucket_meta {
     uint32_t bucket_offset;
 } __attribute__((packed));
 
+// --- long keys ---
+// A key longer than KV_MAX_KEY_LENGTH is written to the value log right before its value, padded to 4 bytes, and the
+// value_length and value_offset of its item cover both, so that the compaction and the recovery handle them as one
+// record. The item keeps the real key length and, in place of the key, a fingerprint: the first KV_LONG_KEY_PREFIX
+// bytes of the key, which the bucket id is taken from, followed by a 64-bit hash of the whole key.
+// The last 4 bytes of the key field hold the expiry of the item, which a key of KV_ITEM_KEY_ROOM bytes at most and a
+// fingerprint leave free. A longer key that expires is stored like a long key, with its first KV_ITEM_KEY_ROOM bytes
+// in place of the fingerprint, and one that does not expire fills the key field.
+#define KV_ITEM_KEY_ROOM (KV_MAX_KEY_LENGTH - 4)
+#define KV_LONG_KEY_PREFIX (KV_ITEM_KEY_ROOM - 8)
+static inline bool kv_is_long_key(uint8_t key_length) { return key_length > KV_MAX_KEY_LENGTH; }
+// whether the key of an item expiring at expire goes to the value log.
+static inline bool kv_key_in_log(uint8_t key_length, uint32_t expire) {
+    return kv_is_long_key(key_length) || (expire && key_length > KV_ITEM_KEY_ROOM);
+}
+static inline bool kv_item_key_in_log(const struct kv_item *item) {
+    return kv_is_long_key(item->key_length) || item->key_in_log;
+}
+// the bytes of the key, or of its fingerprint, an item is looked up by, the rest of a key of at most
+// KV_MAX_KEY_LENGTH bytes is compared once they match.
+static inline uint8_t kv_item_key_length(uint8_t key_length) {
+    return key_length > KV_ITEM_KEY_ROOM ? KV_ITEM_KEY_ROOM : key_length;
+}
+// the bytes a long key takes in the value log.
+static inline uint32_t kv_long_key_size(uint8_t key_length) { return (key_length + 0x3u) & ~0x3u; }
+static inline void kv_long_key_fingerprint(uint8_t *fingerprint, const uint8_t *key, uint8_t key_length) {
+    uint64_t h = key_length * 0x9E3779B97F4A7C15ull, w;
+    uint32_t i = 0;
+    for (; i + 8 <= key_length; i += 8) {
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, key + i, key_length - i);
+    h = (h ^ w) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 29;
+    memcpy(fingerprint, key, KV_LONG_KEY_PREFIX);
+    memcpy(fingerprint + KV_LONG_KEY_PREFIX, &h, 8);
+}
+
+// --- fingerprint tags ---
+// Every item of a bucket chain has a 1-byte tag kept in DRAM, KV_ITEM_PER_BUCKET tags per bucket, indexed by
+// chain_index. Tag 0 marks an empty item, so only the items whose tags match need a full key comparison.
+#define KV_TAG_EMPTY 0
+static inline uint8_t kv_item_tag(const uint8_t *key, uint8_t key_length) {
+    uint64_t h = key_length;
+    if (key_length >= 8) {
+        uint64_t head, tail;
+        memcpy(&head, key, 8);
+        memcpy(&tail, key + kv_item_key_length(key_length) - 8, 8);
+        h ^= head ^ (tail >> 1);
+    } else {
+        for (uint8_t i = 0; i < key_length; ++i) h = (h << 8) | key[i];
+    }
+    // the high bits of the key select the bucket, fold all bits into the top byte.
+    uint8_t tag = (h * 0x9E3779B97F4A7C15ull) >> 56;
+    return tag == KV_TAG_EMPTY ? 1 : tag;
+}
+
+// bit i of the result is set if tags[i] == tag, for the 16 tags of one bucket (or 32 tags of two adjacent buckets).
+static inline uint32_t kv_tag_match(const uint8_t *tags, uint8_t tag, uint32_t bucket_num) {
+#if defined(__AVX2__)
+    if (bucket_num == 2)
+        return (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)tags), _mm256_set1_epi8((char)tag)));
+#endif
+#if defined(__SSE2__)
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < bucket_num; ++i)
+        mask |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)(tags + i * KV_ITEM_PER_BUCKET)), _mm_set1_epi8((char)tag)))
+                << (i * KV_ITEM_PER_BUCKET);
+    return mask;
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < bucket_num * KV_ITEM_PER_BUCKET; ++i)
+        if (tags[i] == tag) mask |= 1u << i;
+    return mask;
+#endif
+}
+
 struct kv_bucket_chain_entry {
     struct kv_bucket *bucket;
-    uint8_t len;
+    uint8_t len, buf_len;  // buf_len: blocks taken from the DMA buffer pool
     bool pre_alloc_bucket;
     TAILQ_ENTRY(kv_bucket_chain_entry)
     entry;
@@ -45,6 +137,8 @@ struct kv_bucket_segment {
     uint64_t bucket_id;
     TAILQ_HEAD(, kv_bucket_chain_entry)
     chain;
+    uint8_t *tags;  // built lazily by kv_bucket_seg_tags
+    struct pending_put *pending;  // the put of the segment, until it is committed or cleaned up
     uint32_t offset;
     bool dirty, empty;
     TAILQ_ENTRY(kv_bucket_segment)
@@ -52,12 +146,44 @@ struct kv_bucket_segment {
 };
 TAILQ_HEAD(kv_bucket_segments, kv_bucket_segment);
 
+// --- expiry ---
+// An item whose expire has passed reads as a miss, and is dropped by the next compaction of either log that meets it:
+// the bucket log compaction clears it from the chains it rewrites anyway, the value log compaction does not move its
+// value. Either way nothing is read or written for it, and expire_cb is called with the item, once dropped.
+typedef uint32_t (*kv_bucket_clock)(void);
+// the wall clock in seconds, the default one.
+uint32_t kv_bucket_wall_clock(void);
+// in seconds of the clock of the bucket log, 0 for never.
+static inline uint32_t kv_item_expire(const struct kv_item *item) {
+    if (item->key_length > KV_ITEM_KEY_ROOM && !kv_item_key_in_log(item)) return 0;
+    uint32_t expire;
+    memcpy(&expire, item->key + KV_ITEM_KEY_ROOM, sizeof(expire));
+    return expire;
+}
+// called once the key is filled in, an item that expires has room for it, see kv_key_in_log.
+static inline void kv_item_set_expire(struct kv_item *item, uint32_t expire) {
+    if (item->key_length > KV_ITEM_KEY_ROOM && !kv_item_key_in_log(item)) return;
+    memcpy(item->key + KV_ITEM_KEY_ROOM, &expire, sizeof(expire));
+}
+static inline bool kv_item_expired(const struct kv_item *item, uint32_t now) {
+    uint32_t expire = kv_item_expire(item);
+    return expire != 0 && expire <= now;
+}
+typedef void (*kv_bucket_expire_cb)(struct kv_item *item, void *arg);
+
+struct kv_ds_io_sched;
 struct kv_bucket_log {
     struct kv_circular_log log;
     uint32_t size;
     uint32_t head, tail;
-    uint32_t compact_head;
+    uint32_t compact_head, compacting;  // compacting: windows in flight
     void *meta, *bucket_lock;
+    struct kv_ds_io_sched *io_sched;  // paces the compaction, NULL to run it at full speed
+    STAILQ_HEAD(, pending_put) pending_puts;  // in the order of the log
+    kv_bucket_clock clock;
+    kv_bucket_expire_cb expire_cb;
+    void *expire_arg;
+    uint64_t expired;  // items dropped by either compaction
 };
 
 static inline uint32_t kv_bucket_log_offset(struct kv_bucket_log *self) { return (uint32_t)self->log.tail; }
@@ -65,23 +191,72 @@ static inline uint32_t kv_bucket_log_offset(struct kv_bucket_log *self) { return
 void kv_bucket_log_init(struct kv_bucket_log *self, struct kv_storage *storage, uint64_t base, uint64_t num_buckets);
 void kv_bucket_log_fini(struct kv_bucket_log *self);
 
+// --- checkpoint & recovery ---
+// A checkpoint holds the meta of every bucket and the cursors of the log. The buckets appended from replay_offset
+// on were not committed, or not even written, when it was taken: the recovery replays them in the order of the
+// log. A chain is replayed only if its tail stamps show that it has been written in full during the current lap.
+struct kv_bucket_log_checkpoint {
+    uint64_t log_head, log_tail;
+    uint32_t head, tail;                  // stamps
+    uint32_t replay_offset, replay_tail;  // replay_tail: the tail stamp before the bucket at replay_offset
+};
+struct kv_bucket_meta_record {
+    uint64_t bucket_id;
+    uint32_t bucket_offset;
+    uint8_t chain_length;
+    uint8_t reserved[3];
+};
+void kv_bucket_log_checkpoint(struct kv_bucket_log *self, struct kv_bucket_log_checkpoint *checkpoint);
+// Called, once the replay is done, with every replayed chain that is still the newest copy of its bucket.
+typedef void (*kv_bucket_log_replay_cb)(struct kv_bucket *buckets, void *cb_arg);
+// The meta must have been restored from the checkpoint first. The chains found past a hole, i.e. after a put that
+// did not reach the storage, are appended again so that the log stays contiguous.
+void kv_bucket_log_recover(struct kv_bucket_log *self, struct kv_bucket_log_checkpoint *checkpoint,
+                           kv_bucket_log_replay_cb replay_cb, kv_circular_log_io_cb cb, void *cb_arg);
+// Rebuilds the meta from the log alone, when no checkpoint is left: the whole log is read, many chunks in flight, for
+// its newest chain, which tells where the head and the tail were, then the chains in between are replayed as from a
+// checkpoint. The storage must not hold the log of an earlier data store, whose chains would be taken for live ones.
+void kv_bucket_log_scan(struct kv_bucket_log *self, kv_bucket_log_replay_cb replay_cb, kv_circular_log_io_cb cb,
+                        void *cb_arg);
+
 bool kv_bucket_alloc_extra(struct kv_bucket_log *self, struct kv_bucket_segment *seg);
 void kv_bucket_free_extra(struct kv_bucket_segment *seg);
 
 void kv_bucket_seg_init(struct kv_bucket_segment *seg, uint64_t bucket_id);
 void kv_bucket_seg_get(struct kv_bucket_log *self, struct kv_bucket_segment *seg, struct kv_bucket_meta *meta_ptr, bool strict, kv_circular_log_io_cb cb, void *cb_arg);
+// Gets the segments of segs, linked by entry, as strict kv_bucket_seg_gets, in the order of the log: the chains a few
+// buckets apart are read together. Every segment is cleaned up on failure.
+void kv_bucket_seg_get_bulk(struct kv_bucket_log *self, struct kv_bucket_segments *segs, kv_circular_log_io_cb cb,
+                            void *cb_arg);
 void kv_bucket_seg_put(struct kv_bucket_log *self, struct kv_bucket_segment *seg, kv_circular_log_io_cb cb, void *cb_arg);
 void kv_bucket_seg_put_bulk(struct kv_bucket_log *self, struct kv_bucket_segments *segs, kv_circular_log_io_cb cb, void *cb_arg);
 void kv_bucket_seg_cleanup(struct kv_bucket_log *self, struct kv_bucket_segment *seg);
 void kv_bucket_seg_commit(struct kv_bucket_log *self, struct kv_bucket_segment *seg);
+uint8_t *kv_bucket_seg_tags(struct kv_bucket_segment *seg);
+uint8_t *kv_bucket_item_tag(struct kv_bucket_segment *seg, struct kv_item *item);
+void kv_bucket_item_tag_update(struct kv_bucket_segment *seg, struct kv_item *item);
+// key is the one held in the item, i.e. the fingerprint of a long key.
+struct kv_item *kv_bucket_seg_find(struct kv_bucket_segment *seg, uint8_t *key, uint8_t key_length);
+// the next match after prev, as the fingerprints of two long keys may match.
+struct kv_item *kv_bucket_seg_find_next(struct kv_bucket_segment *seg, uint8_t *key, uint8_t key_length,
+                                        struct kv_item *prev);
 
 void kv_bucket_meta_init(struct kv_bucket_log *self);
 void kv_bucket_meta_fini(struct kv_bucket_log *self);
 struct kv_bucket_meta kv_bucket_meta_get(struct kv_bucket_log *self, uint64_t bucket_id);
 void kv_bucket_meta_put(struct kv_bucket_log *self, uint64_t bucket_id, struct kv_bucket_meta data);
+uint8_t *kv_bucket_meta_tags(struct kv_bucket_log *self, uint64_t bucket_id);
+void kv_bucket_meta_put_tags(struct kv_bucket_log *self, uint64_t bucket_id, const uint8_t *tags);
+// Writes the meta of every non-empty bucket to records, unless it is NULL, and returns their number: at most one
+// per block of the log.
+uint64_t kv_bucket_meta_dump(struct kv_bucket_log *self, struct kv_bucket_meta_record *records);
 
 void kv_bucket_lock(struct kv_bucket_log *self, struct kv_bucket_segments *segs, kv_task_cb cb, void *cb_arg);
 void kv_bucket_unlock(struct kv_bucket_log *self, struct kv_bucket_segments *segs);
+// true while the bucket is locked and a put of it is in flight.
+bool kv_bucket_is_putting(struct kv_bucket_log *self, uint64_t bucket_id);
+// true while the bucket is locked or waited for, i.e. its chain may be in the hands of another operation.
+bool kv_bucket_is_locked(struct kv_bucket_log *self, uint64_t bucket_id);
 void kv_bucket_lock_init(struct kv_bucket_log *self);
 void kv_bucket_lock_fini(struct kv_bucket_log *self);
 
@@ -90,4 +265,23 @@ bool kv_bucket_key_set_find(kv_bucket_key_set set, uint8_t *key, uint8_t key_len
 void kv_bucket_key_set_del(kv_bucket_key_set set, uint8_t *key, uint8_t key_length);
 kv_bucket_key_set kv_bucket_key_set_init(void);
 void kv_bucket_key_set_fini(kv_bucket_key_set set);
+
+// --- key index ---
+// The full keys in the order of the ring: by their first 8 bytes read as a 64-bit integer, which the bucket id and
+// the vnode of a key are taken from, then by the remaining bytes.
+static inline uint64_t kv_key_prefix(const uint8_t *key) {
+    uint64_t prefix;
+    memcpy(&prefix, key, sizeof(prefix));
+    return prefix;
+}
+void kv_bucket_key_index_add(kv_bucket_key_index index, uint8_t *key, uint8_t key_length);
+void kv_bucket_key_index_del(kv_bucket_key_index index, uint8_t *key, uint8_t key_length);
+// Removes the keys whose prefix is in [start, end), which wraps around if end < start.
+void kv_bucket_key_index_del_range(kv_bucket_key_index index, uint64_t start, uint64_t end);
+// Replaces key, which has room for UINT8_MAX bytes, with the first key of the index from it, or past it if exclusive.
+// false if there is none.
+bool kv_bucket_key_index_next(kv_bucket_key_index index, uint8_t *key, uint8_t *key_length, bool exclusive);
+uint64_t kv_bucket_key_index_size(kv_bucket_key_index index);
+kv_bucket_key_index kv_bucket_key_index_init(void);
+void kv_bucket_key_index_fini(kv_bucket_key_index index);
 #endif
\ No newline at end of file
@@ -27,6 +27,41 @@ void kv_circular_log_fini(struct kv_circular_log *self) {
     kv_free(self->fetch.valid);
 }
 
+// --- recovery ---
+struct recover_ctx {
+    struct kv_circular_log *self;
+    uint64_t n;
+    kv_circular_log_io_cb cb;
+    void *cb_arg;
+};
+static void recover_cb(bool success, void *arg) {
+    struct recover_ctx *ctx = arg;
+    struct kv_circular_log_fetch *fetch = &ctx->self->fetch;
+    if (success) {
+        kv_memset(fetch->valid, 1, ctx->n);
+        fetch->tail = fetch->tail1 = ctx->n;
+    }
+    if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+    kv_free(ctx);
+}
+
+void kv_circular_log_recover(struct kv_circular_log *self, uint64_t head, uint64_t tail, kv_circular_log_io_cb cb,
+                             void *cb_arg) {
+    struct kv_circular_log_fetch *fetch = &self->fetch;
+    self->head = head;
+    self->tail = tail;
+    fetch->head = fetch->tail = fetch->tail1 = 0;
+    kv_memset(fetch->valid, 0, fetch->size);
+    struct recover_ctx *ctx = kv_malloc(sizeof(struct recover_ctx));
+    *ctx = (struct recover_ctx){self, kv_circular_log_length(self), cb, cb_arg};
+    if (ctx->n > fetch->size - 1) ctx->n = fetch->size - 1;
+    if (ctx->n == 0) {
+        recover_cb(true, ctx);
+        return;
+    }
+    kv_circular_log_read(self, head, fetch->buffer, ctx->n, recover_cb, ctx);
+}
+
 // --- fetch ---
 #define FETCH_CON_IO 32
 
@@ -63,4 +63,8 @@ bool kv_circular_log_is_fetchable(struct kv_circular_log *self, uint64_t offset)
 void kv_circular_log_fetch(struct kv_circular_log *self, uint64_t offset, uint64_t n, struct iovec iov[2]);
 void kv_circular_log_fetch_one(struct kv_circular_log *self, uint64_t offset, void **buf);
 void kv_circular_log_move_head(struct kv_circular_log *self, uint64_t n);
+
+// Moves the cursors of a log found on the storage, e.g. by a recovery, and fills the fetch buffer from the new head.
+void kv_circular_log_recover(struct kv_circular_log *self, uint64_t head, uint64_t tail, kv_circular_log_io_cb cb,
+                             void *cb_arg);
 #endif
\ No newline at end of file
@@ -6,11 +6,15 @@
 
 #include "kv_app.h"
 #include "kv_memory.h"
+#include "spdk/env.h"
+#include "utils/timing.h"
 
 // --- queue ---
 struct queue_entry {
     struct kv_data_store *self;
     enum kv_ds_op op;
+    uint32_t cost;
+    uint64_t start_tsc;
     kv_task_cb fn;
     void *ctx;
     kv_data_store_cb cb;
@@ -19,15 +23,23 @@ struct queue_entry {
     entry;
 };
 STAILQ_HEAD(queue_head, queue_entry);
+static __thread struct kv_freelist queue_entries;
+
+// the service time of an op is measured from here, once it leaves the message queue of the bucket log thread.
+static void execute(void *arg) {
+    struct queue_entry *entry = arg;
+    entry->start_tsc = spdk_get_ticks();
+    entry->fn(entry->ctx);
+}
 
 static void *enqueue(struct kv_data_store *self, enum kv_ds_op op, kv_task_cb fn, void *ctx, kv_data_store_cb cb,
                      void *cb_arg) {
-    struct queue_entry *entry = kv_malloc(sizeof(struct queue_entry));
-    *entry = (struct queue_entry){self, op, fn, ctx, cb, cb_arg};
+    struct queue_entry *entry = kv_freelist_get(&queue_entries, sizeof(struct queue_entry));
+    *entry = (struct queue_entry){self, op, kv_ds_queue_cost(self->ds_queue, self->ds_id, op), 0, fn, ctx, cb, cb_arg};
     struct kv_ds_q_info q_info = self->ds_queue->q_info[self->ds_id];
-    if (kv_ds_queue_find(&q_info, NULL, 1, kv_ds_op_cost(op))) {
+    if (kv_ds_queue_find(&q_info, NULL, 1, entry->cost)) {
         self->ds_queue->q_info[self->ds_id] = q_info;
-        kv_app_send(self->bucket_log.log.thread_index, fn, ctx);
+        kv_app_send(self->bucket_log.log.thread_index, execute, entry);
     } else {
         STAILQ_INSERT_TAIL((struct queue_head *)self->q, entry, entry);
     }
@@ -37,18 +49,390 @@ static void dequeue(bool success, void *arg) {
     struct queue_entry *entry = arg;
     struct kv_data_store *self = entry->self;
     struct kv_ds_q_info q_info = self->ds_queue->q_info[self->ds_id];
-    q_info.size -= kv_ds_op_cost(entry->op);
+    q_info.size -= entry->cost;
+    q_info.cap = kv_ds_queue_complete(self->ds_queue, self->ds_id, entry->op, entry->start_tsc);
+    // let the maintenance I/O of the value log catch up before admitting more ops.
+    if (kv_value_log_is_behind(&self->value_log)) q_info.cap = kv_ds_queue_throttle(self->ds_queue, self->ds_id);
     while (!STAILQ_EMPTY((struct queue_head *)self->q)) {
         struct queue_entry *first = STAILQ_FIRST((struct queue_head *)self->q);
-        if (kv_ds_queue_find(&q_info, NULL, 1, kv_ds_op_cost(first->op))) {
-            kv_app_send(self->bucket_log.log.thread_index, first->fn, first->ctx);
+        first->cost = kv_ds_queue_cost(self->ds_queue, self->ds_id, first->op);
+        if (kv_ds_queue_find(&q_info, NULL, 1, first->cost)) {
+            kv_app_send(self->bucket_log.log.thread_index, execute, first);
             STAILQ_REMOVE_HEAD((struct queue_head *)self->q, entry);
         } else
             break;
     }
     self->ds_queue->q_info[self->ds_id] = q_info;
     if (entry->cb) entry->cb(success, entry->cb_arg);
-    kv_free(entry);
+    kv_freelist_put(&queue_entries, entry);
+}
+
+// --- checkpoint ---
+// The header is written once the body is on the storage and holds its checksum, so a slot is either valid or
+// ignored by the recovery.
+#define CHECKPOINT_MAGIC 0x54504B434445454CULL  // "LEEDCKPT"
+#define CHECKPOINT_POLL_PERIOD (100ULL * 1000)  // us
+struct checkpoint_header {
+    uint64_t checksum;  // of the rest of the header and of the body
+    uint64_t magic, seq;
+    uint64_t bucket_log_size, value_log_size, body_blks, meta_num;
+    struct kv_bucket_log_checkpoint bucket_log;
+    struct kv_value_log_checkpoint value_log;
+};
+
+static uint64_t checksum(uint64_t h, const void *buf, uint64_t size) {
+    for (const uint64_t *p = buf; p < (const uint64_t *)buf + size / sizeof(uint64_t); ++p) h = (h ^ *p) * 0x100000001B3ULL;
+    return h;
+}
+static uint64_t header_checksum(struct checkpoint_header *header, const uint8_t *body, uint32_t block_size) {
+    uint64_t h = checksum(0xCBF29CE484222325ULL, &header->magic, sizeof(struct checkpoint_header) - sizeof(uint64_t));
+    return checksum(h, body, header->body_blks * block_size);
+}
+static inline uint64_t meta_blks(struct kv_storage *storage, uint64_t meta_num) {
+    return (meta_num * sizeof(struct kv_bucket_meta_record) + storage->block_size - 1) / storage->block_size;
+}
+static inline uint64_t checkpoint_slot(struct kv_data_store *self, uint64_t seq) {
+    return self->checkpoint_base + (seq & 1) * self->checkpoint_slot_blks;
+}
+
+struct checkpoint_ctx {
+    struct kv_data_store *self;
+    kv_data_store_cb cb;
+    void *cb_arg;
+    uint8_t *buf;  // the header block, then the body
+    struct checkpoint_ctx *next;  // the requests served by the same checkpoint
+};
+
+static void checkpoint_try(struct kv_data_store *self);
+static void checkpoint_finish(bool success, void *arg) {
+    struct checkpoint_ctx *ctx = arg;
+    struct kv_data_store *self = ctx->self;
+    self->is_checkpointing = false;
+    kv_storage_free(ctx->buf);
+    while (ctx) {
+        struct checkpoint_ctx *next = ctx->next;
+        if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+        kv_free(ctx);
+        ctx = next;
+    }
+    checkpoint_try(self);
+}
+
+static void checkpoint_body_cb(bool success, void *arg) {
+    struct checkpoint_ctx *ctx = arg;
+    if (!success) {
+        fprintf(stderr, "kv_data_store_checkpoint: IO error.\n");
+        checkpoint_finish(false, ctx);
+        return;
+    }
+    struct checkpoint_header *header = (struct checkpoint_header *)ctx->buf;
+    kv_storage_write_blocks(ctx->self->bucket_log.log.storage, ctx->buf, 0, checkpoint_slot(ctx->self, header->seq), 1,
+                            checkpoint_finish, ctx);
+}
+
+static void checkpoint_start(struct checkpoint_ctx *ctx) {
+    struct kv_data_store *self = ctx->self;
+    struct kv_storage *storage = self->bucket_log.log.storage;
+    uint64_t value_log_blks = kv_value_log_checkpoint_blks(&self->value_log);
+    uint64_t meta_num = kv_bucket_meta_dump(&self->bucket_log, NULL);
+    uint64_t blks = 1 + value_log_blks + meta_blks(storage, meta_num);
+    ctx->buf = kv_storage_blk_alloc(storage, blks);
+    struct checkpoint_header *header = (struct checkpoint_header *)ctx->buf;
+    uint8_t *body = ctx->buf + storage->block_size;
+    bool taken = kv_value_log_checkpoint(&self->value_log, &header->value_log, body);
+    assert(taken);
+    (void)taken;
+    self->is_checkpointing = true;
+    kv_bucket_meta_dump(&self->bucket_log, (struct kv_bucket_meta_record *)(body + value_log_blks * storage->block_size));
+    kv_bucket_log_checkpoint(&self->bucket_log, &header->bucket_log);
+    header->magic = CHECKPOINT_MAGIC;
+    header->seq = ++self->checkpoint_seq;
+    header->bucket_log_size = self->bucket_log.log.size;
+    header->value_log_size = self->value_log.size;
+    header->body_blks = blks - 1;
+    header->meta_num = meta_num;
+    header->checksum = header_checksum(header, body, storage->block_size);
+    self->checkpoint_elapsed = 0;
+    self->checkpoint_tail = self->bucket_log.tail;
+    kv_storage_write_blocks(storage, body, 0, checkpoint_slot(self, header->seq) + 1, blks - 1, checkpoint_body_cb, ctx);
+}
+
+// the pending requests wait for the checkpoint in flight or the bucket id dumps, they are retried on the completion of
+// the checkpoint and by the checkpoint poller.
+static void checkpoint_try(struct kv_data_store *self) {
+    if (!self->checkpoint_pending || self->is_checkpointing || !kv_value_log_can_checkpoint(&self->value_log)) return;
+    struct checkpoint_ctx *ctx = self->checkpoint_pending;
+    self->checkpoint_pending = NULL;
+    checkpoint_start(ctx);
+}
+
+void kv_data_store_checkpoint(struct kv_data_store *self, kv_data_store_cb cb, void *cb_arg) {
+    struct checkpoint_ctx *ctx = kv_malloc(sizeof(struct checkpoint_ctx));
+    *ctx = (struct checkpoint_ctx){self, cb, cb_arg, NULL, self->checkpoint_pending};
+    self->checkpoint_pending = ctx;
+    checkpoint_try(self);
+}
+
+static int checkpoint_poller(void *arg) {
+    struct kv_data_store *self = arg;
+    if (self->checkpoint_pending) {
+        checkpoint_try(self);
+        return 0;
+    }
+    if (self->checkpoint_period == 0 || self->is_checkpointing) return 0;
+    self->checkpoint_elapsed += CHECKPOINT_POLL_PERIOD;
+    struct kv_bucket_log *bucket_log = &self->bucket_log;
+    uint32_t appended = (bucket_log->size + bucket_log->tail - self->checkpoint_tail) % bucket_log->size;
+    if (appended == 0) return 0;
+    if (self->checkpoint_elapsed >= self->checkpoint_period || appended >= bucket_log->log.size / 4)
+        kv_data_store_checkpoint(self, NULL, NULL);
+    return 0;
+}
+
+// --- key index ---
+// The index is rebuilt from the meta, a few buckets read at once, the long keys of each bucket one after another.
+#define INDEX_REBUILD_DEPTH 32
+struct index_rebuild_ctx {
+    struct kv_data_store *self;
+    struct kv_bucket_meta_record *records;
+    uint64_t record_num, next;
+    uint32_t io_cnt;
+    bool success;
+    kv_data_store_cb cb;
+    void *cb_arg;
+    struct timeval start;
+};
+struct index_bucket_ctx {
+    struct index_rebuild_ctx *rebuild;
+    struct kv_bucket_segment seg;
+    struct kv_bucket_chain_entry *ce;
+    uint32_t i;  // the next item of ce
+    uint8_t key[UINT8_MAX];  // a long key read back
+};
+
+void kv_data_store_index_init(struct kv_data_store *self) {
+    assert(self->key_index == NULL);
+    self->key_index = kv_bucket_key_index_init();
+}
+
+static void index_rebuild_next(struct index_rebuild_ctx *ctx);
+static void index_bucket_scan(struct index_bucket_ctx *bucket);
+static void index_bucket_done(struct index_bucket_ctx *bucket, bool success) {
+    struct index_rebuild_ctx *ctx = bucket->rebuild;
+    kv_bucket_seg_cleanup(&ctx->self->bucket_log, &bucket->seg);
+    kv_free(bucket);
+    ctx->success = ctx->success && success;
+    ctx->io_cnt--;
+    index_rebuild_next(ctx);
+}
+
+static void index_long_key_cb(bool success, void *arg) {
+    struct index_bucket_ctx *bucket = arg;
+    if (!success) {
+        index_bucket_done(bucket, false);
+        return;
+    }
+    struct kv_item *item = bucket->ce->bucket[(bucket->i - 1) / KV_ITEM_PER_BUCKET].items + (bucket->i - 1) % KV_ITEM_PER_BUCKET;
+    kv_bucket_key_index_add(bucket->rebuild->self->key_index, bucket->key, item->key_length);
+    index_bucket_scan(bucket);
+}
+
+static void index_bucket_scan(struct index_bucket_ctx *bucket) {
+    struct kv_data_store *self = bucket->rebuild->self;
+    for (; bucket->ce; bucket->ce = TAILQ_NEXT(bucket->ce, entry), bucket->i = 0) {
+        while (bucket->i < bucket->ce->len * KV_ITEM_PER_BUCKET) {
+            struct kv_item *item = bucket->ce->bucket[bucket->i / KV_ITEM_PER_BUCKET].items + bucket->i % KV_ITEM_PER_BUCKET;
+            bucket->i++;
+            if (KV_EMPTY_ITEM(item)) continue;
+            if (!kv_item_key_in_log(item)) {
+                kv_bucket_key_index_add(self->key_index, item->key, item->key_length);
+                continue;
+            }
+            kv_value_log_read(&self->value_log, item->value_offset, bucket->key, item->key_length, index_long_key_cb, bucket);
+            return;
+        }
+    }
+    index_bucket_done(bucket, true);
+}
+
+static void index_bucket_cb(bool success, void *arg) {
+    struct index_bucket_ctx *bucket = arg;
+    if (!success) {
+        index_bucket_done(bucket, false);
+        return;
+    }
+    bucket->ce = TAILQ_FIRST(&bucket->seg.chain);
+    bucket->i = 0;
+    index_bucket_scan(bucket);
+}
+
+static void index_rebuild_next(struct index_rebuild_ctx *ctx) {
+    struct kv_data_store *self = ctx->self;
+    while (ctx->success && ctx->next < ctx->record_num && ctx->io_cnt < INDEX_REBUILD_DEPTH) {
+        struct kv_bucket_meta_record *record = ctx->records + ctx->next++;
+        struct kv_bucket_meta meta = {record->chain_length, record->bucket_offset};
+        struct index_bucket_ctx *bucket = kv_malloc(sizeof(struct index_bucket_ctx));
+        bucket->rebuild = ctx;
+        kv_bucket_seg_init(&bucket->seg, record->bucket_id);
+        ctx->io_cnt++;
+        kv_bucket_seg_get(&self->bucket_log, &bucket->seg, &meta, true, index_bucket_cb, bucket);
+    }
+    if (ctx->io_cnt) return;
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    if (ctx->success)
+        printf("data store %u key index rebuilt: %lu keys in %lf s.\n", self->ds_id,
+               kv_bucket_key_index_size(self->key_index), timeval_diff(&ctx->start, &end));
+    kv_free(ctx->records);
+    if (ctx->cb) ctx->cb(ctx->success, ctx->cb_arg);
+    kv_free(ctx);
+}
+
+static void index_rebuild(struct kv_data_store *self, kv_data_store_cb cb, void *cb_arg) {
+    struct index_rebuild_ctx *ctx = kv_malloc(sizeof(struct index_rebuild_ctx));
+    *ctx = (struct index_rebuild_ctx){self, NULL, kv_bucket_meta_dump(&self->bucket_log, NULL), 0, 0, true, cb, cb_arg};
+    gettimeofday(&ctx->start, NULL);
+    ctx->records = kv_malloc((ctx->record_num + 1) * sizeof(struct kv_bucket_meta_record));
+    kv_bucket_meta_dump(&self->bucket_log, ctx->records);
+    index_rebuild_next(ctx);
+}
+
+// --- recovery ---
+// The writes rolled back by a failed commit come back if their buckets had reached the log, as the replay cannot
+// tell them from committed ones.
+struct recover_ctx {
+    struct kv_data_store *self;
+    kv_data_store_cb cb;
+    void *cb_arg;
+    uint8_t *headers, *body;  // headers: the header block of each slot
+    uint32_t io_cnt, slot, tried;
+    bool success, scanned;
+    uint64_t chains;
+    struct timeval start;
+};
+
+static void recover_finish(struct recover_ctx *ctx, bool success) {
+    ctx->self->is_checkpointing = false;
+    kv_storage_free(ctx->headers);
+    kv_storage_free(ctx->body);
+    if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+    kv_free(ctx);
+}
+
+static void recover_index_cb(bool success, void *arg) { recover_finish(arg, success); }
+
+static void recover_done(bool success, void *arg) {
+    struct recover_ctx *ctx = arg;
+    struct kv_data_store *self = ctx->self;
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    double t = timeval_diff(&ctx->start, &end);
+    if (success && ctx->scanned) {
+        double gb = (double)self->bucket_log.log.size * self->bucket_log.log.storage->block_size / (1 << 30);
+        printf("data store %u recovered by scanning %lf GB of bucket log in %lf s (%lf GB/s), %lu bucket chains replayed.\n",
+               self->ds_id, gb, t, gb / t, ctx->chains);
+    } else if (success) {
+        printf("data store %u recovered from checkpoint %lu in %lf s, %lu bucket chains replayed.\n", self->ds_id,
+               self->checkpoint_seq, t, ctx->chains);
+    }
+    self->checkpoint_tail = self->bucket_log.tail;
+    if (success && self->key_index)
+        index_rebuild(self, recover_index_cb, ctx);
+    else
+        recover_finish(ctx, success);
+}
+
+static void recover_log_cb(bool success, void *arg) {
+    struct recover_ctx *ctx = arg;
+    if (success)
+        kv_value_log_recover_finish(&ctx->self->value_log, recover_done, ctx);
+    else
+        recover_finish(ctx, false);
+}
+
+static void recover_replay_cb(struct kv_bucket *buckets, void *arg) {
+    struct recover_ctx *ctx = arg;
+    ctx->chains++;
+    for (struct kv_bucket *bucket = buckets; bucket - buckets < buckets->chain_length; ++bucket)
+        for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item)
+            if (!KV_EMPTY_ITEM(item))
+                kv_value_log_recover_value(&ctx->self->value_log, buckets->id, item->value_offset, item->value_length);
+}
+
+static struct checkpoint_header *recover_header(struct recover_ctx *ctx, uint32_t slot) {
+    struct kv_data_store *self = ctx->self;
+    struct kv_storage *storage = self->bucket_log.log.storage;
+    struct checkpoint_header *header = (struct checkpoint_header *)(ctx->headers + slot * storage->block_size);
+    if (ctx->tried & 1u << slot || header->magic != CHECKPOINT_MAGIC || (header->seq & 1) != slot) return NULL;
+    // taken with another layout.
+    if (header->bucket_log_size != self->bucket_log.log.size || header->value_log_size != self->value_log.size ||
+        header->body_blks >= self->checkpoint_slot_blks ||
+        header->body_blks < kv_value_log_checkpoint_blks(&self->value_log) + meta_blks(storage, header->meta_num))
+        return NULL;
+    return header;
+}
+
+static void recover_load(struct recover_ctx *ctx);
+static void recover_body_cb(bool success, void *arg) {
+    struct recover_ctx *ctx = arg;
+    struct kv_data_store *self = ctx->self;
+    struct kv_storage *storage = self->bucket_log.log.storage;
+    struct checkpoint_header *header = (struct checkpoint_header *)(ctx->headers + ctx->slot * storage->block_size);
+    if (!success || header->checksum != header_checksum(header, ctx->body, storage->block_size) ||
+        !kv_value_log_recover(&self->value_log, &header->value_log, ctx->body)) {
+        // fall back to the other slot.
+        kv_storage_free(ctx->body);
+        ctx->body = NULL;
+        recover_load(ctx);
+        return;
+    }
+    struct kv_bucket_meta_record *records =
+        (struct kv_bucket_meta_record *)(ctx->body + kv_value_log_checkpoint_blks(&self->value_log) * storage->block_size);
+    for (uint64_t i = 0; i < header->meta_num; i++)
+        kv_bucket_meta_put(&self->bucket_log, records[i].bucket_id,
+                           (struct kv_bucket_meta){records[i].chain_length, records[i].bucket_offset});
+    self->checkpoint_seq = header->seq;
+    kv_bucket_log_recover(&self->bucket_log, &header->bucket_log, recover_replay_cb, recover_log_cb, ctx);
+}
+
+// loads the newest valid checkpoint not tried yet.
+static void recover_load(struct recover_ctx *ctx) {
+    struct checkpoint_header *header[2] = {recover_header(ctx, 0), recover_header(ctx, 1)};
+    if (header[0] == NULL && header[1] == NULL) {
+        // no checkpoint left, the whole bucket log is scanned.
+        ctx->scanned = true;
+        kv_value_log_recover(&ctx->self->value_log, NULL, NULL);
+        kv_bucket_log_scan(&ctx->self->bucket_log, recover_replay_cb, recover_log_cb, ctx);
+        return;
+    }
+    ctx->slot = header[0] == NULL || (header[1] != NULL && header[1]->seq > header[0]->seq) ? 1 : 0;
+    ctx->tried |= 1u << ctx->slot;
+    struct kv_storage *storage = ctx->self->bucket_log.log.storage;
+    ctx->body = kv_storage_blk_alloc(storage, header[ctx->slot]->body_blks);
+    kv_storage_read_blocks(storage, ctx->body, 0, checkpoint_slot(ctx->self, ctx->slot) + 1, header[ctx->slot]->body_blks,
+                           recover_body_cb, ctx);
+}
+
+static void recover_headers_cb(bool success, void *arg) {
+    struct recover_ctx *ctx = arg;
+    ctx->success = ctx->success && success;
+    if (--ctx->io_cnt) return;
+    if (ctx->success)
+        recover_load(ctx);
+    else
+        recover_finish(ctx, false);
+}
+
+void kv_data_store_recover(struct kv_data_store *self, kv_data_store_cb cb, void *cb_arg) {
+    struct kv_storage *storage = self->bucket_log.log.storage;
+    struct recover_ctx *ctx = kv_malloc(sizeof(struct recover_ctx));
+    *ctx = (struct recover_ctx){self, cb, cb_arg, kv_storage_blk_alloc(storage, 2), NULL, 2, 0, 0, true};
+    gettimeofday(&ctx->start, NULL);
+    // no checkpoint is taken of a data store half recovered.
+    self->is_checkpointing = true;
+    for (uint32_t slot = 0; slot < 2; slot++)
+        kv_storage_read_blocks(storage, ctx->headers + slot * storage->block_size, 0, checkpoint_slot(self, slot), 1,
+                               recover_headers_cb, ctx);
 }
 
 // --- init & fini ---
@@ -56,35 +440,63 @@ static inline uint64_t kv_data_store_bucket_id(struct kv_data_store *self, uint8
     return *(uint64_t *)key >> (64 - self->log_bucket_num);
 }
 
-static inline bool compare_keys(const uint8_t *key1, size_t key1_len, const uint8_t *key2, size_t key2_len) {
-    return key1_len == key2_len && !kv_memcmp8(key1, key2, key1_len);
+// an expired item dropped by a compaction, as if it were deleted. The long keys are left in the key index, where the
+// scans take them for misses.
+static void expire_item(struct kv_item *item, void *arg) {
+    struct kv_data_store *self = arg;
+    kv_value_log_discard(&self->value_log, item->value_offset, item->value_length);
+    if (self->key_index && !kv_item_key_in_log(item))
+        kv_bucket_key_index_del(self->key_index, item->key, item->key_length);
 }
 
 void kv_data_store_init(struct kv_data_store *self, struct kv_storage *storage, uint64_t base, uint64_t num_buckets, uint64_t log_bucket_num,
-                        uint64_t value_log_block_num, uint32_t compact_buf_len, struct kv_ds_queue *ds_queue, uint32_t ds_id) {
+                        uint64_t value_log_block_num, uint32_t max_value_length, uint32_t compact_buf_len,
+                        struct kv_ds_queue *ds_queue, uint32_t ds_id) {
     self->log_bucket_num = log_bucket_num;
     kv_bucket_log_init(&self->bucket_log, storage, base, num_buckets);
+    self->bucket_log.expire_cb = expire_item;
+    self->bucket_log.expire_arg = self;
+    // a long key is stored in the value log with its value.
     kv_value_log_init(&self->value_log, storage, &self->bucket_log, base + self->bucket_log.log.size,
-                      value_log_block_num, compact_buf_len);
-    uint64_t value_log_size = self->value_log.log.size + self->value_log.id_log_size;
-    if (self->bucket_log.log.size + value_log_size > storage->num_blocks) {
+                      value_log_block_num, max_value_length + kv_long_key_size(UINT8_MAX), compact_buf_len);
+    uint64_t value_log_size = self->value_log.size + self->value_log.id_log_size;
+    // a checkpoint holds the meta of a bucket chain at most per block of the bucket log.
+    uint64_t meta_num = self->bucket_log.log.size;
+    if (log_bucket_num < 64 && 1ULL << log_bucket_num < meta_num) meta_num = 1ULL << log_bucket_num;
+    self->checkpoint_base = base + self->bucket_log.log.size + value_log_size;
+    self->checkpoint_slot_blks = 1 + kv_value_log_checkpoint_blks(&self->value_log) + meta_blks(storage, meta_num);
+    if (self->bucket_log.log.size + value_log_size + 2 * self->checkpoint_slot_blks > storage->num_blocks) {
         fprintf(stderr, "kv_data_store_init: Not enough space.\n");
         exit(-1);
     }
     printf("bucket log size: %lf GB\n", ((double)self->bucket_log.log.size) * storage->block_size / (1 << 30));
     printf("value log size: %lf GB\n", ((double)value_log_size) * storage->block_size / (1 << 30));
+    printf("checkpoint size: %lf GB\n", ((double)2 * self->checkpoint_slot_blks) * storage->block_size / (1 << 30));
     self->ds_queue = ds_queue;
     self->ds_id = ds_id;
-    self->ds_queue->q_info[self->ds_id] = (struct kv_ds_q_info){.cap = 1024, .size = 0};
+    self->ds_queue->q_info[self->ds_id] = (struct kv_ds_q_info){.cap = ds_queue->cost_model[ds_id].cap, .size = 0};
+    // the compaction of both logs shares the I/O budget of the data store.
+    kv_ds_io_sched_init(&self->io_sched, ds_queue, ds_id);
+    self->bucket_log.io_sched = self->value_log.io_sched = &self->io_sched;
     self->dirty_set = kv_bucket_key_set_init();
+    self->key_index = NULL;
     self->q = kv_malloc(sizeof(struct queue_head));
     STAILQ_INIT((struct queue_head *)self->q);
+    self->checkpoint_seq = self->checkpoint_elapsed = 0;
+    self->checkpoint_period = KV_DATA_STORE_CHECKPOINT_PERIOD;
+    self->checkpoint_tail = self->bucket_log.tail;
+    self->is_checkpointing = false;
+    self->checkpoint_pending = NULL;
+    self->checkpoint_poller = kv_app_poller_register(checkpoint_poller, self, CHECKPOINT_POLL_PERIOD);
 }
 
+// no checkpoint or recovery may be in flight.
 void kv_data_store_fini(struct kv_data_store *self) {
+    kv_app_poller_unregister(&self->checkpoint_poller);
     kv_bucket_log_fini(&self->bucket_log);
     kv_value_log_fini(&self->value_log);
     kv_bucket_key_set_fini(self->dirty_set);
+    if (self->key_index) kv_bucket_key_index_fini(self->key_index);
     kv_free(self->q);
 }
 
@@ -105,32 +517,99 @@ static void print_buckets(struct kv_bucket *buckets) {
 }
 
 //--- find item ---
+// A short key is found in the bucket right away. A long key is matched on its fingerprint first, then each match is
+// checked against the full key read back from the value log.
+typedef void (*find_item_cb)(bool success, struct kv_item *item, void *cb_arg);
+struct find_item_ctx {
+    struct kv_data_store *self;
+    struct kv_bucket_segment *seg;
+    uint8_t *key;
+    uint8_t key_length;
+    uint8_t fingerprint[KV_MAX_KEY_LENGTH];
+    uint8_t buf[UINT8_MAX];
+    struct kv_item *item;
+    find_item_cb cb;
+    void *cb_arg;
+};
+static __thread struct kv_freelist find_item_ctxs;
+
+// the bytes of the long key stored before the value of the item.
+static inline uint32_t item_key_size(struct kv_item *item) {
+    return kv_item_key_in_log(item) ? kv_long_key_size(item->key_length) : 0;
+}
+
+// an expired item reads as a miss until a compaction drops it, the clock is only read for the items that expire.
+static inline bool item_expired(struct kv_data_store *self, struct kv_item *item) {
+    return kv_item_expire(item) != 0 && self->bucket_log.clock && kv_item_expired(item, self->bucket_log.clock());
+}
+
+// also called on an update, as whether the key is in the value log depends on the expiry.
+static inline void item_key_fill(struct kv_item *item, uint8_t *key, uint8_t key_length, uint32_t expire) {
+    item->key_length = key_length;
+    item->key_in_log = !kv_is_long_key(key_length) && kv_key_in_log(key_length, expire);
+    if (kv_is_long_key(key_length))
+        kv_long_key_fingerprint(item->key, key, key_length);
+    else
+        kv_memcpy(item->key, key, item->key_in_log ? KV_ITEM_KEY_ROOM : key_length);
+    kv_item_set_expire(item, expire);
+}
+
+static void find_long_key(struct find_item_ctx *ctx);
+static void find_long_key_cb(bool success, void *arg) {
+    struct find_item_ctx *ctx = arg;
+    if (success && kv_memcmp8(ctx->buf, ctx->key, ctx->key_length)) {
+        find_long_key(ctx);
+        return;
+    }
+    ctx->cb(success, success ? ctx->item : NULL, ctx->cb_arg);
+    kv_freelist_put(&find_item_ctxs, ctx);
+}
+
+static void find_long_key(struct find_item_ctx *ctx) {
+    uint8_t room = KV_ITEM_KEY_ROOM;
+    while ((ctx->item = kv_bucket_seg_find_next(ctx->seg, ctx->fingerprint, ctx->key_length, ctx->item))) {
+        if (kv_item_key_in_log(ctx->item)) {
+            kv_value_log_read(&ctx->self->value_log, ctx->item->value_offset, ctx->buf, ctx->key_length, find_long_key_cb,
+                              ctx);
+            return;
+        }
+        // the rest of the key is in the item.
+        if (!kv_memcmp8(ctx->item->key + room, ctx->key + room, ctx->key_length - room)) break;
+    }
+    ctx->cb(true, ctx->item, ctx->cb_arg);
+    kv_freelist_put(&find_item_ctxs, ctx);
+}
 
 static void find_item_plus(struct kv_data_store *self, struct kv_bucket_segment *seg, uint8_t *key, uint8_t key_length,
-                           struct kv_item **located_item) {
-    assert(located_item);
-    struct kv_bucket_chain_entry *ce;
-    TAILQ_FOREACH(ce, &seg->chain, entry) {
-        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket)
-            for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item) {
-                // if(KV_EMPTY_ITEM(item)) continue; // empty item key_length != ctx->key_length
-                if (compare_keys(item->key, item->key_length, key, key_length)) {
-                    // job done!
-                    *located_item = item;
-                    return;
-                }
-            }
+                           find_item_cb cb, void *cb_arg) {
+    if (key_length <= KV_ITEM_KEY_ROOM) {
+        cb(true, kv_bucket_seg_find(seg, key, key_length), cb_arg);
+        return;
     }
-    *located_item = NULL;
+    struct find_item_ctx *ctx = kv_freelist_get(&find_item_ctxs, sizeof(struct find_item_ctx));
+    ctx->self = self;
+    ctx->seg = seg;
+    ctx->key = key;
+    ctx->key_length = key_length;
+    ctx->item = NULL;
+    ctx->cb = cb;
+    ctx->cb_arg = cb_arg;
+    if (kv_is_long_key(key_length))
+        kv_long_key_fingerprint(ctx->fingerprint, key, key_length);
+    else
+        kv_memcpy(ctx->fingerprint, key, KV_ITEM_KEY_ROOM);
+    find_long_key(ctx);
 }
 
 // --- find empty ---
 static struct kv_item *find_empty(struct kv_data_store *self, struct kv_bucket_segment *seg) {
+    uint8_t *tags = kv_bucket_seg_tags(seg);
     struct kv_bucket_chain_entry *ce;
     TAILQ_FOREACH(ce, &seg->chain, entry) {
-        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket)
-            for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item)
-                if (KV_EMPTY_ITEM(item)) return item;
+        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket) {
+            uint32_t mask = kv_tag_match(tags + bucket->chain_index * KV_ITEM_PER_BUCKET, KV_TAG_EMPTY, 1);
+            if (mask) return bucket->items + __builtin_ctz(mask);
+        }
     }
     if (kv_bucket_alloc_extra(&self->bucket_log, seg)) {
         ce = TAILQ_LAST(&seg->chain, kv_bucket_chain);
@@ -142,22 +621,27 @@ static struct kv_item *find_empty(struct kv_data_store *self, struct kv_bucket_s
 static void fill_the_hole(struct kv_data_store *self, struct kv_bucket_segment *seg) {
     if (TAILQ_FIRST(&seg->chain)->bucket->chain_length == 1) return;
 
+    uint8_t *tags = kv_bucket_seg_tags(seg);
     struct kv_bucket_chain_entry *ce = TAILQ_LAST(&seg->chain, kv_bucket_chain);
     struct kv_bucket *last_bucket = &ce->bucket[ce->len - 1];
-    struct kv_item *item_to_move = last_bucket->items;
+    uint8_t *last_tags = tags + last_bucket->chain_index * KV_ITEM_PER_BUCKET;
+    uint32_t to_move = ~kv_tag_match(last_tags, KV_TAG_EMPTY, 1) & ((1u << KV_ITEM_PER_BUCKET) - 1);
     TAILQ_FOREACH(ce, &seg->chain, entry) {
-        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len && bucket != last_bucket; ++bucket)
-            for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item)
-                if (KV_EMPTY_ITEM(item)) {
-                    while (KV_EMPTY_ITEM(item_to_move)) {
-                        if (++item_to_move - last_bucket->items == KV_ITEM_PER_BUCKET) {
-                            kv_bucket_free_extra(seg);
-                            return;
-                        }
-                    }
-                    *item = *item_to_move;
-                    item_to_move->key_length = 0;
-                };
+        for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len && bucket != last_bucket; ++bucket) {
+            uint8_t *bucket_tags = tags + bucket->chain_index * KV_ITEM_PER_BUCKET;
+            for (uint32_t holes = kv_tag_match(bucket_tags, KV_TAG_EMPTY, 1); holes; holes &= holes - 1) {
+                if (to_move == 0) {
+                    kv_bucket_free_extra(seg);
+                    return;
+                }
+                uint32_t i = __builtin_ctz(holes), j = __builtin_ctz(to_move);
+                to_move &= to_move - 1;
+                bucket->items[i] = last_bucket->items[j];
+                bucket_tags[i] = last_tags[j];
+                last_bucket->items[j].key_length = 0;
+                last_tags[j] = KV_TAG_EMPTY;
+            }
+        }
     }
 }
 
@@ -166,11 +650,16 @@ struct buffered_set_ctx {
     uint32_t buffer_size;
     uint8_t **key;
     uint8_t *key_length;
-    uint8_t value[KV_BLK_SIZE];
+    uint8_t *value;  // the packed batch, from the DMA buffer pool
+    uint64_t value_size;
     uint32_t *value_length;
     uint64_t *value_offset;
     uint64_t *bucket_id;
     struct kv_bucket_segment *seg;
+    uint32_t *record_length;  // value_length, or the lengths of the long keys and values if the batch has any
+    uint8_t *codec;           // per value, NULL if none is compressed
+    uint32_t *expire;         // per value, NULL if none expires
+    uint32_t index;           // the item being looked up
 };
 
 struct set_ctx {
@@ -187,14 +676,20 @@ struct set_ctx {
     struct kv_bucket_segment seg;
     uint64_t value_offset;
     bool success;
+    uint8_t *record;  // the long key followed by the value, from the DMA buffer pool
+    uint64_t record_size;
+    uint8_t codec;
+    uint32_t expire;
     struct buffered_set_ctx set_ctx_buffer;
 };
+static __thread struct kv_freelist set_ctxs;
 
 void kv_data_store_set_commit(kv_data_store_ctx arg, bool success) {
     struct set_ctx *ctx = arg;
     if (success) kv_bucket_seg_commit(&ctx->self->bucket_log, &ctx->seg);
+    if (success && ctx->self->key_index) kv_bucket_key_index_add(ctx->self->key_index, ctx->key, ctx->key_length);
     kv_bucket_unlock(&ctx->self->bucket_log, &ctx->segs);
-    kv_free(ctx);
+    kv_freelist_put(&set_ctxs, ctx);
 }
 
 void kv_data_store_set_buffered_commit(kv_data_store_ctx arg, bool success) {
@@ -203,37 +698,53 @@ void kv_data_store_set_buffered_commit(kv_data_store_ctx arg, bool success) {
     TAILQ_FOREACH(seg, &ctx->segs, entry) {
         if (success) kv_bucket_seg_commit(&ctx->self->bucket_log, seg);
     }
+    for (uint32_t i = 0; success && ctx->self->key_index && i < ctx->set_ctx_buffer.buffer_size; ++i)
+        kv_bucket_key_index_add(ctx->self->key_index, ctx->set_ctx_buffer.key[i], ctx->set_ctx_buffer.key_length[i]);
     kv_bucket_unlock(&ctx->self->bucket_log, &ctx->segs);
-    kv_free(ctx);
+    kv_freelist_put(&set_ctxs, ctx);
 }
 
 static void set_finish_cb(bool success, void *arg) {
     struct set_ctx *ctx = arg;
-    success = ctx->success && success;
+    success = ctx->success = ctx->success && success;
     if (--ctx->io_cnt) return;  // sync
+    // the buckets are locked and updated, the compaction may move the values from now on.
+    kv_value_log_commit(&ctx->self->value_log, ctx->set_ctx_buffer.value ? ctx->set_ctx_buffer.value_offset[0] : ctx->value_offset);
+    if (ctx->set_ctx_buffer.value) {
+        kv_storage_pool_free(ctx->set_ctx_buffer.value, ctx->set_ctx_buffer.value_size);
+        ctx->set_ctx_buffer.value = NULL;
+        if (ctx->set_ctx_buffer.record_length != ctx->set_ctx_buffer.value_length) kv_free(ctx->set_ctx_buffer.record_length);
+        kv_free(ctx->set_ctx_buffer.codec);
+    }
+    if (ctx->record) {
+        kv_storage_pool_free(ctx->record, ctx->record_size);
+        ctx->record = NULL;
+    }
     if (ctx->cb) ctx->cb(success, ctx->cb_arg);
 }
 
-static void set_lock_cb(void *arg) {
+static void set_find_item_cb(bool success, struct kv_item *located_item, void *arg) {
     struct set_ctx *ctx = arg;
-    if (ctx->success == false) {
+    if (!success) {
         set_finish_cb(false, arg);
         return;
     }
-    struct kv_item *located_item;
-    find_item_plus(ctx->self, &ctx->seg, ctx->key, ctx->key_length, &located_item);
     if (located_item) {  // update
         ctx->seg.dirty = true;
+        kv_value_log_discard(&ctx->self->value_log, located_item->value_offset, located_item->value_length);
+        item_key_fill(located_item, ctx->key, ctx->key_length, ctx->expire);
         located_item->value_length = ctx->value_length;
         located_item->value_offset = ctx->value_offset;
+        located_item->codec = ctx->codec;
         kv_bucket_seg_put(&ctx->self->bucket_log, &ctx->seg, set_finish_cb, ctx);
     } else {  // create
         if ((located_item = find_empty(ctx->self, &ctx->seg))) {
             ctx->seg.dirty = true;
-            located_item->key_length = ctx->key_length;
-            kv_memcpy(located_item->key, ctx->key, ctx->key_length);
+            item_key_fill(located_item, ctx->key, ctx->key_length, ctx->expire);
+            kv_bucket_item_tag_update(&ctx->seg, located_item);
             located_item->value_length = ctx->value_length;
             located_item->value_offset = ctx->value_offset;
+            located_item->codec = ctx->codec;
             kv_bucket_seg_put(&ctx->self->bucket_log, &ctx->seg, set_finish_cb, ctx);
         } else {
             fprintf(stderr, "set_find_item_cb: No more bucket available.\n");
@@ -242,48 +753,84 @@ static void set_lock_cb(void *arg) {
     }
 }
 
-static void buffered_set_lock_cb(void *arg) {
+static void set_lock_cb(void *arg) {
     struct set_ctx *ctx = arg;
     if (ctx->success == false) {
         set_finish_cb(false, arg);
         return;
     }
-    for (uint32_t i = 0; i < ctx->set_ctx_buffer.buffer_size; ++i) {
-        struct kv_bucket_segment *seg;
-        TAILQ_FOREACH(seg, &ctx->segs, entry) {
-            if (seg->bucket_id == ctx->set_ctx_buffer.bucket_id[i]) {
-                break;
-            }
+    find_item_plus(ctx->self, &ctx->seg, ctx->key, ctx->key_length, set_find_item_cb, ctx);
+}
+
+// the items of a batch are looked up one after another, as a long key may have to be read back.
+static struct kv_bucket_segment *buffered_set_seg(struct set_ctx *ctx) {
+    struct kv_bucket_segment *seg;
+    TAILQ_FOREACH(seg, &ctx->segs, entry) {
+        if (seg->bucket_id == ctx->set_ctx_buffer.bucket_id[ctx->set_ctx_buffer.index]) {
+            break;
         }
-        assert(seg);
-        struct kv_item *located_item;
-        find_item_plus(ctx->self, seg, ctx->set_ctx_buffer.key[i], ctx->set_ctx_buffer.key_length[i], &located_item);
-        if (located_item) {  // update
+    }
+    assert(seg);
+    return seg;
+}
+
+static inline uint32_t buffered_expire(struct set_ctx *ctx, uint32_t i) {
+    return ctx->set_ctx_buffer.expire ? ctx->set_ctx_buffer.expire[i] : 0;
+}
+
+static void buffered_set_find_item_cb(bool success, struct kv_item *located_item, void *arg) {
+    struct set_ctx *ctx = arg;
+    uint32_t i = ctx->set_ctx_buffer.index;
+    struct kv_bucket_segment *seg = buffered_set_seg(ctx);
+    if (!success) {
+        set_finish_cb(false, arg);
+        return;
+    }
+    if (located_item) {  // update
+        seg->dirty = true;
+        kv_value_log_discard(&ctx->self->value_log, located_item->value_offset, located_item->value_length);
+        item_key_fill(located_item, ctx->set_ctx_buffer.key[i], ctx->set_ctx_buffer.key_length[i], buffered_expire(ctx, i));
+        located_item->value_length = ctx->set_ctx_buffer.record_length[i];
+        located_item->value_offset = ctx->set_ctx_buffer.value_offset[i];
+        located_item->codec = ctx->set_ctx_buffer.codec ? ctx->set_ctx_buffer.codec[i] : KV_CODEC_NONE;
+    } else {  // create
+        if ((located_item = find_empty(ctx->self, seg))) {
             seg->dirty = true;
-            located_item->value_length = ctx->set_ctx_buffer.value_length[i];
+            item_key_fill(located_item, ctx->set_ctx_buffer.key[i], ctx->set_ctx_buffer.key_length[i], buffered_expire(ctx, i));
+            kv_bucket_item_tag_update(seg, located_item);
+            located_item->value_length = ctx->set_ctx_buffer.record_length[i];
             located_item->value_offset = ctx->set_ctx_buffer.value_offset[i];
-        } else {  // create
-            if ((located_item = find_empty(ctx->self, seg))) {
-                ctx->seg.dirty = true;
-                located_item->key_length = ctx->set_ctx_buffer.key_length[i];
-                kv_memcpy(located_item->key, ctx->set_ctx_buffer.key[i], ctx->set_ctx_buffer.key_length[i]);
-                located_item->value_length = ctx->set_ctx_buffer.value_length[i];
-                located_item->value_offset = ctx->set_ctx_buffer.value_offset[i];
-            } else {
-                set_finish_cb(false, arg);
-                return;
-            }
+            located_item->codec = ctx->set_ctx_buffer.codec ? ctx->set_ctx_buffer.codec[i] : KV_CODEC_NONE;
+        } else {
+            set_finish_cb(false, arg);
+            return;
         }
     }
-    kv_bucket_seg_put_bulk(&ctx->self->bucket_log, &ctx->segs, set_finish_cb, ctx);
+    if (++ctx->set_ctx_buffer.index == ctx->set_ctx_buffer.buffer_size) {
+        kv_bucket_seg_put_bulk(&ctx->self->bucket_log, &ctx->segs, set_finish_cb, ctx);
+        return;
+    }
+    i = ctx->set_ctx_buffer.index;
+    find_item_plus(ctx->self, buffered_set_seg(ctx), ctx->set_ctx_buffer.key[i], ctx->set_ctx_buffer.key_length[i],
+                   buffered_set_find_item_cb, ctx);
 }
 
-static void set_start(void *arg) {
+static void buffered_set_lock_cb(void *arg) {
+    struct set_ctx *ctx = arg;
+    if (ctx->success == false) {
+        set_finish_cb(false, arg);
+        return;
+    }
+    ctx->set_ctx_buffer.index = 0;
+    find_item_plus(ctx->self, buffered_set_seg(ctx), ctx->set_ctx_buffer.key[0], ctx->set_ctx_buffer.key_length[0],
+                   buffered_set_find_item_cb, ctx);
+}
+
+static void set_write(void *arg) {
     struct set_ctx *ctx = arg;
     ctx->io_cnt = 2;
     ctx->success = true;
-    ctx->value_offset = kv_value_log_offset(&ctx->self->value_log);
-    kv_value_log_write(&ctx->self->value_log, ctx->bucket_id, ctx->value, ctx->value_length, set_finish_cb, ctx);
+    ctx->value_offset = kv_value_log_write(&ctx->self->value_log, ctx->bucket_id, ctx->value, ctx->value_length, set_finish_cb, ctx);
 
     TAILQ_INIT(&ctx->segs);
     kv_bucket_seg_init(&ctx->seg, ctx->bucket_id);
@@ -291,22 +838,48 @@ static void set_start(void *arg) {
     kv_bucket_lock(&ctx->self->bucket_log, &ctx->segs, set_lock_cb, ctx);
 }
 
+static void set_start(void *arg) {
+    struct set_ctx *ctx = arg;
+    kv_value_log_wait_space(&ctx->self->value_log, ctx->value_length, set_write, ctx);
+}
+
 kv_data_store_ctx kv_data_store_set(struct kv_data_store *self, uint8_t *key, uint8_t key_length, uint8_t *value, uint32_t value_length,
-                                    kv_data_store_cb cb, void *cb_arg) {
-    struct set_ctx *ctx = kv_malloc(sizeof(struct set_ctx));
+                                    uint32_t expire, kv_data_store_cb cb, void *cb_arg) {
+    struct set_ctx *ctx = kv_freelist_get(&set_ctxs, sizeof(struct set_ctx));
     *ctx = (struct set_ctx){self, key, key_length, value, value_length, cb, cb_arg};
+    ctx->expire = expire;
+    uint32_t key_size = kv_key_in_log(key_length, expire) ? kv_long_key_size(key_length) : 0;
+    if (key_size || self->value_log.compress) {
+        // the value is compressed straight into the record.
+        ctx->record_size = (key_size + value_length + self->value_log.blk_mask) & ~self->value_log.blk_mask;
+        ctx->record = kv_storage_pool_malloc(self->value_log.storage, ctx->record_size);
+        uint32_t length = self->value_log.compress ? kv_value_log_compress(&self->value_log, value, value_length, ctx->record + key_size) : 0;
+        if (length) {
+            ctx->codec = KV_CODEC_LZ;
+            ctx->value_length = length;
+        } else if (key_size) {
+            kv_memcpy(ctx->record + key_size, value, value_length);
+        }
+        if (key_size) kv_memcpy(ctx->record, key, key_length);
+        if (key_size || length) {
+            ctx->value = ctx->record;
+            ctx->value_length += key_size;
+        } else {  // written raw from the buffer of the caller
+            kv_storage_pool_free(ctx->record, ctx->record_size);
+            ctx->record = NULL;
+        }
+    }
     ctx->bucket_id = kv_data_store_bucket_id(self, key);
     ctx->cb = dequeue;
     ctx->cb_arg = enqueue(self, KV_DS_SET, set_start, ctx, cb, cb_arg);
     return ctx;
 }
 
-static void buffered_set_start(void *arg) {
+static void buffered_set_write(void *arg) {
     struct set_ctx *ctx = arg;
     ctx->io_cnt = 2;
     ctx->success = true;
-    kv_value_log_buffered_offset(&ctx->self->value_log, ctx->set_ctx_buffer.value_length, ctx->set_ctx_buffer.value_offset, ctx->set_ctx_buffer.buffer_size);
-    kv_value_log_buffered_write(&ctx->self->value_log, ctx->set_ctx_buffer.value_offset, ctx->set_ctx_buffer.bucket_id, ctx->set_ctx_buffer.value, ctx->set_ctx_buffer.value_length, ctx->set_ctx_buffer.buffer_size, set_finish_cb, ctx);
+    kv_value_log_buffered_write(&ctx->self->value_log, ctx->set_ctx_buffer.value_offset, ctx->set_ctx_buffer.bucket_id, ctx->set_ctx_buffer.value, ctx->set_ctx_buffer.record_length, ctx->set_ctx_buffer.buffer_size, set_finish_cb, ctx);
 
     TAILQ_INIT(&ctx->segs);
     for (uint32_t i = 0; i < ctx->set_ctx_buffer.buffer_size; ++i) {
@@ -322,24 +895,74 @@ static void buffered_set_start(void *arg) {
     kv_bucket_lock(&ctx->self->bucket_log, &ctx->segs, buffered_set_lock_cb, ctx);
 }
 
+static void buffered_set_start(void *arg) {
+    struct set_ctx *ctx = arg;
+    kv_value_log_wait_space(&ctx->self->value_log, ctx->set_ctx_buffer.value_size, buffered_set_write, ctx);
+}
+
 kv_data_store_ctx kv_data_store_buffered_set(struct kv_data_store *self, uint8_t *key[], uint8_t key_length[], uint8_t *value[], uint32_t value_length[],
-                                             uint64_t value_offset[], uint64_t bucket_id[], struct kv_bucket_segment seg[], uint32_t buffer_size,
+                                             uint32_t expire[], uint64_t value_offset[], uint64_t bucket_id[], struct kv_bucket_segment seg[], uint32_t buffer_size,
                                              kv_data_store_cb cb, void *cb_arg) {
-    struct set_ctx *ctx = kv_malloc(sizeof(struct set_ctx));
+    struct set_ctx *ctx = kv_freelist_get(&set_ctxs, sizeof(struct set_ctx));
     ctx->self = self;
     ctx->set_ctx_buffer.key = key;
     ctx->set_ctx_buffer.key_length = key_length;
     ctx->set_ctx_buffer.value_length = value_length;
+    ctx->set_ctx_buffer.expire = expire;
     ctx->set_ctx_buffer.value_offset = value_offset;
     ctx->set_ctx_buffer.bucket_id = bucket_id;
     ctx->set_ctx_buffer.seg = seg;
     ctx->set_ctx_buffer.buffer_size = buffer_size;
-    uint64_t offset = 0;
+    ctx->set_ctx_buffer.record_length = value_length;
+    ctx->set_ctx_buffer.codec = NULL;
+    ctx->record = NULL;
+    // the values are compressed into a scratch buffer first, as the layout of the batch depends on their lengths.
+    uint8_t *compressed = NULL;
+    uint32_t *compressed_offset = NULL;
+    if (self->value_log.compress) {
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < buffer_size; ++i) bytes += value_length[i];
+        compressed = kv_malloc(bytes ? bytes : 1);
+        compressed_offset = kv_malloc(buffer_size * sizeof(uint32_t));
+        ctx->set_ctx_buffer.codec = kv_calloc(buffer_size, sizeof(uint8_t));
+        ctx->set_ctx_buffer.record_length = kv_malloc(buffer_size * sizeof(uint32_t));
+        kv_memcpy(ctx->set_ctx_buffer.record_length, value_length, buffer_size * sizeof(uint32_t));
+        for (uint32_t i = 0, off = 0; i < buffer_size; ++i) {
+            uint32_t length = kv_value_log_compress(&self->value_log, value[i], value_length[i], compressed + off);
+            compressed_offset[i] = off;
+            if (length) {
+                ctx->set_ctx_buffer.codec[i] = KV_CODEC_LZ;
+                ctx->set_ctx_buffer.record_length[i] = length;
+                off += length;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < buffer_size; ++i) {
+        if (!kv_key_in_log(key_length[i], expire ? expire[i] : 0)) continue;
+        if (ctx->set_ctx_buffer.record_length == value_length) {
+            ctx->set_ctx_buffer.record_length = kv_malloc(buffer_size * sizeof(uint32_t));
+            kv_memcpy(ctx->set_ctx_buffer.record_length, value_length, buffer_size * sizeof(uint32_t));
+        }
+        ctx->set_ctx_buffer.record_length[i] += kv_long_key_size(key_length[i]);
+    }
+    uint64_t batch_size = kv_value_log_buffered_layout(ctx->set_ctx_buffer.record_length, value_offset, buffer_size);
+    ctx->set_ctx_buffer.value_size = (batch_size + self->value_log.blk_mask) & ~self->value_log.blk_mask;
+    ctx->set_ctx_buffer.value = kv_storage_pool_malloc(self->value_log.storage, ctx->set_ctx_buffer.value_size);
     for (uint32_t i = 0; i < ctx->set_ctx_buffer.buffer_size; ++i) {
         ctx->set_ctx_buffer.bucket_id[i] = kv_data_store_bucket_id(self, key[i]);
-        memcpy(ctx->set_ctx_buffer.value + offset, value[i], value_length[i]);
-        offset += value_length[i];
+        uint8_t *record = ctx->set_ctx_buffer.value + value_offset[i];
+        uint32_t key_size = 0;
+        if (kv_key_in_log(key_length[i], expire ? expire[i] : 0)) {
+            kv_memcpy(record, key[i], key_length[i]);
+            key_size = kv_long_key_size(key_length[i]);
+        }
+        if (ctx->set_ctx_buffer.codec && ctx->set_ctx_buffer.codec[i] != KV_CODEC_NONE)
+            kv_memcpy(record + key_size, compressed + compressed_offset[i], ctx->set_ctx_buffer.record_length[i] - key_size);
+        else
+            kv_memcpy(record + key_size, value[i], value_length[i]);
     }
+    kv_free(compressed);
+    kv_free(compressed_offset);
     ctx->cb = dequeue;
     ctx->cb_arg = enqueue(self, KV_DS_SET, buffered_set_start, ctx, cb, cb_arg);
     return ctx;
@@ -356,23 +979,31 @@ struct get_ctx {
     struct kv_bucket_segment seg;
     struct kv_bucket_meta *meta;
 };
+static __thread struct kv_freelist get_ctxs;
 
-static void get_seg_cb(bool success, void *arg) {
+static void get_find_item_cb(bool success, struct kv_item *located_item, void *arg) {
     struct get_ctx *ctx = arg;
-    if (success) {
-        struct kv_item *located_item;
-        find_item_plus(ctx->self, &ctx->seg, ctx->key, ctx->key_length, &located_item);
-        if (located_item) {
-            *ctx->value_length = located_item->value_length;
-            kv_value_log_read(&ctx->self->value_log, located_item->value_offset, ctx->value, located_item->value_length, ctx->cb,
-                              ctx->cb_arg);
-        } else {
-            success = false;
-        }
+    if (success && located_item && item_expired(ctx->self, located_item)) located_item = NULL;
+    if (success && located_item) {
+        uint32_t key_size = item_key_size(located_item);
+        kv_value_log_read_value(&ctx->self->value_log, located_item->value_offset + key_size,
+                                located_item->value_length - key_size, located_item->codec, ctx->value,
+                                ctx->value_length, ctx->cb, ctx->cb_arg);
+    } else if (success) {
+        *ctx->value_length = 0;
+        success = false;
     }
     if (!success && ctx->cb) ctx->cb(false, ctx->cb_arg);
     kv_bucket_seg_cleanup(&ctx->self->bucket_log, &ctx->seg);
-    kv_free(ctx);
+    kv_freelist_put(&get_ctxs, ctx);
+}
+
+static void get_seg_cb(bool success, void *arg) {
+    struct get_ctx *ctx = arg;
+    if (success)
+        find_item_plus(ctx->self, &ctx->seg, ctx->key, ctx->key_length, get_find_item_cb, ctx);
+    else
+        get_find_item_cb(false, NULL, ctx);
 }
 
 static void get_read_bucket(void *arg) {
@@ -383,13 +1014,268 @@ static void get_read_bucket(void *arg) {
 
 void kv_data_store_get(struct kv_data_store *self, uint8_t *key, uint8_t key_length, uint8_t *value, uint32_t *value_length,
                        struct kv_bucket_meta *meta, kv_data_store_cb cb, void *cb_arg) {
-    struct get_ctx *ctx = kv_malloc(sizeof(struct get_ctx));
+    struct get_ctx *ctx = kv_freelist_get(&get_ctxs, sizeof(struct get_ctx));
     *ctx = (struct get_ctx){self, key, key_length, value, value_length};
     ctx->meta = meta;
     ctx->cb = dequeue;
     ctx->cb_arg = enqueue(self, KV_DS_GET, get_read_bucket, ctx, cb, cb_arg);
 }
 
+// --- multi get ---
+struct multi_get_key {
+    struct multi_get_ctx *ctx;
+    uint8_t *key;
+    uint8_t key_length;
+    uint32_t seg;
+    bool found;
+    uint8_t codec;
+    uint64_t value_offset;
+    uint32_t value_length;
+    uint8_t *record;  // a compressed value, read before the records are packed
+    uint32_t record_length;
+};
+struct multi_get_ctx {
+    struct kv_data_store *self;
+    uint32_t n, seg_num, pending;
+    bool success;
+    struct multi_get_key *keys;
+    uint8_t *key_buf;
+    struct kv_bucket_segment *segs;
+    struct kv_value_log_read_req *reqs;
+    uint8_t *records;  // of the compressed values, DMA memory as a large one is read straight into it
+    uint32_t records_size;
+    uint8_t *buf;
+    uint32_t *buf_len, *num;
+    kv_data_store_cb cb;
+    void *cb_arg;
+};
+
+static void multi_get_finish(struct multi_get_ctx *ctx, bool success) {
+    if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+    if (ctx->records) kv_storage_pool_free(ctx->records, ctx->records_size);
+    kv_free(ctx->reqs);
+    kv_free(ctx->segs);
+    kv_free(ctx->key_buf);
+    kv_free(ctx->keys);
+    kv_free(ctx);
+}
+
+static void multi_get_read_cb(bool success, void *arg) { multi_get_finish(arg, success); }
+
+static void multi_get_pack(struct multi_get_ctx *ctx) {
+    uint32_t used = 0, req_num = 0, i = 0;
+    for (; i < ctx->n; ++i) {
+        struct multi_get_key *key = ctx->keys + i;
+        uint32_t value_length = key->found ? key->value_length : 0;
+        if (used + kv_data_store_scan_record_size(key->key_length, value_length) > *ctx->buf_len) break;
+        struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)(ctx->buf + used);
+        record->value_length = value_length;
+        record->key_length = key->key_length;
+        kv_memcpy(record->data, key->key, key->key_length);
+        if (value_length && key->codec != KV_CODEC_NONE) {
+            if (!kv_value_log_decompress(&ctx->self->value_log, key->record, key->record_length,
+                                         kv_data_store_scan_value(record))) {
+                multi_get_finish(ctx, false);
+                return;
+            }
+        } else if (value_length)
+            ctx->reqs[req_num++] = (struct kv_value_log_read_req){key->value_offset, kv_data_store_scan_value(record),
+                                                                  value_length};
+        used += kv_data_store_scan_record_size(record->key_length, record->value_length);
+    }
+    *ctx->buf_len = used;
+    *ctx->num = i;
+    if (i == 0) {
+        multi_get_finish(ctx, false);
+        return;
+    }
+    kv_value_log_read_bulk(&ctx->self->value_log, ctx->reqs, req_num, multi_get_read_cb, ctx);
+}
+
+// the lengths of the compressed values are only known once their records are read.
+static void multi_get_records_cb(bool success, void *arg) {
+    struct multi_get_ctx *ctx = arg;
+    if (!success) {
+        multi_get_finish(ctx, false);
+        return;
+    }
+    for (struct multi_get_key *key = ctx->keys; key < ctx->keys + ctx->n; ++key) {
+        if (!key->found || key->codec == KV_CODEC_NONE) continue;
+        key->record_length = key->value_length;
+        key->value_length = kv_value_log_codec_length(key->record);
+    }
+    multi_get_pack(ctx);
+}
+
+static void multi_get_read_records(struct multi_get_ctx *ctx) {
+    for (uint32_t i = 0; i < ctx->seg_num; ++i) kv_bucket_seg_cleanup(&ctx->self->bucket_log, ctx->segs + i);
+    if (!ctx->success) {
+        multi_get_finish(ctx, false);
+        return;
+    }
+    uint32_t bytes = 0, req_num = 0;
+    for (struct multi_get_key *key = ctx->keys; key < ctx->keys + ctx->n; ++key)
+        if (key->found && key->codec != KV_CODEC_NONE) bytes += key->value_length;
+    if (bytes == 0) {
+        multi_get_pack(ctx);
+        return;
+    }
+    ctx->records_size = bytes;
+    ctx->records = kv_storage_pool_malloc(ctx->self->value_log.storage, bytes);
+    for (struct multi_get_key *key = ctx->keys; key < ctx->keys + ctx->n; ++key) {
+        if (!key->found || key->codec == KV_CODEC_NONE) continue;
+        key->record = ctx->records + (bytes -= key->value_length);
+        ctx->reqs[req_num++] = (struct kv_value_log_read_req){key->value_offset, key->record, key->value_length};
+    }
+    kv_value_log_read_bulk(&ctx->self->value_log, ctx->reqs, req_num, multi_get_records_cb, ctx);
+}
+
+static void multi_get_find_item_cb(bool success, struct kv_item *located_item, void *arg) {
+    struct multi_get_key *key = arg;
+    struct multi_get_ctx *ctx = key->ctx;
+    if (success && located_item && item_expired(ctx->self, located_item)) located_item = NULL;
+    if (success && located_item) {
+        uint32_t key_size = item_key_size(located_item);
+        key->found = true;
+        key->codec = located_item->codec;
+        key->value_offset = located_item->value_offset + key_size;
+        key->value_length = located_item->value_length - key_size;
+    }
+    ctx->success = ctx->success && success;
+    if (--ctx->pending == 0) multi_get_read_records(ctx);
+}
+
+static void multi_get_seg_cb(bool success, void *arg) {
+    struct multi_get_ctx *ctx = arg;
+    ctx->success = success;
+    ctx->pending = ctx->n + 1;
+    for (uint32_t i = 0; i < ctx->n; ++i) {
+        struct multi_get_key *key = ctx->keys + i;
+        if (success)
+            find_item_plus(ctx->self, ctx->segs + key->seg, key->key, key->key_length, multi_get_find_item_cb, key);
+        else
+            multi_get_find_item_cb(false, NULL, key);
+    }
+    if (--ctx->pending == 0) multi_get_read_records(ctx);
+}
+
+static void multi_get_read_buckets(void *arg) {
+    struct multi_get_ctx *ctx = arg;
+    struct kv_bucket_segments segs;
+    TAILQ_INIT(&segs);
+    for (uint32_t i = 0; i < ctx->n; ++i) {
+        struct multi_get_key *key = ctx->keys + i;
+        uint64_t bucket_id = kv_data_store_bucket_id(ctx->self, key->key);
+        for (key->seg = 0; key->seg < ctx->seg_num; ++key->seg)
+            if (ctx->segs[key->seg].bucket_id == bucket_id) break;
+        if (key->seg == ctx->seg_num) {
+            kv_bucket_seg_init(ctx->segs + ctx->seg_num, bucket_id);
+            TAILQ_INSERT_TAIL(&segs, ctx->segs + ctx->seg_num, entry);
+            ctx->seg_num++;
+        }
+    }
+    kv_bucket_seg_get_bulk(&ctx->self->bucket_log, &segs, multi_get_seg_cb, ctx);
+}
+
+void kv_data_store_multi_get(struct kv_data_store *self, uint8_t *key[], uint8_t key_length[], uint32_t *num,
+                             uint8_t *buf, uint32_t *buf_len, kv_data_store_cb cb, void *cb_arg) {
+    struct multi_get_ctx *ctx = kv_malloc(sizeof(struct multi_get_ctx));
+    *ctx = (struct multi_get_ctx){self, *num};
+    uint32_t key_bytes = 0;
+    for (uint32_t i = 0; i < ctx->n; ++i) key_bytes += key_length[i];
+    ctx->keys = kv_calloc(ctx->n, sizeof(struct multi_get_key));
+    ctx->key_buf = kv_malloc(key_bytes ? key_bytes : 1);
+    ctx->segs = kv_calloc(ctx->n, sizeof(struct kv_bucket_segment));
+    ctx->reqs = kv_calloc(ctx->n, sizeof(struct kv_value_log_read_req));
+    // the keys are copied, as the records may be packed over them.
+    for (uint32_t i = 0, off = 0; i < ctx->n; off += key_length[i++]) {
+        ctx->keys[i] = (struct multi_get_key){ctx, ctx->key_buf + off, key_length[i]};
+        kv_memcpy(ctx->keys[i].key, key[i], key_length[i]);
+    }
+    ctx->buf = buf;
+    ctx->buf_len = buf_len;
+    ctx->num = num;
+    ctx->cb = dequeue;
+    ctx->cb_arg = enqueue(self, KV_DS_MGET, multi_get_read_buckets, ctx, cb, cb_arg);
+}
+
+// --- scan ---
+struct scan_ctx {
+    struct kv_data_store *self;
+    uint64_t end;
+    uint8_t *buf;
+    uint32_t room, used, max_num, packed;
+    uint32_t *buf_len, *num;
+    bool *more;
+    bool exclusive;
+    uint8_t key[UINT8_MAX];
+    uint8_t key_length;
+    uint32_t value_room, value_length;  // of the get in flight
+    kv_data_store_cb cb;
+    void *cb_arg;
+};
+static __thread struct kv_freelist scan_ctxs;
+
+static void scan_finish(struct scan_ctx *ctx, bool success, bool more) {
+    *ctx->buf_len = ctx->used;
+    *ctx->num = ctx->packed;
+    *ctx->more = more;
+    if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+    kv_freelist_put(&scan_ctxs, ctx);
+}
+
+static void scan_next(struct scan_ctx *ctx);
+static void scan_get_cb(bool success, void *arg) {
+    struct scan_ctx *ctx = arg;
+    struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)(ctx->buf + ctx->used);
+    if (success) {
+        record->value_length = ctx->value_length;
+        ctx->used += kv_data_store_scan_record_size(record->key_length, record->value_length);
+        ctx->packed++;
+    } else if (ctx->value_length > ctx->value_room) {
+        scan_finish(ctx, ctx->packed != 0, true);
+        return;
+    } else if (ctx->value_length != 0) {  // not a miss
+        scan_finish(ctx, false, true);
+        return;
+    }
+    scan_next(ctx);
+}
+
+static void scan_next(struct scan_ctx *ctx) {
+    struct kv_data_store *self = ctx->self;
+    if (!kv_bucket_key_index_next(self->key_index, ctx->key, &ctx->key_length, ctx->exclusive) ||
+        kv_key_prefix(ctx->key) > ctx->end) {
+        scan_finish(ctx, true, false);
+        return;
+    }
+    ctx->exclusive = true;
+    uint32_t head = kv_data_store_scan_record_size(ctx->key_length, 0);
+    ctx->value_room = ctx->used + head < ctx->room ? (ctx->room - ctx->used - head) & ~0x3U : 0;
+    if (ctx->packed == ctx->max_num || ctx->value_room == 0) {
+        scan_finish(ctx, ctx->packed == ctx->max_num || ctx->packed != 0, true);
+        return;
+    }
+    struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)(ctx->buf + ctx->used);
+    record->key_length = ctx->key_length;
+    kv_memcpy(record->data, ctx->key, ctx->key_length);
+    ctx->value_length = ctx->value_room;
+    kv_data_store_get(self, record->data, record->key_length, kv_data_store_scan_value(record), &ctx->value_length,
+                      NULL, scan_get_cb, ctx);
+}
+
+void kv_data_store_scan(struct kv_data_store *self, uint8_t *key, uint8_t key_length, bool exclusive, uint64_t end,
+                        uint8_t *buf, uint32_t *buf_len, uint32_t *num, bool *more, kv_data_store_cb cb, void *cb_arg) {
+    assert(self->key_index);
+    struct scan_ctx *ctx = kv_freelist_get(&scan_ctxs, sizeof(struct scan_ctx));
+    *ctx = (struct scan_ctx){self, end, buf, *buf_len, 0, *num, 0, buf_len, num, more, exclusive};
+    ctx->key_length = key_length;
+    kv_memcpy(ctx->key, key, key_length);
+    ctx->cb = cb;
+    ctx->cb_arg = cb_arg;
+    scan_next(ctx);
+}
+
 // --- delete ---
 struct delete_ctx {
     struct kv_data_store *self;
@@ -402,12 +1288,14 @@ struct delete_ctx {
     struct kv_bucket_segment seg;
     bool success;
 };
+static __thread struct kv_freelist delete_ctxs;
 
 void kv_data_store_del_commit(kv_data_store_ctx arg, bool success) {
     struct delete_ctx *ctx = arg;
     if (success) kv_bucket_seg_commit(&ctx->self->bucket_log, &ctx->seg);
+    if (success && ctx->self->key_index) kv_bucket_key_index_del(ctx->self->key_index, ctx->key, ctx->key_length);
     kv_bucket_unlock(&ctx->self->bucket_log, &ctx->segs);
-    kv_free(ctx);
+    kv_freelist_put(&delete_ctxs, ctx);
 }
 
 static void delete_finish_cb(bool success, void *arg) {
@@ -415,20 +1303,25 @@ static void delete_finish_cb(bool success, void *arg) {
     if (ctx->cb) ctx->cb(success, ctx->cb_arg);
 }
 
-static void delete_lock_cb(void *arg) {
+static void delete_find_item_cb(bool success, struct kv_item *located_item, void *arg) {
     struct delete_ctx *ctx = arg;
-    struct kv_item *located_item = NULL;
-    find_item_plus(ctx->self, &ctx->seg, ctx->key, ctx->key_length, &located_item);
     if (!located_item) {
         delete_finish_cb(false, arg);
         return;
     }
     ctx->seg.dirty = true;
+    kv_value_log_discard(&ctx->self->value_log, located_item->value_offset, located_item->value_length);
     located_item->key_length = 0;
+    kv_bucket_item_tag_update(&ctx->seg, located_item);
     fill_the_hole(ctx->self, &ctx->seg);
     kv_bucket_seg_put(&ctx->self->bucket_log, &ctx->seg, delete_finish_cb, ctx);
 }
 
+static void delete_lock_cb(void *arg) {
+    struct delete_ctx *ctx = arg;
+    find_item_plus(ctx->self, &ctx->seg, ctx->key, ctx->key_length, delete_find_item_cb, ctx);
+}
+
 static void delete_lock(void *arg) {
     struct delete_ctx *ctx = arg;
     TAILQ_INIT(&ctx->segs);
@@ -438,7 +1331,7 @@ static void delete_lock(void *arg) {
 }
 
 kv_data_store_ctx kv_data_store_delete(struct kv_data_store *self, uint8_t *key, uint8_t key_length, kv_data_store_cb cb, void *cb_arg) {
-    struct delete_ctx *ctx = kv_malloc(sizeof(struct delete_ctx));
+    struct delete_ctx *ctx = kv_freelist_get(&delete_ctxs, sizeof(struct delete_ctx));
     *ctx = (struct delete_ctx){self, key, key_length, cb, cb_arg};
     ctx->bucket_id = kv_data_store_bucket_id(self, key);
     ctx->cb = dequeue;
@@ -467,9 +1360,12 @@ struct copy_read_val_ctx {
     struct kv_data_store_copy_buf buf;
     struct key_range_t *range;
     struct kv_item *item;
+    uint8_t key[UINT8_MAX];  // a long key read back
+    uint8_t *record;         // a compressed value read back
     TAILQ_ENTRY(copy_read_val_ctx)
     entry;
 };
+static __thread struct kv_freelist copy_read_val_ctxs;
 
 struct copy_ctx_t {
     struct kv_data_store *self;
@@ -502,11 +1398,52 @@ void kv_data_store_copy_commit(struct kv_data_store_copy_buf *buf) {
     struct key_range_t *range = read_val->range;
     struct copy_ctx_t *ctx = range->ctx;
     ctx->iocnt--;
-    kv_free(read_val);
+    kv_freelist_put(&copy_read_val_ctxs, read_val);
     if (--range->item_num == 0) on_seg_copy_done(range);
     copy_scheduler(ctx);
 }
 
+// the buffer of a compressed value is only got once its length is known.
+static void copy_read_record_cb(bool success, void *arg) {
+    struct copy_read_val_ctx *read_val = arg;
+    struct copy_ctx_t *ctx = read_val->range->ctx;
+    struct kv_item *item = read_val->item;
+    uint32_t record_length = item->value_length - item_key_size(item);
+    read_val->buf.val_len = success ? kv_value_log_codec_length(read_val->record) : record_length;
+    ctx->get_buf(kv_item_key_in_log(item) ? read_val->key : item->key, item->key_length, &read_val->buf, ctx->arg);
+    success = success && kv_value_log_decompress(&ctx->self->value_log, read_val->record, record_length, read_val->buf.val_buf);
+    kv_storage_pool_free(read_val->record, record_length);
+    ctx->copy_cb(success, read_val->buf.ctx);
+}
+
+static void copy_read_val(struct copy_read_val_ctx *read_val, uint8_t *key) {
+    struct copy_ctx_t *ctx = read_val->range->ctx;
+    struct kv_item *item = read_val->item;
+    uint32_t key_size = item_key_size(item);
+    if (item->codec != KV_CODEC_NONE) {
+        read_val->record = kv_storage_pool_malloc(ctx->self->value_log.storage, item->value_length - key_size);
+        kv_value_log_read(&ctx->self->value_log, item->value_offset + key_size, read_val->record,
+                          item->value_length - key_size, copy_read_record_cb, read_val);
+        return;
+    }
+    read_val->buf.val_len = item->value_length - key_size;
+    ctx->get_buf(key, item->key_length, &read_val->buf, ctx->arg);
+    kv_value_log_read(&ctx->self->value_log, item->value_offset + key_size, read_val->buf.val_buf, read_val->buf.val_len,
+                      ctx->copy_cb, read_val->buf.ctx);
+}
+
+static void copy_read_key_cb(bool success, void *arg) {
+    struct copy_read_val_ctx *read_val = arg;
+    if (success) {
+        copy_read_val(read_val, read_val->key);
+        return;
+    }
+    struct copy_ctx_t *ctx = read_val->range->ctx;
+    read_val->buf.val_len = read_val->item->value_length - item_key_size(read_val->item);
+    ctx->get_buf(read_val->item->key, read_val->item->key_length, &read_val->buf, ctx->arg);
+    ctx->copy_cb(false, read_val->buf.ctx);
+}
+
 static void copy_consumer(struct copy_ctx_t *ctx) {
     while (ctx->iocnt < ctx->buf_num) {
         struct copy_read_val_ctx *read_val = TAILQ_FIRST(&ctx->queue);
@@ -515,10 +1452,11 @@ static void copy_consumer(struct copy_ctx_t *ctx) {
         ctx->queue_size--;
         ctx->iocnt++;
         struct kv_item *item = read_val->item;
-        read_val->buf.val_len = item->value_length;
-        ctx->get_buf(item->key, item->key_length, &read_val->buf, ctx->arg);
-        kv_value_log_read(&ctx->self->value_log, item->value_offset, read_val->buf.val_buf, item->value_length,
-                          ctx->copy_cb, read_val->buf.ctx);
+        if (kv_item_key_in_log(item))
+            kv_value_log_read(&ctx->self->value_log, item->value_offset, read_val->key, item->key_length, copy_read_key_cb,
+                              read_val);
+        else
+            copy_read_val(read_val, item->key);
     }
 }
 
@@ -536,9 +1474,10 @@ static void copy_lock_cb(void *arg) {
     TAILQ_FOREACH(ce, &range->seg.chain, entry) {
         for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket)
             for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item) {
-                if (KV_EMPTY_ITEM(item)) continue;
-                struct copy_read_val_ctx *read_val = kv_malloc(sizeof(*read_val));
+                if (KV_EMPTY_ITEM(item) || item_expired(ctx->self, item)) continue;
+                struct copy_read_val_ctx *read_val = kv_freelist_get(&copy_read_val_ctxs, sizeof(*read_val));
                 read_val->item = item;
+                read_val->buf.expire = kv_item_expire(item);
                 read_val->range = range;
                 range->item_num++;
                 ctx->queue_size++;
@@ -625,6 +1564,10 @@ void kv_data_store_copy_del_key_range(struct kv_data_store *self, uint8_t *start
                 for (uint64_t i = range->start; i != range->end; i = (i + 1) % id_space_size) {
                     kv_bucket_meta_put(&ctx->self->bucket_log, i, (struct kv_bucket_meta){0, 0});
                 }
+                if (self->key_index) {
+                    uint64_t shift = 64 - self->log_bucket_num;
+                    kv_bucket_key_index_del_range(self->key_index, range->start << shift, range->end << shift);
+                }
             }
             CIRCLEQ_REMOVE(&ctx->key_ranges, range, entry);
             kv_free(range);
@@ -10,13 +10,23 @@ struct kv_data_store {
     struct kv_value_log value_log;
     struct kv_ds_queue *ds_queue;
     uint32_t ds_id;
+    struct kv_ds_io_sched io_sched;
     uint64_t log_bucket_num;  // cluster
     kv_bucket_key_set dirty_set;
+    kv_bucket_key_index key_index;  // NULL unless kv_data_store_index_init has been called
     void *q;
     void *copy_ctx;
+    // checkpoints
+    uint64_t checkpoint_base, checkpoint_slot_blks, checkpoint_seq;
+    uint64_t checkpoint_period, checkpoint_elapsed;  // us, a period of 0 disables the periodic checkpoints
+    uint32_t checkpoint_tail;  // the tail stamp of the bucket log at the last checkpoint
+    bool is_checkpointing;
+    void *checkpoint_pending;  // the requests waiting for the checkpoint in flight or the bucket id dumps
+    void *checkpoint_poller;
 };
 struct kv_data_store_copy_buf {
     uint32_t val_len;
+    uint32_t expire;  // of the item copied, see kv_data_store_set
     uint8_t *val_buf;
     void *ctx;
 };
@@ -24,16 +34,42 @@ typedef void *kv_data_store_ctx;
 typedef kv_storage_io_cb kv_data_store_cb;
 typedef void (*kv_data_store_get_buf_cb)(uint8_t *key, uint8_t key_len, struct kv_data_store_copy_buf *buf, void *cb_arg);
 
+// The sets of values longer than max_value_length may fail.
 void kv_data_store_init(struct kv_data_store *self, struct kv_storage *storage, uint64_t base, uint64_t num_buckets, uint64_t log_bucket_num,
-                        uint64_t value_log_block_num, uint32_t compact_buf_len, struct kv_ds_queue *ds_queue, uint32_t ds_id);
+                        uint64_t value_log_block_num, uint32_t max_value_length, uint32_t compact_buf_len,
+                        struct kv_ds_queue *ds_queue, uint32_t ds_id);
 void kv_data_store_fini(struct kv_data_store *self);
+
+// --- checkpoint & recovery ---
+// Two checkpoint slots follow the logs and are written in turn, so that a checkpoint torn by a crash leaves the
+// previous one. A checkpoint holds the bucket meta and the state of both logs. It is taken every checkpoint_period,
+// or earlier once a quarter of the bucket log has been appended since the last one.
+#define KV_DATA_STORE_CHECKPOINT_PERIOD (10ULL * 1000 * 1000)  // us
+void kv_data_store_checkpoint(struct kv_data_store *self, kv_data_store_cb cb, void *cb_arg);
+// Called right after kv_data_store_init on the storage of a previous instance: loads the newest checkpoint and
+// replays the bucket log past it. Without a usable checkpoint, the meta is rebuilt by scanning the whole bucket log,
+// which takes as long as reading it. cb(false) on an IO error, which may leave the data store half recovered.
+void kv_data_store_recover(struct kv_data_store *self, kv_data_store_cb cb, void *cb_arg);
+// With value_log.compress set, the values of the sets are compressed when it pays off and decompressed again by the
+// gets, the multi-gets and the copies, so the callers only ever see the values as written.
+// expire is the time of bucket_log.clock from which the item reads as a miss, 0 for never, see kv_data_store_expire.
 kv_data_store_ctx kv_data_store_set(struct kv_data_store *self, uint8_t *key, uint8_t key_length, uint8_t *value, uint32_t value_length,
-                                    kv_data_store_cb cb, void *cb_arg);
+                                    uint32_t expire, kv_data_store_cb cb, void *cb_arg);
+// Packs the values into a single value log append, which may span many blocks. value_offset, bucket_id and seg are
+// caller-provided scratch arrays of buffer_size entries that must stay valid until the commit. expire may be NULL if
+// no value expires.
 kv_data_store_ctx kv_data_store_buffered_set(struct kv_data_store *self, uint8_t *key[], uint8_t key_length[], uint8_t *value[], uint32_t value_length[],
-                                             uint64_t value_offset[], uint64_t bucket_id[], struct kv_bucket_segment seg[], uint32_t buffer_size,
+                                             uint32_t expire[], uint64_t value_offset[], uint64_t bucket_id[], struct kv_bucket_segment seg[], uint32_t buffer_size,
                                              kv_data_store_cb cb, void *cb_arg);
 void kv_data_store_set_commit(kv_data_store_ctx arg, bool success);
 void kv_data_store_set_buffered_commit(kv_data_store_ctx arg, bool success);
+// the expire of a set whose item lives for ttl seconds from now, 0 for ever.
+static inline uint32_t kv_data_store_expire(struct kv_data_store *self, uint32_t ttl) {
+    return ttl ? self->bucket_log.clock() + ttl : 0;
+}
+// *value_length is the room in value, 0 for no limit, and is set to the length of the value: a longer value fails the
+// get. Only *value_length bytes are written to value, which may point straight into a pre-registered response buffer.
+// A get that misses sets *value_length to 0.
 void kv_data_store_get(struct kv_data_store *self, uint8_t *key, uint8_t key_length, uint8_t *value, uint32_t *value_length,
                        struct kv_bucket_meta *meta, kv_data_store_cb cb, void *cb_arg);
 kv_data_store_ctx kv_data_store_delete(struct kv_data_store *self, uint8_t *key, uint8_t key_length, kv_data_store_cb cb, void *cb_arg);
@@ -49,6 +85,46 @@ static inline bool kv_data_store_is_dirty(struct kv_data_store *self, uint8_t *k
     return kv_bucket_key_set_find(self->dirty_set, key, key_length);
 }
 
+// --- key index & scan ---
+// An optional ordered index of the keys, for the scans of the hash-indexed buckets. It is kept in DRAM only, along with
+// the sets and deletes that commit, and rebuilt by the recovery from the buckets, the long keys being read back from
+// the value log. kv_data_store_index_init is called right after kv_data_store_init.
+void kv_data_store_index_init(struct kv_data_store *self);
+
+// A scan packs its items as records, each followed by the key then the value, both padded to 4 bytes.
+struct kv_data_store_scan_record {
+    uint32_t value_length;
+    uint8_t key_length;
+    uint8_t reserved[3];
+    uint8_t data[0];
+};
+#define KV_DATA_STORE_SCAN_ALIGN(size) (((size) + 0x3U) & ~0x3U)
+static inline uint32_t kv_data_store_scan_record_size(uint8_t key_length, uint32_t value_length) {
+    return sizeof(struct kv_data_store_scan_record) + KV_DATA_STORE_SCAN_ALIGN(key_length) +
+           KV_DATA_STORE_SCAN_ALIGN(value_length);
+}
+static inline uint8_t *kv_data_store_scan_value(struct kv_data_store_scan_record *record) {
+    return record->data + KV_DATA_STORE_SCAN_ALIGN(record->key_length);
+}
+static inline struct kv_data_store_scan_record *kv_data_store_scan_next(struct kv_data_store_scan_record *record) {
+    return (struct kv_data_store_scan_record *)((uint8_t *)record +
+                                                kv_data_store_scan_record_size(record->key_length, record->value_length));
+}
+// Reads the items of up to *num keys in the order of the key index, from key (past it if exclusive) to the last key
+// whose 64-bit prefix is at most end, one after another, and packs them in buf. *buf_len is the room in buf and is
+// set to the bytes packed, *num is set to the records packed and *more tells whether the range holds more keys than
+// packed. The keys deleted or expired meanwhile are skipped, a value larger than the room left ends the scan, and fails it if
+// nothing has been packed yet.
+void kv_data_store_scan(struct kv_data_store *self, uint8_t *key, uint8_t key_length, bool exclusive, uint64_t end,
+                        uint8_t *buf, uint32_t *buf_len, uint32_t *num, bool *more, kv_data_store_cb cb, void *cb_arg);
+
+// Gets *num keys at once and packs their items in buf as the records of a scan, in the same order, a miss as a record
+// without value. The buckets, then the values, are read in the order of their logs, the blocks close to each other by
+// a single I/O. *buf_len is the room in buf and is set to the bytes packed, *num is set to the records packed: the
+// keys that do not fit are left out, and fail the get if none fits. The keys are copied first, so buf may hold them.
+void kv_data_store_multi_get(struct kv_data_store *self, uint8_t *key[], uint8_t key_length[], uint32_t *num,
+                             uint8_t *buf, uint32_t *buf_len, kv_data_store_cb cb, void *cb_arg);
+
 void kv_data_store_copy_commit(struct kv_data_store_copy_buf *buf);
 bool kv_data_store_copy_forward(struct kv_data_store *self, uint8_t *key);
 void kv_data_store_copy_range_counter(struct kv_data_store *self, uint8_t *key, bool inc);
@@ -4,14 +4,25 @@
 #include <stdbool.h>
 
 #include "kv_memory.h"
+#include "spdk/env.h"
+
+uint64_t kv_ds_ticks_per_us(void) { return spdk_get_ticks_hz() / 1000000; }
+
 void kv_ds_queue_init(struct kv_ds_queue *self, uint32_t ds_cnt) {
     self->ds_cnt = ds_cnt;
     self->q_info = kv_calloc(ds_cnt, sizeof(*self->q_info));
     self->io_cnt = kv_calloc(ds_cnt, sizeof(*self->io_cnt));
+    self->cost_model = kv_calloc(ds_cnt, sizeof(*self->cost_model));
+    for (uint32_t i = 0; i < ds_cnt; i++) {
+        struct kv_ds_cost_model *model = self->cost_model + i;
+        for (uint32_t op = 0; op < KV_DS_OP_NUM; op++) model->service_us[op] = kv_ds_op_cost(op) * KV_DS_COST_UNIT_US * 8;
+        model->cap = KV_DS_CAP_INIT;
+    }
 }
 void kv_ds_queue_fini(struct kv_ds_queue *self) {
     kv_free(self->q_info);
     kv_free(self->io_cnt);
+    kv_free(self->cost_model);
 }
 uint32_t kv_ds_op_cost(enum kv_ds_op op) {
     switch (op) {
@@ -21,18 +32,23 @@ uint32_t kv_ds_op_cost(enum kv_ds_op op) {
             return 3;
         case KV_DS_DEL:
             return 4;
+        case KV_DS_MGET:
+            return 12;
         default:
             assert(false);
     }
     return 0;
 }
 
+// the capacity may shrink below the outstanding work.
+static inline uint32_t q_free(struct kv_ds_q_info *q) { return q->cap > q->size ? q->cap - q->size : 0; }
+
 struct kv_ds_q_info *kv_ds_queue_find(struct kv_ds_q_info *qs, uint32_t *io_cnt, uint32_t size, uint32_t cost) {
     if (size == 0) return NULL;
     uint32_t j = 0;
     for (size_t i = 0; i < size; i++) {
         if (io_cnt && io_cnt[i] == 0) return qs + i;
-        if (qs[i].cap - qs[i].size > qs[j].cap - qs[j].size) j = i;
+        if (q_free(qs + i) > q_free(qs + j)) j = i;
     }
     if (qs[j].cap >= qs[j].size + cost) {
         qs[j].size += cost;
@@ -40,4 +56,85 @@ struct kv_ds_q_info *kv_ds_queue_find(struct kv_ds_q_info *qs, uint32_t *io_cnt,
     } else {
         return NULL;
     }
-}
\ No newline at end of file
+}
+
+// --- cost model ---
+uint32_t kv_ds_queue_cost(struct kv_ds_queue *self, uint32_t ds_id, enum kv_ds_op op) {
+    uint32_t cost = (self->cost_model[ds_id].service_us[op] / 8 + KV_DS_COST_UNIT_US / 2) / KV_DS_COST_UNIT_US;
+    // an op must fit in an empty queue of the smallest capacity, or nothing would ever complete to admit it.
+    if (cost > KV_DS_CAP_MIN) return KV_DS_CAP_MIN;
+    return cost ? cost : 1;
+}
+
+void kv_ds_queue_set_cost(struct kv_ds_queue *self, uint32_t ds_id, enum kv_ds_op op, uint32_t cost) {
+    self->cost_model[ds_id].service_us[op] = cost * KV_DS_COST_UNIT_US * 8;
+}
+
+uint32_t kv_ds_queue_complete(struct kv_ds_queue *self, uint32_t ds_id, enum kv_ds_op op, uint64_t start_tsc) {
+    struct kv_ds_cost_model *model = self->cost_model + ds_id;
+    uint64_t us = (spdk_get_ticks() - start_tsc) / kv_ds_ticks_per_us();
+    if (us > UINT32_MAX / 8) us = UINT32_MAX / 8;
+    model->service_us[op] = model->service_us[op] - model->service_us[op] / 8 + us;
+    // additive increase, multiplicative decrease at most once per KV_DS_CAP_MIN completions.
+    if (us > KV_DS_LATENCY_TARGET_US) {
+        if (model->since_decrease >= KV_DS_CAP_MIN) {
+            model->cap -= model->cap / 8;
+            if (model->cap < KV_DS_CAP_MIN) model->cap = KV_DS_CAP_MIN;
+            model->since_decrease = 0;
+        }
+    } else if (model->cap < KV_DS_CAP_MAX) {
+        model->cap++;
+    }
+    model->since_decrease++;
+    return model->cap;
+}
+
+uint32_t kv_ds_queue_throttle(struct kv_ds_queue *self, uint32_t ds_id) {
+    struct kv_ds_cost_model *model = self->cost_model + ds_id;
+    // the capacity grows back by the additive increase once the data store has caught up.
+    if (model->since_decrease >= KV_DS_CAP_MIN / 8 && model->cap > KV_DS_CAP_MIN) {
+        model->cap /= 2;
+        if (model->cap < KV_DS_CAP_MIN) model->cap = KV_DS_CAP_MIN;
+        model->since_decrease = 0;
+        model->throttles++;
+    }
+    return model->cap;
+}
+
+// --- compaction I/O scheduler ---
+void kv_ds_io_sched_init(struct kv_ds_io_sched *self, struct kv_ds_queue *queue, uint32_t ds_id) {
+    *self = (struct kv_ds_io_sched){queue, ds_id, true, KV_DS_IO_BURST * KV_DS_IO_TOKEN_PER_BLK, spdk_get_ticks(), 0};
+}
+
+uint32_t kv_ds_io_sched_share(struct kv_ds_io_sched *self, uint32_t pressure) {
+    if (self == NULL || !self->enabled || pressure >= KV_DS_IO_SHARE_UNIT) return KV_DS_IO_SHARE_UNIT;
+    struct kv_ds_q_info q_info = self->queue->q_info[self->ds_id];
+    uint32_t load = q_info.size >= q_info.cap ? KV_DS_IO_SHARE_UNIT : q_info.size * KV_DS_IO_SHARE_UNIT / q_info.cap;
+    uint32_t share = KV_DS_IO_SHARE_UNIT - load * (KV_DS_IO_SHARE_UNIT - pressure) / KV_DS_IO_SHARE_UNIT;
+    return share > KV_DS_IO_SHARE_MIN ? share : KV_DS_IO_SHARE_MIN;
+}
+
+uint32_t kv_ds_io_sched_bound(struct kv_ds_io_sched *self, uint32_t pressure, uint32_t max) {
+    uint32_t bound = (uint64_t)max * kv_ds_io_sched_share(self, pressure) / KV_DS_IO_SHARE_UNIT;
+    return bound ? bound : 1;
+}
+
+bool kv_ds_io_sched_acquire(struct kv_ds_io_sched *self, uint32_t pressure, uint64_t blks) {
+    if (self == NULL || !self->enabled) return true;
+    uint32_t share = kv_ds_io_sched_share(self, pressure);
+    // refill at the current share of the rate. last_tsc only moves by whole microseconds, so that frequent calls
+    // do not lose the fractions.
+    uint64_t ticks_per_us = kv_ds_ticks_per_us();
+    uint64_t us = (spdk_get_ticks() - self->last_tsc) / ticks_per_us;
+    self->last_tsc += us * ticks_per_us;
+    self->tokens += (int64_t)(us * KV_DS_IO_RATE_MAX * share);
+    if (self->tokens > KV_DS_IO_BURST * KV_DS_IO_TOKEN_PER_BLK) self->tokens = KV_DS_IO_BURST * KV_DS_IO_TOKEN_PER_BLK;
+    if (self->tokens < 0 && share < KV_DS_IO_SHARE_UNIT) {
+        self->deferrals++;
+        return false;
+    }
+    // the I/O granted under full pressure is charged too, but its debt is bounded by a burst.
+    self->tokens -= (int64_t)blks * KV_DS_IO_TOKEN_PER_BLK;
+    if (self->tokens < -(int64_t)KV_DS_IO_BURST * KV_DS_IO_TOKEN_PER_BLK) self->tokens = -(int64_t)KV_DS_IO_BURST * KV_DS_IO_TOKEN_PER_BLK;
+    return true;
+}
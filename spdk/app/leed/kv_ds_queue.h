@@ -1,6 +1,7 @@
 #ifndef _KV_DS_QUEUE_
 #define _KV_DS_QUEUE_
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 struct kv_ds_q_info {
@@ -8,15 +9,72 @@ struct kv_ds_q_info {
     uint32_t cap;
 };
 typedef _Atomic struct kv_ds_q_info kv_ds_atomic_q;
-enum kv_ds_op { KV_DS_SET, KV_DS_GET, KV_DS_DEL };
+enum kv_ds_op { KV_DS_SET, KV_DS_GET, KV_DS_DEL, KV_DS_MGET, KV_DS_OP_NUM };
+
+// Each data store charges an op its measured service time (an EWMA over completions, in KV_DS_COST_UNIT_US
+// units) against a capacity that grows while ops complete within KV_DS_LATENCY_TARGET_US and shrinks when
+// they do not. q_info.size is thus the outstanding work of a data store, i.e. the queueing delay a new op sees.
+#define KV_DS_COST_UNIT_US 10
+#define KV_DS_LATENCY_TARGET_US 2000
+#define KV_DS_CAP_INIT 1024
+#define KV_DS_CAP_MIN 64
+#define KV_DS_CAP_MAX 8192
+struct kv_ds_cost_model {
+    uint32_t service_us[KV_DS_OP_NUM];  // EWMA, scaled by 8
+    uint32_t cap;
+    uint32_t since_decrease;
+    uint64_t throttles;
+};
+
 struct kv_ds_queue {
     uint32_t ds_cnt;
     kv_ds_atomic_q *q_info;
     atomic_uint *io_cnt;
+    struct kv_ds_cost_model *cost_model;
 };
 #define KV_DS_Q_NOTFOUND UINT32_MAX
+// the spdk_get_ticks() per microsecond, the one tick rate of the data stores, known once kv_app has started.
+uint64_t kv_ds_ticks_per_us(void);
 void kv_ds_queue_init(struct kv_ds_queue *self, uint32_t ds_cnt);
 void kv_ds_queue_fini(struct kv_ds_queue *self);
+// the initial cost of op, in KV_DS_COST_UNIT_US units, before any completion is measured.
 uint32_t kv_ds_op_cost(enum kv_ds_op op);
 struct kv_ds_q_info *kv_ds_queue_find(struct kv_ds_q_info *qs, uint32_t *io_cnt, uint32_t size, uint32_t cost);
-#endif
\ No newline at end of file
+
+// the cost ds_id charges op in q_info, at most KV_DS_CAP_MIN.
+uint32_t kv_ds_queue_cost(struct kv_ds_queue *self, uint32_t ds_id, enum kv_ds_op op);
+// sets the cost of op to the one a data store reported, so that a client charges q_info in the units of the server.
+void kv_ds_queue_set_cost(struct kv_ds_queue *self, uint32_t ds_id, enum kv_ds_op op, uint32_t cost);
+// feeds the service time of a completed op into the model of ds_id, returns the new capacity. start_tsc is the
+// spdk_get_ticks() of when the op started to execute, so that the time it was queued is not counted.
+uint32_t kv_ds_queue_complete(struct kv_ds_queue *self, uint32_t ds_id, enum kv_ds_op op, uint64_t start_tsc);
+// halves the capacity of ds_id while its background work is behind, returns the new capacity.
+uint32_t kv_ds_queue_throttle(struct kv_ds_queue *self, uint32_t ds_id);
+
+// --- compaction I/O scheduler ---
+// The compaction of both logs of a data store draws its I/O, in blocks, from a token bucket. Its share of
+// KV_DS_IO_RATE_MAX is 1 - load * (1 - pressure): it falls as the foreground queue of the data store fills up
+// (load = q_info.size / q_info.cap) and rises as the logs run out of free space, the pressure the compaction asks
+// with. A compaction under full pressure, e.g. writes are waiting for space, is never held back.
+#define KV_DS_IO_SHARE_UNIT 256U
+#define KV_DS_IO_SHARE_MIN (KV_DS_IO_SHARE_UNIT / 16)
+#define KV_DS_IO_RATE_MAX 256U  // blk per ms
+#define KV_DS_IO_BURST 4096U    // blk
+#define KV_DS_IO_TOKEN_PER_BLK (1000LL * KV_DS_IO_SHARE_UNIT)
+struct kv_ds_io_sched {
+    struct kv_ds_queue *queue;
+    uint32_t ds_id;
+    bool enabled;
+    int64_t tokens;  // in 1/KV_DS_IO_TOKEN_PER_BLK blk, below 0 after a grant larger than what was left
+    uint64_t last_tsc;
+    uint64_t deferrals;
+};
+void kv_ds_io_sched_init(struct kv_ds_io_sched *self, struct kv_ds_queue *queue, uint32_t ds_id);
+// the share of its upper bound the compaction may use, in 1/KV_DS_IO_SHARE_UNIT. pressure is in the same unit.
+uint32_t kv_ds_io_sched_share(struct kv_ds_io_sched *self, uint32_t pressure);
+// scales an upper bound of the compaction, e.g. the number of windows in flight, by its share, at least 1.
+uint32_t kv_ds_io_sched_bound(struct kv_ds_io_sched *self, uint32_t pressure, uint32_t max);
+// takes blks tokens and returns true if the compaction may issue blks more blocks of I/O now. Otherwise it
+// should retry later, e.g. on the next write.
+bool kv_ds_io_sched_acquire(struct kv_ds_io_sched *self, uint32_t pressure, uint64_t blks);
+#endif
@@ -7,6 +7,48 @@ void *kv_dma_malloc(size_t size) { return spdk_dma_malloc(size, 4, NULL); }
 void *kv_dma_zmalloc(size_t size) { return spdk_dma_zmalloc(size, 4, NULL); }
 void kv_dma_free(void *buf) { spdk_dma_free(buf); }
 
+// --- freelists ---
+// the slow path of kv_freelist_get: the remote stack is taken back at once, else a new element is allocated.
+void *kv_freelist_alloc(struct kv_freelist *list, size_t size) {
+    void *ele = __atomic_exchange_n(&list->remote, NULL, __ATOMIC_ACQUIRE);
+    while (ele) {
+        void *next = *(void **)ele;
+        if (list->len == KV_FREELIST_CAP) {
+            kv_free((struct kv_freelist_hdr *)ele - 1);
+        } else {
+            *(void **)ele = list->head;
+            list->head = ele;
+            list->len++;
+        }
+        ele = next;
+    }
+    if (list->head) return kv_freelist_get(list, size);
+    list->misses++;
+    struct kv_freelist_hdr *hdr = kv_malloc(sizeof(struct kv_freelist_hdr) + size);
+    hdr->owner = list;
+    return hdr + 1;
+}
+void kv_freelist_remote_put(struct kv_freelist *owner, void *ele) {
+    void *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)ele = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote, &head, ele, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&owner->remote_puts, 1, __ATOMIC_RELAXED);
+}
+void kv_freelist_clear(struct kv_freelist *list) {
+    void *ele = __atomic_exchange_n(&list->remote, NULL, __ATOMIC_ACQUIRE);
+    while (ele) {
+        void *next = *(void **)ele;
+        kv_free((struct kv_freelist_hdr *)ele - 1);
+        ele = next;
+    }
+    while ((ele = list->head) != NULL) {
+        list->head = *(void **)ele;
+        kv_free((struct kv_freelist_hdr *)ele - 1);
+    }
+    list->len = 0;
+}
+
 struct _kv_mempool {
     uint8_t *buf;
     MoodycamelCQHandle cq;
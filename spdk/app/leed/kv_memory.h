@@ -11,8 +11,59 @@
 #define kv_memset(s, c, n) memset(s, c, n)
 #define kv_malloc(size) malloc(size)
 #define kv_calloc(nmemb, size) calloc(nmemb, size)
+#define kv_realloc(ptr, size) realloc(ptr, size)
 #define kv_free(ptr) free(ptr)
 
+// Per-thread freelists of fixed-size elements, declared as `static __thread struct kv_freelist`, one per type.
+// Each element remembers the freelist of the thread that allocated it. An element freed on that thread is pushed back
+// without any atomic. An element freed on another thread is pushed on the remote stack of its owner, which takes the
+// whole stack back the next time its own list runs dry: the contexts created by one thread and released by another,
+// such as the dispatch and forward contexts of kv_ring, still come back. A freelist holding KV_FREELIST_CAP elements
+// returns the rest to malloc.
+#define KV_FREELIST_CAP 1024
+struct kv_freelist {
+    void *head;
+    uint32_t len;
+    void *remote;     // freed by the other threads, only accessed with __atomic builtins
+    uint64_t misses;  // gets that fell back to malloc
+    uint64_t remote_puts;
+};
+struct kv_freelist_hdr {
+    struct kv_freelist *owner;
+    uint64_t reserved;  // keeps the element 16 bytes aligned
+};
+#ifdef __cplusplus
+extern "C" {
+#endif
+void *kv_freelist_alloc(struct kv_freelist *list, size_t size);
+void kv_freelist_remote_put(struct kv_freelist *owner, void *ele);
+// frees the elements held by the freelist of the calling thread, remote ones included.
+void kv_freelist_clear(struct kv_freelist *list);
+#ifdef __cplusplus
+}
+#endif
+static inline void *kv_freelist_get(struct kv_freelist *list, size_t size) {
+    void *ele = list->head;
+    if (ele == NULL) return kv_freelist_alloc(list, size);
+    list->head = *(void **)ele;
+    list->len--;
+    return ele;
+}
+static inline void kv_freelist_put(struct kv_freelist *list, void *ele) {
+    struct kv_freelist_hdr *hdr = (struct kv_freelist_hdr *)ele - 1;
+    if (hdr->owner != list) {
+        kv_freelist_remote_put(hdr->owner, ele);
+        return;
+    }
+    if (list->len == KV_FREELIST_CAP) {
+        kv_free(hdr);
+        return;
+    }
+    *(void **)ele = list->head;
+    list->head = ele;
+    list->len++;
+}
+
 void *kv_dma_malloc(size_t size);
 void *kv_dma_zmalloc(size_t size);
 void kv_dma_free(void *buf);
@@ -3,9 +3,12 @@
 #include <stdint.h>
 
 #include "kv_ds_queue.h"
+#include "kv_rdma.h"
 
 
 #define _KV_MSG_ALIGN(size) ((size) & 0x3 ? ((size) & ~0x3) + 0x4 : (size))
+// the room the longest key takes in a message.
+#define KV_MSG_MAX_KEY_SIZE _KV_MSG_ALIGN(UINT8_MAX)
 struct kv_msg {
 // msg_types:
 #define KV_MSG_OK (0U)
@@ -14,7 +17,12 @@ struct kv_msg {
 #define KV_MSG_DEL (3U)
 #define KV_MSG_META_GET (5U)
 #define KV_MSG_BUFFERED_SET (6U)
+#define KV_MSG_SCAN (7U)
+#define KV_MSG_MGET (8U)
+#define KV_MSG_MULTI (9U)
 #define KV_MSG_TEST (128U)
+#define KV_MSG_NOT_FOUND (252U)  // a GET whose key is not stored, alone or in a KV_MSG_MULTI
+#define KV_MSG_TOO_LARGE (253U)  // a SET of a value longer than the largest the server stores, see its -v option
 #define KV_MSG_OUTDATED (254U)
 #define KV_MSG_ERR (255U)
     uint8_t type;
@@ -23,8 +31,19 @@ struct kv_msg {
     uint32_t value_len;
     uint8_t put_key_ok;
     uint8_t slot_id;
-    uint16_t reserved;
+// flags:
+// The value is moved by RDMA READ/WRITE: the value field holds the struct kv_rdma_remote_buf of a registered buffer
+// of the sender, and value_len is the length of the value itself. Without it, a GET of a value that does not fit in
+// the message fails.
+#define KV_MSG_EXT_VALUE (1U)
+// The item of a SET expires ttl seconds after the data store has set it, see kv_data_store_set. Without it, ttl is
+// left unread and the item never expires.
+#define KV_MSG_TTL (2U)
+    uint8_t flags;
+    // set in a response to the cost the data store charges for an op of its type in q_info, 0 if unknown.
+    uint8_t cost;
     uint32_t ds_id;
+    uint32_t ttl;
     struct kv_ds_q_info q_info;
     uint8_t data[0];
 // data:
@@ -33,7 +52,64 @@ struct kv_msg {
 // uint8_t value[value_len]; //must be 4 bytes aligned
 #define KV_MSG_KEY(msg) ((msg)->data)
 #define KV_MSG_VALUE(msg) ((msg)->data + _KV_MSG_ALIGN((msg)->key_len))
-#define KV_MSG_SIZE(msg) (sizeof(struct kv_msg) + _KV_MSG_ALIGN((msg)->key_len) + (msg)->value_len)
+#define KV_MSG_VALUE_SIZE(msg) \
+    ((msg)->flags & KV_MSG_EXT_VALUE ? (uint32_t)sizeof(struct kv_rdma_remote_buf) : (msg)->value_len)
+#define KV_MSG_SIZE(msg) (sizeof(struct kv_msg) + _KV_MSG_ALIGN((msg)->key_len) + KV_MSG_VALUE_SIZE(msg))
 };
 
+// the op of a request in the queue of its data store, see kv_ds_queue.h.
+static inline enum kv_ds_op kv_msg_ds_op(struct kv_msg *msg) {
+    switch (msg->type) {
+        case KV_MSG_SET:
+        case KV_MSG_BUFFERED_SET:
+            return KV_DS_SET;
+        case KV_MSG_DEL:
+            return KV_DS_DEL;
+        case KV_MSG_MGET:
+            return KV_DS_MGET;
+        default:
+            return KV_DS_GET;
+    }
+}
+
+// KV_MSG_SCAN: the key is the first key of the scan and the value a struct kv_msg_scan. kv_ring_dispatch sends it to
+// the tail of the vnode owning the key and bounds it to the range of that vnode, so a scan crossing vnodes is sent
+// again from where the response stops. The response holds the scan followed by the records, packed as the
+// struct kv_data_store_scan_record of a scan of the data store, unless they are written to the records buffer.
+struct kv_msg_scan {
+    uint64_t end;     // the last 64-bit key prefix of the range, set by kv_ring_dispatch
+    uint32_t num;     // the records asked for, then returned
+    bool exclusive;   // skips the first key itself, to resume a scan past its last record
+    bool more;        // the range holds more keys than returned
+    uint16_t reserved;
+    // a registered buffer of the sender the records are written to by RDMA WRITE, length 0 to return them in the
+    // response. Its length is set to the bytes written.
+    struct kv_rdma_remote_buf records;
+};
+#define KV_MSG_SCAN_RECORDS(msg) (KV_MSG_VALUE(msg) + sizeof(struct kv_msg_scan))
+
+// KV_MSG_MGET: the key is the first key and the value a struct kv_msg_scan followed by num records of the keys alone,
+// in the order of their 64-bit prefixes. It is routed as a scan: the tail of the vnode owning the first key gets the
+// keys up to end, packs as many of their records as fit, in the same order, and sets num to their number and more
+// if keys are left. A miss is a record without value.
+
+// KV_MSG_MULTI: a container of independent GET, SET and DEL messages for the same node, without key. Its value is a
+// struct kv_msg_multi followed by the num messages, each taking room bytes of value whatever its value_len. The node
+// answers them in place, a GET filling the room of its message, and answers the container once they are all done. The
+// node serves a GET if it is the tail of the key, and a SET or a DEL if it is the only replica of the key; a message it
+// does not serve, or a GET of a value longer than the room, is answered with KV_MSG_OUTDATED and sent again alone, and
+// a GET of a key that is not stored with KV_MSG_NOT_FOUND. A node takes the messages of up to the size set by its -M
+// option; its request buffers hold a block more, as the value of a SET is written from its room by whole blocks.
+#define KV_MSG_MULTI_MAX_OPS 64U  // the ops past it are answered with KV_MSG_OUTDATED
+struct kv_msg_multi {
+    uint32_t num;
+    uint32_t room;  // 4 bytes aligned
+};
+#define KV_MSG_MULTI_OPS(msg) ((struct kv_msg *)(KV_MSG_VALUE(msg) + sizeof(struct kv_msg_multi)))
+static inline uint32_t kv_msg_multi_op_size(struct kv_msg_multi *multi, uint8_t key_len) {
+    return sizeof(struct kv_msg) + _KV_MSG_ALIGN(key_len) + multi->room;
+}
+static inline struct kv_msg *kv_msg_multi_next(struct kv_msg_multi *multi, struct kv_msg *op) {
+    return (struct kv_msg *)((uint8_t *)op + kv_msg_multi_op_size(multi, op->key_len));
+}
 #endif
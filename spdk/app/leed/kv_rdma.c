@@ -6,6 +6,7 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <rdma/rdma_cma.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +15,14 @@
 
 #include "kv_app.h"
 #include "kv_memory.h"
+#include "kv_shm.h"
 #include "utils/uthash.h"
 
 #define TIMEOUT_IN_MS (500U)
 #define MAX_Q_NUM (4096U)
+#define MAX_RD_ATOMIC (16)  // RDMA READs in flight per connection
+#define MAX_INLINE_SZ (128U)   // requests up to this size, header included, are copied into the send WQE
+#define SIGNAL_INTERVAL (16U)  // a client signals one request send in this many, to reclaim the send queue
 
 #define TEST_NZ(x)                                      \
     do {                                                \
@@ -39,12 +44,15 @@ struct rdma_connection {
     struct rdma_cm_id *cm_id;
     struct ibv_qp *qp;
     bool is_server;
+    struct cq_poller_ctx *poller;  // the only one that polls the completions of the connection
     union {
         // server connection data
         struct {
             kv_rdma_req_handler handler;
             void *arg;
+            uint32_t qp_num;  // the key of both hashes, which outlives the qp
             UT_hash_handle hh;
+            UT_hash_handle poller_hh;
         } s;
         // client connection data
         struct {
@@ -53,13 +61,23 @@ struct rdma_connection {
             kv_rdma_disconnect_cb disconnect;
             void *disconnect_arg;
             struct kv_mempool *mp;
+            _Atomic uint32_t send_cnt;
         } c;
     } u;
 };
+// Every poller thread has its own CQ and, for the server, its own SRQ with its share of the request buffers, so that
+// the pollers never contend on a queue and all the requests of a connection complete on the same thread.
 struct cq_poller_ctx {
     struct kv_rdma *self;
     struct ibv_cq *cq;
     void *poller;
+    // server data
+    struct ibv_srq *srq;
+    uint32_t req_num;
+    struct mr_bulk *mrs;
+    struct server_req_ctx *requests;
+    // the connections seen by the poller, only ever touched by its thread
+    struct rdma_connection *connections;
 };
 struct fini_ctx_t {
     uint32_t thread_id, io_cnt;
@@ -69,22 +87,21 @@ struct fini_ctx_t {
 struct kv_rdma {
     struct ibv_context *ctx;
     struct ibv_pd *pd;
-    struct ibv_cq *cq;
     struct rdma_event_channel *ec;
     void *cm_poller;
     bool has_server;
     uint32_t thread_num, thread_id;
     struct cq_poller_ctx *cq_pollers;
+    uint32_t next_poller;  // connections are spread over the pollers in turn
     // client data
     uint32_t conn_id;
     // server data
-    struct ibv_srq *srq;
+    bool is_server_ready;
     uint32_t con_req_num;
+    uint32_t srq_depth;  // 0 until kv_rdma_listen for the default
     uint32_t max_msg_sz;
     pthread_rwlock_t lock;
-    struct mr_bulk *mrs;
-    struct server_req_ctx *requests;
-    struct rdma_connection *connections;
+    struct rdma_connection *connections;  // all the server connections, the pollers cache theirs
     kv_rdma_server_init_cb init_cb;
     void *init_cb_arg;
     // finish ctx
@@ -99,12 +116,30 @@ struct client_req_ctx {
 struct server_req_ctx {
     struct rdma_connection *conn;
     struct kv_rdma *self;
+    struct cq_poller_ctx *poller;
     uint32_t resp_rkey;
     struct ibv_mr *mr;
     struct req_header header;
 };
+// the wr_id of a one-sided transfer has its lowest bit set, the other wr_ids are aligned pointers.
+#define REMOTE_IO_TAG (1ULL)
+struct remote_io_ctx {
+    kv_rdma_io_cb cb;
+    void *cb_arg;
+};
+static __thread struct kv_freelist remote_io_ctxs;
+// set by kv_rdma_init for the whole process, the calls are then forwarded to kv_shm.c
+static bool use_shm;
 
 // --- alloc and free ---
+// without a NIC, an mr only describes its buffer
+static struct ibv_mr *shm_mr_create(void *buf, size_t length, uint32_t rkey) {
+    struct ibv_mr *mr = kv_calloc(1, sizeof(struct ibv_mr));
+    mr->addr = buf;
+    mr->length = length;
+    mr->rkey = rkey;
+    return mr;
+}
 struct mr_bulk {
     struct ibv_mr *mr;
     uint8_t *buf;
@@ -113,9 +148,17 @@ struct mr_bulk {
 kv_rdma_mrs_handle kv_rdma_alloc_bulk(kv_rdma_handle h, enum kv_rdma_mr_type type, size_t size, size_t count) {
     struct kv_rdma *self = h;
     struct mr_bulk *mr_h = kv_malloc(sizeof(struct mr_bulk));
-    if (type != KV_RDMA_MR_RESP) size += HEADER_SIZE;
-    mr_h->buf = kv_dma_malloc(size * count);
-    mr_h->mr = ibv_reg_mr(self->pd, mr_h->buf, size * count, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+    if (type == KV_RDMA_MR_VALUE) access |= IBV_ACCESS_REMOTE_READ;
+    if (type != KV_RDMA_MR_RESP && type != KV_RDMA_MR_VALUE) size += HEADER_SIZE;
+    if (use_shm) {
+        uint32_t rkey = 0;
+        mr_h->buf = type == KV_RDMA_MR_VALUE ? kv_shm_alloc_value(size * count, &rkey) : kv_dma_zmalloc(size * count);
+        mr_h->mr = shm_mr_create(mr_h->buf, size * count, rkey);
+    } else {
+        mr_h->buf = kv_dma_zmalloc(size * count);
+        mr_h->mr = ibv_reg_mr(self->pd, mr_h->buf, size * count, access);
+    }
     mr_h->mrs = kv_calloc(count, sizeof(struct ibv_mr));
     for (size_t i = 0; i < count; i++) {
         mr_h->mrs[i] = *mr_h->mr;
@@ -127,8 +170,17 @@ kv_rdma_mrs_handle kv_rdma_alloc_bulk(kv_rdma_handle h, enum kv_rdma_mr_type typ
 kv_rdma_mr kv_rdma_mrs_get(kv_rdma_mrs_handle h, size_t index) { return ((struct mr_bulk *)h)->mrs + index; }
 void kv_rdma_free_bulk(kv_rdma_mrs_handle h) {
     struct mr_bulk *mr_h = h;
-    ibv_dereg_mr(mr_h->mr);
-    kv_dma_free(mr_h->buf);
+    if (use_shm) {
+        if (mr_h->mr->rkey) {
+            kv_shm_free_value(mr_h->buf);
+        } else {
+            kv_dma_free(mr_h->buf);
+        }
+        kv_free(mr_h->mr);
+    } else {
+        ibv_dereg_mr(mr_h->mr);
+        kv_dma_free(mr_h->buf);
+    }
     kv_free(mr_h->mrs);
     kv_free(mr_h);
 }
@@ -136,7 +188,8 @@ void kv_rdma_free_bulk(kv_rdma_mrs_handle h) {
 kv_rdma_mr kv_rdma_alloc_req(kv_rdma_handle h, uint32_t size) {
     struct kv_rdma *self = h;
     size += HEADER_SIZE;
-    uint8_t *buf = kv_dma_malloc(size);
+    uint8_t *buf = kv_dma_zmalloc(size);
+    if (use_shm) return shm_mr_create(buf, size, 0);
     return ibv_reg_mr(self->pd, buf, size, 0);
 }
 
@@ -144,42 +197,59 @@ uint8_t *kv_rdma_get_req_buf(kv_rdma_mr mr) { return (uint8_t *)((struct ibv_mr
 
 kv_rdma_mr kv_rdma_alloc_resp(kv_rdma_handle h, uint32_t size) {
     struct kv_rdma *self = h;
-    uint8_t *buf = kv_dma_malloc(size);
+    uint8_t *buf = kv_dma_zmalloc(size);
+    if (use_shm) return shm_mr_create(buf, size, 0);
     return ibv_reg_mr(self->pd, buf, size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
 }
 
 uint8_t *kv_rdma_get_resp_buf(kv_rdma_mr mr) { return (uint8_t *)((struct ibv_mr *)mr)->addr; }
 
+uint8_t *kv_rdma_get_value_buf(kv_rdma_mr mr) { return (uint8_t *)((struct ibv_mr *)mr)->addr; }
+
 void kv_rdma_free_mr(kv_rdma_mr h) {
     struct ibv_mr *mr = h;
     uint8_t *buf = mr->addr;
-    ibv_dereg_mr(mr);
+    if (use_shm) {
+        kv_free(mr);
+    } else {
+        ibv_dereg_mr(mr);
+    }
     kv_dma_free(buf);
 }
 
 // --- cm_poller ---
 static int rdma_cq_poller(void *arg);
-static void server_data_init(struct kv_rdma *self) {
+// Connections are spread over the pollers in turn whatever their load, so the connections of one poller may have more
+// than their share of the requests of the server in flight: each SRQ gets srq_depth, on the first connection of its
+// poller. A sender finding the SRQ empty retries on RNR.
+static void srq_init(struct kv_rdma *self, struct cq_poller_ctx *poller) {
+    poller->req_num = self->srq_depth;
     struct ibv_srq_init_attr srq_init_attr;
     memset(&srq_init_attr, 0, sizeof(srq_init_attr));
-    srq_init_attr.attr.max_wr = MAX_Q_NUM;
+    srq_init_attr.attr.max_wr = poller->req_num;
     srq_init_attr.attr.max_sge = 1;
-    TEST_Z(self->srq = ibv_create_srq(self->pd, &srq_init_attr));
+    TEST_Z(poller->srq = ibv_create_srq(self->pd, &srq_init_attr));
 
-    self->requests = kv_calloc(self->con_req_num, sizeof(struct server_req_ctx));
-    self->mrs = kv_rdma_alloc_bulk(self, KV_RDMA_MR_SERVER, self->max_msg_sz, self->con_req_num);
+    poller->requests = kv_calloc(poller->req_num, sizeof(struct server_req_ctx));
+    poller->mrs = kv_rdma_alloc_bulk(self, KV_RDMA_MR_SERVER, self->max_msg_sz, poller->req_num);
     struct ibv_recv_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge = {0, self->mrs->mr->length, self->mrs->mr->lkey};
+    struct ibv_sge sge = {0, poller->mrs->mr->length, poller->mrs->mr->lkey};
     wr.next = NULL;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    for (size_t i = 0; i < self->con_req_num; i++) {
-        self->requests[i].self = self;
-        self->requests[i].mr = kv_rdma_mrs_get(self->mrs, i);
-        sge.addr = (uint64_t)self->requests[i].mr->addr;
-        wr.wr_id = (uint64_t)(self->requests + i);
-        TEST_NZ(ibv_post_srq_recv(self->srq, &wr, &bad_wr));
+    for (size_t i = 0; i < poller->req_num; i++) {
+        poller->requests[i].self = self;
+        poller->requests[i].poller = poller;
+        poller->requests[i].mr = kv_rdma_mrs_get(poller->mrs, i);
+        sge.addr = (uint64_t)poller->requests[i].mr->addr;
+        wr.wr_id = (uint64_t)(poller->requests + i);
+        TEST_NZ(ibv_post_srq_recv(poller->srq, &wr, &bad_wr));
     }
+    printf("kv rdma: SRQ %zu of %u holds %u requests of %u bytes.\n", (size_t)(poller - self->cq_pollers),
+           self->thread_num, poller->req_num, self->max_msg_sz);
+}
+static void server_data_init(struct kv_rdma *self) {
+    self->is_server_ready = true;
     if (self->init_cb) self->init_cb(self->init_cb_arg);
 }
 
@@ -189,29 +259,32 @@ static int create_connetion(struct kv_rdma *self, struct rdma_cm_id *cm_id) {
     if (self->ctx == NULL) {
         self->ctx = cm_id->verbs;
         TEST_Z(self->pd = ibv_alloc_pd(self->ctx));
-        TEST_Z(self->cq = ibv_create_cq(self->ctx, 3 * MAX_Q_NUM /* max_conn_num */, NULL, NULL, 0));
         self->cq_pollers = kv_calloc(self->thread_num, sizeof(struct cq_poller_ctx));
         for (size_t i = 0; i < self->thread_num; i++) {
-            self->cq_pollers[i] = (struct cq_poller_ctx){self, self->cq};
+            self->cq_pollers[i] = (struct cq_poller_ctx){self};
+            TEST_Z(self->cq_pollers[i].cq = ibv_create_cq(self->ctx, 3 * MAX_Q_NUM /* max_conn_num */, NULL, NULL, 0));
             kv_app_poller_register_on(self->thread_id + i, rdma_cq_poller, self->cq_pollers + i, 0,
                                       &self->cq_pollers[i].poller);
         }
     }
     // assume only have one context
     assert(self->ctx == cm_id->verbs);
-    if (self->has_server && self->requests == NULL) server_data_init(self);
+    if (self->has_server && !self->is_server_ready) server_data_init(self);
     // --- build qp ---
+    conn->poller = self->cq_pollers + self->next_poller++ % self->thread_num;
+    if (conn->is_server && conn->poller->srq == NULL) srq_init(self, conn->poller);
     struct ibv_qp_init_attr qp_attr;
     memset(&qp_attr, 0, sizeof(struct ibv_qp_init_attr));
-    qp_attr.send_cq = self->cq;
-    qp_attr.recv_cq = self->cq;
+    qp_attr.send_cq = conn->poller->cq;
+    qp_attr.recv_cq = conn->poller->cq;
     qp_attr.qp_type = IBV_QPT_RC;
-    if (conn->is_server) qp_attr.srq = self->srq;
+    if (conn->is_server) qp_attr.srq = conn->poller->srq;
 
     qp_attr.cap.max_send_wr = MAX_Q_NUM;
     qp_attr.cap.max_recv_wr = MAX_Q_NUM;
     qp_attr.cap.max_send_sge = 1;
     qp_attr.cap.max_recv_sge = 1;
+    qp_attr.cap.max_inline_data = MAX_INLINE_SZ;
     TEST_NZ(rdma_create_qp(cm_id, self->pd, &qp_attr));
     conn->qp = cm_id->qp;
     return 0;
@@ -223,25 +296,35 @@ static inline int on_addr_resolved(struct kv_rdma *self, struct rdma_cm_id *cm_i
     return 0;
 }
 
+// both sides may issue RDMA READs: a server reads the values of its clients, and forwards requests as a client.
+static void conn_param_init(struct rdma_cm_id *cm_id, struct rdma_conn_param *cm_params) {
+    struct ibv_device_attr attr;
+    TEST_NZ(ibv_query_device(cm_id->verbs, &attr));
+    memset(cm_params, 0, sizeof(*cm_params));
+    cm_params->responder_resources = attr.max_qp_rd_atom < MAX_RD_ATOMIC ? attr.max_qp_rd_atom : MAX_RD_ATOMIC;
+    cm_params->initiator_depth = attr.max_qp_init_rd_atom < MAX_RD_ATOMIC ? attr.max_qp_init_rd_atom : MAX_RD_ATOMIC;
+}
+
 static inline int on_route_resolved(struct kv_rdma *self, struct rdma_cm_id *cm_id) {
     struct rdma_conn_param cm_params;
-    memset(&cm_params, 0, sizeof(cm_params));
+    conn_param_init(cm_id, &cm_params);
     TEST_NZ(rdma_connect(cm_id, &cm_params));
     return 0;
 }
 
 static inline int on_connect_request(struct kv_rdma *self, struct rdma_cm_id *cm_id) {
     struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection)), *lconn = cm_id->context;
-    *conn = (struct rdma_connection){self, cm_id, NULL, true};
+    *conn = (struct rdma_connection){self, cm_id, NULL, true, NULL};
     conn->u.s.handler = lconn->u.s.handler;
     conn->u.s.arg = lconn->u.s.arg;
     cm_id->context = conn;
     TEST_NZ(create_connetion(self, cm_id));
+    conn->u.s.qp_num = conn->qp->qp_num;
     pthread_rwlock_wrlock(&self->lock);
-    HASH_ADD(u.s.hh, self->connections, qp->qp_num, sizeof(uint32_t), conn);
+    HASH_ADD(u.s.hh, self->connections, u.s.qp_num, sizeof(uint32_t), conn);
     pthread_rwlock_unlock(&self->lock);
     struct rdma_conn_param cm_params;
-    memset(&cm_params, 0, sizeof(cm_params));
+    conn_param_init(cm_id, &cm_params);
     TEST_NZ(rdma_accept(cm_id, &cm_params));
     return 0;
 }
@@ -264,6 +347,15 @@ static inline int on_established(struct kv_rdma *self, struct rdma_cm_id *cm_id)
     }
     return 0;
 }
+// the completions still queued for a connection may be polled after its disconnection, so a server connection is
+// freed by its poller, once it is out of the poller's hash.
+static void server_conn_free(void *arg) {
+    struct rdma_connection *conn = arg;
+    struct rdma_connection *x = NULL;
+    HASH_FIND(u.s.poller_hh, conn->poller->connections, &conn->u.s.qp_num, sizeof(uint32_t), x);
+    if (x == conn) HASH_DELETE(u.s.poller_hh, conn->poller->connections, conn);  // qp_num may be reused already
+    kv_free(conn);
+}
 static inline int on_disconnect(struct rdma_cm_id *cm_id) {
     struct rdma_connection *conn = cm_id->context;
     if (conn->is_server) {
@@ -277,7 +369,11 @@ static inline int on_disconnect(struct rdma_cm_id *cm_id) {
     }
     rdma_destroy_qp(cm_id);
     rdma_destroy_id(cm_id);
-    if (!conn->is_server && conn->u.c.disconnect) conn->u.c.disconnect(conn->u.c.disconnect_arg);
+    if (conn->is_server) {
+        kv_app_send(conn->self->thread_id + (uint32_t)(conn->poller - conn->self->cq_pollers), server_conn_free, conn);
+        return 0;
+    }
+    if (conn->u.c.disconnect) conn->u.c.disconnect(conn->u.c.disconnect_arg);
     kv_free(conn);
     return 0;
 }
@@ -320,14 +416,19 @@ static int rdma_cm_poller(void *_self) {
 
 void kv_rdma_connect(kv_rdma_handle h, char *addr_str, char *port_str, kv_rdma_connect_cb connect_cb, void *connect_arg,
                      kv_rdma_disconnect_cb disconnect_cb, void *disconnect_arg) {
+    if (use_shm) {
+        kv_shm_connect(h, addr_str, port_str, connect_cb, connect_arg, disconnect_cb, disconnect_arg);
+        return;
+    }
     struct kv_rdma *self = h;
     struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection));
-    *conn = (struct rdma_connection){self, NULL, NULL, false};
+    *conn = (struct rdma_connection){self, NULL, NULL, false, NULL};
     conn->u.c.connect = connect_cb;
     conn->u.c.connect_arg = connect_arg;
     conn->u.c.disconnect = disconnect_cb;
     conn->u.c.disconnect_arg = disconnect_arg;
     conn->u.c.mp = kv_mempool_create(8191, sizeof(struct client_req_ctx));
+    conn->u.c.send_cnt = 0;
     struct addrinfo *addr;
     TEST_NZ(getaddrinfo(addr_str, port_str, NULL, &addr));
     TEST_NZ(rdma_create_id(self->ec, &conn->cm_id, NULL, RDMA_PS_TCP));
@@ -336,39 +437,72 @@ void kv_rdma_connect(kv_rdma_handle h, char *addr_str, char *port_str, kv_rdma_c
     freeaddrinfo(addr);
 }
 
-void kv_rdma_send_req(connection_handle h, kv_rdma_mr req, uint32_t req_sz, kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
-                      void *cb_arg) {
+#define SEND_BATCH_MAX (32U)
+// The receives and the sends of a batch are posted as two lists, so one doorbell each. Only one send in
+// SIGNAL_INTERVAL is signaled: the response of a request tells that its send is done.
+static void send_req_batch(struct rdma_connection *conn, struct kv_rdma_req *reqs, uint32_t num) {
+    struct client_req_ctx *ctxs[SEND_BATCH_MAX];
+    struct ibv_recv_wr r_wrs[SEND_BATCH_MAX], *r_bad_wr = NULL;
+    struct ibv_send_wr s_wrs[SEND_BATCH_MAX], *s_bad_wr = NULL;
+    struct ibv_sge sges[SEND_BATCH_MAX];
+    assert(num <= SEND_BATCH_MAX);
+    uint32_t cnt = atomic_fetch_add(&conn->u.c.send_cnt, num);
+    memset(s_wrs, 0, sizeof(struct ibv_send_wr) * num);
+    for (uint32_t i = 0; i < num; i++) {
+        struct kv_rdma_req *x = reqs + i;
+        struct client_req_ctx *ctx = ctxs[i] = kv_mempool_get(conn->u.c.mp);
+        *ctx = (struct client_req_ctx){conn, x->cb, x->cb_arg, x->req, x->resp};
+        assert(x->req_sz <= ctx->req->length);
+        void *resp_addr = x->resp_addr ? x->resp_addr : ctx->resp->addr;
+        *(struct req_header *)ctx->req->addr =
+            (struct req_header){(uint64_t)resp_addr, (uint32_t)kv_mempool_get_id(conn->u.c.mp, ctx)};
+        r_wrs[i] = (struct ibv_recv_wr){(uintptr_t)conn, i + 1 < num ? r_wrs + i + 1 : NULL, NULL, 0};
+        sges[i] = (struct ibv_sge){(uintptr_t)ctx->req->addr, x->req_sz + HEADER_SIZE, ctx->req->lkey};
+        s_wrs[i].wr_id = (uintptr_t)ctx;
+        s_wrs[i].next = i + 1 < num ? s_wrs + i + 1 : NULL;
+        s_wrs[i].opcode = IBV_WR_SEND_WITH_IMM;
+        s_wrs[i].imm_data = ctx->resp->rkey;
+        s_wrs[i].sg_list = sges + i;
+        s_wrs[i].num_sge = 1;
+        if ((cnt + i) % SIGNAL_INTERVAL == SIGNAL_INTERVAL - 1) s_wrs[i].send_flags |= IBV_SEND_SIGNALED;
+        if (sges[i].length <= MAX_INLINE_SZ) s_wrs[i].send_flags |= IBV_SEND_INLINE;
+    }
+    // the receives are alike, so only the sends of the receives posted are posted in turn
+    uint32_t posted = num;
+    if (ibv_post_recv(conn->qp, r_wrs, &r_bad_wr)) {
+        posted = r_bad_wr - r_wrs;
+        if (posted) s_wrs[posted - 1].next = NULL;
+    }
+    if (posted && ibv_post_send(conn->qp, s_wrs, &s_bad_wr)) posted = s_bad_wr - s_wrs;
+    for (uint32_t i = posted; i < num; i++) {
+        struct client_req_ctx *ctx = ctxs[i];
+        if (ctx->cb) ctx->cb(conn, false, ctx->req, ctx->resp, ctx->cb_arg);
+        kv_mempool_put(conn->u.c.mp, ctx);
+    }
+}
+
+void kv_rdma_send_req_batch(connection_handle h, struct kv_rdma_req *reqs, uint32_t num) {
+    if (use_shm) {
+        kv_shm_send_req_batch(h, reqs, num);
+        return;
+    }
     struct rdma_connection *conn = h;
     assert(conn->is_server == false);
-    struct client_req_ctx *ctx = kv_mempool_get(conn->u.c.mp);
-    *ctx = (struct client_req_ctx){conn, cb, cb_arg, req, resp};
-    assert(req_sz <= ctx->req->length);
-    if (resp_addr == NULL) resp_addr = ctx->resp->addr;
-    *(struct req_header *)ctx->req->addr =
-        (struct req_header){(uint64_t)resp_addr, (uint32_t)kv_mempool_get_id(conn->u.c.mp, ctx)};
-    struct ibv_recv_wr r_wr = {(uintptr_t)conn, NULL, NULL, 0}, *r_bad_wr = NULL;
-    if (ibv_post_recv(conn->qp, &r_wr, &r_bad_wr)) {
-        goto fail;
-    }
-    struct ibv_sge sge = {(uintptr_t)ctx->req->addr, req_sz + HEADER_SIZE, ctx->req->lkey};
-    struct ibv_send_wr s_wr, *s_bad_wr = NULL;
-    memset(&s_wr, 0, sizeof(s_wr));
-    s_wr.wr_id = (uintptr_t)ctx;
-    s_wr.opcode = IBV_WR_SEND_WITH_IMM;
-    s_wr.imm_data = ctx->resp->rkey;
-    s_wr.sg_list = &sge;
-    s_wr.num_sge = 1;
-    s_wr.send_flags = IBV_SEND_SIGNALED;
-    if (ibv_post_send(conn->qp, &s_wr, &s_bad_wr)) {
-        goto fail;
-    }
-    return;
-fail:
-    if (ctx->cb) ctx->cb(h, false, req, resp, ctx->cb_arg);
-    kv_free(ctx);
+    for (uint32_t i = 0; i < num; i += SEND_BATCH_MAX)
+        send_req_batch(conn, reqs + i, num - i < SEND_BATCH_MAX ? num - i : SEND_BATCH_MAX);
+}
+
+void kv_rdma_send_req(connection_handle h, kv_rdma_mr req, uint32_t req_sz, kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
+                      void *cb_arg) {
+    struct kv_rdma_req x = {req, req_sz, resp, resp_addr, cb, cb_arg};
+    kv_rdma_send_req_batch(h, &x, 1);
 }
 
 void kv_rdma_disconnect(connection_handle h) {
+    if (use_shm) {
+        kv_shm_disconnect(h);
+        return;
+    }
     struct rdma_connection *conn = h;
     TEST_NZ(rdma_disconnect(conn->cm_id));
 }
@@ -376,12 +510,16 @@ void kv_rdma_disconnect(connection_handle h) {
 // --- server ---
 void kv_rdma_listen(kv_rdma_handle h, char *addr_str, char *port_str, uint32_t con_req_num, uint32_t max_msg_sz,
                     kv_rdma_req_handler handler, void *arg, kv_rdma_server_init_cb cb, void *cb_arg) {
+    if (use_shm) {
+        kv_shm_listen(h, addr_str, port_str, con_req_num, max_msg_sz, handler, arg, cb, cb_arg);
+        return;
+    }
     struct kv_rdma *self = h;
     self->has_server = true;
     self->init_cb = cb;
     self->init_cb_arg = cb_arg;
     struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection));
-    *conn = (struct rdma_connection){self, NULL, NULL, true};
+    *conn = (struct rdma_connection){self, NULL, NULL, true, NULL};
     conn->u.s.handler = handler;
     conn->u.s.arg = arg;
     struct addrinfo *addr;
@@ -392,12 +530,24 @@ void kv_rdma_listen(kv_rdma_handle h, char *addr_str, char *port_str, uint32_t c
     conn->cm_id->context = conn;
     freeaddrinfo(addr);
     self->con_req_num = con_req_num;
+    uint32_t share = (con_req_num + self->thread_num - 1) / self->thread_num;
+    if (self->srq_depth == 0) self->srq_depth = share + share / 2;  // the share of a poller, plus half of it
+    if (self->srq_depth > con_req_num) self->srq_depth = con_req_num;
     self->max_msg_sz = max_msg_sz;
     pthread_rwlock_init(&self->lock, NULL);
     printf("kv rdma listening on %s %s.\n", addr_str, port_str);
 }
 
+void kv_rdma_set_srq_depth(kv_rdma_handle h, uint32_t srq_depth) {
+    if (use_shm) return;
+    ((struct kv_rdma *)h)->srq_depth = srq_depth;
+}
+
 void kv_rdma_make_resp(void *req_h, uint8_t *resp, uint32_t resp_sz) {
+    if (use_shm) {
+        kv_shm_make_resp(req_h, resp, resp_sz);
+        return;
+    }
     struct server_req_ctx *ctx = req_h;
     struct ibv_sge sge = {(uintptr_t)resp, resp_sz, ctx->mr->lkey};
     struct ibv_send_wr wr, *bad_wr = NULL;
@@ -413,7 +563,55 @@ void kv_rdma_make_resp(void *req_h, uint8_t *resp, uint32_t resp_sz) {
     TEST_NZ(ibv_post_send(ctx->conn->qp, &wr, &bad_wr));
 }
 
+void kv_rdma_fill_remote_buf(kv_rdma_mr mr, uint8_t *buf, uint32_t length, struct kv_rdma_remote_buf *remote) {
+    assert(buf >= (uint8_t *)((struct ibv_mr *)mr)->addr);
+    assert(buf + length <= (uint8_t *)((struct ibv_mr *)mr)->addr + ((struct ibv_mr *)mr)->length);
+    *remote = (struct kv_rdma_remote_buf){(uint64_t)buf, ((struct ibv_mr *)mr)->rkey, length};
+}
+
+static void post_remote_io(void *req_h, enum ibv_wr_opcode opcode, kv_rdma_mr mr, uint8_t *buf,
+                           struct kv_rdma_remote_buf *remote, uint32_t length, kv_rdma_io_cb cb, void *cb_arg) {
+    struct server_req_ctx *req = req_h;
+    assert(req->conn->is_server);
+    assert(length <= remote->length);
+    struct remote_io_ctx *ctx = kv_freelist_get(&remote_io_ctxs, sizeof(struct remote_io_ctx));
+    *ctx = (struct remote_io_ctx){cb, cb_arg};
+    struct ibv_sge sge = {(uintptr_t)buf, length, ((struct ibv_mr *)mr)->lkey};
+    struct ibv_send_wr wr, *bad_wr = NULL;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)ctx | REMOTE_IO_TAG;
+    wr.opcode = opcode;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = remote->addr;
+    wr.wr.rdma.rkey = remote->rkey;
+    if (ibv_post_send(req->conn->qp, &wr, &bad_wr)) {
+        kv_freelist_put(&remote_io_ctxs, ctx);
+        if (cb) cb(false, cb_arg);
+    }
+}
+
+void kv_rdma_read_remote(void *req_h, kv_rdma_mr mr, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length,
+                         kv_rdma_io_cb cb, void *cb_arg) {
+    if (use_shm) {
+        kv_shm_read_remote(req_h, buf, remote, length, cb, cb_arg);
+        return;
+    }
+    post_remote_io(req_h, IBV_WR_RDMA_READ, mr, buf, remote, length, cb, cb_arg);
+}
+
+void kv_rdma_write_remote(void *req_h, kv_rdma_mr mr, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length,
+                          kv_rdma_io_cb cb, void *cb_arg) {
+    if (use_shm) {
+        kv_shm_write_remote(req_h, buf, remote, length, cb, cb_arg);
+        return;
+    }
+    post_remote_io(req_h, IBV_WR_RDMA_WRITE, mr, buf, remote, length, cb, cb_arg);
+}
+
 uint32_t kv_rdma_conn_num(kv_rdma_handle h) {
+    if (use_shm) return kv_shm_conn_num(h);
     struct kv_rdma *self = h;
     uint32_t num;
     pthread_rwlock_rdlock(&self->lock);
@@ -431,7 +629,7 @@ static inline void on_write_resp_done(struct ibv_wc *wc) {
     assert(ctx->conn->is_server);
     struct ibv_sge sge = {(uint64_t)ctx->mr->addr, ctx->mr->length, ctx->mr->lkey};
     struct ibv_recv_wr wr = {(uint64_t)ctx, NULL, &sge, 1}, *bad_wr = NULL;
-    TEST_NZ(ibv_post_srq_recv(ctx->self->srq, &wr, &bad_wr));
+    TEST_NZ(ibv_post_srq_recv(ctx->poller->srq, &wr, &bad_wr));
 }
 
 static inline void on_recv_req(struct ibv_wc *wc) {
@@ -444,10 +642,19 @@ static inline void on_recv_req(struct ibv_wc *wc) {
     struct server_req_ctx *ctx = (struct server_req_ctx *)wc->wr_id;
     assert(wc->byte_len > HEADER_SIZE);
     assert(wc->wc_flags & IBV_WC_WITH_IMM);
-    pthread_rwlock_rdlock(&ctx->self->lock);
-    HASH_FIND(u.s.hh, ctx->self->connections, &wc->qp_num, sizeof(uint32_t), ctx->conn);
-    pthread_rwlock_unlock(&ctx->self->lock);
-    assert(ctx->conn);
+    // the poller's own hash is lock-free, the shared one is only read on the first request of a connection.
+    HASH_FIND(u.s.poller_hh, ctx->poller->connections, &wc->qp_num, sizeof(uint32_t), ctx->conn);
+    if (ctx->conn == NULL) {
+        pthread_rwlock_rdlock(&ctx->self->lock);
+        HASH_FIND(u.s.hh, ctx->self->connections, &wc->qp_num, sizeof(uint32_t), ctx->conn);
+        pthread_rwlock_unlock(&ctx->self->lock);
+        if (ctx->conn == NULL) {  // disconnected meanwhile
+            on_write_resp_done(wc);
+            return;
+        }
+        assert(ctx->conn->poller == ctx->poller);
+        HASH_ADD(u.s.poller_hh, ctx->poller->connections, u.s.qp_num, sizeof(uint32_t), ctx->conn);
+    }
     assert(ctx->conn->is_server);
     ctx->resp_rkey = wc->imm_data;
     ctx->header = *(struct req_header *)ctx->mr->addr;
@@ -464,6 +671,15 @@ static inline void on_recv_resp(struct ibv_wc *wc) {
     kv_mempool_put(conn->u.c.mp, ctx);
 }
 
+static inline void on_remote_io_done(struct ibv_wc *wc) {
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "on_remote_io_done: status is %d\n", wc->status);
+    }
+    struct remote_io_ctx *ctx = (struct remote_io_ctx *)(wc->wr_id & ~REMOTE_IO_TAG);
+    if (ctx->cb) ctx->cb(wc->status == IBV_WC_SUCCESS, ctx->cb_arg);
+    kv_freelist_put(&remote_io_ctxs, ctx);
+}
+
 static inline void on_send_req(struct ibv_wc *wc) {
     if (wc->status != IBV_WC_SUCCESS) {
         fprintf(stderr, "on_send_req: status is %d\n", wc->status);
@@ -474,10 +690,15 @@ static inline void on_send_req(struct ibv_wc *wc) {
 static int rdma_cq_poller(void *arg) {
     struct cq_poller_ctx *ctx = arg;
     struct ibv_wc wc[MAX_ENTRIES_PER_POLL];
-    while (ctx->cq) {
+    while (true) {
         int rc = ibv_poll_cq(ctx->cq, MAX_ENTRIES_PER_POLL, wc);
         if (rc <= 0) return rc;
         for (int i = 0; i < rc; i++) {
+            // the opcode of a failed completion is undefined, the tag is not.
+            if (wc[i].wr_id & REMOTE_IO_TAG) {
+                on_remote_io_done(wc + i);
+                continue;
+            }
             switch (wc[i].opcode) {
                 case IBV_WC_RECV:
                     on_recv_req(wc + i);
@@ -502,6 +723,12 @@ static int rdma_cq_poller(void *arg) {
 
 // --- init & fini ---
 void kv_rdma_init(kv_rdma_handle *h, uint32_t thread_num) {
+    char *transport = getenv(KV_SHM_ENV);
+    use_shm = transport && strcmp(transport, "shm") == 0;
+    if (use_shm) {
+        kv_shm_init(h, thread_num);
+        return;
+    }
     struct kv_rdma *self = kv_malloc(sizeof(struct kv_rdma));
     kv_memset(self, 0, sizeof(struct kv_rdma));
     self->ec = rdma_create_event_channel();
@@ -520,14 +747,17 @@ static void poller_unregister_done(void *arg) {
     struct kv_rdma *self = arg;
     if (--self->fini_ctx.io_cnt) return;
     if (self->ctx) {
-        ibv_destroy_cq(self->cq);
+        for (size_t i = 0; i < self->thread_num; i++) {
+            struct cq_poller_ctx *poller = self->cq_pollers + i;
+            if (poller->requests) {
+                ibv_destroy_srq(poller->srq);
+                kv_rdma_free_bulk(poller->mrs);
+                kv_free(poller->requests);
+            }
+            ibv_destroy_cq(poller->cq);
+        }
         ibv_dealloc_pd(self->pd);
         kv_free(self->cq_pollers);
-        if (self->requests) {
-            ibv_destroy_srq(self->srq);
-            kv_rdma_free_bulk(self->mrs);
-            kv_free(self->requests);
-        }
     }
     kv_app_send(self->fini_ctx.thread_id, self->fini_ctx.cb, self->fini_ctx.cb_arg);
     kv_free(self);
@@ -535,7 +765,7 @@ static void poller_unregister_done(void *arg) {
 
 static void cq_poller_unregister(void *arg) {
     struct cq_poller_ctx *ctx = arg;
-    ctx->cq = NULL;
+    HASH_CLEAR(u.s.poller_hh, ctx->connections);
     kv_app_poller_unregister(&ctx->poller);
     kv_app_send(ctx->self->thread_id, poller_unregister_done, ctx->self);
 }
@@ -547,6 +777,10 @@ static void cm_poller_unregister(void *arg) {
     kv_app_send(self->thread_id, poller_unregister_done, self);
 }
 void kv_rdma_fini(kv_rdma_handle h, kv_rdma_fini_cb cb, void *cb_arg) {
+    if (use_shm) {
+        kv_shm_fini(h, cb, cb_arg);
+        return;
+    }
     struct kv_rdma *self = h;
     self->fini_ctx = (struct fini_ctx_t){kv_app_get_thread_index(), 1, cb, cb_arg};
     kv_app_send(self->thread_id, cm_poller_unregister, self);
@@ -16,10 +16,12 @@ typedef void (*kv_rdma_req_handler)(void *req_h, kv_rdma_mr req, uint32_t req_sz
 typedef void (*kv_rdma_fini_cb)(void *ctx);
 typedef void (*kv_rdma_server_init_cb)(void *arg);
 
+// KV_RDMA_TRANSPORT=shm in the environment selects the shared-memory transport of kv_shm.h for the process.
 void kv_rdma_init(kv_rdma_handle *h, uint32_t thread_num);
 void kv_rdma_fini(kv_rdma_handle h, kv_rdma_fini_cb cb, void *cb_arg);
 
-enum kv_rdma_mr_type {KV_RDMA_MR_REQ,KV_RDMA_MR_RESP,KV_RDMA_MR_SERVER};
+// KV_RDMA_MR_VALUE: buffers the peer reads or writes with RDMA READ/WRITE, without any header.
+enum kv_rdma_mr_type {KV_RDMA_MR_REQ,KV_RDMA_MR_RESP,KV_RDMA_MR_SERVER,KV_RDMA_MR_VALUE};
 kv_rdma_mrs_handle kv_rdma_alloc_bulk(kv_rdma_handle h, enum kv_rdma_mr_type type, size_t size, size_t count);
 kv_rdma_mr kv_rdma_mrs_get(kv_rdma_mrs_handle h, size_t index);
 void kv_rdma_free_bulk(kv_rdma_mrs_handle h);
@@ -28,8 +30,14 @@ kv_rdma_mr kv_rdma_alloc_req(kv_rdma_handle h, uint32_t size);
 uint8_t *kv_rdma_get_req_buf(kv_rdma_mr mr);
 kv_rdma_mr kv_rdma_alloc_resp(kv_rdma_handle h, uint32_t size);
 uint8_t *kv_rdma_get_resp_buf(kv_rdma_mr mr);
+uint8_t *kv_rdma_get_value_buf(kv_rdma_mr mr);
 void kv_rdma_free_mr(kv_rdma_mr h);
 
+// Each of the thread_num pollers has its own CQ and SRQ. The connections are spread over the pollers in turn, the handler
+// of a request runs on the poller of its connection. The SRQ of a poller is made on its first connection and holds
+// srq_depth request buffers, at most con_req_num, by default the con_req_num / thread_num share of a poller plus half
+// of it. kv_rdma_set_srq_depth must be called before kv_rdma_listen, the pollers of kv_shm always take their share.
+void kv_rdma_set_srq_depth(kv_rdma_handle h, uint32_t srq_depth);
 void kv_rdma_listen(kv_rdma_handle h, char *addr_str, char *port_str, uint32_t con_req_num, uint32_t max_msg_sz,
                     kv_rdma_req_handler handler, void *arg, kv_rdma_server_init_cb cb, void *cb_arg);
 void kv_rdma_make_resp(void *req_h, uint8_t *resp, uint32_t resp_sz);  // resp must within buf
@@ -39,5 +47,31 @@ void kv_rdma_connect(kv_rdma_handle h, char *addr_str, char *port_str, kv_rdma_c
                      kv_rdma_disconnect_cb disconnect_cb, void *disconnect_arg);
 void kv_rdma_send_req(connection_handle h, kv_rdma_mr req, uint32_t req_sz, kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
                       void *cb_arg);
+// Sends num requests on the same connection at once, with one doorbell for up to 32 of them. The small requests are
+// sent inline: their buffers may be reused as soon as the call returns, the others once their responses arrive.
+struct kv_rdma_req {
+    kv_rdma_mr req;
+    uint32_t req_sz;
+    kv_rdma_mr resp;
+    void *resp_addr;
+    kv_rdma_req_cb cb;
+    void *cb_arg;
+};
+void kv_rdma_send_req_batch(connection_handle h, struct kv_rdma_req *reqs, uint32_t num);
 void kv_rdma_disconnect(connection_handle h);
+
+// --- one-sided transfers ---
+// A request may describe a registered buffer of the client instead of carrying the data, the server then moves the
+// data with RDMA READ/WRITE on the connection of the request, before responding to it. cb runs on a CQ poller.
+struct kv_rdma_remote_buf {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t length;
+};
+typedef void (*kv_rdma_io_cb)(bool success, void *cb_arg);
+void kv_rdma_fill_remote_buf(kv_rdma_mr mr, uint8_t *buf, uint32_t length, struct kv_rdma_remote_buf *remote);
+void kv_rdma_read_remote(void *req_h, kv_rdma_mr mr, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length,
+                         kv_rdma_io_cb cb, void *cb_arg);
+void kv_rdma_write_remote(void *req_h, kv_rdma_mr mr, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length,
+                          kv_rdma_io_cb cb, void *cb_arg);
 #endif
\ No newline at end of file
@@ -103,6 +103,18 @@ struct dispatch_ctx {
     next;
 };
 TAILQ_HEAD(dispatch_queue, dispatch_ctx);
+static __thread struct kv_freelist dispatch_ctxs;
+
+// a KV_MSG_MULTI message of a client and the requests packed in it, see kv_ring_multi_init.
+struct multi_ctx {
+    kv_rdma_mr req, resp;
+    uint32_t thread_index;  // of the ring thread it is free on
+    uint32_t num;
+    struct dispatch_ctx *ops[KV_MSG_MULTI_MAX_OPS];
+    SLIST_ENTRY(multi_ctx)
+    next;
+};
+SLIST_HEAD(multi_list, multi_ctx);
 
 #define RING_VERSION_MAX 64
 struct ring_version_t {
@@ -129,6 +141,11 @@ struct kv_ring {
     void *copy_cb_arg;
     struct ring_version_t (*rings_version)[RING_VERSION_MAX];
     uint64_t server_init_cnt;
+    // clients: the multi-op messages, free per ring thread
+    struct multi_ctx *multi_ctxs;
+    struct multi_list *multi_free;
+    kv_rdma_mrs_handle multi_reqs, multi_resps;
+    uint32_t multi_msg_sz, multi_room;
     struct init_ctx_t {
         char *local_ip;
         char *local_port;
@@ -257,6 +274,9 @@ static void dispatch_send_cb(connection_handle h, bool success, kv_rdma_mr req,
     struct kv_msg *msg = ctx->resp_addr;
     ctx->node->ds_queue.io_cnt[ctx->ds_id]--;
     ctx->node->ds_queue.q_info[ctx->ds_id] = msg->q_info;
+    if (success && msg->cost)
+        kv_ds_queue_set_cost(&ctx->node->ds_queue, ctx->ds_id, kv_msg_ds_op((struct kv_msg *)kv_rdma_get_req_buf(ctx->req)),
+                             msg->cost);
     ctx->node->req_cnt--;
     if (success && msg->type == KV_MSG_OUTDATED) {
         struct dispatch_queue *dp = &self->dqs[kv_app_get_thread_index() - self->thread_id];
@@ -267,25 +287,60 @@ static void dispatch_send_cb(connection_handle h, bool success, kv_rdma_mr req,
     }
     if (!success) msg->type = KV_MSG_ERR;
     if (ctx->cb) kv_app_send(ctx->thread_id, ctx->cb, ctx->cb_arg);
-    kv_free(ctx);
+    kv_freelist_put(&dispatch_ctxs, ctx);
 }
+// keys from (vnode_a, vnode_b] belong to b, and the keys past the last vnode of a ring to its first one.
+static uint64_t vnode_range_end(struct vnode_chain *chain, uint8_t *key) {
+    struct kv_ring *self = &g_ring;
+    uint64_t vid = get_vid_64(chain->base->vid.vid), prefix = get_vid_64(key);
+    if (vid >= prefix) return vid;
+    return self->log_ring_num ? prefix | ((1ULL << (64 - self->log_ring_num)) - 1) : UINT64_MAX;
+}
+
+// picks the node of a request and counts it in the queues of the node, the caller then sends it there.
 #define DISPATCH_TYPE 0
 #if DISPATCH_TYPE == 0
-static bool try_send_req(struct dispatch_ctx *ctx) {
+static bool route_req(struct dispatch_ctx *ctx) {
     struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(ctx->req);
     struct vnode_chain *chain = get_chain(KV_MSG_KEY(msg));
     if (chain == NULL) return false;
     msg->hop = 1;
-    if (msg->type == KV_MSG_GET || msg->type == KV_MSG_META_GET) {
+    if (msg->type == KV_MSG_SCAN || msg->type == KV_MSG_MGET) {
+        // served by the tail, which holds no uncommitted write, within the range of the vnode.
+        struct vid_entry *dst = chain->rpl_num ? chain->vids[chain->rpl_num - 1] : NULL;
+        struct kv_ds_q_info q_info;
+        uint32_t io_cnt;
+        if (dst) {
+            q_info = dst->node->ds_queue.q_info[dst->vid.ds_id];
+            io_cnt = dst->node->ds_queue.io_cnt[dst->vid.ds_id];
+        }
+        if (dst == NULL || !kv_ds_queue_find(&q_info, &io_cnt, 1,
+                                             kv_ds_queue_cost(&dst->node->ds_queue, dst->vid.ds_id, kv_msg_ds_op(msg)))) {
+            kv_free(chain);
+            return false;
+        }
+        ((struct kv_msg_scan *)KV_MSG_VALUE(msg))->end = vnode_range_end(chain, KV_MSG_KEY(msg));
+        msg->hop = 2;
+        ctx->ds_id = dst->vid.ds_id;
+        ctx->node = dst->node;
+        ctx->node->ds_queue.io_cnt[ctx->ds_id]++;
+        ctx->node->ds_queue.q_info[ctx->ds_id] = q_info;
+        ctx->node->req_cnt++;
+        kv_free(chain);
+        return true;
+    } else if (msg->type == KV_MSG_GET || msg->type == KV_MSG_META_GET) {
         struct kv_ds_q_info q_info[chain->rpl_num];
         uint32_t io_cnt[chain->rpl_num];
-        uint32_t i = 0;
+        uint32_t i = 0, cost = 0;
         for (; i < chain->rpl_num; i++) {
             struct vid_entry *x = chain->vids[i];
             q_info[i] = x->node->ds_queue.q_info[x->vid.ds_id];
             io_cnt[i] = x->node->ds_queue.io_cnt[x->vid.ds_id];
+            // the replica is picked before its own cost is known, the highest one is charged.
+            uint32_t x_cost = kv_ds_queue_cost(&x->node->ds_queue, x->vid.ds_id, KV_DS_GET);
+            if (x_cost > cost) cost = x_cost;
         }
-        struct kv_ds_q_info *y = kv_ds_queue_find(q_info, io_cnt, i, kv_ds_op_cost(KV_DS_GET));
+        struct kv_ds_q_info *y = kv_ds_queue_find(q_info, io_cnt, i, cost);
         if (y == NULL) {
             kv_free(chain);
             return false;
@@ -296,7 +351,6 @@ static bool try_send_req(struct dispatch_ctx *ctx) {
         ctx->node->ds_queue.io_cnt[ctx->ds_id]++;
         ctx->node->ds_queue.q_info[ctx->ds_id] = *y;
         ctx->node->req_cnt++;
-        kv_rdma_send_req(dst->node->conn, ctx->req, KV_MSG_SIZE(msg), ctx->resp, ctx->resp_addr, dispatch_send_cb, ctx);
         kv_free(chain);
         return true;
     } else {
@@ -304,7 +358,6 @@ static bool try_send_req(struct dispatch_ctx *ctx) {
             kv_free(chain);
             return false;
         }
-        uint32_t cost = kv_ds_op_cost(msg->type == KV_MSG_SET ? KV_DS_SET : KV_DS_DEL);
         struct kv_ds_q_info q_info[chain->rpl_num];
         uint32_t io_cnt[chain->rpl_num];
         uint32_t i = 0;
@@ -312,6 +365,7 @@ static bool try_send_req(struct dispatch_ctx *ctx) {
             struct vid_entry *x = chain->vids[i];
             q_info[i] = x->node->ds_queue.q_info[x->vid.ds_id];
             io_cnt[i] = x->node->ds_queue.io_cnt[x->vid.ds_id];
+            uint32_t cost = kv_ds_queue_cost(&x->node->ds_queue, x->vid.ds_id, kv_msg_ds_op(msg));
             if (!kv_ds_queue_find(q_info + i, io_cnt + i, 1, cost)) {
                 kv_free(chain);
                 return false;
@@ -325,13 +379,12 @@ static bool try_send_req(struct dispatch_ctx *ctx) {
             x->node->ds_queue.q_info[x->vid.ds_id] = q_info[i];
         }
         ctx->node->req_cnt++;
-        kv_rdma_send_req(ctx->node->conn, ctx->req, KV_MSG_SIZE(msg), ctx->resp, ctx->resp_addr, dispatch_send_cb, ctx);
         kv_free(chain);
         return true;
     }
 }
 #else
-static bool try_send_req(struct dispatch_ctx *ctx) {
+static bool route_req(struct dispatch_ctx *ctx) {
     struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(ctx->req);
     uint8_t *key = KV_MSG_KEY(msg);
     struct vid_entry *entry = find_vid_entry_from_key(key, NULL);
@@ -345,10 +398,19 @@ static bool try_send_req(struct dispatch_ctx *ctx) {
     ctx->entry = entry;
     entry->node->ds_queue.io_cnt[entry->vid->ds_id]++;
     msg->ds_id = entry->vid->ds_id;
-    kv_rdma_send_req(entry->node->conn, ctx->req, KV_MSG_SIZE(msg), ctx->resp, ctx->resp_addr, dispatch_send_cb, ctx);
     return true;
 }
 #endif
+static inline struct kv_rdma_req dispatch_req(struct dispatch_ctx *ctx) {
+    struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(ctx->req);
+    return (struct kv_rdma_req){ctx->req, KV_MSG_SIZE(msg), ctx->resp, ctx->resp_addr, dispatch_send_cb, ctx};
+}
+static bool try_send_req(struct dispatch_ctx *ctx) {
+    if (!route_req(ctx)) return false;
+    struct kv_rdma_req x = dispatch_req(ctx);
+    kv_rdma_send_req_batch(ctx->node->conn, &x, 1);
+    return true;
+}
 #define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
     for ((var) = TAILQ_FIRST((head)); (var) && ((tvar) = TAILQ_NEXT((var), field), 1); (var) = (tvar))
 static int dispatch_dequeue(void *arg) {
@@ -377,7 +439,7 @@ static void dispatch(void *arg) {
 }
 void kv_ring_dispatch(kv_rdma_mr req, kv_rdma_mr resp, void *resp_addr, kv_ring_cb cb, void *cb_arg) {
     struct kv_ring *self = &g_ring;
-    struct dispatch_ctx *ctx = kv_malloc(sizeof(*ctx));
+    struct dispatch_ctx *ctx = kv_freelist_get(&dispatch_ctxs, sizeof(*ctx));
     *ctx = (struct dispatch_ctx){req, resp, resp_addr, cb, cb_arg, kv_app_get_thread_index(), 0, 1};
     if (ctx->thread_id >= self->thread_id && ctx->thread_id < self->thread_id + self->thread_num) {
         dispatch(ctx);
@@ -386,6 +448,220 @@ void kv_ring_dispatch(kv_rdma_mr req, kv_rdma_mr resp, void *resp_addr, kv_ring_
     }
 };
 
+// the requests of a batch routed to the same node are sent together.
+struct dispatch_batch_ctx {
+    uint32_t num;
+    struct dispatch_ctx *ctxs[0];
+};
+static void dispatch_batch(void *arg) {
+    struct kv_ring *self = &g_ring;
+    struct dispatch_batch_ctx *batch = arg;
+    struct dispatch_queue *dp = &self->dqs[kv_app_get_thread_index() - self->thread_id];
+    struct kv_rdma_req reqs[batch->num];
+    for (uint32_t i = 0; i < batch->num; i++) {
+        if (!route_req(batch->ctxs[i])) {
+            TAILQ_INSERT_TAIL(dp, batch->ctxs[i], next);
+            batch->ctxs[i] = NULL;
+        }
+    }
+    for (uint32_t i = 0; i < batch->num; i++) {
+        if (batch->ctxs[i] == NULL) continue;
+        struct kv_node *node = batch->ctxs[i]->node;
+        uint32_t n = 0;
+        for (uint32_t j = i; j < batch->num; j++) {
+            if (batch->ctxs[j] == NULL || batch->ctxs[j]->node != node) continue;
+            reqs[n++] = dispatch_req(batch->ctxs[j]);
+            batch->ctxs[j] = NULL;
+        }
+        kv_rdma_send_req_batch(node->conn, reqs, n);
+    }
+    kv_free(batch);
+}
+static void send_batch(struct kv_ring_req *reqs, uint32_t num, kv_app_func func) {
+    struct kv_ring *self = &g_ring;
+    if (num == 0) return;
+    struct dispatch_batch_ctx *batch = kv_malloc(sizeof(*batch) + sizeof(struct dispatch_ctx *) * num);
+    batch->num = num;
+    uint32_t thread_id = kv_app_get_thread_index();
+    for (uint32_t i = 0; i < num; i++) {
+        struct dispatch_ctx *ctx = kv_freelist_get(&dispatch_ctxs, sizeof(*ctx));
+        *ctx = (struct dispatch_ctx){reqs[i].req, reqs[i].resp, reqs[i].resp_addr, reqs[i].cb, reqs[i].cb_arg, thread_id, 0, 1};
+        batch->ctxs[i] = ctx;
+    }
+    if (thread_id >= self->thread_id && thread_id < self->thread_id + self->thread_num) {
+        func(batch);
+    } else {
+        kv_app_send(self->thread_id + random() % self->thread_num, func, batch);
+    }
+}
+void kv_ring_dispatch_batch(struct kv_ring_req *reqs, uint32_t num) { send_batch(reqs, num, dispatch_batch); }
+
+// --- multi-op requests ---
+// picks the node serving a request in a KV_MSG_MULTI, see kv_msg.h, false if it is to be sent alone.
+static bool route_multi_op(struct dispatch_ctx *ctx) {
+    struct kv_ring *self = &g_ring;
+    struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(ctx->req);
+    if (msg->flags & KV_MSG_EXT_VALUE) return false;
+    if (msg->type != KV_MSG_GET && msg->type != KV_MSG_SET && msg->type != KV_MSG_DEL) return false;
+    if (msg->type == KV_MSG_SET && msg->value_len > self->multi_room) return false;
+    if (2 * sizeof(struct kv_msg) + sizeof(struct kv_msg_multi) + _KV_MSG_ALIGN(msg->key_len) + self->multi_room >
+        self->multi_msg_sz)
+        return false;
+    struct vnode_chain *chain = get_chain(KV_MSG_KEY(msg));
+    if (chain == NULL) return false;
+    struct vid_entry *dst = NULL;
+    if (msg->type == KV_MSG_GET && chain->rpl_num)
+        dst = chain->vids[chain->rpl_num - 1];
+    else if (msg->type != KV_MSG_GET && chain->rpl_num == 1 && chain->copy == NULL)
+        dst = chain->vids[0];
+    if (dst == NULL) {
+        kv_free(chain);
+        return false;
+    }
+    struct kv_ds_q_info q_info = dst->node->ds_queue.q_info[dst->vid.ds_id];
+    uint32_t io_cnt = dst->node->ds_queue.io_cnt[dst->vid.ds_id];
+    uint32_t cost = kv_ds_queue_cost(&dst->node->ds_queue, dst->vid.ds_id, kv_msg_ds_op(msg));
+    if (!kv_ds_queue_find(&q_info, &io_cnt, 1, cost)) {
+        kv_free(chain);
+        return false;
+    }
+    msg->hop = 1;
+    ctx->ds_id = dst->vid.ds_id;
+    ctx->node = dst->node;
+    ctx->node->ds_queue.io_cnt[ctx->ds_id]++;
+    ctx->node->ds_queue.q_info[ctx->ds_id] = q_info;
+    ctx->node->req_cnt++;
+    kv_free(chain);
+    return true;
+}
+
+static struct multi_ctx *multi_get(uint32_t thread_index) {
+    struct kv_ring *self = &g_ring;
+    struct multi_ctx *multi = SLIST_FIRST(&self->multi_free[thread_index]);
+    if (multi == NULL) return NULL;
+    SLIST_REMOVE_HEAD(&self->multi_free[thread_index], next);
+    struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(multi->req);
+    msg->type = KV_MSG_MULTI;
+    msg->key_len = 0;
+    msg->hop = 1;
+    msg->flags = 0;
+    msg->value_len = sizeof(struct kv_msg_multi);
+    *(struct kv_msg_multi *)KV_MSG_VALUE(msg) = (struct kv_msg_multi){0, self->multi_room};
+    multi->num = 0;
+    return multi;
+}
+static void multi_put(void *arg) {
+    struct kv_ring *self = &g_ring;
+    struct multi_ctx *multi = arg;
+    if (kv_app_get_thread_index() != self->thread_id + multi->thread_index) {
+        kv_app_send(self->thread_id + multi->thread_index, multi_put, multi);
+        return;
+    }
+    SLIST_INSERT_HEAD(&self->multi_free[multi->thread_index], multi, next);
+}
+// false if the request does not fit in the message.
+static bool multi_add(struct multi_ctx *multi, struct dispatch_ctx *ctx) {
+    struct kv_ring *self = &g_ring;
+    struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(multi->req);
+    struct kv_msg *op = (struct kv_msg *)kv_rdma_get_req_buf(ctx->req);
+    struct kv_msg_multi *m = (struct kv_msg_multi *)KV_MSG_VALUE(msg);
+    uint32_t op_size = kv_msg_multi_op_size(m, op->key_len);
+    if (multi->num == KV_MSG_MULTI_MAX_OPS || KV_MSG_SIZE(msg) + op_size > self->multi_msg_sz) return false;
+    kv_memcpy(KV_MSG_VALUE(msg) + msg->value_len, op, KV_MSG_SIZE(op));
+    msg->value_len += op_size;
+    m->num++;
+    multi->ops[multi->num++] = ctx;
+    return true;
+}
+// each request gets its own response out of the message, and is sent again alone if the node did not serve it.
+static void multi_send_cb(connection_handle h, bool success, kv_rdma_mr req, kv_rdma_mr resp, void *cb_arg) {
+    struct multi_ctx *multi = cb_arg;
+    struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_resp_buf(resp);
+    struct kv_msg_multi *m = (struct kv_msg_multi *)KV_MSG_VALUE(msg);
+    struct kv_msg *op = KV_MSG_MULTI_OPS(msg);
+    for (uint32_t i = 0; i < multi->num; i++) {
+        struct dispatch_ctx *ctx = multi->ops[i];
+        if (success && msg->type == KV_MSG_OK) {
+            kv_memcpy(ctx->resp_addr, op, KV_MSG_SIZE(op));
+            op = kv_msg_multi_next(m, op);
+        } else {
+            kv_memcpy(ctx->resp_addr, msg, sizeof(struct kv_msg));
+        }
+        dispatch_send_cb(h, success, ctx->req, ctx->resp, ctx);
+    }
+    multi_put(multi);
+}
+static inline struct kv_rdma_req multi_req(struct multi_ctx *multi) {
+    struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(multi->req);
+    return (struct kv_rdma_req){multi->req, KV_MSG_SIZE(msg), multi->resp, kv_rdma_get_resp_buf(multi->resp),
+                                multi_send_cb, multi};
+}
+
+// as dispatch_batch, the requests that may go in a KV_MSG_MULTI being packed in as few as possible per node.
+static void dispatch_multi(void *arg) {
+    struct kv_ring *self = &g_ring;
+    struct dispatch_batch_ctx *batch = arg;
+    uint32_t thread_index = kv_app_get_thread_index() - self->thread_id;
+    struct dispatch_queue *dp = &self->dqs[thread_index];
+    struct kv_rdma_req reqs[batch->num];
+    bool packed[batch->num];
+    for (uint32_t i = 0; i < batch->num; i++) {
+        packed[i] = route_multi_op(batch->ctxs[i]);
+        if (!packed[i] && !route_req(batch->ctxs[i])) {
+            TAILQ_INSERT_TAIL(dp, batch->ctxs[i], next);
+            batch->ctxs[i] = NULL;
+        }
+    }
+    for (uint32_t i = 0; i < batch->num; i++) {
+        if (batch->ctxs[i] == NULL) continue;
+        struct kv_node *node = batch->ctxs[i]->node;
+        struct multi_ctx *multi = NULL;
+        uint32_t n = 0;
+        for (uint32_t j = i; j < batch->num; j++) {
+            struct dispatch_ctx *ctx = batch->ctxs[j];
+            if (ctx == NULL || ctx->node != node) continue;
+            batch->ctxs[j] = NULL;
+            if (packed[j]) {
+                if (multi && !multi_add(multi, ctx)) {
+                    reqs[n++] = multi_req(multi);
+                    multi = NULL;
+                }
+                if (multi == NULL && (multi = multi_get(thread_index)) != NULL) multi_add(multi, ctx);
+                if (multi) continue;
+            }
+            reqs[n++] = dispatch_req(ctx);
+        }
+        if (multi) reqs[n++] = multi_req(multi);
+        kv_rdma_send_req_batch(node->conn, reqs, n);
+    }
+    kv_free(batch);
+}
+void kv_ring_dispatch_multi(struct kv_ring_req *reqs, uint32_t num) {
+    struct kv_ring *self = &g_ring;
+    send_batch(reqs, num, self->multi_ctxs ? dispatch_multi : dispatch_batch);
+}
+
+void kv_ring_multi_init(uint32_t max_msg_sz, uint32_t value_room, uint32_t msg_num) {
+    struct kv_ring *self = &g_ring;
+    uint32_t n = self->thread_num * msg_num;
+    self->multi_msg_sz = max_msg_sz;
+    self->multi_room = _KV_MSG_ALIGN(value_room);
+    self->multi_reqs = kv_rdma_alloc_bulk(self->h, KV_RDMA_MR_REQ, max_msg_sz, n);
+    self->multi_resps = kv_rdma_alloc_bulk(self->h, KV_RDMA_MR_RESP, max_msg_sz, n);
+    self->multi_ctxs = kv_calloc(n, sizeof(struct multi_ctx));
+    self->multi_free = kv_calloc(self->thread_num, sizeof(struct multi_list));
+    for (uint32_t i = 0; i < self->thread_num; i++) {
+        SLIST_INIT(&self->multi_free[i]);
+        for (uint32_t j = i * msg_num; j < (i + 1) * msg_num; j++) {
+            struct multi_ctx *multi = self->multi_ctxs + j;
+            multi->req = kv_rdma_mrs_get(self->multi_reqs, j);
+            multi->resp = kv_rdma_mrs_get(self->multi_resps, j);
+            multi->thread_index = i;
+            SLIST_INSERT_HEAD(&self->multi_free[i], multi, next);
+        }
+    }
+}
+
 struct forward_ctx {
     struct kv_node *node;
     kv_rdma_mr req;
@@ -394,7 +670,11 @@ struct forward_ctx {
     void *cb_arg;
     uint32_t thread_id;
     struct ring_version_t *ring_version;
+    // a KV_MSG_MULTI holds the versions of the rings of its ops instead, NULL for the other requests.
+    struct ring_version_t **versions;
+    uint32_t version_num;
 };
+static __thread struct kv_freelist forward_ctxs, multi_versions;
 
 static void forward_cb(connection_handle h, bool success, kv_rdma_mr req, kv_rdma_mr resp, void *cb_arg) {
     struct forward_ctx *ctx = cb_arg;
@@ -403,7 +683,7 @@ static void forward_cb(connection_handle h, bool success, kv_rdma_mr req, kv_rdm
     if (!success) msg->type = KV_MSG_ERR;
     if (ctx->cb) kv_app_send(ctx->thread_id, ctx->cb, ctx->cb_arg);
     if (!ctx->is_copy_req) ctx->ring_version->counter--;
-    kv_free(ctx);
+    kv_freelist_put(&forward_ctxs, ctx);
 }
 
 static void forward(void *arg) {
@@ -426,12 +706,17 @@ void kv_ring_forward(void *_ctx, kv_rdma_mr req, bool is_copy_req, kv_ring_cb cb
     struct forward_ctx *ctx = _ctx;
     if (is_copy_req) {
         assert(ctx == NULL);
-        ctx = kv_malloc(sizeof(*ctx));
+        ctx = kv_freelist_get(&forward_ctxs, sizeof(*ctx));
         ctx->node = NULL;
     } else if (req == NULL || ctx->node == NULL) {
         if (ctx->node) ctx->node->req_cnt--;
-        ctx->ring_version->counter--;
-        kv_free(ctx);
+        if (ctx->versions) {
+            for (uint32_t i = 0; i < ctx->version_num; i++) ctx->versions[i]->counter--;
+            kv_freelist_put(&multi_versions, ctx->versions);
+        } else {
+            ctx->ring_version->counter--;
+        }
+        kv_freelist_put(&forward_ctxs, ctx);
         if (cb) cb(cb_arg);
         return;
     }
@@ -949,6 +1234,7 @@ kv_rdma_handle kv_ring_init(char *etcd_ip, char *etcd_port, uint32_t thread_num,
     self->nodes = NULL;
     self->rings = NULL;
     self->dqs = NULL;
+    self->multi_ctxs = NULL;
     STAILQ_INIT(&self->conn_q);
     self->thread_id = kv_app_get_thread_index();
     self->thread_num = thread_num;
@@ -977,16 +1263,54 @@ void kv_ring_stop_copy(struct kv_ring_copy_info *info) {
     kvEtcdDel(key);
 }
 
+// The ops of a KV_MSG_MULTI that this node serves alone get the data store in their ds_id, the others are sent back.
+// The handler answers them all at once, without forwarding.
+static void multi_req_handler(void *req_h, kv_rdma_mr req, struct kv_msg *msg, void *arg) {
+    struct kv_ring *self = &g_ring;
+    struct kv_msg_multi *multi = (struct kv_msg_multi *)KV_MSG_VALUE(msg);
+    struct forward_ctx *ctx = kv_freelist_get(&forward_ctxs, sizeof(*ctx));
+    ctx->node = NULL;
+    ctx->versions = kv_freelist_get(&multi_versions, sizeof(struct ring_version_t *) * KV_MSG_MULTI_MAX_OPS);
+    ctx->version_num = 0;
+    struct kv_msg *op = KV_MSG_MULTI_OPS(msg);
+    for (uint32_t i = 0; i < multi->num; i++, op = kv_msg_multi_next(multi, op)) {
+        struct vnode_chain *chain = NULL;
+        struct vid_entry *local = NULL;
+        if (i < KV_MSG_MULTI_MAX_OPS && !(op->flags & KV_MSG_EXT_VALUE)) chain = get_chain(KV_MSG_KEY(op));
+        if (chain && chain->rpl_num) {
+            if (op->type == KV_MSG_GET ||
+                ((op->type == KV_MSG_SET || op->type == KV_MSG_DEL) && chain->rpl_num == 1 && chain->copy == NULL))
+                local = chain->vids[chain->rpl_num - 1];
+        }
+        if (local && local->node->is_local) {
+            op->ds_id = local->vid.ds_id;
+            ctx->versions[ctx->version_num] =
+                self->rings_version[get_ring_id(KV_MSG_KEY(op), self->log_ring_num)] + chain->ring->version;
+            ctx->versions[ctx->version_num++]->counter++;
+        } else {
+            op->type = KV_MSG_OUTDATED;
+        }
+        if (chain) kv_free(chain);
+    }
+    self->req_handler(req_h, req, ctx, false, 0, KV_RING_TAIL, arg);
+}
+
 static void rdma_req_handler_wrapper(void *req_h, kv_rdma_mr req, uint32_t req_sz, void *arg) {
     struct kv_ring *self = &g_ring;
     struct kv_msg *msg = (struct kv_msg *)kv_rdma_get_req_buf(req);
     struct vnode_chain *chain = NULL;
     struct forward_ctx *ctx = NULL;
     if (self->is_server_exiting) goto send_nak;
+    if (msg->type == KV_MSG_MULTI) {
+        if (self->rings == NULL) goto send_nak;
+        multi_req_handler(req_h, req, msg, arg);
+        return;
+    }
     chain = get_chain(KV_MSG_KEY(msg));
     if (chain == NULL) goto send_nak;
-    ctx = kv_malloc(sizeof(*ctx));
+    ctx = kv_freelist_get(&forward_ctxs, sizeof(*ctx));
     ctx->ring_version = self->rings_version[get_ring_id(KV_MSG_KEY(msg), self->log_ring_num)] + chain->ring->version;
+    ctx->versions = NULL;
     ctx->node = NULL;
     if (msg->type == KV_MSG_SET || msg->type == KV_MSG_BUFFERED_SET || msg->type == KV_MSG_DEL) {
         struct vid_entry *local, *next = NULL;
@@ -1016,8 +1340,9 @@ static void rdma_req_handler_wrapper(void *req_h, kv_rdma_mr req, uint32_t req_s
         self->req_handler(req_h, req, ctx, ctx->node != NULL, local->vid.ds_id, vnode_type, arg);
         kv_free(chain);
         return;
-    } else if (msg->type == KV_MSG_GET || msg->type == KV_MSG_META_GET) {
-        if (msg->hop == 1) {
+    } else if (msg->type == KV_MSG_GET || msg->type == KV_MSG_META_GET || msg->type == KV_MSG_SCAN ||
+               msg->type == KV_MSG_MGET) {
+        if (msg->hop == 1 && msg->type != KV_MSG_SCAN && msg->type != KV_MSG_MGET) {
             uint32_t i = 0;
             for (; i < chain->rpl_num; i++)
                 if (chain->vids[i]->node->is_local) break;
@@ -1037,6 +1362,12 @@ static void rdma_req_handler_wrapper(void *req_h, kv_rdma_mr req, uint32_t req_s
         } else if (msg->hop == 2) {
             struct vid_entry *tail = chain->vids[chain->rpl_num - 1];
             if (!tail->node->is_local) goto send_nak;
+            if (msg->type == KV_MSG_SCAN || msg->type == KV_MSG_MGET) {
+                // the ring may have changed since the dispatch.
+                struct kv_msg_scan *scan = (struct kv_msg_scan *)KV_MSG_VALUE(msg);
+                uint64_t end = vnode_range_end(chain, KV_MSG_KEY(msg));
+                if (end < scan->end) scan->end = end;
+            }
             ctx->ring_version->counter++;
             self->req_handler(req_h, req, ctx, ctx->node != NULL, tail->vid.ds_id, KV_RING_TAIL, arg);
             kv_free(chain);
@@ -1046,7 +1377,7 @@ static void rdma_req_handler_wrapper(void *req_h, kv_rdma_mr req, uint32_t req_s
     assert(false);
 send_nak:
     if (chain) kv_free(chain);
-    if (ctx) kv_free(ctx);
+    if (ctx) kv_freelist_put(&forward_ctxs, ctx);
     msg->type = KV_MSG_OUTDATED;
     msg->value_len = 0;
     kv_rdma_make_resp(req_h, (uint8_t *)msg, KV_MSG_SIZE(msg));
@@ -1070,6 +1401,13 @@ void kv_ring_fini(kv_rdma_fini_cb cb, void *cb_arg) {
     kvEtcdFini();
     // TODO: diconnect all nodes
     kv_app_poller_unregister(&self->conn_q_poller);
+    if (self->multi_ctxs) {
+        kv_rdma_free_bulk(self->multi_reqs);
+        kv_rdma_free_bulk(self->multi_resps);
+        kv_free(self->multi_ctxs);
+        kv_free(self->multi_free);
+        self->multi_ctxs = NULL;
+    }
     kv_rdma_fini(self->h, cb, cb_arg);
     if (self->rings) {
         for (size_t i = 0; i < self->thread_num; i++) kv_free(self->rings[i]);
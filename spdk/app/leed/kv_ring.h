@@ -16,7 +16,24 @@ typedef void (*kv_ring_req_handler)(void *req_h, kv_rdma_mr req, void *fwd_ctx,
                                     uint32_t ds_id, uint32_t vnode_type, void *arg);
 typedef void (*kv_ring_copy_cb)(bool is_start, struct kv_ring_copy_info *info, void *arg);
 
+struct kv_ring_req {
+    kv_rdma_mr req;
+    kv_rdma_mr resp;
+    void *resp_addr;
+    kv_ring_cb cb;
+    void *cb_arg;
+};
 void kv_ring_dispatch(kv_rdma_mr req, kv_rdma_mr resp, void *resp_addr, kv_ring_cb cb, void *cb_arg);  // for clients
+// dispatches num requests at once, those going to the same node with a single doorbell. reqs may be reused on return.
+void kv_ring_dispatch_batch(struct kv_ring_req *reqs, uint32_t num);                                     // for clients
+// as kv_ring_dispatch_batch, but the GETs, SETs and DELs going to the same node are packed into KV_MSG_MULTI messages,
+// see kv_msg.h, each request still getting its own response and callback. Needs kv_ring_multi_init, else the requests
+// are sent alone.
+void kv_ring_dispatch_multi(struct kv_ring_req *reqs, uint32_t num);                                     // for clients
+// The messages hold up to max_msg_sz bytes, at most the -M option of the servers, and give value_room bytes of value
+// to each request: a SET with a longer value is sent alone. msg_num messages are allocated per ring thread, the
+// requests past them are sent alone. Called once after kv_ring_init.
+void kv_ring_multi_init(uint32_t max_msg_sz, uint32_t value_room, uint32_t msg_num);                    // for clients
 void kv_ring_forward(void *fwd_ctx, kv_rdma_mr req, bool is_copy_req, kv_ring_cb cb, void *cb_arg);    // for servers
 
 void kv_ring_register_copy_cb(kv_ring_copy_cb copy_cb, void *cb_arg);
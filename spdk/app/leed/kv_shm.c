@@ -0,0 +1,729 @@
+#include "kv_shm.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kv_app.h"
+#include "kv_memory.h"
+
+#define SHM_MAGIC (0x6c656564U)        // "leed"
+#define SHM_BACKLOG (64U)              // connection requests pending on a listener
+#define SHM_SLOT_NUM (1024U)           // slots of each ring, a power of 2
+#define SHM_CONNECT_TIMEOUT (5000U)    // in polls of the cm poller, 5s
+#define SHM_MAX_MAPS (64U)             // value buffers of a client the server keeps mapped
+#define SHM_NAME_LEN (64U)
+#define SHM_LINE (64U)
+#define SHM_ALIGN(size) (((size) + SHM_LINE - 1) & ~(size_t)(SHM_LINE - 1))
+#define MAX_ENTRIES_PER_POLL 128
+
+#define TEST_NZ(x)                                      \
+    do {                                                \
+        if ((x)) {                                      \
+            fprintf(stderr, "error: " #x " failed.\n"); \
+            exit(-1);                                   \
+        }                                               \
+    } while (0)
+#define TEST_Z(x) TEST_NZ(!(x))
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
+    for ((var) = TAILQ_FIRST((head)); (var) && ((tvar) = TAILQ_NEXT((var), field), 1); (var) = (tvar))
+
+// --- shared layouts ---
+// The rings are bounded MPMC queues whose slots carry a sequence number: many threads of a process produce, the poller
+// of the connection consumes.
+struct shm_slot {
+    _Atomic uint64_t seq;
+    uint32_t len;
+    uint32_t req_id;
+    uint64_t resp_addr;  // in the client
+    uint8_t data[0];
+};
+struct shm_ring {
+    _Atomic uint64_t tail __attribute__((aligned(SHM_LINE)));  // the producers
+    uint64_t head __attribute__((aligned(SHM_LINE)));          // the consumer
+};
+// created by the client, SHM_SLOT_NUM slots of the request ring then as many of the response ring follow.
+struct shm_conn_seg {
+    uint32_t magic;
+    uint32_t slot_sz;
+    _Atomic bool closed;  // set by either side, the peer then drops the connection
+    struct shm_ring req, resp;
+    uint8_t slots[0] __attribute__((aligned(SHM_LINE)));
+};
+// the connection requests of the clients, each claims a free one.
+enum { REQ_FREE, REQ_CLAIMED, REQ_PENDING, REQ_ACCEPTED, REQ_REJECTED };
+struct shm_listener {
+    _Atomic uint32_t magic;  // set last
+    uint32_t max_msg_sz;
+    struct shm_conn_req {
+        _Atomic uint32_t state;
+        uint32_t pid;
+        uint32_t conn_id;
+    } reqs[SHM_BACKLOG];
+};
+// the head of a value buffer, base is its address in the client.
+struct shm_value_seg {
+    uint64_t base;
+    uint64_t length;
+    uint32_t rkey;
+    _Atomic bool freed;  // by the client, the servers unmap it then
+};
+#define VALUE_SEG_HEAD SHM_ALIGN(sizeof(struct shm_value_seg))
+
+// --- local state ---
+enum { SHM_FAILED, SHM_CONNECTING, SHM_ESTABLISHED };
+struct shm_value_map {
+    uint32_t rkey;         // 0 if the map is unused
+    _Atomic uint32_t ref;  // remote IOs copying from or to the buffer, which keep it mapped
+    struct shm_value_seg *seg;
+    size_t size;  // mapped, the header of the segment is the client's to change
+    uint64_t base;
+};
+struct shm_connection {
+    struct kv_shm *self;
+    bool is_server;
+    uint32_t state;
+    struct shm_poller *poller;
+    struct shm_conn_seg *seg;
+    size_t seg_sz;
+    char name[SHM_NAME_LEN];
+    _Atomic bool removed;  // from its poller, which polls it no more
+    TAILQ_ENTRY(shm_connection) cm_entry;
+    TAILQ_ENTRY(shm_connection) poller_entry;
+    union {
+        // server connection data
+        struct {
+            uint32_t pid;
+            _Atomic uint32_t inflight;  // requests not responded yet, which keep the connection
+            pthread_mutex_t resp_lock;
+            _Atomic uint32_t resp_num;
+            STAILQ_HEAD(, server_req_ctx) resps;  // responses waiting for a free slot of the response ring
+            pthread_mutex_t map_lock;
+            uint32_t next_map;  // the next one to evict
+            struct shm_value_map maps[SHM_MAX_MAPS];
+        } s;
+        // client connection data
+        struct {
+            kv_rdma_connect_cb connect;
+            void *connect_arg;
+            kv_rdma_disconnect_cb disconnect;
+            void *disconnect_arg;
+            struct kv_mempool *mp;
+            struct shm_listener *listener;
+            size_t listener_sz;
+            struct shm_conn_req *req;
+            uint32_t timeout;
+        } c;
+    } u;
+};
+TAILQ_HEAD(shm_conn_list, shm_connection);
+struct server_req_ctx {
+    struct shm_connection *conn;
+    kv_rdma_mr mr;
+    uint32_t req_id;
+    uint64_t resp_addr;
+    uint8_t *resp;  // in the request buffer, kept until sent
+    uint32_t resp_sz;
+    STAILQ_ENTRY(server_req_ctx) entry;
+    _Atomic bool busy;
+};
+// Like the CQ pollers of kv_rdma, each has its share of the request buffers and polls the connections given to it.
+struct shm_poller {
+    struct kv_shm *self;
+    void *poller;
+    struct shm_conn_list conns;  // only ever touched by its thread
+    struct server_req_ctx *reqs;
+    kv_rdma_mrs_handle mrs;
+    uint32_t req_num, next;
+};
+struct client_req_ctx {
+    kv_rdma_req_cb cb;
+    void *cb_arg;
+    kv_rdma_mr req, resp;
+};
+struct fini_ctx_t {
+    uint32_t thread_id, io_cnt;
+    kv_app_func cb;
+    void *cb_arg;
+};
+struct kv_shm {
+    uint32_t thread_num, thread_id;
+    void *cm_poller;
+    struct shm_poller *pollers;
+    uint32_t next_poller;
+    struct shm_conn_list conns;  // only ever touched by the cm poller
+    // client data
+    _Atomic uint32_t conn_id;
+    // server data
+    struct shm_listener *listener;
+    char listener_name[SHM_NAME_LEN];
+    kv_rdma_req_handler handler;
+    void *arg;
+    uint32_t max_msg_sz;
+    _Atomic uint32_t conn_num;
+    kv_rdma_server_init_cb init_cb;
+    void *init_cb_arg;
+    // finish ctx
+    struct fini_ctx_t fini_ctx;
+};
+struct remote_io_ctx {
+    kv_rdma_io_cb cb;
+    void *cb_arg;
+    bool success;
+};
+static __thread struct kv_freelist remote_io_ctxs;
+
+// --- segments & rings ---
+// *size is the size to create, or is set to the size of the segment opened.
+static void *shm_map(const char *name, size_t *size, bool create) {
+    if (create) shm_unlink(name);  // left by a crashed process
+    int fd = shm_open(name, create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (create ? ftruncate(fd, *size) != 0 : fstat(fd, &st) != 0) goto fail;
+    if (!create) *size = st.st_size;
+    void *addr = *size ? mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (addr == MAP_FAILED) goto fail;
+    close(fd);
+    return addr;
+fail:
+    close(fd);
+    if (create) shm_unlink(name);
+    return NULL;
+}
+
+static inline struct shm_slot *ring_slot(struct shm_conn_seg *seg, struct shm_ring *ring, uint64_t pos) {
+    uint8_t *slots = seg->slots + (ring == &seg->resp ? (size_t)SHM_SLOT_NUM * seg->slot_sz : 0);
+    return (struct shm_slot *)(slots + (pos & (SHM_SLOT_NUM - 1)) * seg->slot_sz);
+}
+// a slot to fill then commit, NULL if the ring is full.
+static struct shm_slot *ring_reserve(struct shm_conn_seg *seg, struct shm_ring *ring) {
+    uint64_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (true) {
+        struct shm_slot *slot = ring_slot(seg, ring, pos);
+        int64_t dif = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (dif < 0) return NULL;
+        if (dif == 0 && atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed,
+                                                              memory_order_relaxed))
+            return slot;
+        if (dif > 0) pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+}
+static inline void ring_commit(struct shm_slot *slot) {
+    atomic_store_explicit(&slot->seq, atomic_load_explicit(&slot->seq, memory_order_relaxed) + 1, memory_order_release);
+}
+static inline struct shm_slot *ring_peek(struct shm_conn_seg *seg, struct shm_ring *ring) {
+    struct shm_slot *slot = ring_slot(seg, ring, ring->head);
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == ring->head + 1 ? slot : NULL;
+}
+static inline void ring_pop(struct shm_ring *ring, struct shm_slot *slot) {
+    atomic_store_explicit(&slot->seq, ring->head + SHM_SLOT_NUM, memory_order_release);
+    ring->head++;
+}
+static void ring_init(struct shm_conn_seg *seg, struct shm_ring *ring) {
+    ring->tail = 0;
+    ring->head = 0;
+    for (uint64_t i = 0; i < SHM_SLOT_NUM; i++) ring_slot(seg, ring, i)->seq = i;
+}
+
+// --- value buffers ---
+static _Atomic uint32_t value_seg_num;
+static inline void value_seg_name(char *name, uint32_t pid, uint32_t rkey) {
+    snprintf(name, SHM_NAME_LEN, "/leed-%u-v%u", pid, rkey);
+}
+void *kv_shm_alloc_value(size_t size, uint32_t *rkey) {
+    char name[SHM_NAME_LEN];
+    *rkey = ++value_seg_num;
+    value_seg_name(name, getpid(), *rkey);
+    size_t seg_sz = VALUE_SEG_HEAD + size;
+    struct shm_value_seg *seg;
+    TEST_Z(seg = shm_map(name, &seg_sz, true));
+    uint8_t *buf = (uint8_t *)seg + VALUE_SEG_HEAD;
+    seg->base = (uint64_t)buf;
+    seg->length = size;
+    seg->rkey = *rkey;
+    return buf;
+}
+void kv_shm_free_value(void *buf) {
+    char name[SHM_NAME_LEN];
+    struct shm_value_seg *seg = (struct shm_value_seg *)((uint8_t *)buf - VALUE_SEG_HEAD);
+    value_seg_name(name, getpid(), seg->rkey);
+    atomic_store(&seg->freed, true);
+    shm_unlink(name);
+    munmap(seg, VALUE_SEG_HEAD + seg->length);
+}
+
+static inline void value_map_clear(struct shm_value_map *map) {
+    munmap(map->seg, map->size);
+    map->rkey = 0;
+}
+static struct shm_value_map *value_map_init(struct shm_connection *conn, struct shm_value_map *map, uint32_t rkey) {
+    char name[SHM_NAME_LEN];
+    size_t size = 0;
+    value_seg_name(name, conn->u.s.pid, rkey);
+    struct shm_value_seg *seg = shm_map(name, &size, false);
+    if (seg == NULL) return NULL;
+    if (size < VALUE_SEG_HEAD || atomic_load(&seg->freed)) {
+        munmap(seg, size);
+        return NULL;
+    }
+    map->rkey = rkey;
+    map->seg = seg;
+    map->size = size;
+    map->base = seg->base;
+    return map;
+}
+// the value buffer rkey of the client, kept mapped until value_map_put. The maps of a connection are a fixed pool: on
+// a miss, the buffers the client freed are unmapped, then an idle map is evicted if none is unused.
+static struct shm_value_map *value_map_get(struct shm_connection *conn, uint32_t rkey) {
+    struct shm_value_map *maps = conn->u.s.maps, *map = NULL;
+    if (rkey == 0) return NULL;
+    pthread_mutex_lock(&conn->u.s.map_lock);
+    for (uint32_t i = 0; i < SHM_MAX_MAPS && map == NULL; i++)
+        if (maps[i].rkey == rkey && !atomic_load(&maps[i].seg->freed)) map = maps + i;
+    if (map == NULL) {
+        for (uint32_t i = 0; i < SHM_MAX_MAPS; i++)
+            if (maps[i].rkey && atomic_load(&maps[i].ref) == 0 && atomic_load(&maps[i].seg->freed))
+                value_map_clear(maps + i);
+        for (uint32_t i = 0; i < SHM_MAX_MAPS && map == NULL; i++)
+            if (maps[i].rkey == 0) map = maps + i;
+        for (uint32_t i = 0; i < SHM_MAX_MAPS && map == NULL; i++) {
+            struct shm_value_map *x = maps + conn->u.s.next_map++ % SHM_MAX_MAPS;
+            if (atomic_load(&x->ref) == 0) {
+                value_map_clear(x);
+                map = x;
+            }
+        }
+        if (map) map = value_map_init(conn, map, rkey);
+    }
+    if (map) atomic_fetch_add(&map->ref, 1);
+    pthread_mutex_unlock(&conn->u.s.map_lock);
+    return map;
+}
+static inline void value_map_put(struct shm_value_map *map) { atomic_fetch_sub(&map->ref, 1); }
+
+// --- connections ---
+static inline uint32_t poller_thread(struct shm_connection *conn) {
+    return conn->self->thread_id + (uint32_t)(conn->poller - conn->self->pollers);
+}
+static void poller_add(void *arg) {
+    struct shm_connection *conn = arg;
+    TAILQ_INSERT_TAIL(&conn->poller->conns, conn, poller_entry);
+}
+static void conn_establish(struct kv_shm *self, struct shm_connection *conn) {
+    conn->state = SHM_ESTABLISHED;
+    conn->poller = self->pollers + self->next_poller++ % self->thread_num;
+    kv_app_send(poller_thread(conn), poller_add, conn);
+}
+static void conn_free(struct shm_connection *conn, bool notify) {
+    if (conn->seg) munmap(conn->seg, conn->seg_sz);
+    if (conn->is_server) {
+        for (uint32_t i = 0; i < SHM_MAX_MAPS; i++)
+            if (conn->u.s.maps[i].rkey) value_map_clear(conn->u.s.maps + i);
+        pthread_mutex_destroy(&conn->u.s.map_lock);
+        pthread_mutex_destroy(&conn->u.s.resp_lock);
+        if (conn->state == SHM_ESTABLISHED) {
+            conn->self->conn_num--;
+            if (notify) printf("server: process %u disconnected.\n", conn->u.s.pid);
+        }
+    } else {
+        if (conn->seg) shm_unlink(conn->name);
+        if (conn->u.c.listener) munmap(conn->u.c.listener, conn->u.c.listener_sz);
+        kv_mempool_free(conn->u.c.mp);
+        if (notify && conn->u.c.disconnect) conn->u.c.disconnect(conn->u.c.disconnect_arg);
+    }
+    kv_free(conn);
+}
+
+static void on_connect_req(struct kv_shm *self, struct shm_conn_req *req) {
+    struct shm_connection *conn = kv_calloc(1, sizeof(struct shm_connection));
+    conn->self = self;
+    conn->is_server = true;
+    conn->u.s.pid = req->pid;
+    pthread_mutex_init(&conn->u.s.map_lock, NULL);
+    pthread_mutex_init(&conn->u.s.resp_lock, NULL);
+    STAILQ_INIT(&conn->u.s.resps);
+    snprintf(conn->name, SHM_NAME_LEN, "/leed-%u-c%u", req->pid, req->conn_id);
+    conn->seg = shm_map(conn->name, &conn->seg_sz, false);
+    uint32_t expected = REQ_PENDING;
+    if (conn->seg == NULL || conn->seg_sz < sizeof(struct shm_conn_seg) || conn->seg->magic != SHM_MAGIC ||
+        conn->seg->slot_sz < sizeof(struct shm_slot) + self->max_msg_sz ||
+        conn->seg_sz < sizeof(struct shm_conn_seg) + 2ULL * SHM_SLOT_NUM * conn->seg->slot_sz) {
+        atomic_compare_exchange_strong(&req->state, &expected, REQ_REJECTED);
+        conn_free(conn, false);
+        return;
+    }
+    if (!atomic_compare_exchange_strong(&req->state, &expected, REQ_ACCEPTED)) {  // the client gave up
+        conn_free(conn, false);
+        return;
+    }
+    conn_establish(self, conn);
+    self->conn_num++;
+    TAILQ_INSERT_TAIL(&self->conns, conn, cm_entry);
+    printf("server: received connection from process %u.\n", conn->u.s.pid);
+}
+
+static void on_connecting(struct kv_shm *self, struct shm_connection *conn) {
+    uint32_t state = atomic_load(&conn->u.c.req->state);
+    if (state == REQ_PENDING) {
+        if (--conn->u.c.timeout) return;
+        if (atomic_compare_exchange_strong(&conn->u.c.req->state, &state, REQ_FREE)) state = REQ_FREE;
+    }
+    if (state != REQ_FREE) atomic_store(&conn->u.c.req->state, REQ_FREE);
+    munmap(conn->u.c.listener, conn->u.c.listener_sz);
+    conn->u.c.listener = NULL;
+    if (state == REQ_ACCEPTED) {
+        conn_establish(self, conn);
+        if (conn->u.c.connect) conn->u.c.connect(conn, conn->u.c.connect_arg);
+    } else {
+        conn->state = SHM_FAILED;
+    }
+}
+
+static int shm_cm_poller(void *arg) {
+    struct kv_shm *self = arg;
+    if (self->listener) {
+        for (uint32_t i = 0; i < SHM_BACKLOG; i++) {
+            if (atomic_load(&self->listener->reqs[i].state) == REQ_PENDING) on_connect_req(self, self->listener->reqs + i);
+        }
+    }
+    struct shm_connection *conn, *tmp;
+    TAILQ_FOREACH_SAFE(conn, &self->conns, cm_entry, tmp) {
+        if (conn->state == SHM_CONNECTING) on_connecting(self, conn);
+        if (conn->state == SHM_FAILED) {
+            TAILQ_REMOVE(&self->conns, conn, cm_entry);
+            if (conn->u.c.connect) conn->u.c.connect(NULL, conn->u.c.connect_arg);
+            conn_free(conn, false);
+        } else if (conn->state == SHM_ESTABLISHED && atomic_load(&conn->removed) &&
+                   (!conn->is_server || atomic_load(&conn->u.s.inflight) == 0)) {
+            TAILQ_REMOVE(&self->conns, conn, cm_entry);
+            conn_free(conn, true);
+        }
+    }
+    return 0;
+}
+
+// --- client ---
+static void cm_add(void *arg) {
+    struct shm_connection *conn = arg;
+    TAILQ_INSERT_TAIL(&conn->self->conns, conn, cm_entry);
+}
+void kv_shm_connect(kv_rdma_handle h, char *addr_str, char *port_str, kv_rdma_connect_cb connect_cb, void *connect_arg,
+                    kv_rdma_disconnect_cb disconnect_cb, void *disconnect_arg) {
+    struct kv_shm *self = h;
+    struct shm_connection *conn = kv_calloc(1, sizeof(struct shm_connection));
+    conn->self = self;
+    conn->state = SHM_FAILED;
+    conn->u.c.connect = connect_cb;
+    conn->u.c.connect_arg = connect_arg;
+    conn->u.c.disconnect = disconnect_cb;
+    conn->u.c.disconnect_arg = disconnect_arg;
+    conn->u.c.mp = kv_mempool_create(8191, sizeof(struct client_req_ctx));
+    // the failures are reported by the cm poller, as those of kv_rdma
+    char name[SHM_NAME_LEN];
+    snprintf(name, SHM_NAME_LEN, "/leed-%s", port_str);
+    struct shm_listener *listener = shm_map(name, &conn->u.c.listener_sz, false);
+    if (listener == NULL) goto out;
+    conn->u.c.listener = listener;
+    if (conn->u.c.listener_sz < sizeof(struct shm_listener) || listener->magic != SHM_MAGIC) goto out;
+
+    uint32_t conn_id = atomic_fetch_add(&self->conn_id, 1);
+    snprintf(conn->name, SHM_NAME_LEN, "/leed-%u-c%u", getpid(), conn_id);
+    uint32_t slot_sz = SHM_ALIGN(sizeof(struct shm_slot) + listener->max_msg_sz);
+    conn->seg_sz = sizeof(struct shm_conn_seg) + 2ULL * SHM_SLOT_NUM * slot_sz;
+    if ((conn->seg = shm_map(conn->name, &conn->seg_sz, true)) == NULL) goto out;
+    conn->seg->slot_sz = slot_sz;
+    conn->seg->closed = false;
+    ring_init(conn->seg, &conn->seg->req);
+    ring_init(conn->seg, &conn->seg->resp);
+    conn->seg->magic = SHM_MAGIC;
+
+    for (uint32_t i = 0; i < SHM_BACKLOG; i++) {
+        uint32_t expected = REQ_FREE;
+        if (!atomic_compare_exchange_strong(&listener->reqs[i].state, &expected, REQ_CLAIMED)) continue;
+        listener->reqs[i].pid = getpid();
+        listener->reqs[i].conn_id = conn_id;
+        atomic_store(&listener->reqs[i].state, REQ_PENDING);
+        conn->u.c.req = listener->reqs + i;
+        conn->u.c.timeout = SHM_CONNECT_TIMEOUT;
+        conn->state = SHM_CONNECTING;
+        break;
+    }
+out:
+    kv_app_send(self->thread_id, cm_add, conn);
+}
+
+void kv_shm_send_req_batch(connection_handle h, struct kv_rdma_req *reqs, uint32_t num) {
+    struct shm_connection *conn = h;
+    assert(conn->is_server == false);
+    for (uint32_t i = 0; i < num; i++) {
+        struct kv_rdma_req *x = reqs + i;
+        struct client_req_ctx *ctx = kv_mempool_get(conn->u.c.mp);
+        *ctx = (struct client_req_ctx){x->cb, x->cb_arg, x->req, x->resp};
+        assert(x->req_sz + sizeof(struct shm_slot) <= conn->seg->slot_sz);
+        struct shm_slot *slot = atomic_load(&conn->seg->closed) ? NULL : ring_reserve(conn->seg, &conn->seg->req);
+        if (slot == NULL) {
+            if (ctx->cb) ctx->cb(conn, false, ctx->req, ctx->resp, ctx->cb_arg);
+            kv_mempool_put(conn->u.c.mp, ctx);
+            continue;
+        }
+        void *resp_addr = x->resp_addr ? x->resp_addr : kv_rdma_get_resp_buf(x->resp);
+        slot->len = x->req_sz;
+        slot->req_id = (uint32_t)kv_mempool_get_id(conn->u.c.mp, ctx);
+        slot->resp_addr = (uint64_t)resp_addr;
+        kv_memcpy(slot->data, kv_rdma_get_req_buf(x->req), x->req_sz);
+        ring_commit(slot);
+    }
+}
+
+void kv_shm_disconnect(connection_handle h) {
+    struct shm_connection *conn = h;
+    atomic_store(&conn->seg->closed, true);
+}
+
+// --- server ---
+static void server_init_done(void *arg) {
+    struct kv_shm *self = arg;
+    self->init_cb(self->init_cb_arg);
+}
+void kv_shm_listen(kv_rdma_handle h, char *addr_str, char *port_str, uint32_t con_req_num, uint32_t max_msg_sz,
+                   kv_rdma_req_handler handler, void *arg, kv_rdma_server_init_cb cb, void *cb_arg) {
+    struct kv_shm *self = h;
+    self->handler = handler;
+    self->arg = arg;
+    self->max_msg_sz = max_msg_sz;
+    self->init_cb = cb;
+    self->init_cb_arg = cb_arg;
+    // the request buffers are shared out among the pollers
+    uint32_t req_num = (con_req_num + self->thread_num - 1) / self->thread_num;
+    for (size_t i = 0; i < self->thread_num; i++) {
+        struct shm_poller *poller = self->pollers + i;
+        poller->req_num = req_num;
+        poller->reqs = kv_calloc(req_num, sizeof(struct server_req_ctx));
+        poller->mrs = kv_rdma_alloc_bulk(self, KV_RDMA_MR_SERVER, max_msg_sz, req_num);
+        for (size_t j = 0; j < req_num; j++) poller->reqs[j].mr = kv_rdma_mrs_get(poller->mrs, j);
+    }
+    snprintf(self->listener_name, SHM_NAME_LEN, "/leed-%s", port_str);
+    size_t size = sizeof(struct shm_listener);
+    struct shm_listener *listener;
+    TEST_Z(listener = shm_map(self->listener_name, &size, true));
+    listener->max_msg_sz = max_msg_sz;
+    for (size_t i = 0; i < SHM_BACKLOG; i++) listener->reqs[i].state = REQ_FREE;
+    atomic_store(&listener->magic, SHM_MAGIC);
+    self->listener = listener;
+    printf("kv shm listening on %s.\n", port_str);
+    // called back once listening, as kv_rdma does on its first connection
+    if (cb) kv_app_send(kv_app_get_thread_index(), server_init_done, self);
+}
+
+// slot is NULL if the client is gone, the response is dropped then.
+static void resp_send(struct server_req_ctx *ctx, struct shm_slot *slot) {
+    struct shm_connection *conn = ctx->conn;
+    if (slot) {
+        slot->len = ctx->resp_sz;
+        slot->req_id = ctx->req_id;
+        slot->resp_addr = ctx->resp_addr;
+        kv_memcpy(slot->data, ctx->resp, ctx->resp_sz);
+        ring_commit(slot);
+    }
+    atomic_store_explicit(&ctx->busy, false, memory_order_release);
+    conn->u.s.inflight--;
+}
+void kv_shm_make_resp(void *req_h, uint8_t *resp, uint32_t resp_sz) {
+    struct server_req_ctx *ctx = req_h;
+    struct shm_connection *conn = ctx->conn;
+    assert(resp_sz + sizeof(struct shm_slot) <= conn->seg->slot_sz);
+    ctx->resp = resp;
+    ctx->resp_sz = resp_sz;
+    struct shm_slot *slot = ring_reserve(conn->seg, &conn->seg->resp);
+    if (slot == NULL) {
+        // the client drains its responses as it polls, the poller of the connection sends the rest then. The closed
+        // flag is checked under the lock, for the poller flushes the list once more as it removes the connection.
+        pthread_mutex_lock(&conn->u.s.resp_lock);
+        bool closed = atomic_load(&conn->seg->closed);
+        if (!closed) {
+            STAILQ_INSERT_TAIL(&conn->u.s.resps, ctx, entry);
+            conn->u.s.resp_num++;
+        }
+        pthread_mutex_unlock(&conn->u.s.resp_lock);
+        if (!closed) return;
+    }
+    resp_send(ctx, slot);
+}
+
+uint32_t kv_shm_conn_num(kv_rdma_handle h) { return ((struct kv_shm *)h)->conn_num; }
+
+static void remote_io_done(void *arg) {
+    struct remote_io_ctx *ctx = arg;
+    if (ctx->cb) ctx->cb(ctx->success, ctx->cb_arg);
+    kv_freelist_put(&remote_io_ctxs, ctx);
+}
+// the copy is done at once, the callback runs later as that of an RDMA READ/WRITE.
+static void remote_io(void *req_h, bool is_read, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length,
+                      kv_rdma_io_cb cb, void *cb_arg) {
+    struct server_req_ctx *req = req_h;
+    assert(length <= remote->length);
+    struct shm_value_map *map = value_map_get(req->conn, remote->rkey);
+    uint64_t map_len = map ? map->size - VALUE_SEG_HEAD : 0;
+    bool success = map && remote->addr >= map->base && remote->addr - map->base <= map_len &&
+                   length <= map_len - (remote->addr - map->base);
+    if (success) {
+        uint8_t *addr = (uint8_t *)map->seg + VALUE_SEG_HEAD + (remote->addr - map->base);
+        if (is_read) {
+            kv_memcpy(buf, addr, length);
+        } else {
+            kv_memcpy(addr, buf, length);
+        }
+    }
+    if (map) value_map_put(map);
+    struct remote_io_ctx *ctx = kv_freelist_get(&remote_io_ctxs, sizeof(struct remote_io_ctx));
+    *ctx = (struct remote_io_ctx){cb, cb_arg, success};
+    kv_app_send(kv_app_get_thread_index(), remote_io_done, ctx);
+}
+void kv_shm_read_remote(void *req_h, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length, kv_rdma_io_cb cb,
+                        void *cb_arg) {
+    remote_io(req_h, true, buf, remote, length, cb, cb_arg);
+}
+void kv_shm_write_remote(void *req_h, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length, kv_rdma_io_cb cb,
+                         void *cb_arg) {
+    remote_io(req_h, false, buf, remote, length, cb, cb_arg);
+}
+
+// --- cq_poller ---
+static inline struct server_req_ctx *req_ctx_get(struct shm_poller *poller) {
+    for (uint32_t i = 0; i < poller->req_num; i++) {
+        struct server_req_ctx *ctx = poller->reqs + poller->next++ % poller->req_num;
+        if (!atomic_load_explicit(&ctx->busy, memory_order_acquire)) {
+            ctx->busy = true;
+            return ctx;
+        }
+    }
+    return NULL;
+}
+static int poll_reqs(struct shm_poller *poller, struct shm_connection *conn) {
+    struct shm_slot *slot;
+    int i = 0;
+    for (; i < MAX_ENTRIES_PER_POLL && (slot = ring_peek(conn->seg, &conn->seg->req)); i++) {
+        struct server_req_ctx *ctx = req_ctx_get(poller);
+        if (ctx == NULL) break;  // left in the ring until a request buffer is free
+        ctx->conn = conn;
+        ctx->req_id = slot->req_id;
+        ctx->resp_addr = slot->resp_addr;
+        uint32_t len = slot->len;
+        kv_memcpy(kv_rdma_get_req_buf(ctx->mr), slot->data, len);
+        ring_pop(&conn->seg->req, slot);
+        conn->u.s.inflight++;
+        poller->self->handler(ctx, ctx->mr, len, poller->self->arg);
+    }
+    return i;
+}
+static int flush_resps(struct shm_connection *conn) {
+    struct server_req_ctx *ctx;
+    int i = 0;
+    pthread_mutex_lock(&conn->u.s.resp_lock);
+    while ((ctx = STAILQ_FIRST(&conn->u.s.resps))) {
+        struct shm_slot *slot = ring_reserve(conn->seg, &conn->seg->resp);
+        if (slot == NULL && !atomic_load(&conn->seg->closed)) break;
+        STAILQ_REMOVE_HEAD(&conn->u.s.resps, entry);
+        conn->u.s.resp_num--;
+        resp_send(ctx, slot);
+        i++;
+    }
+    pthread_mutex_unlock(&conn->u.s.resp_lock);
+    return i;
+}
+static int poll_resps(struct shm_connection *conn) {
+    struct shm_slot *slot;
+    int i = 0;
+    for (; i < MAX_ENTRIES_PER_POLL && (slot = ring_peek(conn->seg, &conn->seg->resp)); i++) {
+        struct client_req_ctx *ctx = kv_mempool_get_ele(conn->u.c.mp, (int32_t)slot->req_id);
+        kv_memcpy((void *)(uintptr_t)slot->resp_addr, slot->data, slot->len);
+        ring_pop(&conn->seg->resp, slot);
+        if (ctx->cb) ctx->cb(conn, true, ctx->req, ctx->resp, ctx->cb_arg);
+        kv_mempool_put(conn->u.c.mp, ctx);
+    }
+    return i;
+}
+static int shm_cq_poller(void *arg) {
+    struct shm_poller *poller = arg;
+    struct shm_connection *conn, *tmp;
+    int rc = 0;
+    TAILQ_FOREACH_SAFE(conn, &poller->conns, poller_entry, tmp) {
+        if (atomic_load(&conn->seg->closed)) {  // the cm poller frees it
+            if (conn->is_server) flush_resps(conn);  // dropped, to release their requests
+            TAILQ_REMOVE(&poller->conns, conn, poller_entry);
+            atomic_store(&conn->removed, true);
+            continue;
+        }
+        if (conn->is_server) {
+            if (atomic_load(&conn->u.s.resp_num)) rc += flush_resps(conn);
+            rc += poll_reqs(poller, conn);
+        } else {
+            rc += poll_resps(conn);
+        }
+    }
+    return rc;
+}
+
+// --- init & fini ---
+void kv_shm_init(kv_rdma_handle *h, uint32_t thread_num) {
+    struct kv_shm *self = kv_calloc(1, sizeof(struct kv_shm));
+    self->thread_num = thread_num;
+    self->thread_id = kv_app_get_thread_index();
+    TAILQ_INIT(&self->conns);
+    self->cm_poller = kv_app_poller_register(shm_cm_poller, self, 1000);
+    self->pollers = kv_calloc(thread_num, sizeof(struct shm_poller));
+    for (size_t i = 0; i < thread_num; i++) {
+        self->pollers[i].self = self;
+        TAILQ_INIT(&self->pollers[i].conns);
+        kv_app_poller_register_on(self->thread_id + i, shm_cq_poller, self->pollers + i, 0, &self->pollers[i].poller);
+    }
+    *h = self;
+}
+static void poller_unregister_done(void *arg) {
+    struct kv_shm *self = arg;
+    if (--self->fini_ctx.io_cnt) return;
+    struct shm_connection *conn, *tmp;
+    TAILQ_FOREACH_SAFE(conn, &self->conns, cm_entry, tmp) {
+        if (conn->seg) atomic_store(&conn->seg->closed, true);  // for the peer
+        conn_free(conn, false);
+    }
+    if (self->listener) {
+        shm_unlink(self->listener_name);
+        munmap(self->listener, sizeof(struct shm_listener));
+    }
+    for (size_t i = 0; i < self->thread_num; i++) {
+        if (self->pollers[i].reqs == NULL) continue;
+        kv_rdma_free_bulk(self->pollers[i].mrs);
+        kv_free(self->pollers[i].reqs);
+    }
+    kv_free(self->pollers);
+    kv_app_send(self->fini_ctx.thread_id, self->fini_ctx.cb, self->fini_ctx.cb_arg);
+    kv_free(self);
+}
+static void cq_poller_unregister(void *arg) {
+    struct shm_poller *poller = arg;
+    kv_app_poller_unregister(&poller->poller);
+    kv_app_send(poller->self->thread_id, poller_unregister_done, poller->self);
+}
+static void cm_poller_unregister(void *arg) {
+    struct kv_shm *self = arg;
+    if (self->listener) atomic_store(&self->listener->magic, 0);  // no more connection
+    kv_app_poller_unregister(&self->cm_poller);
+    kv_app_send(self->thread_id, poller_unregister_done, self);
+}
+void kv_shm_fini(kv_rdma_handle h, kv_rdma_fini_cb cb, void *cb_arg) {
+    struct kv_shm *self = h;
+    self->fini_ctx = (struct fini_ctx_t){kv_app_get_thread_index(), 1 + self->thread_num, cb, cb_arg};
+    kv_app_send(self->thread_id, cm_poller_unregister, self);
+    for (size_t i = 0; i < self->thread_num; i++)
+        kv_app_send(self->thread_id + i, cq_poller_unregister, self->pollers + i);
+}
@@ -0,0 +1,33 @@
+#ifndef _KV_SHM_H_
+#define _KV_SHM_H_
+#include "kv_rdma.h"
+
+// A same-host transport behind kv_rdma.h, for the hosts without RDMA NICs and the clients next to their server. The
+// requests and responses are copied through a pair of shared-memory rings per connection, and the one-sided transfers
+// through the KV_RDMA_MR_VALUE buffers of the client, which live in shared memory. A listener is named by its port
+// alone. kv_rdma_init selects it when the environment has KV_RDMA_TRANSPORT=shm, for the whole process, and kv_rdma.c
+// then forwards its calls here. The mrs keep the layout of struct ibv_mr, so the buffer accessors are shared.
+#define KV_SHM_ENV "KV_RDMA_TRANSPORT"
+
+void kv_shm_init(kv_rdma_handle *h, uint32_t thread_num);
+void kv_shm_fini(kv_rdma_handle h, kv_rdma_fini_cb cb, void *cb_arg);
+
+// a buffer the servers map to serve the one-sided transfers, *rkey names it.
+void *kv_shm_alloc_value(size_t size, uint32_t *rkey);
+void kv_shm_free_value(void *buf);
+
+void kv_shm_listen(kv_rdma_handle h, char *addr_str, char *port_str, uint32_t con_req_num, uint32_t max_msg_sz,
+                   kv_rdma_req_handler handler, void *arg, kv_rdma_server_init_cb cb, void *cb_arg);
+void kv_shm_make_resp(void *req_h, uint8_t *resp, uint32_t resp_sz);
+uint32_t kv_shm_conn_num(kv_rdma_handle h);
+
+void kv_shm_connect(kv_rdma_handle h, char *addr_str, char *port_str, kv_rdma_connect_cb connect_cb, void *connect_arg,
+                    kv_rdma_disconnect_cb disconnect_cb, void *disconnect_arg);
+void kv_shm_send_req_batch(connection_handle h, struct kv_rdma_req *reqs, uint32_t num);
+void kv_shm_disconnect(connection_handle h);
+
+void kv_shm_read_remote(void *req_h, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length, kv_rdma_io_cb cb,
+                        void *cb_arg);
+void kv_shm_write_remote(void *req_h, uint8_t *buf, struct kv_rdma_remote_buf *remote, uint32_t length, kv_rdma_io_cb cb,
+                         void *cb_arg);
+#endif
@@ -55,6 +55,7 @@ static void io_complete(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg
 }
 
 static void storage_io_wait(void *_arg);
+static __thread struct kv_storage_io_stats io_stats;
 
 static void _storage_io(struct kv_storage *self, void *buf, int iovcnt, uint64_t offset, uint64_t n, kv_storage_io_cb cb,
                         void *cb_arg, bool is_read, bool is_block, struct io_wait_arg *wait_arg) {
@@ -67,6 +68,13 @@ static void _storage_io(struct kv_storage *self, void *buf, int iovcnt, uint64_t
     struct io_complete_arg *arg = kv_malloc(sizeof(struct io_complete_arg));
     arg->cb = cb;
     arg->cb_arg = cb_arg;
+    if (!wait_arg) {
+        uint64_t nbytes = is_block ? n * self->block_size : n;
+        if (is_read)
+            io_stats.reads++, io_stats.read_bytes += nbytes;
+        else
+            io_stats.writes++, io_stats.write_bytes += nbytes;
+    }
     int rc = 0;
     uint32_t i = ((is_block ? 1 : 0) << 1) | (is_read ? 1 : 0);
     if (iovcnt)
@@ -103,6 +111,8 @@ static void storage_io_wait(void *_arg) {
     _storage_io(arg->self, arg->buf, arg->iovcnt, arg->offset, arg->n, arg->cb, arg->cb_arg, arg->is_read, arg->is_block, arg);
 }
 
+void kv_storage_io_stats(struct kv_storage_io_stats *stats) { *stats = io_stats; }
+
 void kv_storage_read(struct kv_storage *self, void *buf, int iovcnt, uint64_t offset, uint64_t nbytes, kv_storage_io_cb cb,
                      void *cb_arg) {
     _storage_io(self, buf, iovcnt, offset, nbytes, cb, cb_arg, true, false, NULL);
@@ -172,4 +182,81 @@ void *kv_storage_blk_alloc(struct kv_storage *self, uint64_t n) {
 void *kv_storage_zblk_alloc(struct kv_storage *self, uint64_t n) {
     return spdk_dma_zmalloc(n * self->block_size, self->align, NULL);
 }
-void kv_storage_free(void *buf) { spdk_free(buf); }
\ No newline at end of file
+void kv_storage_free(void *buf) { spdk_free(buf); }
+// --- DMA buffer pool ---
+// Each thread caches freed buffers per size class, so GETs and compactions stop paying for spdk_dma_malloc.
+// A buffer freed on another thread joins that thread's pool; a full pool returns buffers to the allocator.
+// The pooled buffers are aligned to POOL_ALIGN, the most any storage asks for, so one pool serves every storage of the
+// thread. Debug builds tag each buffer past its end with its class, to catch a free with another size.
+#define POOL_ALIGN 4096U
+#ifndef NDEBUG
+#define POOL_TAG sizeof(uint32_t)
+#else
+#define POOL_TAG 0
+#endif
+static const size_t pool_class_size[KV_STORAGE_POOL_CLASSES] = {512, 4096, 65536};
+static const uint32_t pool_class_cap[KV_STORAGE_POOL_CLASSES] = {1024, 256, 32};
+struct dma_pool {
+    void *head;  // each free buffer holds the next one
+    uint32_t len;
+};
+static __thread struct dma_pool pools[KV_STORAGE_POOL_CLASSES];
+static __thread struct kv_storage_pool_stats pool_stats;
+
+static inline uint32_t pool_class(size_t size) {
+    uint32_t c = 0;
+    while (c < KV_STORAGE_POOL_CLASSES && size > pool_class_size[c]) ++c;
+    return c;
+}
+
+static void *pool_alloc(size_t size, size_t align, uint32_t c) {
+    uint8_t *buf = spdk_dma_malloc(size + POOL_TAG, align, NULL);
+#ifndef NDEBUG
+    if (buf) kv_memcpy(buf + size, &c, sizeof(c));
+#endif
+    return buf;
+}
+
+void *kv_storage_pool_malloc(struct kv_storage *self, size_t size) {
+    uint32_t c = pool_class(size);
+    if (c == KV_STORAGE_POOL_CLASSES) {
+        pool_stats.oversized++;
+        return pool_alloc(size, self->align, c);
+    }
+    assert(self->align <= POOL_ALIGN);
+    struct dma_pool *pool = pools + c;
+    void *buf = pool->head;
+    if (buf == NULL) {
+        pool_stats.misses[c]++;
+        return pool_alloc(pool_class_size[c], POOL_ALIGN, c);
+    }
+    pool_stats.hits[c]++;
+    pool->head = *(void **)buf;
+    pool->len--;
+    return buf;
+}
+
+void *kv_storage_pool_zmalloc(struct kv_storage *self, size_t size) {
+    void *buf = kv_storage_pool_malloc(self, size);
+    if (buf) kv_memset(buf, 0, size);
+    return buf;
+}
+
+void kv_storage_pool_free(void *buf, size_t size) {
+    uint32_t c = pool_class(size);
+#ifndef NDEBUG
+    uint32_t tag;
+    kv_memcpy(&tag, (uint8_t *)buf + (c == KV_STORAGE_POOL_CLASSES ? size : pool_class_size[c]), sizeof(tag));
+    assert(tag == c);
+#endif
+    struct dma_pool *pool = pools + c;
+    if (c == KV_STORAGE_POOL_CLASSES || pool->len == pool_class_cap[c]) {
+        kv_storage_free(buf);
+        return;
+    }
+    *(void **)buf = pool->head;
+    pool->head = buf;
+    pool->len++;
+}
+
+void kv_storage_pool_stats(struct kv_storage_pool_stats *stats) { *stats = pool_stats; }
@@ -20,6 +20,27 @@ void *kv_storage_blk_alloc(struct kv_storage *self, uint64_t n);
 void *kv_storage_zblk_alloc(struct kv_storage *self, uint64_t n);
 void kv_storage_free(void *buf);
 
+// Per-thread pool of DMA buffers for short-lived I/O buffers, in size classes of 512B, 4KB and 64KB.
+// A buffer must be freed with the size it was allocated with, which debug builds check; larger sizes bypass the pool.
+// The pooled buffers are 4KB aligned, storages asking for more must not use it.
+#define KV_STORAGE_POOL_CLASSES 3
+struct kv_storage_pool_stats {
+    uint64_t hits[KV_STORAGE_POOL_CLASSES];
+    uint64_t misses[KV_STORAGE_POOL_CLASSES];
+    uint64_t oversized;
+};
+void *kv_storage_pool_malloc(struct kv_storage *self, size_t size);
+void *kv_storage_pool_zmalloc(struct kv_storage *self, size_t size);
+void kv_storage_pool_free(void *buf, size_t size);
+void kv_storage_pool_stats(struct kv_storage_pool_stats *stats);
+
+// Per-thread count of the I/Os submitted and their bytes.
+struct kv_storage_io_stats {
+    uint64_t reads, read_bytes;
+    uint64_t writes, write_bytes;
+};
+void kv_storage_io_stats(struct kv_storage_io_stats *stats);
+
 
 void kv_storage_read(struct kv_storage *self, void *buf, int iovcnt, uint64_t offset, uint64_t nbytes, kv_storage_io_cb cb,
                      void *cb_arg);
@@ -2,57 +2,246 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/queue.h>
 #include <sys/uio.h>
 
+#include "kv_app.h"
+#include "kv_ds_queue.h"
 #include "kv_memory.h"
+#include "utils/lz.h"
+#include "utils/timing.h"
 #include "utils/uthash.h"
 static inline uint64_t align(struct kv_value_log *self, uint64_t size) {
     if (size & self->blk_mask) return (size >> self->blk_shift) + 1;
     return size >> self->blk_shift;
 }
-static inline uint64_t dword_align(uint64_t size) { return size & 0x3 ? (size & ~0x3) + 0x4 : size; }
+enum { SEGMENT_FREE, SEGMENT_OPEN, SEGMENT_SEALED, SEGMENT_CLEANING };
+
+static inline struct kv_value_log_segment *offset_to_segment(struct kv_value_log *self, uint64_t offset) {
+    return self->segments + (offset >> self->blk_shift) / self->segment_blks;
+}
+// the first block of the segment, relative to the log base.
+static inline uint64_t segment_blk(struct kv_value_log *self, struct kv_value_log_segment *segment) {
+    return (segment - self->segments) * self->segment_blks;
+}
+// the logical time of the log: the value bytes written so far.
+static inline uint64_t log_clock(struct kv_value_log *self) { return self->stats.user_bytes + self->stats.gc_bytes; }
+
 // --- read ---
+// The block-aligned body of a value is read straight into the caller's buffer. The partial blocks at its ends
+// are read into scratch blocks from the DMA buffer pool, so exactly value_length bytes are written to value.
 struct read_ctx {
     uint8_t *value;
+    uint32_t value_length;
     kv_circular_log_io_cb cb;
     void *cb_arg;
-    uint8_t *buf;
-    uint16_t buf_offset, len_in_buf;
+    uint8_t *head, *tail;
+    uint32_t blk_size;
+    uint16_t head_offset, head_len, tail_len;
+    struct iovec iov[3];
 };
+static __thread struct kv_freelist read_ctxs;
 
 static void read_cb(bool success, void *cb_arg) {
     struct read_ctx *ctx = (struct read_ctx *)cb_arg;
-    kv_memcpy(ctx->value, ctx->buf + ctx->buf_offset, ctx->len_in_buf);
+    if (ctx->head) {
+        kv_memcpy(ctx->value, ctx->head + ctx->head_offset, ctx->head_len);
+        kv_storage_pool_free(ctx->head, ctx->blk_size);
+    }
+    if (ctx->tail) {
+        kv_memcpy(ctx->value + ctx->value_length - ctx->tail_len, ctx->tail, ctx->tail_len);
+        kv_storage_pool_free(ctx->tail, ctx->blk_size);
+    }
     if (ctx->cb) ctx->cb(success, ctx->cb_arg);
-    kv_storage_free(ctx->buf);
-    kv_free(ctx);
+    kv_freelist_put(&read_ctxs, ctx);
 }
 
 void kv_value_log_read(struct kv_value_log *self, uint64_t offset, uint8_t *value, uint32_t value_length,
                        kv_circular_log_io_cb cb, void *cb_arg) {
     assert((offset & 0x3) == 0);
-    if (offset & self->blk_mask) {
-        struct read_ctx *ctx = kv_malloc(sizeof(struct read_ctx));
-        ctx->value = value;
-        ctx->cb = cb;
-        ctx->cb_arg = cb_arg;
-        ctx->buf_offset = offset & self->blk_mask;
-        ctx->len_in_buf = self->log.storage->block_size - ctx->buf_offset;
-        ctx->buf = kv_storage_blk_alloc(self->log.storage, 1);
-        if (value_length > ctx->len_in_buf) {
-            struct iovec iov[2] = {{ctx->buf, 1}, {value + ctx->len_in_buf, align(self, value_length - ctx->len_in_buf)}};
-            kv_circular_log_readv(&self->log, offset >> self->blk_shift, iov, 2, read_cb, ctx);
-        } else {
-            ctx->len_in_buf = value_length;
-            kv_circular_log_read(&self->log, offset >> self->blk_shift, ctx->buf, 1, read_cb, ctx);
+    assert(offset_to_segment(self, offset) == offset_to_segment(self, offset + value_length - 1));
+    uint32_t blk_size = self->storage->block_size;
+    uint32_t head_offset = offset & self->blk_mask;
+    uint32_t head_len = head_offset ? blk_size - head_offset : 0;
+    if (head_len > value_length) head_len = value_length;
+    uint32_t tail_len = (value_length - head_len) & self->blk_mask;
+    uint64_t blk = self->base + (offset >> self->blk_shift);
+    if (head_len == 0 && tail_len == 0) {
+        kv_storage_read_blocks(self->storage, value, 0, blk, value_length >> self->blk_shift, cb, cb_arg);
+        return;
+    }
+    struct read_ctx *ctx = kv_freelist_get(&read_ctxs, sizeof(struct read_ctx));
+    *ctx = (struct read_ctx){value, value_length, cb, cb_arg, NULL, NULL, blk_size, head_offset, head_len, tail_len};
+    int iovcnt = 0;
+    if (head_len) {
+        ctx->head = kv_storage_pool_malloc(self->storage, blk_size);
+        ctx->iov[iovcnt++] = (struct iovec){ctx->head, blk_size};
+    }
+    uint32_t body_blks = (value_length - head_len) >> self->blk_shift;
+    if (body_blks) ctx->iov[iovcnt++] = (struct iovec){value + head_len, body_blks << self->blk_shift};
+    if (tail_len) {
+        ctx->tail = kv_storage_pool_malloc(self->storage, blk_size);
+        ctx->iov[iovcnt++] = (struct iovec){ctx->tail, blk_size};
+    }
+    uint64_t n = (head_len ? 1 : 0) + body_blks + (tail_len ? 1 : 0);
+    kv_storage_read_blocks(self->storage, ctx->iov, iovcnt, blk, n, read_cb, ctx);
+}
+
+// --- bulk read ---
+// The values are read in the order of the log. A run of values of the same segment at most READ_BULK_GAP blocks
+// apart is read by a single I/O into a pooled buffer, then copied out. A value larger than the buffer is read alone.
+#define READ_BULK_GAP 2U
+#define READ_BULK_SIZE (64U << 10)
+struct read_bulk_ctx {
+    uint32_t pending;
+    bool success;
+    kv_circular_log_io_cb cb;
+    void *cb_arg;
+};
+struct read_run_ctx {
+    struct read_bulk_ctx *bulk;
+    struct kv_value_log_read_req *reqs;
+    uint32_t n;
+    uint8_t *buf;
+    uint64_t base;  // the offset of buf in the log
+};
+static __thread struct kv_freelist read_run_ctxs;
+
+static int read_req_cmp(const void *a, const void *b) {
+    uint64_t x = ((const struct kv_value_log_read_req *)a)->offset, y = ((const struct kv_value_log_read_req *)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+static void read_bulk_done(bool success, void *arg) {
+    struct read_bulk_ctx *bulk = arg;
+    bulk->success = bulk->success && success;
+    if (--bulk->pending) return;
+    if (bulk->cb) bulk->cb(bulk->success, bulk->cb_arg);
+    kv_free(bulk);
+}
+
+static void read_run_cb(bool success, void *arg) {
+    struct read_run_ctx *run = arg;
+    if (success)
+        for (uint32_t i = 0; i < run->n; ++i)
+            kv_memcpy(run->reqs[i].value, run->buf + (run->reqs[i].offset - run->base), run->reqs[i].value_length);
+    kv_storage_pool_free(run->buf, READ_BULK_SIZE);
+    read_bulk_done(success, run->bulk);
+    kv_freelist_put(&read_run_ctxs, run);
+}
+
+void kv_value_log_read_bulk(struct kv_value_log *self, struct kv_value_log_read_req *reqs, uint32_t n,
+                            kv_circular_log_io_cb cb, void *cb_arg) {
+    qsort(reqs, n, sizeof(struct kv_value_log_read_req), read_req_cmp);
+    struct read_bulk_ctx *bulk = kv_malloc(sizeof(*bulk));
+    *bulk = (struct read_bulk_ctx){1, true, cb, cb_arg};
+    for (uint32_t start = 0, end = 0; start < n; start = end) {
+        if (reqs[start].value_length == 0) {
+            end = start + 1;
+            continue;
+        }
+        uint64_t first = reqs[start].offset >> self->blk_shift;
+        uint64_t last = (reqs[start].offset + reqs[start].value_length - 1) >> self->blk_shift;
+        struct kv_value_log_segment *segment = offset_to_segment(self, reqs[start].offset);
+        for (end = start + 1; end < n && reqs[end].value_length; ++end) {
+            uint64_t next = (reqs[end].offset + reqs[end].value_length - 1) >> self->blk_shift;
+            if (offset_to_segment(self, reqs[end].offset) != segment ||
+                (reqs[end].offset >> self->blk_shift) > last + READ_BULK_GAP ||
+                ((next > last ? next : last) - first + 1) << self->blk_shift > READ_BULK_SIZE)
+                break;
+            if (next > last) last = next;
         }
-    } else
-        kv_circular_log_read(&self->log, offset >> self->blk_shift, value, align(self, value_length), cb, cb_arg);
+        bulk->pending++;
+        if (end - start == 1) {
+            kv_value_log_read(self, reqs[start].offset, reqs[start].value, reqs[start].value_length, read_bulk_done,
+                              bulk);
+            continue;
+        }
+        struct read_run_ctx *run = kv_freelist_get(&read_run_ctxs, sizeof(struct read_run_ctx));
+        *run = (struct read_run_ctx){bulk, reqs + start, end - start};
+        run->buf = kv_storage_pool_malloc(self->storage, READ_BULK_SIZE);
+        run->base = first << self->blk_shift;
+        kv_storage_read_blocks(self->storage, run->buf, 0, self->base + first, last - first + 1, read_run_cb, run);
+    }
+    read_bulk_done(true, bulk);
+}
+
+// --- compression ---
+uint32_t kv_value_log_compress(struct kv_value_log *self, const uint8_t *value, uint32_t value_length, uint8_t *record) {
+    if (value_length < KV_VALUE_LOG_COMPRESS_MIN) return 0;
+    struct kv_value_log_codec_stats *stats = &self->codec_stats;
+    uint32_t header_size = sizeof(struct kv_value_log_codec_header);
+    uint64_t start = rdtsc();
+    uint32_t length = lz_compress(value, value_length, record + header_size, value_length - value_length / 8 - header_size);
+    stats->compress_tsc += rdtsc() - start;
+    stats->value_bytes += value_length;
+    if (length == 0) {
+        stats->raw++;
+        stats->record_bytes += value_length;
+        return 0;
+    }
+    struct kv_value_log_codec_header header = {value_length};
+    kv_memcpy(record, &header, header_size);
+    stats->compressed++;
+    stats->record_bytes += header_size + length;
+    return header_size + length;
 }
 
-// --- bucket ids log ---
-#define BUCKET_ID_DUMP_BLKS (128u)
+bool kv_value_log_decompress(struct kv_value_log *self, const uint8_t *record, uint32_t record_length, uint8_t *value) {
+    uint32_t header_size = sizeof(struct kv_value_log_codec_header);
+    if (record_length < header_size) return false;
+    uint64_t start = rdtsc();
+    bool success = lz_decompress(record + header_size, record_length - header_size, value, kv_value_log_codec_length(record));
+    self->codec_stats.decompress_tsc += rdtsc() - start;
+    self->codec_stats.decompressed++;
+    return success;
+}
+
+struct read_value_ctx {
+    struct kv_value_log *self;
+    uint8_t *value;
+    uint32_t *value_length, room;
+    uint8_t *record;
+    uint32_t record_length;
+    kv_circular_log_io_cb cb;
+    void *cb_arg;
+};
+static __thread struct kv_freelist read_value_ctxs;
+
+static void read_value_cb(bool success, void *arg) {
+    struct read_value_ctx *ctx = arg;
+    if (success) {
+        *ctx->value_length = kv_value_log_codec_length(ctx->record);
+        success = (ctx->room == 0 || *ctx->value_length <= ctx->room) &&
+                  kv_value_log_decompress(ctx->self, ctx->record, ctx->record_length, ctx->value);
+    }
+    kv_storage_pool_free(ctx->record, ctx->record_length);
+    if (ctx->cb) ctx->cb(success, ctx->cb_arg);
+    kv_freelist_put(&read_value_ctxs, ctx);
+}
+
+void kv_value_log_read_value(struct kv_value_log *self, uint64_t offset, uint32_t record_length, uint8_t codec,
+                             uint8_t *value, uint32_t *value_length, kv_circular_log_io_cb cb, void *cb_arg) {
+    uint32_t room = *value_length;
+    if (codec == KV_CODEC_NONE) {
+        *value_length = record_length;
+        if (room == 0 || record_length <= room)
+            kv_value_log_read(self, offset, value, record_length, cb, cb_arg);
+        else if (cb)
+            cb(false, cb_arg);
+        return;
+    }
+    // the body of the record is read straight into it, so it is DMA memory.
+    struct read_value_ctx *ctx = kv_freelist_get(&read_value_ctxs, sizeof(struct read_value_ctx));
+    *ctx = (struct read_value_ctx){self, value, value_length, room, kv_storage_pool_malloc(self->storage, record_length),
+                                   record_length, cb, cb_arg};
+    kv_value_log_read(self, offset, ctx->record, record_length, read_value_cb, ctx);
+}
+
+// --- bucket ids ---
+// Each segment has id_blks blocks of bucket ids, one per log unit, right after the segments in the same order.
+// The ids of an open segment are collected in memory and dumped when the segment is sealed.
 #define BUCKET_ID_PER_BLK (85u)
 struct uint48_t {
     uint64_t val : 48;
@@ -63,93 +252,147 @@ struct bucket_ids_block {
     uint16_t reserved;
 };
 
-struct bucket_ids_ctx {
-    struct kv_circular_log log;
-    struct bucket_ids_block *blk_buf[2];
-    uint32_t blk_index;
-    bool is_dumping;
+struct bucket_ids_dump {
+    struct kv_value_log *self;
+    struct kv_value_log_segment *segment;
+    struct bucket_ids_block *ids;
 };
+static __thread struct kv_freelist bucket_ids_dumps;
 
-static inline uint64_t offset_to_block(uint64_t val_offset) {
-    return (val_offset >> KV_VALUE_LOG_UNIT_SHIFT) / BUCKET_ID_PER_BLK;
-}
-static inline struct uint48_t *get_bucket_id_from_blk(struct bucket_ids_block *blk, uint64_t val_offset) {
-    return &blk->ids[(val_offset >> KV_VALUE_LOG_UNIT_SHIFT) % BUCKET_ID_PER_BLK];
-}
-
-static struct uint48_t *get_bucket_id(struct kv_value_log *self, uint64_t val_offset) {
-    struct bucket_ids_ctx *ctx = self->bucket_id_log;
-    struct bucket_ids_block *blk;
-    kv_circular_log_fetch_one(&ctx->log, offset_to_block(val_offset), (void **)&blk);
-    return get_bucket_id_from_blk(blk, val_offset);
+static inline struct uint48_t *get_bucket_id(struct kv_value_log *self, struct bucket_ids_block *ids, uint64_t val_offset) {
+    uint64_t unit = (val_offset % (self->segment_blks << self->blk_shift)) >> KV_VALUE_LOG_UNIT_SHIFT;
+    return &ids[unit / BUCKET_ID_PER_BLK].ids[unit % BUCKET_ID_PER_BLK];
 }
 
-static void dump_bucket_id_cb(bool success, void *arg) {
+static void dump_bucket_ids_cb(bool success, void *arg) {
     if (!success) {
         fprintf(stderr, "value log: dumping bucket ids has failed.");
         exit(-1);
     }
-    struct bucket_ids_ctx *ctx = arg;
-    ctx->is_dumping = false;
+    struct bucket_ids_dump *dump = arg;
+    kv_storage_pool_free(dump->ids, dump->self->id_blks << dump->self->blk_shift);
+    dump->self->id_dumping--;
+    dump->segment->pins--;
+    kv_freelist_put(&bucket_ids_dumps, dump);
 }
 
-static void append_bucket_id(struct kv_value_log *self, uint64_t val_offset, uint64_t bucket_id) {
-    struct bucket_ids_ctx *ctx = self->bucket_id_log;
-    uint64_t blk_i = (ctx->log.size - ctx->log.tail + offset_to_block(val_offset)) % ctx->log.size;
-    assert(blk_i < 2 * BUCKET_ID_DUMP_BLKS);
-    if (blk_i >= BUCKET_ID_DUMP_BLKS) {
-        if (ctx->is_dumping) {
-            fprintf(stderr, "value log: dumping bucket ids is too slow.");
-            exit(-1);
-        }
-        ctx->is_dumping = true;
-        kv_circular_log_append(&ctx->log, ctx->blk_buf[ctx->blk_index], BUCKET_ID_DUMP_BLKS, dump_bucket_id_cb, ctx);
-        ctx->blk_index = !ctx->blk_index;
-        kv_memset(ctx->blk_buf[ctx->blk_index], 0xFF, BUCKET_ID_DUMP_BLKS << self->blk_shift);
-        blk_i -= BUCKET_ID_DUMP_BLKS;
+// --- segments & streams ---
+static void segment_free_cb(bool success, void *arg) {
+    if (!success) {
+        fprintf(stderr, "value log: clearing bucket ids has failed.");
+        exit(-1);
     }
-    get_bucket_id_from_blk(&ctx->blk_buf[ctx->blk_index][blk_i], val_offset)->val = bucket_id;
+    struct bucket_ids_dump *dump = arg;
+    struct kv_value_log *self = dump->self;
+    // freed segments are reused last, to leave the reads started before the compaction time to finish.
+    TAILQ_INSERT_TAIL(&self->free_segments, dump->segment, entry);
+    self->free_segment_num++;
+    self->id_dumping--;
+    kv_freelist_put(&bucket_ids_dumps, dump);
+}
+
+// A sealed segment always has a value in its first log unit, so the first block of its bucket ids is cleared
+// before it is reused: a recovery tells by it the segments freed since the checkpoint.
+static void segment_free(struct kv_value_log *self, struct kv_value_log_segment *segment) {
+    segment->state = SEGMENT_FREE;
+    segment->live_bytes = 0;
+    self->stats.gc_segments++;
+    self->id_dumping++;
+    struct bucket_ids_dump *dump = kv_freelist_get(&bucket_ids_dumps, sizeof(struct bucket_ids_dump));
+    *dump = (struct bucket_ids_dump){self, segment, NULL};
+    kv_storage_write_blocks(self->storage, self->empty_ids, 0, self->base + self->size + (segment - self->segments) * self->id_blks,
+                            1, segment_free_cb, dump);
 }
 
-static uint64_t on_val_log_head_move(struct kv_value_log *self) {
-    struct bucket_ids_ctx *ctx = self->bucket_id_log;
-    uint64_t max_blk = (self->log.size + self->compact_head - self->log.head) % self->log.size;
-    uint64_t val_offset;
-    for (uint64_t i = 0; i <= max_blk << self->blk_shift; i += KV_VALUE_LOG_UNIT_SIZE) {
-        val_offset = ((self->log.head << self->blk_shift) + i) % (self->log.size << self->blk_shift);
-        if (get_bucket_id(self, val_offset)->val != KV_BUCKET_ID_EMPTY) break;
+static void stream_open(struct kv_value_log *self, struct kv_value_log_stream *stream) {
+    struct kv_value_log_segment *segment = TAILQ_FIRST(&self->free_segments);
+    assert(segment);
+    TAILQ_REMOVE(&self->free_segments, segment, entry);
+    self->free_segment_num--;
+    *segment = (struct kv_value_log_segment){.mtime = log_clock(self), .state = SEGMENT_OPEN};
+    stream->segment = segment;
+    stream->tail = 0;
+    stream->ids = kv_storage_pool_malloc(self->storage, self->id_blks << self->blk_shift);
+    kv_memset(stream->ids, 0xFF, self->id_blks << self->blk_shift);
+}
+
+static void stream_seal(struct kv_value_log *self, struct kv_value_log_stream *stream) {
+    struct kv_value_log_segment *segment = stream->segment;
+    if (segment == NULL) return;
+    segment->state = SEGMENT_SEALED;
+    TAILQ_INSERT_TAIL(&self->sealed_segments, segment, entry);
+    if (self->id_dumping) self->stats.id_log_stalls++;
+    self->id_dumping++;
+    segment->pins++;
+    struct bucket_ids_dump *dump = kv_freelist_get(&bucket_ids_dumps, sizeof(struct bucket_ids_dump));
+    *dump = (struct bucket_ids_dump){self, segment, stream->ids};
+    kv_storage_write_blocks(self->storage, stream->ids, 0, self->base + self->size + (segment - self->segments) * self->id_blks,
+                            self->id_blks, dump_bucket_ids_cb, dump);
+    stream->segment = NULL;
+    stream->ids = NULL;
+}
+
+// Returns the first of blks blocks at the tail of the stream, opening a new segment if they do not fit, or
+// UINT64_MAX if that would leave no more than reserve segments free.
+static uint64_t stream_alloc(struct kv_value_log *self, struct kv_value_log_stream *stream, uint64_t blks,
+                             uint64_t reserve) {
+    assert(blks <= self->segment_blks);
+    if (stream->segment == NULL || stream->tail + blks > self->segment_blks) {
+        if (self->free_segment_num <= reserve) return UINT64_MAX;
+        stream_seal(self, stream);
+        stream_open(self, stream);
     }
-    val_offset &= ~self->blk_mask;
-    uint64_t offset = (ctx->log.size + offset_to_block(val_offset) - ctx->log.head) % ctx->log.size;
-    kv_circular_log_move_head(&ctx->log, offset);
-    return val_offset;
+    uint64_t blk = segment_blk(self, stream->segment) + stream->tail;
+    stream->tail += blks;
+    return blk;
 }
 
-static void bucket_id_log_init(struct kv_value_log *self) {
-    struct bucket_ids_ctx *ctx = kv_malloc(sizeof(*ctx));
-    assert(sizeof(struct bucket_ids_block) == 1 << self->blk_shift);
-    self->id_log_size = offset_to_block(self->log.size << self->blk_shift) + 1;
-    uint64_t base = self->log.base + self->log.size;
-    kv_circular_log_init(&ctx->log, self->log.storage, base, self->id_log_size, 0, 0, BUCKET_ID_DUMP_BLKS * 2, BUCKET_ID_DUMP_BLKS / 8);
-    ctx->blk_buf[0] = kv_storage_blk_alloc(ctx->log.storage, BUCKET_ID_DUMP_BLKS);
-    ctx->blk_buf[1] = kv_storage_blk_alloc(ctx->log.storage, BUCKET_ID_DUMP_BLKS);
-    ctx->blk_index = 0;
-    ctx->is_dumping = false;
-    kv_memset(ctx->blk_buf[ctx->blk_index], 0xFF, BUCKET_ID_DUMP_BLKS << self->blk_shift);
-    self->bucket_id_log = ctx;
-}
-
-static void bucket_id_log_fini(struct kv_value_log *self) {
-    struct bucket_ids_ctx *ctx = self->bucket_id_log;
-    kv_storage_free(ctx->blk_buf[0]);
-    kv_storage_free(ctx->blk_buf[1]);
-    kv_circular_log_fini(&ctx->log);
-    kv_free(ctx);
+static void stream_append_value(struct kv_value_log *self, struct kv_value_log_stream *stream, uint64_t val_offset,
+                                uint64_t bucket_id, uint32_t value_length) {
+    assert(offset_to_segment(self, val_offset) == stream->segment);
+    get_bucket_id(self, stream->ids, val_offset)->val = bucket_id;
+    stream->segment->live_bytes += value_length;
+    stream->segment->mtime = log_clock(self);
 }
 
 // --- compaction ---
-#define COMPACTION_CONCURRENCY 4U
+// A victim segment is read as a whole, its bucket ids included. Its live values are found window by window
+// under the locks of their buckets, packed and appended to the cold stream, then the segment is freed.
 #define COMPACTION_LENGTH 256U
+#define COMPACTION_CONCURRENCY 8U  // windows of a victim in flight, at most
+#define GC_RESERVE_SEGMENTS 2U  // left to the cost-benefit compaction, see gc_reserve
+#define GC_START_SEGMENTS 8U    // the compaction runs while fewer segments than this are free
+#define GC_SAMPLES 1024U        // segments examined per victim on a large log
+
+static inline uint64_t compaction_windows(struct kv_value_log *self) {
+    return (self->segment_blks + COMPACTION_LENGTH - 1) / COMPACTION_LENGTH;
+}
+// The segments the writes leave free for the compaction, none without a bucket log as nothing is moved then. A window
+// opens a segment when its values do not fit in the one open. The cold stream is only filled by the compaction, so
+// the live values of a victim, less than a segment, take the room left and at most one more segment, and a spare one
+// covers the blocks lost at the ends of the windows. FIFO appends to the hot stream, which the writes may fill
+// between two windows of the same victim, so each window may have to open a segment.
+static inline uint64_t gc_reserve(struct kv_value_log *self) {
+    if (self->bucket_log == NULL) return 0;
+    return self->gc_policy == KV_VALUE_LOG_GC_FIFO ? compaction_windows(self) + 1 : GC_RESERVE_SEGMENTS;
+}
+// the free segments the compaction of victim is started with.
+static inline uint64_t victim_need(struct kv_value_log *self, struct kv_value_log_segment *victim) {
+    if (victim->live_bytes == 0 || self->bucket_log == NULL) return 0;
+    return self->gc_policy == KV_VALUE_LOG_GC_FIFO ? compaction_windows(self) : 1;
+}
+static inline uint64_t gc_threshold(struct kv_value_log *self) {
+    uint64_t n = self->segment_num / 8 ? self->segment_num / 8 : 1;
+    return gc_reserve(self) + (n < GC_START_SEGMENTS ? n : GC_START_SEGMENTS);
+}
+
+// 0 while enough segments are free, full once the log is behind and the writes wait for the compaction.
+static uint32_t gc_pressure(struct kv_value_log *self) {
+    uint64_t threshold = gc_threshold(self), floor = gc_reserve(self) + 1;
+    if (kv_value_log_is_behind(self) || !STAILQ_EMPTY(&self->space_waiters) || threshold <= floor + 1) return KV_DS_IO_SHARE_UNIT;
+    if (self->free_segment_num >= threshold) return 0;
+    return (threshold - self->free_segment_num) * KV_DS_IO_SHARE_UNIT / (threshold - floor);
+}
 
 struct item_list_entry {
     struct kv_value_log *self;
@@ -160,20 +403,83 @@ struct item_list_entry {
     entry;
 };
 TAILQ_HEAD(item_list, item_list_entry);
+static __thread struct kv_freelist item_list_entries, compact_segs;
 
 struct compact_ctx {
     struct kv_value_log *self;
     struct kv_bucket_segments segments;
     struct item_list items;
     uint32_t iocnt;
+    uint8_t *buf;
+    // the packed values fill the room left in the open segment of the stream, then continue in a new one.
+    struct kv_value_log_segment *dst[2];
+    uint64_t blk[2], blks[2];
 };
+static __thread struct kv_freelist compact_ctxs;
 #define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
     for ((var) = TAILQ_FIRST((head)); (var) && ((tvar) = TAILQ_NEXT((var), field), 1); (var) = (tvar))
 
-static void compact_move_head(struct kv_value_log *self) {
-    uint64_t blk = on_val_log_head_move(self) >> self->blk_shift;
-    uint64_t offset = (self->log.size + blk - self->log.head) % self->log.size;
-    kv_circular_log_move_head(&self->log, offset);
+// *pinned is set if a candidate is still being written, and may be picked once committed.
+static struct kv_value_log_segment *pick_victim(struct kv_value_log *self, bool *pinned) {
+    struct kv_value_log_segment *segment, *victim = NULL;
+    *pinned = false;
+    // without a bucket log, no value can be moved and only the segments left empty are reclaimed.
+    if (self->gc_policy == KV_VALUE_LOG_GC_FIFO) {
+        TAILQ_FOREACH(segment, &self->sealed_segments, entry) {
+            if (segment->pins) *pinned = true;
+            if (segment->pins == 0 && (self->bucket_log || segment->live_bytes == 0) &&
+                victim_need(self, segment) <= self->free_segment_num)
+                return segment;
+        }
+        return NULL;
+    }
+    uint64_t segment_bytes = self->segment_blks << self->blk_shift, now = log_clock(self);
+    uint64_t samples = self->segment_num < GC_SAMPLES ? self->segment_num : GC_SAMPLES;
+    double best = 0;
+    for (uint64_t i = 0; i < samples; i++) {
+        segment = self->segments + (self->segment_num <= GC_SAMPLES ? i : (uint64_t)random() % self->segment_num);
+        if (segment->state != SEGMENT_SEALED) continue;
+        if (segment->pins) {
+            *pinned = true;
+            continue;
+        }
+        if (segment->live_bytes == 0) return segment;
+        if (!self->bucket_log || segment->live_bytes >= segment_bytes || victim_need(self, segment) > self->free_segment_num)
+            continue;
+        // (1 - u) * age / (1 + u)
+        double score = (double)(segment_bytes - segment->live_bytes) * (now - segment->mtime + 1) /
+                       (segment_bytes + segment->live_bytes);
+        if (score > best) {
+            best = score;
+            victim = segment;
+        }
+    }
+    return victim;
+}
+
+static void maintenance_start(struct kv_value_log *self);
+static void gc(struct kv_value_log *self);
+static void compact_windows(struct kv_value_log *self);
+static void compact_window_done(struct kv_value_log *self) {
+    --self->victim_windows;
+    if (self->victim_next < self->segment_blks) {
+        if (self->victim_windows < kv_ds_io_sched_bound(self->io_sched, gc_pressure(self), COMPACTION_CONCURRENCY))
+            compact_windows(self);
+        return;
+    }
+    if (self->victim_windows) return;
+    if (self->victim_aborted) {
+        // the values left are moved once a segment is freed, e.g. by the discards of the writes.
+        self->victim->state = SEGMENT_SEALED;
+        TAILQ_INSERT_HEAD(&self->sealed_segments, self->victim, entry);
+        self->victim_aborted = false;
+        self->stats.gc_aborts++;
+    } else {
+        segment_free(self, self->victim);
+    }
+    self->victim = NULL;
+    gc(self);
+    if (!STAILQ_EMPTY(&self->space_waiters)) maintenance_start(self);
 }
 
 static void compact_write(bool success, void *arg) {
@@ -187,9 +493,8 @@ static void compact_write(bool success, void *arg) {
 
     struct item_list_entry *entry, *tmp;
     TAILQ_FOREACH_SAFE(entry, &ctx->items, entry, tmp) {
-        get_bucket_id(self, entry->value_offset)->val = KV_BUCKET_ID_EMPTY;
         TAILQ_REMOVE(&ctx->items, entry, entry);
-        kv_free(entry);
+        kv_freelist_put(&item_list_entries, entry);
     }
 
     struct kv_bucket_segment *seg;
@@ -199,35 +504,80 @@ static void compact_write(bool success, void *arg) {
     kv_bucket_unlock(self->bucket_log, &ctx->segments);
     while ((seg = TAILQ_FIRST(&ctx->segments)) != NULL) {
         TAILQ_REMOVE(&ctx->segments, seg, entry);
-        kv_free(seg);
+        kv_freelist_put(&compact_segs, seg);
     }
-
-    compact_move_head(self);
-    kv_free(ctx);
-}
-
-static inline uint8_t *last_buf(struct kv_value_log *self, struct iovec *iov, uint32_t iocnt) {
-    iov = iov + iocnt - 1;
-    return (uint8_t *)iov->iov_base + ((iov->iov_len - 1) << self->blk_shift);
+    for (uint32_t r = 0; r < 2; r++)
+        if (ctx->dst[r]) ctx->dst[r]->pins--;
+    if (ctx->buf) kv_storage_pool_free(ctx->buf, (ctx->blks[0] + ctx->blks[1]) << self->blk_shift);
+    kv_freelist_put(&compact_ctxs, ctx);
+    compact_window_done(self);
 }
 
-static void append_val_iov(struct kv_value_log *self, struct iovec *iov, uint32_t *cnt, uint64_t tail, uint8_t *src,
-                           uint32_t len) {
-    tail = tail & self->blk_mask;
-    if (tail) {
-        uint8_t *dst = last_buf(self, iov, *cnt) + tail;
-        uint64_t n = (1 << self->blk_shift) - tail;
-        // dst and src may overlap
-        if (len <= n) {
-            kv_memmove(dst, src, len);
-        } else {
-            kv_memmove(dst, src, n);
-            iov[*cnt].iov_len = align(self, len - n);
-            iov[(*cnt)++].iov_base = src + n;
+static void compact_values(struct compact_ctx *ctx) {
+    struct kv_value_log *self = ctx->self;
+    struct kv_value_log_stream *stream =
+        self->streams + (self->gc_policy == KV_VALUE_LOG_GC_FIFO ? KV_VALUE_LOG_HOT : KV_VALUE_LOG_COLD);
+    uint64_t victim_offset = segment_blk(self, self->victim) << self->blk_shift;
+    uint64_t room = stream->segment ? (self->segment_blks - stream->tail) << self->blk_shift : 0;
+    // pack the values like a buffered batch, they never take more than they did in the victim. The values that do
+    // not fit in the room left start over at a block boundary, to be written to the next segment.
+    struct item_list_entry *entry;
+    uint64_t offset = 0, end[2] = {0, 0};
+    uint32_t run = 0;
+    TAILQ_FOREACH(entry, &ctx->items, entry) {
+        uint32_t value_length = entry->item->value_length;
+        if (run == 0 && offset + value_length > room) {
+            run = 1;
+            offset = align(self, end[0]) << self->blk_shift;
         }
-    } else {
-        iov[*cnt].iov_len = align(self, len);
-        iov[(*cnt)++].iov_base = src;
+        entry->value_offset = offset;
+        end[run] = offset + value_length;
+        offset = kv_value_log_next_offset(offset, value_length);
+    }
+    ctx->blks[0] = align(self, end[0]);
+    ctx->blks[1] = run ? align(self, end[1]) - ctx->blks[0] : 0;
+    if (self->victim_aborted || (ctx->blks[1] && self->free_segment_num == 0)) {
+        // no segment to open: the values of the window stay in the victim, which is not freed.
+        struct item_list_entry *tmp;
+        TAILQ_FOREACH_SAFE(entry, &ctx->items, entry, tmp) {
+            TAILQ_REMOVE(&ctx->items, entry, entry);
+            kv_freelist_put(&item_list_entries, entry);
+        }
+        ctx->blks[0] = ctx->blks[1] = 0;
+        self->victim_aborted = true;
+    }
+    // only the buckets are put if every value left has expired.
+    ctx->buf = ctx->blks[0] + ctx->blks[1]
+                   ? kv_storage_pool_malloc(self->storage, (ctx->blks[0] + ctx->blks[1]) << self->blk_shift)
+                   : NULL;
+    ctx->iocnt = 1;
+    entry = TAILQ_FIRST(&ctx->items);
+    for (uint32_t r = 0; r < 2; r++) {
+        ctx->dst[r] = NULL;
+        if (ctx->blks[r] == 0) continue;
+        uint64_t buf_offset = r ? ctx->blks[0] << self->blk_shift : 0;
+        ctx->blk[r] = stream_alloc(self, stream, ctx->blks[r], 0);
+        ctx->dst[r] = stream->segment;
+        ctx->dst[r]->pins++;
+        // the bucket ids go to the segment before the next run may seal it.
+        for (; entry && (r || entry->value_offset < ctx->blks[0] << self->blk_shift); entry = TAILQ_NEXT(entry, entry)) {
+            struct kv_item *item = entry->item;
+            kv_memcpy(ctx->buf + entry->value_offset, self->victim_buf + item->value_offset - victim_offset,
+                      item->value_length);
+            item->value_offset = (ctx->blk[r] << self->blk_shift) + entry->value_offset - buf_offset;
+            self->stats.gc_bytes += item->value_length;
+            // only matters if the victim is given back.
+            self->victim->live_bytes -= self->victim->live_bytes < item->value_length ? self->victim->live_bytes
+                                                                                      : item->value_length;
+            stream_append_value(self, stream, item->value_offset, entry->seg->bucket_id, item->value_length);
+        }
+        ctx->iocnt++;
+    }
+    kv_bucket_seg_put_bulk(self->bucket_log, &ctx->segments, compact_write, ctx);
+    for (uint32_t r = 0; r < 2; r++) {
+        if (ctx->blks[r] == 0) continue;
+        kv_storage_write_blocks(self->storage, ctx->buf + (r ? ctx->blks[0] << self->blk_shift : 0), 0,
+                                self->base + ctx->blk[r], ctx->blks[r], compact_write, ctx);
     }
 }
 
@@ -236,33 +586,42 @@ static void compact_lock_cb(void *arg) {
     struct kv_value_log *self = ctx->self;
 
     // find all the values that need to be moved.
-    uint64_t items_num = 0;
+    struct kv_bucket_log *bucket_log = self->bucket_log;
+    uint32_t now = bucket_log->clock ? bucket_log->clock() : 0;
     struct item_list_entry *entry, *tmp0;
     TAILQ_FOREACH_SAFE(entry, &ctx->items, entry, tmp0) {
-        items_num++;
         struct kv_bucket_chain_entry *ce;
         TAILQ_FOREACH(ce, &entry->seg->chain, entry) {
             for (struct kv_bucket *bucket = ce->bucket; bucket - ce->bucket < ce->len; ++bucket)
                 for (struct kv_item *item = bucket->items; item - bucket->items < KV_ITEM_PER_BUCKET; ++item) {
                     if (KV_EMPTY_ITEM(item)) continue;
                     if ((item->value_offset & ~KV_VALUE_LOG_UNIT_MASK) == entry->value_offset) {
-                        entry->item = item;
-                        goto next_item;
+                        if (!kv_item_expired(item, now)) {
+                            entry->item = item;
+                            goto next_item;
+                        }
+                        // dropped rather than moved, the bucket is put all the same.
+                        struct kv_item expired = *item;
+                        item->key_length = 0;
+                        kv_bucket_item_tag_update(entry->seg, item);
+                        entry->seg->dirty = true;
+                        bucket_log->expired++;
+                        if (bucket_log->expire_cb) bucket_log->expire_cb(&expired, bucket_log->expire_arg);
+                        goto drop_item;
                     }
                 }
         }
-        // outdated values
-        items_num--;
-        get_bucket_id(self, entry->value_offset)->val = KV_BUCKET_ID_EMPTY;
+    drop_item:  // outdated or expired values
         TAILQ_REMOVE(&ctx->items, entry, entry);
-        kv_free(entry);
+        kv_freelist_put(&item_list_entries, entry);
     next_item:;
     }
-    // unlock the segments having no item_entry reference.
+    // unlock the segments having neither item_entry reference nor expired items.
     struct kv_bucket_segments unlock_segs;
     TAILQ_INIT(&unlock_segs);
     struct kv_bucket_segment *seg, *tmp1;
     TAILQ_FOREACH_SAFE(seg, &ctx->segments, entry, tmp1) {
+        if (seg->dirty) continue;
         TAILQ_FOREACH(entry, &ctx->items, entry) {
             if (entry->seg == seg) {
                 seg->dirty = true;
@@ -276,134 +635,511 @@ static void compact_lock_cb(void *arg) {
     if (!TAILQ_EMPTY(&unlock_segs)) kv_bucket_unlock(self->bucket_log, &unlock_segs);
     while ((seg = TAILQ_FIRST(&unlock_segs)) != NULL) {
         TAILQ_REMOVE(&unlock_segs, seg, entry);
-        kv_free(seg);
+        kv_freelist_put(&compact_segs, seg);
     }
 
     if (TAILQ_EMPTY(&ctx->segments)) {
-        compact_move_head(self);
-        kv_free(ctx);
+        kv_freelist_put(&compact_ctxs, ctx);
+        compact_window_done(self);
         return;
     }
-    // value compaction
-    struct iovec iov[2], val_iov[items_num + 2];
-    uint64_t tail = 0;
-    uint32_t iovcnt = 0;
-    TAILQ_FOREACH(entry, &ctx->items, entry) {
-        struct kv_item *item = entry->item;
-        uint64_t val_blk = item->value_offset >> self->blk_shift;
-        uint64_t val_end = align(self, item->value_offset + item->value_length);
-        if (!kv_circular_log_is_fetchable(&self->log, val_end)) {
-            fprintf(stderr, "value_log_compaction: value log prefetch is too slow.\n");
-            exit(-1);
-        }
-        kv_circular_log_fetch(&self->log, val_blk, val_end - val_blk, iov);
-
-        if (iov[1].iov_len) {
-            uint32_t offset_in_buf = item->value_offset & self->blk_mask;
-            uint32_t len = (iov->iov_len << self->blk_shift) - offset_in_buf;
-            append_val_iov(self, val_iov, &iovcnt, tail, (uint8_t *)iov->iov_base + offset_in_buf, len);
-            append_val_iov(self, val_iov, &iovcnt, tail, iov[1].iov_base, item->value_length - len);
-        } else {
-            uint8_t *src = (uint8_t *)iov->iov_base + (item->value_offset & self->blk_mask);
-            append_val_iov(self, val_iov, &iovcnt, tail, src, item->value_length);
-        }
-        item->value_offset = (kv_value_log_offset(self) + tail) % (self->log.size << self->blk_shift);
-        append_bucket_id(self, item->value_offset, entry->seg->bucket_id);
-
-        uint64_t next_tail = tail + dword_align(item->value_length);
-        if (tail >> KV_VALUE_LOG_UNIT_SHIFT == next_tail >> KV_VALUE_LOG_UNIT_SHIFT)
-            tail = (tail & ~KV_VALUE_LOG_UNIT_MASK) + KV_VALUE_LOG_UNIT_SIZE;
-        else
-            tail = next_tail;
-    }
-    ctx->iocnt = 2;
-    kv_bucket_seg_put_bulk(self->bucket_log, &ctx->segments, compact_write, ctx);
-    kv_circular_log_appendv(&self->log, val_iov, iovcnt, compact_write, ctx);
+    compact_values(ctx);
 }
 
-static void compact(struct kv_value_log *self) {
-    if (!self->bucket_log || kv_circular_log_empty_space(&self->log) >= COMPACTION_LENGTH * COMPACTION_CONCURRENCY * 8) return;
-    if ((self->log.size - self->log.head + self->compact_head) % self->log.size > COMPACTION_LENGTH * COMPACTION_CONCURRENCY) return;
-    if (self->is_compaction_started == false) {
-        puts("kv_value_log: the compaction has started.");
-        self->is_compaction_started = true;
-    }
-    struct compact_ctx *ctx = kv_malloc(sizeof(struct compact_ctx));
+// locks the buckets of the values starting in the window of the victim at blk.
+static void compact(struct kv_value_log *self, struct bucket_ids_block *ids, uint64_t blk, uint64_t blks) {
+    struct compact_ctx *ctx = kv_freelist_get(&compact_ctxs, sizeof(struct compact_ctx));
     ctx->self = self;
     TAILQ_INIT(&ctx->segments);
     TAILQ_INIT(&ctx->items);
-    for (size_t i = 0; i < (COMPACTION_LENGTH << self->blk_shift); i += KV_VALUE_LOG_UNIT_SIZE) {
-        uint64_t val_offset = ((self->compact_head << self->blk_shift) + i) % (self->log.size << self->blk_shift);
-        uint64_t bucket_id = get_bucket_id(self, val_offset)->val;
+    for (size_t i = 0; i < (blks << self->blk_shift); i += KV_VALUE_LOG_UNIT_SIZE) {
+        uint64_t val_offset = (blk << self->blk_shift) + i;
+        uint64_t bucket_id = get_bucket_id(self, ids, val_offset)->val;
         if (bucket_id == KV_BUCKET_ID_EMPTY) continue;
         struct kv_bucket_segment *seg = NULL;
         TAILQ_FOREACH(seg, &ctx->segments, entry) {
             if (seg->bucket_id == bucket_id) break;
         }
         if (seg == NULL) {
-            seg = kv_malloc(sizeof(*seg));
+            seg = kv_freelist_get(&compact_segs, sizeof(*seg));
             kv_bucket_seg_init(seg, bucket_id);
             TAILQ_INSERT_TAIL(&ctx->segments, seg, entry);
         }
 
-        struct item_list_entry *entry = kv_malloc(sizeof(*entry));
+        struct item_list_entry *entry = kv_freelist_get(&item_list_entries, sizeof(*entry));
         *entry = (struct item_list_entry){self, seg, val_offset, NULL};
         TAILQ_INSERT_TAIL(&ctx->items, entry, entry);
     }
-    self->compact_head = (self->compact_head + COMPACTION_LENGTH) % self->log.size;
     if (TAILQ_EMPTY(&ctx->segments)) {
-        compact_move_head(self);
-        kv_free(ctx);
+        kv_freelist_put(&compact_ctxs, ctx);
         return;
     }
+    self->victim_windows++;
     kv_bucket_lock(self->bucket_log, &ctx->segments, compact_lock_cb, ctx);
 }
 
+static void victim_read_cb(bool success, void *arg) {
+    struct kv_value_log *self = arg;
+    if (!success) {
+        fprintf(stderr, "value log: reading the segment to compact has failed.\n");
+        exit(-1);
+    }
+    if (--self->victim_windows) return;
+    compact_windows(self);
+}
+
+// starts as many windows of the victim as the scheduler lets be in flight.
+static void compact_windows(struct kv_value_log *self) {
+    struct bucket_ids_block *ids = (struct bucket_ids_block *)(self->victim_buf + (self->segment_blks << self->blk_shift));
+    uint64_t window = self->segment_blks < COMPACTION_LENGTH ? self->segment_blks : COMPACTION_LENGTH;
+    uint32_t concurrency = kv_ds_io_sched_bound(self->io_sched, gc_pressure(self), COMPACTION_CONCURRENCY);
+    self->victim_windows++;  // holds the victim until the windows are started
+    while (self->victim_next < self->segment_blks && self->victim_windows <= concurrency) {
+        uint64_t blk = segment_blk(self, self->victim) + self->victim_next;
+        self->victim_next += window;
+        compact(self, ids, blk, window);
+    }
+    compact_window_done(self);
+}
+
+static void gc(struct kv_value_log *self) {
+    while (self->victim == NULL && self->free_segment_num < gc_threshold(self)) {
+        bool pinned;
+        struct kv_value_log_segment *victim = pick_victim(self, &pinned);
+        if (victim == NULL) {
+            if (!self->gc_stalled) self->stats.victim_stalls++;
+            self->gc_stalled = true;
+            // retry once the candidates are committed. Without any, no segment is freed until more values are
+            // discarded, see maintenance_poller.
+            self->gc_blocked = !pinned;
+            if (kv_value_log_is_behind(self)) maintenance_start(self);
+            return;
+        }
+        self->gc_stalled = self->gc_blocked = false;
+        // the victim is read as a whole, its live values written again.
+        uint64_t blks = self->segment_blks + self->id_blks + (victim->live_bytes >> self->blk_shift);
+        if (self->bucket_log && !kv_ds_io_sched_acquire(self->io_sched, gc_pressure(self), blks)) return;
+        TAILQ_REMOVE(&self->sealed_segments, victim, entry);
+        if (self->bucket_log == NULL) {
+            segment_free(self, victim);
+            continue;
+        }
+        if (self->is_compaction_started == false) {
+            puts("kv_value_log: the compaction has started.");
+            self->is_compaction_started = true;
+        }
+        victim->state = SEGMENT_CLEANING;
+        self->victim = victim;
+        self->victim_next = 0;
+        self->victim_windows = 2;
+        uint64_t blk = segment_blk(self, victim);
+        kv_storage_read_blocks(self->storage, self->victim_buf, 0, self->base + blk, self->segment_blks, victim_read_cb, self);
+        kv_storage_read_blocks(self->storage, self->victim_buf + (self->segment_blks << self->blk_shift), 0,
+                               self->base + self->size + (victim - self->segments) * self->id_blks, self->id_blks,
+                               victim_read_cb, self);
+    }
+}
+
+// --- maintenance ---
+// While the log is behind, maintenance_poller drives the compaction on its own, as the writes it is started by
+// may be waiting for space themselves.
+struct space_waiter {
+    uint64_t blks;
+    kv_task_cb cb;
+    void *cb_arg;
+    STAILQ_ENTRY(space_waiter)
+    entry;
+};
+static __thread struct kv_freelist space_waiters;
+
+static inline bool has_space(struct kv_value_log *self, uint64_t blks) {
+    struct kv_value_log_stream *stream = self->streams + KV_VALUE_LOG_HOT;
+    if (blks > self->segment_blks) return true;  // fails in the write
+    if (stream->segment && stream->tail + blks <= self->segment_blks) return true;
+    return self->free_segment_num > gc_reserve(self);
+}
+
+// Once nothing left to compact can free a segment, the writes waiting go on: those that find no room fail on their
+// own rather than wait for ever.
+static inline bool is_stuck(struct kv_value_log *self) {
+    return self->gc_blocked && self->victim == NULL && self->id_dumping == 0;
+}
+
+static int maintenance_poller(void *arg) {
+    struct kv_value_log *self = arg;
+    gc(self);
+    struct space_waiter *waiter;
+    while ((waiter = STAILQ_FIRST(&self->space_waiters)) != NULL && (has_space(self, waiter->blks) || is_stuck(self))) {
+        STAILQ_REMOVE_HEAD(&self->space_waiters, entry);
+        waiter->cb(waiter->cb_arg);
+        kv_freelist_put(&space_waiters, waiter);
+    }
+    if (STAILQ_EMPTY(&self->space_waiters) && !kv_value_log_is_behind(self))
+        kv_app_poller_unregister(&self->maintenance_poller);
+    return 0;
+}
+
+static void maintenance_start(struct kv_value_log *self) {
+    if (!self->maintenance_poller) self->maintenance_poller = kv_app_poller_register(maintenance_poller, self, 0);
+}
+
+void kv_value_log_wait_space(struct kv_value_log *self, uint64_t value_length, kv_task_cb cb, void *cb_arg) {
+    uint64_t blks = align(self, value_length);
+    if (STAILQ_EMPTY(&self->space_waiters) && has_space(self, blks)) {
+        cb(cb_arg);
+        return;
+    }
+    self->stats.space_waits++;
+    struct space_waiter *waiter = kv_freelist_get(&space_waiters, sizeof(struct space_waiter));
+    *waiter = (struct space_waiter){blks, cb, cb_arg};
+    STAILQ_INSERT_TAIL(&self->space_waiters, waiter, entry);
+    maintenance_start(self);
+}
+
 //--- write ---
-void kv_value_log_write(struct kv_value_log *self, uint64_t bucket_id, uint8_t *value, uint32_t value_length,
-                        kv_circular_log_io_cb cb, void *cb_arg) {
-    append_bucket_id(self, kv_value_log_offset(self), bucket_id);
-    kv_circular_log_append(&self->log, value, align(self, value_length), cb, cb_arg);
-    compact(self);
+uint64_t kv_value_log_write(struct kv_value_log *self, uint64_t bucket_id, uint8_t *value, uint32_t value_length,
+                            kv_circular_log_io_cb cb, void *cb_arg) {
+    struct kv_value_log_stream *stream = self->streams + KV_VALUE_LOG_HOT;
+    uint64_t blks = align(self, value_length);
+    if (blks > self->segment_blks) {
+        fprintf(stderr, "kv_value_log_write: the value is larger than a segment.\n");
+        if (cb) cb(false, cb_arg);
+        return self->size << self->blk_shift;
+    }
+    uint64_t blk = stream_alloc(self, stream, blks, gc_reserve(self));
+    if (blk == UINT64_MAX) {
+        self->stats.write_fails++;
+        if (cb) cb(false, cb_arg);
+        return self->size << self->blk_shift;
+    }
+    self->stats.user_bytes += value_length;
+    stream_append_value(self, stream, blk << self->blk_shift, bucket_id, value_length);
+    stream->segment->pins++;
+    kv_storage_write_blocks(self->storage, value, 0, self->base + blk, blks, cb, cb_arg);
+    gc(self);
+    return blk << self->blk_shift;
+}
+
+void kv_value_log_commit(struct kv_value_log *self, uint64_t offset) {
+    if (offset >= self->size << self->blk_shift) return;
+    struct kv_value_log_segment *segment = offset_to_segment(self, offset);
+    assert(segment->pins);
+    segment->pins--;
+}
+
+void kv_value_log_discard(struct kv_value_log *self, uint64_t offset, uint32_t value_length) {
+    if (offset >= self->size << self->blk_shift) return;
+    struct kv_value_log_segment *segment = offset_to_segment(self, offset);
+    // only steers the choice of victims, the compaction checks every value against its bucket.
+    segment->live_bytes -= segment->live_bytes < value_length ? segment->live_bytes : value_length;
 }
 
 //--- buffered ---
-void kv_value_log_buffered_offset(struct kv_value_log *self, uint32_t *value_length, uint64_t *value_offset,
-                                  uint32_t buffer_size) {
-    uint64_t offset = self->log.tail << self->blk_shift;
+uint64_t kv_value_log_buffered_layout(uint32_t *value_length, uint64_t *value_offset, uint32_t buffer_size) {
+    uint64_t offset = 0, end = 0;
     for (uint32_t i = 0; i < buffer_size; ++i) {
         value_offset[i] = offset;
-        offset += value_length[i];
-        assert(offset >> self->blk_shift == self->log.tail);
+        end = offset + value_length[i];
+        offset = kv_value_log_next_offset(offset, value_length[i]);
     }
+    return end;
 }
 
 void kv_value_log_buffered_write(struct kv_value_log *self, uint64_t *value_offset, uint64_t *bucket_id,
                                  uint8_t *value, uint32_t *value_length, uint32_t buffer_size,
                                  kv_circular_log_io_cb cb, void *cb_arg) {
-    uint32_t total_value_length = 0;
+    struct kv_value_log_stream *stream = self->streams + KV_VALUE_LOG_HOT;
+    uint64_t blks = align(self, value_offset[buffer_size - 1] + value_length[buffer_size - 1]);
+    if (blks > self->segment_blks) {
+        fprintf(stderr, "kv_value_log_buffered_write: the batch is larger than a segment.\n");
+        for (uint32_t i = 0; i < buffer_size; ++i) value_offset[i] = self->size << self->blk_shift;
+        if (cb) cb(false, cb_arg);
+        return;
+    }
+    uint64_t blk = stream_alloc(self, stream, blks, gc_reserve(self));
+    if (blk == UINT64_MAX) {
+        self->stats.write_fails++;
+        for (uint32_t i = 0; i < buffer_size; ++i) value_offset[i] = self->size << self->blk_shift;
+        if (cb) cb(false, cb_arg);
+        return;
+    }
     for (uint32_t i = 0; i < buffer_size; ++i) {
-        append_bucket_id(self, value_offset[i], bucket_id[i]);
-        total_value_length += value_length[i];
+        value_offset[i] += blk << self->blk_shift;
+        self->stats.user_bytes += value_length[i];
+        stream_append_value(self, stream, value_offset[i], bucket_id[i], value_length[i]);
     }
-    kv_circular_log_append(&self->log, value, align(self, total_value_length), cb, cb_arg);
-    compact(self);
+    stream->segment->pins++;
+    kv_storage_write_blocks(self->storage, value, 0, self->base + blk, blks, cb, cb_arg);
+    gc(self);
+}
+
+// --- checkpoint & recovery ---
+struct segment_record {
+    uint64_t live_bytes, mtime;
+    uint8_t state;
+    uint8_t reserved[7];
+};
+static inline uint64_t segment_table_blks(struct kv_value_log *self) {
+    return align(self, self->segment_num * sizeof(struct segment_record));
+}
+
+uint64_t kv_value_log_checkpoint_blks(struct kv_value_log *self) {
+    return segment_table_blks(self) + KV_VALUE_LOG_STREAM_NUM * self->id_blks;
+}
+
+// the sealed segments must have their bucket ids on the storage.
+bool kv_value_log_can_checkpoint(struct kv_value_log *self) { return self->id_dumping == 0; }
+
+bool kv_value_log_checkpoint(struct kv_value_log *self, struct kv_value_log_checkpoint *checkpoint, uint8_t *buf) {
+    if (!kv_value_log_can_checkpoint(self)) return false;
+    checkpoint->segment_num = self->segment_num;
+    checkpoint->segment_blks = self->segment_blks;
+    checkpoint->stats = self->stats;
+    struct segment_record *records = (struct segment_record *)buf;
+    for (uint64_t i = 0; i < self->segment_num; i++)
+        records[i] = (struct segment_record){self->segments[i].live_bytes, self->segments[i].mtime, self->segments[i].state};
+    uint8_t *ids = buf + (segment_table_blks(self) << self->blk_shift);
+    for (uint32_t r = 0; r < KV_VALUE_LOG_STREAM_NUM; r++, ids += self->id_blks << self->blk_shift) {
+        struct kv_value_log_stream *stream = self->streams + r;
+        checkpoint->stream_segment[r] = stream->segment ? (uint64_t)(stream->segment - self->segments) : self->segment_num;
+        if (stream->segment) kv_memcpy(ids, stream->ids, self->id_blks << self->blk_shift);
+    }
+    return true;
+}
+
+// the bucket ids and the live bytes of the values replayed into a segment.
+struct segment_recovery {
+    struct bucket_ids_block *ids;
+    uint64_t live_bytes;
+};
+
+static void recovery_ids_alloc(struct kv_value_log *self, struct segment_recovery *recovery) {
+    recovery->ids = kv_storage_pool_malloc(self->storage, self->id_blks << self->blk_shift);
+    kv_memset(recovery->ids, 0xFF, self->id_blks << self->blk_shift);
+}
+
+bool kv_value_log_recover(struct kv_value_log *self, struct kv_value_log_checkpoint *checkpoint, uint8_t *buf) {
+    if (checkpoint && (checkpoint->segment_num != self->segment_num || checkpoint->segment_blks != self->segment_blks))
+        return false;
+    assert(self->victim == NULL && self->id_dumping == 0);
+    // forget the stream opened by kv_value_log_init, the first write after the recovery opens a new one.
+    for (uint32_t r = 0; r < KV_VALUE_LOG_STREAM_NUM; r++) {
+        if (self->streams[r].ids) kv_storage_pool_free(self->streams[r].ids, self->id_blks << self->blk_shift);
+        self->streams[r] = (struct kv_value_log_stream){NULL, 0, NULL};
+    }
+    TAILQ_INIT(&self->free_segments);
+    TAILQ_INIT(&self->sealed_segments);
+    self->free_segment_num = 0;
+    self->stats = checkpoint ? checkpoint->stats : (struct kv_value_log_stats){0};
+    self->recovery = kv_calloc(self->segment_num, sizeof(struct segment_recovery));
+    struct segment_record *records = (struct segment_record *)buf;
+    for (uint64_t i = 0; i < self->segment_num; i++) {
+        struct kv_value_log_segment *segment = self->segments + i;
+        *segment = checkpoint ? (struct kv_value_log_segment){records[i].live_bytes, records[i].mtime, 0, records[i].state}
+                              : (struct kv_value_log_segment){0, 0, 0, SEGMENT_FREE};
+        if (segment->state == SEGMENT_FREE) {
+            TAILQ_INSERT_TAIL(&self->free_segments, segment, entry);
+            self->free_segment_num++;
+        } else if (segment->state != SEGMENT_OPEN) {
+            // a segment being cleaned is cleaned again.
+            segment->state = SEGMENT_SEALED;
+            TAILQ_INSERT_TAIL(&self->sealed_segments, segment, entry);
+        } else {
+            recovery_ids_alloc(self, self->recovery + i);
+        }
+    }
+    if (checkpoint == NULL) return true;
+    uint8_t *ids = buf + (segment_table_blks(self) << self->blk_shift);
+    for (uint32_t r = 0; r < KV_VALUE_LOG_STREAM_NUM; r++, ids += self->id_blks << self->blk_shift) {
+        uint64_t i = checkpoint->stream_segment[r];
+        if (i < self->segment_num && self->recovery[i].ids)
+            kv_memcpy(self->recovery[i].ids, ids, self->id_blks << self->blk_shift);
+    }
+    return true;
+}
+
+void kv_value_log_recover_value(struct kv_value_log *self, uint64_t bucket_id, uint64_t offset, uint32_t value_length) {
+    if (offset >= self->size << self->blk_shift) return;
+    struct kv_value_log_segment *segment = offset_to_segment(self, offset);
+    struct segment_recovery *recovery = self->recovery + (segment - self->segments);
+    if (recovery->ids == NULL) {
+        recovery_ids_alloc(self, recovery);
+        if (segment->state == SEGMENT_FREE) {
+            // written after the checkpoint.
+            TAILQ_REMOVE(&self->free_segments, segment, entry);
+            self->free_segment_num--;
+            segment->state = SEGMENT_OPEN;
+            segment->live_bytes = 0;
+        } else {
+            // the ids on the storage are merged with the replayed ones.
+            TAILQ_REMOVE(&self->sealed_segments, segment, entry);
+        }
+    }
+    struct uint48_t *id = get_bucket_id(self, recovery->ids, offset);
+    if (id->val == bucket_id) return;
+    id->val = bucket_id;
+    recovery->live_bytes += value_length;
+    // the live bytes of a sealed segment are in the checkpoint already.
+    if (segment->state == SEGMENT_OPEN) segment->live_bytes += value_length;
+    segment->mtime = log_clock(self);
+}
+
+struct recover_ctx {
+    struct kv_value_log *self;
+    kv_circular_log_io_cb cb;
+    void *cb_arg;
+    uint64_t io_cnt;
+    bool success;
+};
+struct recover_segment {
+    struct recover_ctx *ctx;
+    struct kv_value_log_segment *segment;
+    struct bucket_ids_block *ids, *stored_ids;
+};
+
+static void recover_done(struct recover_ctx *ctx) {
+    if (--ctx->io_cnt) return;
+    struct kv_value_log *self = ctx->self;
+    kv_free(self->recovery);
+    self->recovery = NULL;
+    // the hot stream is opened by the first write, which waits for the compaction if few segments are free.
+    if (ctx->cb) ctx->cb(ctx->success, ctx->cb_arg);
+    kv_free(ctx);
+}
+
+static void recover_write_cb(bool success, void *arg) {
+    struct recover_segment *rs = arg;
+    struct kv_value_log *self = rs->ctx->self;
+    kv_storage_pool_free(rs->ids, self->id_blks << self->blk_shift);
+    rs->segment->state = SEGMENT_SEALED;
+    TAILQ_INSERT_TAIL(&self->sealed_segments, rs->segment, entry);
+    rs->ctx->success = rs->ctx->success && success;
+    recover_done(rs->ctx);
+    kv_free(rs);
+}
+
+static void recover_write(struct recover_segment *rs) {
+    struct kv_value_log *self = rs->ctx->self;
+    kv_storage_write_blocks(self->storage, rs->ids, 0, self->base + self->size + (rs->segment - self->segments) * self->id_blks,
+                            self->id_blks, recover_write_cb, rs);
+}
+
+static void recover_read_cb(bool success, void *arg) {
+    struct recover_segment *rs = arg;
+    struct kv_value_log *self = rs->ctx->self;
+    uint64_t units = self->segment_blks << self->blk_shift >> KV_VALUE_LOG_UNIT_SHIFT;
+    if (rs->stored_ids[0].ids[0].val == KV_BUCKET_ID_EMPTY) {
+        // freed and written again since the checkpoint, the stored ids are outdated.
+        rs->segment->live_bytes = self->recovery[rs->segment - self->segments].live_bytes;
+        units = 0;
+    }
+    for (uint64_t u = 0; success && u < units; u++) {
+        struct uint48_t *id = rs->ids[u / BUCKET_ID_PER_BLK].ids + u % BUCKET_ID_PER_BLK;
+        if (id->val == KV_BUCKET_ID_EMPTY) id->val = rs->stored_ids[u / BUCKET_ID_PER_BLK].ids[u % BUCKET_ID_PER_BLK].val;
+    }
+    rs->ctx->success = rs->ctx->success && success;
+    kv_storage_pool_free(rs->stored_ids, self->id_blks << self->blk_shift);
+    recover_write(rs);
+}
+
+static void recover_free_cb(bool success, void *arg) {
+    struct recover_segment *rs = arg;
+    struct kv_value_log *self = rs->ctx->self;
+    if (success && rs->stored_ids[0].ids[0].val == KV_BUCKET_ID_EMPTY) {
+        // freed since the checkpoint.
+        TAILQ_REMOVE(&self->sealed_segments, rs->segment, entry);
+        rs->segment->state = SEGMENT_FREE;
+        rs->segment->live_bytes = 0;
+        TAILQ_INSERT_TAIL(&self->free_segments, rs->segment, entry);
+        self->free_segment_num++;
+    }
+    rs->ctx->success = rs->ctx->success && success;
+    kv_storage_pool_free(rs->stored_ids, self->storage->block_size);
+    recover_done(rs->ctx);
+    kv_free(rs);
+}
+
+void kv_value_log_recover_finish(struct kv_value_log *self, kv_circular_log_io_cb cb, void *cb_arg) {
+    struct recover_ctx *ctx = kv_malloc(sizeof(struct recover_ctx));
+    *ctx = (struct recover_ctx){self, cb, cb_arg, 1, true};
+    for (uint64_t i = 0; i < self->segment_num; i++) {
+        struct kv_value_log_segment *segment = self->segments + i;
+        if (self->recovery[i].ids == NULL && segment->state != SEGMENT_SEALED) continue;
+        struct recover_segment *rs = kv_malloc(sizeof(struct recover_segment));
+        *rs = (struct recover_segment){ctx, segment, self->recovery[i].ids, NULL};
+        ctx->io_cnt++;
+        if (rs->ids == NULL) {
+            // untouched by the replay, the first block of its bucket ids tells whether it is still sealed.
+            rs->stored_ids = kv_storage_pool_malloc(self->storage, self->storage->block_size);
+            kv_storage_read_blocks(self->storage, rs->stored_ids, 0, self->base + self->size + i * self->id_blks, 1,
+                                   recover_free_cb, rs);
+            continue;
+        }
+        if (rs->segment->state == SEGMENT_OPEN) {
+            recover_write(rs);
+            continue;
+        }
+        rs->stored_ids = kv_storage_pool_malloc(self->storage, self->id_blks << self->blk_shift);
+        kv_storage_read_blocks(self->storage, rs->stored_ids, 0, self->base + self->size + i * self->id_blks, self->id_blks,
+                               recover_read_cb, rs);
+    }
+    recover_done(ctx);
 }
 
 // --- init & fini ---
 void kv_value_log_init(struct kv_value_log *self, struct kv_storage *storage, struct kv_bucket_log *bucket_log, uint64_t base,
-                       uint64_t size, uint32_t index_buf_len) {
+                       uint64_t size, uint32_t max_value_length, uint32_t index_buf_len) {
     kv_memset(self, 0, sizeof(struct kv_value_log));
     for (self->blk_shift = 0; !((storage->block_size >> self->blk_shift) & 1); ++self->blk_shift)
         ;
     assert(storage->block_size == 1U << self->blk_shift);
+    assert(sizeof(struct bucket_ids_block) == 1 << self->blk_shift);
     self->blk_mask = storage->block_size - 1;
+    self->storage = storage;
     self->bucket_log = bucket_log;
-    kv_circular_log_init(&self->log, storage, base, size, 0, 0, COMPACTION_LENGTH * COMPACTION_CONCURRENCY * 8, 256);
-    bucket_id_log_init(self);
+    self->base = base;
+    // larger segments for the values that take more than a few blocks of one, smaller segments on a small log so
+    // that the compaction still has victims to choose from, but never smaller than the largest value.
+    uint64_t value_blks = align(self, max_value_length);
+    self->segment_blks = KV_VALUE_LOG_SEGMENT_BLKS;
+    while (self->segment_blks < value_blks * KV_VALUE_LOG_VALUES_PER_SEGMENT) self->segment_blks <<= 1;
+    while (self->segment_blks > KV_VALUE_LOG_MIN_SEGMENT_BLKS && self->segment_blks >> 1 >= value_blks &&
+           size / self->segment_blks < 64)
+        self->segment_blks >>= 1;
+    self->segment_num = size / self->segment_blks;
+    if (self->segment_num <= GC_RESERVE_SEGMENTS + KV_VALUE_LOG_STREAM_NUM) {
+        fprintf(stderr, "kv_value_log_init: the value log is too small.\n");
+        exit(-1);
+    }
+    self->size = self->segment_num * self->segment_blks;
+    self->id_blks = ((self->segment_blks << self->blk_shift >> KV_VALUE_LOG_UNIT_SHIFT) + BUCKET_ID_PER_BLK - 1) / BUCKET_ID_PER_BLK;
+    self->id_log_size = self->segment_num * self->id_blks;
+    self->segments = kv_calloc(self->segment_num, sizeof(struct kv_value_log_segment));
+    TAILQ_INIT(&self->free_segments);
+    TAILQ_INIT(&self->sealed_segments);
+    for (uint64_t i = 0; i < self->segment_num; i++) TAILQ_INSERT_TAIL(&self->free_segments, self->segments + i, entry);
+    self->free_segment_num = self->segment_num;
+    self->victim_buf = kv_storage_blk_alloc(storage, self->segment_blks + self->id_blks);
+    self->empty_ids = kv_storage_blk_alloc(storage, 1);
+    kv_memset(self->empty_ids, 0xFF, storage->block_size);
+    STAILQ_INIT(&self->space_waiters);
+    stream_open(self, self->streams + KV_VALUE_LOG_HOT);
 }
 
 void kv_value_log_fini(struct kv_value_log *self) {
-    bucket_id_log_fini(self);
-    kv_circular_log_fini(&self->log);
+    if (self->maintenance_poller) kv_app_poller_unregister(&self->maintenance_poller);
+    for (uint32_t i = 0; i < KV_VALUE_LOG_STREAM_NUM; i++)
+        if (self->streams[i].ids) kv_storage_pool_free(self->streams[i].ids, self->id_blks << self->blk_shift);
+    kv_storage_free(self->victim_buf);
+    kv_storage_free(self->empty_ids);
+    for (uint64_t i = 0; self->recovery && i < self->segment_num; i++)
+        if (self->recovery[i].ids) kv_storage_pool_free(self->recovery[i].ids, self->id_blks << self->blk_shift);
+    kv_free(self->recovery);
+    kv_free(self->segments);
+}
+
+bool kv_value_log_is_behind(struct kv_value_log *self) {
+    if (self->id_dumping > 1) return true;
+    // the compaction has not kept the segments it needs free.
+    return self->bucket_log && self->free_segment_num <= gc_reserve(self) + 1;
 }
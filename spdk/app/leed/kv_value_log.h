@@ -1,4 +1,3 @@
-
 #ifndef _KV_VALUE_LOG_H_
 #define _KV_VALUE_LOG_H_
 #include "kv_bucket_log.h"
@@ -8,34 +7,192 @@
 #define KV_VALUE_LOG_UNIT_SIZE (1ULL << KV_VALUE_LOG_UNIT_SHIFT)
 #define KV_VALUE_LOG_UNIT_MASK (KV_VALUE_LOG_UNIT_SIZE - 1ULL)
 
+// The value log is split into fixed-size segments. The writes of the clients fill the hot stream, the values
+// moved by the compaction fill the cold one, and each stream appends to its own open segment. A value, or a
+// buffered batch, never spans two segments, so the segments are sized from the largest value: 1 MB with 512 B
+// blocks, or KV_VALUE_LOG_VALUES_PER_SEGMENT of the largest values when they take more. A value is read straight
+// into the buffer of the caller but for its first and last partial blocks.
+#define KV_VALUE_LOG_SEGMENT_BLKS (2048U)
+#define KV_VALUE_LOG_MIN_SEGMENT_BLKS (32U)
+#define KV_VALUE_LOG_VALUES_PER_SEGMENT (4U)  // so that the ends of the segments left unused stay small
+enum kv_value_log_stream_type { KV_VALUE_LOG_HOT, KV_VALUE_LOG_COLD, KV_VALUE_LOG_STREAM_NUM };
+
+// How the compaction picks the segment to clean:
+//   COST_BENEFIT: the sealed segment with the highest (1 - u) * age / (1 + u), u being its live ratio and age the
+//                 bytes written since its last write; the live values are moved into the cold stream.
+//   FIFO: the oldest sealed segment, with the live values appended to the hot stream, as the compaction at the
+//         head of a circular log does.
+enum kv_value_log_gc_policy { KV_VALUE_LOG_GC_COST_BENEFIT, KV_VALUE_LOG_GC_FIFO };
+
+struct kv_value_log_stats {
+    uint64_t id_log_stalls;  // bucket id dumps started while the previous one was still in flight
+    uint64_t victim_stalls;  // compactions postponed as no segment could be cleaned yet
+    uint64_t space_waits;    // writes held back to leave the compaction the space it needs
+    uint64_t write_fails;    // writes failed as no segment was left to them
+    uint64_t user_bytes;     // value bytes written by the clients
+    uint64_t gc_bytes;       // value bytes moved by the compaction
+    uint64_t gc_segments;    // segments reclaimed
+    uint64_t gc_aborts;      // victims given back as the compaction ran out of segments
+};
+// the bytes written to the value log per byte written by the clients.
+static inline double kv_value_log_write_amplification(struct kv_value_log_stats *stats) {
+    return stats->user_bytes ? (double)(stats->user_bytes + stats->gc_bytes) / stats->user_bytes : 1.0;
+}
+
+// the cost of the compression on the core of the value log, kept apart from the checkpointed stats.
+struct kv_value_log_codec_stats {
+    uint64_t compressed, raw;               // values stored compressed, or tried and stored raw
+    uint64_t value_bytes, record_bytes;     // of the values tried, before and after
+    uint64_t decompressed;                  // values read back
+    uint64_t compress_tsc, decompress_tsc;  // cycles spent
+};
+
+struct kv_value_log_segment {
+    uint64_t live_bytes;
+    uint64_t mtime;  // user_bytes + gc_bytes at the last write
+    uint32_t pins;   // writes not committed yet and bucket id dumps in flight
+    uint8_t state;
+    TAILQ_ENTRY(kv_value_log_segment)
+    entry;
+};
+
+struct kv_value_log_stream {
+    struct kv_value_log_segment *segment;
+    uint64_t tail;  // blocks written to the open segment
+    void *ids;      // bucket ids of the open segment, dumped when it is sealed
+};
+
+struct kv_ds_io_sched;
 struct kv_value_log {
-    struct kv_circular_log log;
+    struct kv_storage *storage;
     struct kv_bucket_log *bucket_log;
+    struct kv_ds_io_sched *io_sched;  // paces the compaction, NULL to run it at full speed
+    uint64_t base, size;  // blk
     uint64_t blk_mask, blk_shift;
-    uint64_t compact_head;
+    uint64_t segment_blks, segment_num, id_blks;  // id_blks: bucket id blocks per segment
+    struct kv_value_log_segment *segments;
+    TAILQ_HEAD(, kv_value_log_segment) free_segments, sealed_segments;
+    uint64_t free_segment_num;
+    struct kv_value_log_stream streams[KV_VALUE_LOG_STREAM_NUM];
+    enum kv_value_log_gc_policy gc_policy;
+    bool compress;  // stores the values compressed when it pays off, see kv_value_log_compress
+    struct kv_value_log_segment *victim;
+    uint8_t *victim_buf;
+    uint64_t victim_next;  // blk of the first window of the victim not started yet
+    uint32_t victim_windows, id_dumping;
+    bool victim_aborted;          // a window of the victim found no segment to move its values to
+    bool gc_stalled, gc_blocked;  // no victim found, and none will be until more values are discarded
     bool is_compaction_started;
-    void *bucket_id_log;
     uint64_t id_log_size;
+    STAILQ_HEAD(, space_waiter) space_waiters;
+    void *maintenance_poller;
+    struct kv_value_log_stats stats;
+    struct kv_value_log_codec_stats codec_stats;
+    uint8_t *empty_ids;  // a block of empty bucket ids, written to the segments freed
+    struct segment_recovery *recovery;  // per segment, while a recovery is in progress
 };
 
-static inline uint64_t kv_value_log_offset(struct kv_value_log *self) { return self->log.tail << self->blk_shift; }
-
-// base(blk) size(blk)
+// base(blk) size(blk), the writes of values longer than max_value_length may fail.
 void kv_value_log_init(struct kv_value_log *self, struct kv_storage *storage, struct kv_bucket_log *bucket_log, uint64_t base,
-                       uint64_t size, uint32_t buf_len);
+                       uint64_t size, uint32_t max_value_length, uint32_t buf_len);
 void kv_value_log_fini(struct kv_value_log *self);
 
+// true while the compaction or the bucket id dumps lag behind the writes, the caller should hold back new writes
+// until it catches up.
+bool kv_value_log_is_behind(struct kv_value_log *self);
+
+// Appends the value to the hot stream and returns its offset. The write fails if it has to open a segment and only
+// the ones left to the compaction are free, so kv_value_log_wait_space should be called first.
 // To avoid unnecessary copy, value buffer size is at least value_length + block_size.
-void kv_value_log_write(struct kv_value_log *self, uint64_t bucket_id, uint8_t *value, uint32_t value_length,
-                        kv_circular_log_io_cb cb, void *cb_arg);
-                        
+uint64_t kv_value_log_write(struct kv_value_log *self, uint64_t bucket_id, uint8_t *value, uint32_t value_length,
+                            kv_circular_log_io_cb cb, void *cb_arg);
+
+// Must be called once for every write, failed ones included, after the bucket of the value has been locked and
+// updated: until then the compaction does not clean the segment the value was written to.
+void kv_value_log_commit(struct kv_value_log *self, uint64_t offset);
+
+// The value at offset is no longer referenced, e.g. it has been overwritten or deleted.
+void kv_value_log_discard(struct kv_value_log *self, uint64_t offset, uint32_t value_length);
+
+// Calls cb once the log has room for value_length more bytes besides the space reserved for the compaction, so
+// that writes wait rather than fail while the compaction falls behind. The waiting writes are served in order. If
+// the compaction cannot free any segment, e.g. the log is full of live values, cb is called all the same and the
+// write fails.
+void kv_value_log_wait_space(struct kv_value_log *self, uint64_t value_length, kv_task_cb cb, void *cb_arg);
+
+// --- checkpoint & recovery ---
+// A checkpoint holds the segment table, the stats and the bucket ids of the open segments, which take
+// kv_value_log_checkpoint_blks blocks. kv_value_log_recover restores them, then kv_value_log_recover_value is called
+// for every value the replayed buckets reference, so that the bucket ids of the segments they point to are rebuilt.
+// kv_value_log_recover_finish writes these ids, seals the segments and frees again the ones freed since the
+// checkpoint.
+// The live bytes are an estimate once recovered, the compaction checks every value against its bucket anyway.
+struct kv_value_log_checkpoint {
+    uint64_t segment_num, segment_blks;
+    uint64_t stream_segment[KV_VALUE_LOG_STREAM_NUM];  // segment_num if the stream has no open segment
+    struct kv_value_log_stats stats;
+};
+uint64_t kv_value_log_checkpoint_blks(struct kv_value_log *self);
+// false while the bucket ids of a sealed segment are being dumped, the checkpoint has to be taken later.
+bool kv_value_log_can_checkpoint(struct kv_value_log *self);
+bool kv_value_log_checkpoint(struct kv_value_log *self, struct kv_value_log_checkpoint *checkpoint, uint8_t *buf);
+// false if the checkpoint has been taken with another layout. Without a checkpoint, every segment is taken as free
+// until the replay writes to it.
+bool kv_value_log_recover(struct kv_value_log *self, struct kv_value_log_checkpoint *checkpoint, uint8_t *buf);
+void kv_value_log_recover_value(struct kv_value_log *self, uint64_t bucket_id, uint64_t offset, uint32_t value_length);
+void kv_value_log_recover_finish(struct kv_value_log *self, kv_circular_log_io_cb cb, void *cb_arg);
+
+// Writes exactly value_length bytes to value, so value may point into a pre-registered (e.g. RDMA) response buffer.
 void kv_value_log_read(struct kv_value_log *self, uint64_t offset, uint8_t *value, uint32_t value_length,
                        kv_circular_log_io_cb cb, void *cb_arg);
+// Reads n values at once, in the order of the log, the values a few blocks apart by a single I/O. reqs is sorted by
+// offset and must stay valid until cb.
+struct kv_value_log_read_req {
+    uint64_t offset;
+    uint8_t *value;
+    uint32_t value_length;
+};
+void kv_value_log_read_bulk(struct kv_value_log *self, struct kv_value_log_read_req *reqs, uint32_t n,
+                            kv_circular_log_io_cb cb, void *cb_arg);
+
+// --- compression ---
+// A compressed value is stored as a record: a struct kv_value_log_codec_header holding the length of the value,
+// followed by the value as an LZ4 block. Its item is marked KV_CODEC_LZ and its value_length is that of the record,
+// so the compaction and the recovery move it as any other value. kv_value_log_compress writes the record and returns
+// its length, or 0 to store the value raw: a value shorter than KV_VALUE_LOG_COMPRESS_MIN, or one the codec saves
+// less than an eighth of, is not worth the cycles of decompressing it on every read.
+#define KV_VALUE_LOG_COMPRESS_MIN (64U)
+struct kv_value_log_codec_header {
+    uint32_t value_length;
+};
+// record has room for value_length bytes.
+uint32_t kv_value_log_compress(struct kv_value_log *self, const uint8_t *value, uint32_t value_length, uint8_t *record);
+static inline uint32_t kv_value_log_codec_length(const uint8_t *record) {
+    struct kv_value_log_codec_header header;
+    memcpy(&header, record, sizeof(header));
+    return header.value_length;
+}
+// value has room for kv_value_log_codec_length(record) bytes.
+bool kv_value_log_decompress(struct kv_value_log *self, const uint8_t *record, uint32_t record_length, uint8_t *value);
+// Reads the record_length bytes at offset, stored with codec, and writes the value they hold to value, which has
+// room for *value_length bytes, or for any value if it is 0. *value_length is set to the length of the value, even if
+// the read fails because it does not fit.
+void kv_value_log_read_value(struct kv_value_log *self, uint64_t offset, uint32_t record_length, uint8_t codec,
+                             uint8_t *value, uint32_t *value_length, kv_circular_log_io_cb cb, void *cb_arg);
 
-void kv_value_log_buffered_offset(struct kv_value_log *self, uint32_t *value_length, uint64_t *value_offset,
-                                  uint32_t buffer_size);
+// A buffered batch is packed like compacted values, so that at most one value starts in each log unit and the
+// unit's bucket id identifies it. kv_value_log_buffered_layout fills the offsets relative to the start of the
+// batch and returns the batch size in bytes; kv_value_log_buffered_write rebases them onto the tail of the hot
+// stream and appends the batch, which may span many blocks but no more than one segment.
+static inline uint64_t kv_value_log_next_offset(uint64_t offset, uint32_t value_length) {
+    uint64_t next = offset + ((value_length + 0x3ULL) & ~0x3ULL);
+    if (offset >> KV_VALUE_LOG_UNIT_SHIFT == next >> KV_VALUE_LOG_UNIT_SHIFT)
+        return (offset & ~KV_VALUE_LOG_UNIT_MASK) + KV_VALUE_LOG_UNIT_SIZE;
+    return next;
+}
+uint64_t kv_value_log_buffered_layout(uint32_t *value_length, uint64_t *value_offset, uint32_t buffer_size);
 
 void kv_value_log_buffered_write(struct kv_value_log *self, uint64_t *value_offset, uint64_t *bucket_id,
                                  uint8_t *value, uint32_t *value_length, uint32_t buffer_size,
                                  kv_circular_log_io_cb cb, void *cb_arg);
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,8 @@
 #include "../../kv_data_store.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../../kv_app.h"
 #include "../../kv_memory.h"
@@ -12,30 +14,266 @@ uint8_t *key[] = {"00000000", "00000000", "00000000"};
 uint8_t *value[VALUE_NUM];
 kv_data_store_ctx ds_ctx[VALUE_NUM];
 uint32_t value_length, io_cnt = VALUE_NUM;
+// many in-flight sets on a handful of keys, each pair of keys shares a bucket.
+#define CONFLICT_KEY_NUM 4
+#define CONFLICT_SET_NUM 1024
+uint8_t *conflict_key[CONFLICT_KEY_NUM] = {"0000000a", "1000000a", "2000000b", "3000000b"};
+uint8_t *conflict_value;
+kv_data_store_ctx conflict_ctx[CONFLICT_SET_NUM];
+uint32_t conflict_get;
+// keys too long for the bucket items, sharing their first 32 bytes and thus their bucket. The first one is deleted,
+// the others are checked again once compacted and recovered.
+#define LONG_KEY_NUM 4
+#define LONG_KEY_LENGTH 61
+uint8_t long_key[LONG_KEY_NUM][64];
+uint32_t long_get;
+// sets wrapping the value log several times, so the compaction runs along with them. On a slowed-down bdev the value
+// log maintenance falls behind and new sets are held back meanwhile, without any of them failing. delay_bdev.json
+// sets up such a bdev, Delay0 on top of Malloc0: test_kv_data_store delay_bdev.json 1
+#define OVERWRITE_KEY_NUM 1024
+#define OVERWRITE_SET_NUM (64 << 10)
+#define OVERWRITE_DEPTH 256
+uint8_t overwrite_key[OVERWRITE_KEY_NUM][8];
+uint8_t *overwrite_value;
+kv_data_store_ctx overwrite_ctx[OVERWRITE_DEPTH];
+uint32_t overwrite_issued, overwrite_get;
+// a checkpoint, sets after it, then a new data store on the same storage recovers both. Once the checkpoints are
+// wiped out, another one recovers them again by scanning the bucket log.
+#define REPLAY_KEY_NUM 256
+// the key index, rebuilt by the last recovery, is scanned from the first key in pieces of a few records: every key
+// left comes once, in the order of the ring.
+#define SCAN_PIECE_NUM 64
+#define SCAN_KEY_NUM (CONFLICT_KEY_NUM + LONG_KEY_NUM - 1 + OVERWRITE_KEY_NUM)
+uint8_t scan_key[UINT8_MAX], scan_key_length;
+uint32_t scan_len, scan_num, scan_total;
+bool scan_more;
+// the overwritten keys are got again by multi-gets, out of order, the first one along with a deleted and a live long
+// key. The room takes half of a batch, the keys left out are asked for again.
+#define MULTI_GET_BATCH 64
+uint8_t *mget_key[MULTI_GET_BATCH], mget_key_length[MULTI_GET_BATCH];
+uint32_t mget_len, mget_num, mget_total;
+// keys set on a clock of the test, every other one with a TTL. Once the clock has moved past it they miss, and the
+// sets wrapping the value log again let the compactions drop them. Half of the keys fill the key field of the item,
+// in pairs differing in their last byte only: the one with a TTL keeps its key in the value log, the other one in
+// the item.
+#define TTL_KEY_NUM 64
+#define TTL 10
+uint8_t ttl_key[TTL_KEY_NUM][KV_MAX_KEY_LENGTH];
+static inline uint8_t ttl_key_length(uint32_t i) { return i % 4 >= 2 ? KV_MAX_KEY_LENGTH : 8; }
+uint32_t test_now = 1;
+void *restart_poller;
 enum { INIT,
        SET0,
        GET0,
-       DELETE } state = INIT;
-char const *op_str[] = {"INIT", "SET0", "GET0", "DELETE"};
+       DELETE,
+       CONFLICT_SET,
+       CONFLICT_GET,
+       LONG_SET,
+       LONG_GET,
+       LONG_DELETE,
+       OVERWRITE,
+       OVERWRITE_GET,
+       CHECKPOINT,
+       REPLAY_SET,
+       RECOVER,
+       RECOVERED_GET,
+       WIPE_CHECKPOINT,
+       SCAN,
+       SCANNED_GET,
+       LONG_SCANNED_GET,
+       KEY_SCAN,
+       MULTI_GET,
+       TTL_SET,
+       TTL_GET,
+       TTL_EXPIRED_GET,
+       TTL_COMPACT } state = INIT;
+char const *op_str[] = {"INIT", "SET0", "GET0", "DELETE", "CONFLICT_SET", "CONFLICT_GET", "LONG_SET", "LONG_GET",
+                        "LONG_DELETE", "OVERWRITE", "OVERWRITE_GET", "CHECKPOINT", "REPLAY_SET", "RECOVER",
+                        "RECOVERED_GET", "WIPE_CHECKPOINT", "SCAN", "SCANNED_GET", "LONG_SCANNED_GET",
+                        "KEY_SCAN", "MULTI_GET", "TTL_SET", "TTL_GET", "TTL_EXPIRED_GET", "TTL_COMPACT"};
+static void test_fini(int rc) {
+    kv_data_store_fini(&data_store);
+    kv_storage_fini(&storage);
+    for (size_t i = 0; i < VALUE_NUM; i++) kv_storage_free(value[i]);
+    kv_storage_free(conflict_value);
+    kv_storage_free(overwrite_value);
+    kv_app_stop(rc);
+}
+
+static void test_cb(bool success, void *cb_arg);
+static uint32_t test_clock(void) { return test_now; }
+static void data_store_init(void) {
+    kv_data_store_init(&data_store, &storage, 0, 1 << 10, 10, 14 << 10, storage.block_size, 256, &ds_queue, 0);
+    kv_data_store_index_init(&data_store);
+    data_store.bucket_log.clock = test_clock;
+}
+
+static int restart(void *arg) {
+    struct kv_value_log *value_log = &data_store.value_log;
+    // wait for the maintenance I/O of both logs.
+    if (value_log->id_dumping || value_log->victim || data_store.bucket_log.compacting || data_store.is_checkpointing ||
+        data_store.checkpoint_pending)
+        return 0;
+    kv_app_poller_unregister(&restart_poller);
+    kv_data_store_fini(&data_store);
+    data_store_init();
+    state = state == WIPE_CHECKPOINT ? SCAN : RECOVER;
+    kv_data_store_recover(&data_store, test_cb, NULL);
+    return 0;
+}
+
+static void overwrite_set(uint32_t slot) {
+    uint32_t i = overwrite_issued++;
+    uint8_t *val = overwrite_value + slot * storage.block_size;
+    sprintf(val, "key %u set %u", i % OVERWRITE_KEY_NUM, i);
+    overwrite_ctx[slot] = kv_data_store_set(&data_store, overwrite_key[i % OVERWRITE_KEY_NUM], 8, val,
+                                            storage.block_size, 0, test_cb, overwrite_ctx + slot);
+}
+static bool long_get_check(void) {
+    char expected[32];
+    sprintf(expected, "long key %u", long_get);
+    if (strcmp(value[0], expected) || value_length != storage.block_size) {
+        fprintf(stderr, "%s: unexpected value \"%s\" of %u bytes, expected \"%s\".\n", op_str[(int)state], value[0],
+                value_length, expected);
+        return false;
+    }
+    return true;
+}
+
+static void key_scan(void) {
+    scan_len = 5 * storage.block_size;
+    scan_num = SCAN_PIECE_NUM;
+    kv_data_store_scan(&data_store, scan_key, scan_key_length, scan_total != 0, UINT64_MAX, value[1], &scan_len,
+                       &scan_num, &scan_more, test_cb, NULL);
+}
+// in the order of the ring, see kv_bucket_key_index.
+static bool key_less(uint8_t *a, uint8_t a_length, uint8_t *b, uint8_t b_length) {
+    if (kv_key_prefix(a) != kv_key_prefix(b)) return kv_key_prefix(a) < kv_key_prefix(b);
+    int cmp = memcmp(a + 8, b + 8, (a_length < b_length ? a_length : b_length) - 8);
+    return cmp ? cmp < 0 : a_length < b_length;
+}
+static bool key_scan_check(void) {
+    struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)value[1];
+    for (uint32_t i = 0; i < scan_num; i++, record = kv_data_store_scan_next(record)) {
+        if (scan_total && !key_less(scan_key, scan_key_length, record->data, record->key_length)) {
+            fprintf(stderr, "KEY_SCAN: key %u out of order.\n", scan_total);
+            return false;
+        }
+        uint64_t prefix = kv_key_prefix(record->data);
+        uint32_t k = prefix & (OVERWRITE_KEY_NUM - 1);
+        if (record->key_length == 8 && prefix == ((uint64_t)k << 54 | k)) {
+            char expected[32];
+            if (k < REPLAY_KEY_NUM)
+                sprintf(expected, "key %u replayed", k);
+            else
+                sprintf(expected, "key %u set %u", k, OVERWRITE_SET_NUM - OVERWRITE_KEY_NUM + k);
+            if (strcmp(kv_data_store_scan_value(record), expected) || record->value_length != storage.block_size) {
+                fprintf(stderr, "KEY_SCAN: unexpected value \"%s\", expected \"%s\".\n",
+                        kv_data_store_scan_value(record), expected);
+                return false;
+            }
+        }
+        kv_memcpy(scan_key, record->data, record->key_length);
+        scan_key_length = record->key_length;
+        scan_total++;
+    }
+    return true;
+}
+
+static void multi_get(void) {
+    uint32_t n = 0;
+    if (mget_total == 0) {
+        mget_key[n] = long_key[0];
+        mget_key_length[n++] = LONG_KEY_LENGTH;
+        mget_key[n] = long_key[1];
+        mget_key_length[n++] = LONG_KEY_LENGTH;
+    }
+    for (uint32_t i = mget_total; n < MULTI_GET_BATCH && i < OVERWRITE_KEY_NUM; i++, n++) {
+        mget_key[n] = overwrite_key[i * 7 % OVERWRITE_KEY_NUM];
+        mget_key_length[n] = 8;
+    }
+    mget_num = n;
+    mget_len = MULTI_GET_BATCH / 2 * kv_data_store_scan_record_size(8, storage.block_size);
+    kv_data_store_multi_get(&data_store, mget_key, mget_key_length, &mget_num, overwrite_value, &mget_len, test_cb,
+                            NULL);
+}
+static bool multi_get_check(void) {
+    struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)overwrite_value;
+    uint32_t got = 0;
+    for (uint32_t i = 0; i < mget_num; i++, record = kv_data_store_scan_next(record)) {
+        char expected[32] = "";
+        if (record->key_length != mget_key_length[i] || memcmp(record->data, mget_key[i], mget_key_length[i])) {
+            fprintf(stderr, "MULTI_GET: record %u holds another key.\n", i);
+            return false;
+        }
+        if (mget_key[i] == long_key[1]) {
+            sprintf(expected, "long key 1");
+        } else if (mget_key[i] != long_key[0]) {
+            uint32_t k = (mget_total + got++) * 7 % OVERWRITE_KEY_NUM;
+            if (k < REPLAY_KEY_NUM)
+                sprintf(expected, "key %u replayed", k);
+            else
+                sprintf(expected, "key %u set %u", k, OVERWRITE_SET_NUM - OVERWRITE_KEY_NUM + k);
+        }
+        uint32_t expected_length = expected[0] ? storage.block_size : 0;  // the deleted key misses
+        if (record->value_length != expected_length ||
+            (expected_length && strcmp(kv_data_store_scan_value(record), expected))) {
+            fprintf(stderr, "MULTI_GET: unexpected value of %u bytes for record %u, expected \"%s\".\n",
+                    record->value_length, i, expected);
+            return false;
+        }
+    }
+    if (mget_len != (uint32_t)((uint8_t *)record - overwrite_value)) {
+        fprintf(stderr, "MULTI_GET: %u bytes packed, %u expected.\n", mget_len,
+                (uint32_t)((uint8_t *)record - overwrite_value));
+        return false;
+    }
+    mget_total += got;
+    return true;
+}
+
+static void ttl_get(void) {
+    for (uint32_t i = 0; i < TTL_KEY_NUM; i++) {
+        mget_key[i] = ttl_key[i];
+        mget_key_length[i] = ttl_key_length(i);
+    }
+    mget_num = TTL_KEY_NUM;
+    mget_len = TTL_KEY_NUM * kv_data_store_scan_record_size(KV_MAX_KEY_LENGTH, storage.block_size);
+    kv_data_store_multi_get(&data_store, mget_key, mget_key_length, &mget_num, overwrite_value, &mget_len, test_cb,
+                            NULL);
+}
+static bool ttl_get_check(bool expired) {
+    struct kv_data_store_scan_record *record = (struct kv_data_store_scan_record *)overwrite_value;
+    for (uint32_t i = 0; i < TTL_KEY_NUM; i++, record = kv_data_store_scan_next(record)) {
+        char expected[32] = "";
+        if (i % 2 || !expired) sprintf(expected, "ttl key %u", i);
+        uint32_t expected_length = expected[0] ? storage.block_size : 0;
+        if (i == mget_num || record->value_length != expected_length ||
+            (expected_length && strcmp(kv_data_store_scan_value(record), expected))) {
+            fprintf(stderr, "%s: unexpected value of %u bytes for key %u, expected \"%s\".\n", op_str[(int)state],
+                    i < mget_num ? record->value_length : 0, i, expected);
+            return false;
+        }
+    }
+    return true;
+}
+
 static void test_cb(bool success, void *cb_arg) {
     if (!success) {
         fprintf(stderr, "%s failed.\n", op_str[(int)state]);
-        kv_data_store_fini(&data_store);
-        kv_storage_fini(&storage);
-        for (size_t i = 0; i < VALUE_NUM; i++) kv_storage_free(value[i]);
-        kv_app_stop(-1);
+        test_fini(-1);
         return;
     }
-    printf("%s successfully.\n", op_str[(int)state]);
+    if (state != OVERWRITE && state != KEY_SCAN && state != MULTI_GET && state != TTL_COMPACT) printf("%s successfully.\n", op_str[(int)state]);
     switch (state) {
         case INIT:
             state = SET0;
             sprintf(value[0], "hello world!");
             sprintf(value[1], "hi!");
             sprintf(value[2], "bye!");
-            ds_ctx[0] = kv_data_store_set(&data_store, key[0], 8, value[0], 256, test_cb, ds_ctx);
-            ds_ctx[1] = kv_data_store_set(&data_store, key[1], 8, value[1], 513, test_cb, ds_ctx + 1);
-            ds_ctx[2] = kv_data_store_set(&data_store, key[2], 8, value[2], 1000, test_cb, ds_ctx + 2);
+            ds_ctx[0] = kv_data_store_set(&data_store, key[0], 8, value[0], 256, 0, test_cb, ds_ctx);
+            ds_ctx[1] = kv_data_store_set(&data_store, key[1], 8, value[1], 513, 0, test_cb, ds_ctx + 1);
+            ds_ctx[2] = kv_data_store_set(&data_store, key[2], 8, value[2], 1000, 0, test_cb, ds_ctx + 2);
             break;
         case SET0:
             kv_data_store_set_commit(*(kv_data_store_ctx *)cb_arg, true);
@@ -52,22 +290,286 @@ static void test_cb(bool success, void *cb_arg) {
             break;
         case DELETE:
             kv_data_store_del_commit(ds_ctx[0], true);
-            kv_data_store_fini(&data_store);
-            kv_storage_fini(&storage);
-            for (size_t i = 0; i < VALUE_NUM; i++) kv_storage_free(value[i]);
-            kv_app_stop(0);
+            state = CONFLICT_SET;
+            io_cnt = CONFLICT_SET_NUM;
+            for (size_t i = 0; i < CONFLICT_SET_NUM; i++) {
+                uint8_t *val = conflict_value + i * storage.block_size;
+                sprintf(val, "key %zu set %zu", i % CONFLICT_KEY_NUM, i);
+                conflict_ctx[i] = kv_data_store_set(&data_store, conflict_key[i % CONFLICT_KEY_NUM], 8, val, storage.block_size,
+                                                    0, test_cb, conflict_ctx + i);
+            }
+            break;
+        case CONFLICT_SET:
+            kv_data_store_set_commit(*(kv_data_store_ctx *)cb_arg, true);
+            if (--io_cnt) return;
+            state = CONFLICT_GET;
+            conflict_get = 0;
+            kv_data_store_get(&data_store, conflict_key[0], 8, value[0], &value_length, NULL, test_cb, NULL);
+            break;
+        case CONFLICT_GET:
+            // the last set of each key wins.
+            if (strcmp(value[0], conflict_value + (CONFLICT_SET_NUM - CONFLICT_KEY_NUM + conflict_get) * storage.block_size)) {
+                fprintf(stderr, "CONFLICT_GET: unexpected value \"%s\".\n", value[0]);
+                test_fini(-1);
+                return;
+            }
+            if (++conflict_get < CONFLICT_KEY_NUM) {
+                kv_data_store_get(&data_store, conflict_key[conflict_get], 8, value[0], &value_length, NULL, test_cb, NULL);
+                return;
+            }
+            state = LONG_SET;
+            io_cnt = LONG_KEY_NUM;
+            for (uint32_t i = 0; i < LONG_KEY_NUM; i++) {
+                kv_memset(long_key[i], 'k', LONG_KEY_LENGTH);
+                long_key[i][LONG_KEY_LENGTH - 1] = '0' + i;
+                uint8_t *val = conflict_value + i * storage.block_size;
+                sprintf(val, "long key %u", i);
+                conflict_ctx[i] = kv_data_store_set(&data_store, long_key[i], LONG_KEY_LENGTH, val, storage.block_size,
+                                                    0, test_cb, conflict_ctx + i);
+            }
+            break;
+        case LONG_SET:
+            kv_data_store_set_commit(*(kv_data_store_ctx *)cb_arg, true);
+            if (--io_cnt) return;
+            state = LONG_GET;
+            long_get = 0;
+            kv_data_store_get(&data_store, long_key[0], LONG_KEY_LENGTH, value[0], &value_length, NULL, test_cb, NULL);
+            break;
+        case LONG_GET:
+            if (!long_get_check()) {
+                test_fini(-1);
+                return;
+            }
+            if (++long_get < LONG_KEY_NUM) {
+                kv_data_store_get(&data_store, long_key[long_get], LONG_KEY_LENGTH, value[0], &value_length, NULL, test_cb,
+                                  NULL);
+                return;
+            }
+            state = LONG_DELETE;
+            ds_ctx[0] = kv_data_store_delete(&data_store, long_key[0], LONG_KEY_LENGTH, test_cb, NULL);
+            break;
+        case LONG_DELETE:
+            kv_data_store_del_commit(ds_ctx[0], true);
+            state = OVERWRITE;
+            io_cnt = OVERWRITE_SET_NUM;
+            overwrite_issued = 0;
+            for (uint32_t i = 0; i < OVERWRITE_KEY_NUM; i++) {
+                // the high bits select the bucket.
+                uint64_t key = (uint64_t)i << 54 | i;
+                kv_memcpy(overwrite_key[i], &key, 8);
+            }
+            for (uint32_t slot = 0; slot < OVERWRITE_DEPTH; slot++) overwrite_set(slot);
+            break;
+        case OVERWRITE:
+            kv_data_store_set_commit(*(kv_data_store_ctx *)cb_arg, true);
+            if (overwrite_issued < OVERWRITE_SET_NUM) overwrite_set((kv_data_store_ctx *)cb_arg - overwrite_ctx);
+            if (--io_cnt) return;
+            printf("%s successfully.\n", op_str[(int)state]);
+            printf("value log stalls id log/victim: %lu/%lu, space waits: %lu, write fails: %lu, admission throttles: %lu\n",
+                   data_store.value_log.stats.id_log_stalls, data_store.value_log.stats.victim_stalls,
+                   data_store.value_log.stats.space_waits, data_store.value_log.stats.write_fails,
+                   ds_queue.cost_model[0].throttles);
+            printf("write amplification: %lf, %lu segments compacted\n",
+                   kv_value_log_write_amplification(&data_store.value_log.stats), data_store.value_log.stats.gc_segments);
+            if (data_store.value_log.stats.space_waits == 0) {
+                fprintf(stderr, "OVERWRITE: no set waited for space, is the bdev slowed down?\n");
+                test_fini(-1);
+                return;
+            }
+            state = OVERWRITE_GET;
+            overwrite_get = 0;
+            kv_data_store_get(&data_store, overwrite_key[0], 8, value[0], &value_length, NULL, test_cb, NULL);
+            break;
+        case OVERWRITE_GET: {
+            // the value of the last set of each key has survived the compaction.
+            char expected[32];
+            uint32_t last = OVERWRITE_SET_NUM - OVERWRITE_KEY_NUM + overwrite_get;
+            sprintf(expected, "key %u set %u", overwrite_get, last);
+            if (strcmp(value[0], expected)) {
+                fprintf(stderr, "OVERWRITE_GET: unexpected value \"%s\", expected \"%s\".\n", value[0], expected);
+                test_fini(-1);
+                return;
+            }
+            if (++overwrite_get < OVERWRITE_KEY_NUM) {
+                kv_data_store_get(&data_store, overwrite_key[overwrite_get], 8, value[0], &value_length, NULL, test_cb, NULL);
+                return;
+            }
+            state = CHECKPOINT;
+            kv_data_store_checkpoint(&data_store, test_cb, NULL);
+            break;
+        }
+        case CHECKPOINT:
+            // replayed from the bucket log after the restart.
+            state = REPLAY_SET;
+            io_cnt = REPLAY_KEY_NUM;
+            for (uint32_t i = 0; i < REPLAY_KEY_NUM; i++) {
+                uint8_t *val = overwrite_value + i * storage.block_size;
+                sprintf(val, "key %u replayed", i);
+                overwrite_ctx[i] = kv_data_store_set(&data_store, overwrite_key[i], 8, val, storage.block_size, 0, test_cb,
+                                                     overwrite_ctx + i);
+            }
+            break;
+        case REPLAY_SET:
+            kv_data_store_set_commit(*(kv_data_store_ctx *)cb_arg, true);
+            if (--io_cnt) return;
+            restart_poller = kv_app_poller_register(restart, NULL, 1000);
+            break;
+        case RECOVER:
+        case SCAN:
+            state = state == RECOVER ? RECOVERED_GET : SCANNED_GET;
+            overwrite_get = 0;
+            kv_data_store_get(&data_store, overwrite_key[0], 8, value[0], &value_length, NULL, test_cb, NULL);
+            break;
+        case WIPE_CHECKPOINT:
+            if (--io_cnt) return;
+            restart_poller = kv_app_poller_register(restart, NULL, 1000);
+            break;
+        case RECOVERED_GET:
+        case SCANNED_GET: {
+            char expected[32];
+            if (overwrite_get < REPLAY_KEY_NUM)
+                sprintf(expected, "key %u replayed", overwrite_get);
+            else
+                sprintf(expected, "key %u set %u", overwrite_get, OVERWRITE_SET_NUM - OVERWRITE_KEY_NUM + overwrite_get);
+            if (strcmp(value[0], expected)) {
+                fprintf(stderr, "%s: unexpected value \"%s\", expected \"%s\".\n", op_str[(int)state], value[0], expected);
+                test_fini(-1);
+                return;
+            }
+            if (++overwrite_get < OVERWRITE_KEY_NUM) {
+                kv_data_store_get(&data_store, overwrite_key[overwrite_get], 8, value[0], &value_length, NULL, test_cb, NULL);
+                return;
+            }
+            if (state == SCANNED_GET) {
+                state = LONG_SCANNED_GET;
+                long_get = 1;
+                kv_data_store_get(&data_store, long_key[1], LONG_KEY_LENGTH, value[0], &value_length, NULL, test_cb, NULL);
+                return;
+            }
+            state = WIPE_CHECKPOINT;
+            data_store.checkpoint_period = 0;
+            io_cnt = 2;
+            kv_memset(value[1], 0, storage.block_size);
+            for (uint32_t slot = 0; slot < 2; slot++)
+                kv_storage_write_blocks(&storage, value[1], 0, data_store.checkpoint_base + slot * data_store.checkpoint_slot_blks,
+                                        1, test_cb, NULL);
+            break;
+        }
+        case LONG_SCANNED_GET:
+            if (!long_get_check()) {
+                test_fini(-1);
+                return;
+            }
+            if (++long_get < LONG_KEY_NUM) {
+                kv_data_store_get(&data_store, long_key[long_get], LONG_KEY_LENGTH, value[0], &value_length, NULL, test_cb,
+                                  NULL);
+                return;
+            }
+            state = KEY_SCAN;
+            kv_memset(scan_key, 0, 8);
+            scan_key_length = 8;
+            scan_total = 0;
+            key_scan();
+            break;
+        case KEY_SCAN:
+            if (!key_scan_check()) {
+                test_fini(-1);
+                return;
+            }
+            if (scan_more) {
+                key_scan();
+                return;
+            }
+            if (scan_total != SCAN_KEY_NUM) {
+                fprintf(stderr, "KEY_SCAN: %u keys scanned, expected %u.\n", scan_total, SCAN_KEY_NUM);
+                test_fini(-1);
+                return;
+            }
+            printf("%s successfully, %u keys.\n", op_str[(int)state], scan_total);
+            state = MULTI_GET;
+            mget_total = 0;
+            multi_get();
+            break;
+        case MULTI_GET:
+            if (!multi_get_check()) {
+                test_fini(-1);
+                return;
+            }
+            if (mget_total < OVERWRITE_KEY_NUM) {
+                multi_get();
+                return;
+            }
+            printf("%s successfully, %u keys.\n", op_str[(int)state], mget_total);
+            state = TTL_SET;
+            io_cnt = TTL_KEY_NUM;
+            for (uint32_t i = 0; i < TTL_KEY_NUM; i++) {
+                // in the buckets of the overwritten keys, past them in the order of the ring.
+                uint32_t k = ttl_key_length(i) == 8 ? i : i & ~1U;
+                uint64_t key = (uint64_t)k << 54 | (OVERWRITE_KEY_NUM + k);
+                kv_memcpy(ttl_key[i], &key, 8);
+                kv_memset(ttl_key[i] + 8, 't', KV_MAX_KEY_LENGTH - 8);
+                ttl_key[i][KV_MAX_KEY_LENGTH - 1] = i;
+                uint8_t *val = conflict_value + i * storage.block_size;
+                sprintf(val, "ttl key %u", i);
+                conflict_ctx[i] = kv_data_store_set(&data_store, ttl_key[i], ttl_key_length(i), val, storage.block_size,
+                                                    i % 2 ? 0 : test_now + TTL, test_cb, conflict_ctx + i);
+            }
+            break;
+        case TTL_SET:
+            kv_data_store_set_commit(*(kv_data_store_ctx *)cb_arg, true);
+            if (--io_cnt) return;
+            state = TTL_GET;
+            ttl_get();
+            break;
+        case TTL_GET:
+        case TTL_EXPIRED_GET:
+            if (!ttl_get_check(state == TTL_EXPIRED_GET)) {
+                test_fini(-1);
+                return;
+            }
+            if (state == TTL_GET) {
+                state = TTL_EXPIRED_GET;
+                test_now += TTL;
+                ttl_get();
+                return;
+            }
+            state = TTL_COMPACT;
+            io_cnt = OVERWRITE_SET_NUM;
+            overwrite_issued = 0;
+            for (uint32_t slot = 0; slot < OVERWRITE_DEPTH; slot++) overwrite_set(slot);
+            break;
+        case TTL_COMPACT:
+            kv_data_store_set_commit(*(kv_data_store_ctx *)cb_arg, true);
+            if (overwrite_issued < OVERWRITE_SET_NUM) overwrite_set((kv_data_store_ctx *)cb_arg - overwrite_ctx);
+            if (--io_cnt) return;
+            // the expired keys held in their items have left the key index along with them.
+            if (data_store.bucket_log.expired != TTL_KEY_NUM / 2 ||
+                kv_bucket_key_index_size(data_store.key_index) != SCAN_KEY_NUM + TTL_KEY_NUM / 2 + TTL_KEY_NUM / 4) {
+                fprintf(stderr, "TTL_COMPACT: %lu items dropped, %lu keys indexed, expected %u and %u.\n",
+                        data_store.bucket_log.expired, kv_bucket_key_index_size(data_store.key_index), TTL_KEY_NUM / 2,
+                        SCAN_KEY_NUM + TTL_KEY_NUM / 2 + TTL_KEY_NUM / 4);
+                test_fini(-1);
+                return;
+            }
+            printf("%s successfully, %lu items dropped.\n", op_str[(int)state], data_store.bucket_log.expired);
+            test_fini(0);
     }
 }
 
+static uint32_t storage_index;
 static void start(void *arg) {
-    kv_storage_init(&storage, 0);
+    kv_storage_init(&storage, storage_index);
     for (size_t i = 0; i < VALUE_NUM; i++) value[i] = kv_storage_blk_alloc(&storage, 5);
-    kv_data_store_init(&data_store, &storage, 0, 1 << 10, 10, 14 << 10, 256, &ds_queue, 0);
+    conflict_value = kv_storage_blk_alloc(&storage, CONFLICT_SET_NUM);
+    overwrite_value = kv_storage_blk_alloc(&storage, OVERWRITE_DEPTH);
+    data_store_init();
     test_cb(true, NULL);
 }
 
 int main(int argc, char **argv) {
     kv_ds_queue_init(&ds_queue, 1);
-    kv_app_start_single_task(argv[1], start, NULL);
+    if (argc > 2) storage_index = atoi(argv[2]);
+    int rc = kv_app_start_single_task(argv[1], start, NULL);
     kv_ds_queue_fini(&ds_queue);
+    return rc;
 }
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "../../kv_ds_queue.h"
+
+#include <stdio.h>
+
+#include "../../kv_app.h"
+#include "spdk/env.h"
+// Two replicas serve GETs. When one of them is throttled, its measured service time must show up in the
+// q_info it piggybacks, so that a client choosing replicas by q_info shifts its reads to the other one.
+#define INFLIGHT 8
+#define COMPLETIONS 2000
+#define PICKS 100
+struct kv_ds_queue ds_queue;
+
+// completes COMPLETIONS GETs of latency_us each on ds_id, with INFLIGHT of them outstanding.
+static void serve(uint32_t ds_id, uint64_t latency_us) {
+    uint32_t cost[INFLIGHT];
+    struct kv_ds_q_info q_info = {0, ds_queue.cost_model[ds_id].cap};
+    for (uint32_t i = 0; i < INFLIGHT; i++) {
+        cost[i] = kv_ds_queue_cost(&ds_queue, ds_id, KV_DS_GET);
+        q_info.size += cost[i];
+    }
+    for (uint32_t n = 0; n < COMPLETIONS; n++) {
+        uint32_t i = n % INFLIGHT;
+        q_info.size -= cost[i];
+        q_info.cap = kv_ds_queue_complete(&ds_queue, ds_id, KV_DS_GET, spdk_get_ticks() - latency_us * kv_ds_ticks_per_us());
+        cost[i] = kv_ds_queue_cost(&ds_queue, ds_id, KV_DS_GET);
+        q_info.size += cost[i];
+    }
+    ds_queue.q_info[ds_id] = q_info;
+}
+
+// the number of PICKS GETs a client sends to replica 0.
+static uint32_t client_picks(void) {
+    struct kv_ds_q_info q_info[2] = {ds_queue.q_info[0], ds_queue.q_info[1]};
+    uint32_t picks = 0;
+    for (uint32_t i = 0; i < PICKS; i++)
+        if (kv_ds_queue_find(q_info, NULL, 2, kv_ds_op_cost(KV_DS_GET)) == q_info) picks++;
+    return picks;
+}
+
+static int check(const char *name, uint64_t latency0, uint64_t latency1, uint32_t min_picks, uint32_t max_picks) {
+    serve(0, latency0);
+    serve(1, latency1);
+    uint32_t picks = client_picks();
+    struct kv_ds_q_info q0 = ds_queue.q_info[0], q1 = ds_queue.q_info[1];
+    printf("%s: q_info %u/%u vs %u/%u, %u of %u reads to replica 0\n", name, q0.size, q0.cap, q1.size, q1.cap, picks,
+           PICKS);
+    if (picks < min_picks || picks > max_picks) {
+        fprintf(stderr, "%s failed.\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// The compaction of ds_id asks for COMPACTION_BLKS blocks at a time for PACING_US while its queue is full, the
+// blocks granted must follow the rate of its share once the initial burst is spent.
+#define PACING_US 20000
+#define COMPACTION_BLKS 64
+static int check_pacing(uint32_t ds_id) {
+    struct kv_ds_io_sched sched;
+    kv_ds_io_sched_init(&sched, &ds_queue, ds_id);
+    struct kv_ds_q_info q_info = {0, ds_queue.cost_model[ds_id].cap};
+    ds_queue.q_info[ds_id] = q_info;
+    uint32_t idle_share = kv_ds_io_sched_share(&sched, 0);
+    q_info.size = q_info.cap;
+    ds_queue.q_info[ds_id] = q_info;
+    uint32_t busy_share = kv_ds_io_sched_share(&sched, 0), urgent_share = kv_ds_io_sched_share(&sched, KV_DS_IO_SHARE_UNIT);
+    printf("SCHEDULER: share idle %u, busy %u, busy and urgent %u of %u, busy bound %u of 8\n", idle_share, busy_share,
+           urgent_share, KV_DS_IO_SHARE_UNIT, kv_ds_io_sched_bound(&sched, 0, 8));
+    if (idle_share != KV_DS_IO_SHARE_UNIT || busy_share != KV_DS_IO_SHARE_MIN || urgent_share != KV_DS_IO_SHARE_UNIT ||
+        kv_ds_io_sched_bound(&sched, 0, 8) != 1) {
+        fprintf(stderr, "SCHEDULER failed.\n");
+        return -1;
+    }
+
+    uint64_t granted = 0, start = spdk_get_ticks();
+    while (spdk_get_ticks() - start < PACING_US * kv_ds_ticks_per_us())
+        if (kv_ds_io_sched_acquire(&sched, 0, COMPACTION_BLKS)) granted += COMPACTION_BLKS;
+    uint64_t expected = KV_DS_IO_BURST + (uint64_t)KV_DS_IO_RATE_MAX * KV_DS_IO_SHARE_MIN / KV_DS_IO_SHARE_UNIT * PACING_US / 1000;
+    printf("PACING: %lu blocks granted in %u us, %lu expected, %lu deferrals\n", granted, PACING_US, expected, sched.deferrals);
+    if (granted < expected * 9 / 10 || granted > expected * 11 / 10 + COMPACTION_BLKS) {
+        fprintf(stderr, "PACING failed.\n");
+        return -1;
+    }
+    ds_queue.q_info[ds_id] = (struct kv_ds_q_info){0, ds_queue.cost_model[ds_id].cap};
+    return 0;
+}
+
+// the tick rate is only known once kv_app has started.
+static void start(void *arg) {
+    int rc = 0;
+    kv_ds_queue_init(&ds_queue, 2);
+    rc = rc ? rc : check("BALANCED", 100, 100, PICKS * 2 / 5, PICKS * 3 / 5);
+    rc = rc ? rc : check("THROTTLED", 100, 1000, PICKS * 9 / 10, PICKS);
+    rc = rc ? rc : check("RECOVERED", 100, 100, PICKS * 2 / 5, PICKS * 3 / 5);
+    if (rc == 0) {
+        uint32_t cap = ds_queue.cost_model[1].cap;
+        serve(1, 5 * KV_DS_LATENCY_TARGET_US);
+        printf("OVERLOADED: capacity %u -> %u\n", cap, ds_queue.cost_model[1].cap);
+        if (ds_queue.cost_model[1].cap >= cap) {
+            fprintf(stderr, "OVERLOADED failed.\n");
+            rc = -1;
+        }
+    }
+    rc = rc ? rc : check_pacing(0);
+    if (rc == 0) {
+        // a client adopting the cost a server reports charges its q_info in the same units.
+        struct kv_ds_queue client;
+        kv_ds_queue_init(&client, 2);
+        uint32_t cost = kv_ds_queue_cost(&ds_queue, 1, KV_DS_GET);
+        kv_ds_queue_set_cost(&client, 1, KV_DS_GET, cost);
+        printf("UNITS: server cost %u, client cost %u\n", cost, kv_ds_queue_cost(&client, 1, KV_DS_GET));
+        if (kv_ds_queue_cost(&client, 1, KV_DS_GET) != cost) {
+            fprintf(stderr, "UNITS failed.\n");
+            rc = -1;
+        }
+        kv_ds_queue_fini(&client);
+    }
+    kv_ds_queue_fini(&ds_queue);
+    kv_app_stop(rc);
+}
+
+int main(int argc, char **argv) { return kv_app_start_single_task(argc > 1 ? argv[1] : NULL, start, NULL); }
@@ -1,8 +1,13 @@
 #include "../../kv_rdma.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "../../kv_app.h"
+// usage: test_kv_rdma <json config> [thread num], the server polls its connections on thread num threads.
+// With KV_RDMA_TRANSPORT=shm, it serves the clients of the same host through shared memory.
+static uint32_t thread_num = 1;
+
 static void handler(void *req_h, kv_rdma_mr req, uint32_t req_sz, void *arg) {
     // puts(buf);
     // sprintf(buf, "msg from server.");
@@ -10,8 +15,15 @@ static void handler(void *req_h, kv_rdma_mr req, uint32_t req_sz, void *arg) {
 }
 
 static void rdma_start(void *arg) {
+    if (kv_app_get_thread_index() != 0) return;
     kv_rdma_handle rdma;
-    kv_rdma_init(&rdma, 1);
-    kv_rdma_listen(rdma, "0.0.0.0", "9000", 32, 8192, handler, NULL, NULL, NULL);
+    kv_rdma_init(&rdma, thread_num);
+    kv_rdma_listen(rdma, "0.0.0.0", "9000", 32 * thread_num, 8192, handler, NULL, NULL, NULL);
+}
+int main(int argc, char **argv) {
+    if (argc > 2) thread_num = strtoul(argv[2], NULL, 10);
+    if (thread_num == 0 || thread_num > MAX_TASKS_NUM) thread_num = 1;
+    struct kv_app_task tasks[MAX_TASKS_NUM];
+    for (size_t i = 0; i < thread_num; i++) tasks[i] = (struct kv_app_task){rdma_start, NULL};
+    kv_app_start(argv[1], thread_num, tasks);
 }
-int main(int argc, char **argv) { kv_app_start_single_task(argv[1], rdma_start, NULL); }
\ No newline at end of file
@@ -0,0 +1,89 @@
+// on_recv_req is static, the test is built with kv_rdma.c to drive it with synthetic completions: no RDMA device is
+// needed, as long as every request comes from a known connection and is never reposted.
+#include "../../kv_rdma.c"
+
+#include "spdk/env.h"
+// usage: test_kv_rdma_lookup [json config]
+// It times the connection lookup of on_recv_req for 1 to MAX_CONN_NUM connections, on the first request of each
+// connection, which goes through the shared hash, then on ROUNDS requests served from the poller's own hash.
+#define MAX_CONN_NUM 4096U
+#define ROUNDS (1U << 20)
+#define REQ_SIZE 64U
+
+static uint64_t handled;
+static void handler(void *req_h, kv_rdma_mr req, uint32_t req_sz, void *arg) { handled++; }
+
+static double ns_per(uint64_t ticks, uint64_t n) { return (double)ticks * 1e9 / spdk_get_ticks_hz() / n; }
+
+static int bench(uint32_t conn_num) {
+    struct kv_rdma *self = kv_calloc(1, sizeof(struct kv_rdma));
+    pthread_rwlock_init(&self->lock, NULL);
+    struct cq_poller_ctx poller = {self};
+    struct rdma_connection *conns = kv_calloc(conn_num, sizeof(struct rdma_connection));
+    for (uint32_t i = 0; i < conn_num; i++) {
+        conns[i] = (struct rdma_connection){self, NULL, NULL, true, &poller};
+        conns[i].u.s.handler = handler;
+        conns[i].u.s.qp_num = (i * 2654435761U) & 0xFFFFFFU;  // distinct 24-bit qp_nums, as spread as real ones
+        HASH_ADD(u.s.hh, self->connections, u.s.qp_num, sizeof(uint32_t), conns + i);
+    }
+    uint8_t buf[HEADER_SIZE + REQ_SIZE] = {0};
+    struct ibv_mr mr = {.addr = buf, .length = sizeof(buf)};
+    struct server_req_ctx req = {.self = self, .poller = &poller, .mr = &mr};
+    struct ibv_wc wc = {.wr_id = (uint64_t)&req, .status = IBV_WC_SUCCESS, .opcode = IBV_WC_RECV,
+                        .byte_len = sizeof(buf), .wc_flags = IBV_WC_WITH_IMM};
+
+    handled = 0;
+    uint64_t start = spdk_get_ticks();
+    for (uint32_t i = 0; i < conn_num; i++) {
+        wc.qp_num = conns[i].u.s.qp_num;
+        on_recv_req(&wc);
+    }
+    uint64_t first = spdk_get_ticks() - start;
+    start = spdk_get_ticks();
+    for (uint32_t n = 0; n < ROUNDS; n++) {
+        wc.qp_num = conns[(n * 7919U) % conn_num].u.s.qp_num;  // interleaves the connections
+        on_recv_req(&wc);
+    }
+    uint64_t steady = spdk_get_ticks() - start;
+    printf("%4u connections: %.1f ns on the first request, then %.1f ns per request\n", conn_num,
+           ns_per(first, conn_num), ns_per(steady, ROUNDS));
+
+    int rc = 0;
+    if (handled != conn_num + ROUNDS || HASH_CNT(u.s.poller_hh, poller.connections) != conn_num) {
+        fprintf(stderr, "LOOKUP with %u connections failed.\n", conn_num);
+        rc = -1;
+    }
+    HASH_CLEAR(u.s.poller_hh, poller.connections);
+    HASH_CLEAR(u.s.hh, self->connections);
+    kv_free(conns);
+    pthread_rwlock_destroy(&self->lock);
+    kv_free(self);
+    return rc;
+}
+
+// a connection freed after its qp_num went to a new connection must leave the new one in the poller's hash.
+static int check_reused_qp_num(void) {
+    struct cq_poller_ctx poller = {NULL};
+    struct rdma_connection conn = {NULL, NULL, NULL, true, &poller};
+    struct rdma_connection *stale = kv_malloc(sizeof(struct rdma_connection));
+    *stale = conn;
+    conn.u.s.qp_num = stale->u.s.qp_num = 42;
+    HASH_ADD(u.s.poller_hh, poller.connections, u.s.qp_num, sizeof(uint32_t), &conn);
+    server_conn_free(stale);
+    struct rdma_connection *x = NULL;
+    HASH_FIND(u.s.poller_hh, poller.connections, &conn.u.s.qp_num, sizeof(uint32_t), x);
+    HASH_CLEAR(u.s.poller_hh, poller.connections);
+    if (x != &conn) {
+        fprintf(stderr, "REUSED failed.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void start(void *arg) {
+    int rc = check_reused_qp_num();
+    for (uint32_t conn_num = 1; rc == 0 && conn_num <= MAX_CONN_NUM; conn_num *= 4) rc = bench(conn_num);
+    kv_app_stop(rc);
+}
+
+int main(int argc, char **argv) { return kv_app_start_single_task(argc > 1 ? argv[1] : NULL, start, NULL); }
@@ -97,7 +97,9 @@ static void io_start(void *arg) {
     switch (io->msg->type) {
         case KV_MSG_SET:
             io->ctx = kv_data_store_set(&self->data_store, KV_MSG_KEY(io->msg), io->msg->key_len, KV_MSG_VALUE(io->msg),
-                                        io->msg->value_len, io_fini, arg);
+                                        io->msg->value_len,
+                                        io->msg->flags & KV_MSG_TTL ? kv_data_store_expire(&self->data_store, io->msg->ttl) : 0,
+                                        io_fini, arg);
             io->msg->value_len = 0;
             break;
         case KV_MSG_GET:
@@ -138,7 +140,8 @@ static void worker_init(void *arg) {
     while ((1ULL << log_bucket_num) >= opt.num_items / KV_ITEM_PER_BUCKET) log_bucket_num--;
     ++log_bucket_num;
     uint64_t value_log_block_num = opt.value_size * opt.num_items * 1.4 / self->storage.block_size;
-    kv_data_store_init(&self->data_store, &self->storage, 0, bucket_num, log_bucket_num, value_log_block_num, 512, &ds_queue, self - workers);
+    kv_data_store_init(&self->data_store, &self->storage, 0, bucket_num, log_bucket_num, value_log_block_num, opt.value_size, 512,
+                       &ds_queue, self - workers);
     kv_app_send(opt.ssd_num, rdma_start, NULL);
 }
 
@@ -2,13 +2,215 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../../kv_app.h"
+#include "../../kv_memory.h"
 struct kv_storage storage;
 struct kv_value_log value_log;
 uint8_t *buf;
-enum { WRITE1, READ0, READ1, DONE } state = WRITE1;
-char const *op_str[] = {"WRITE0", "WRITE1", "READ0", "READ1"};
+enum { WRITE1, READ0, READ1, READ2, DONE } state = WRITE1;
+char const *op_str[] = {"WRITE0", "WRITE1", "READ0", "READ1", "READ2"};
+// --- buffered batches ---
+// Batches of 100B-1KB values span several blocks. The log of SMALL_LOG_SIZE blocks is split into segments of
+// KV_VALUE_LOG_MIN_SEGMENT_BLKS blocks, so the batches open new segments and, reusing the ones left empty, wrap around
+// the end of the log.
+#define SMALL_LOG_SIZE (8 * KV_VALUE_LOG_MIN_SEGMENT_BLKS)
+#define BATCH_NUM 64
+#define BATCH_SIZE 6
+struct kv_value_log small_log;
+uint8_t *batch_buf, *read_buf[BATCH_SIZE];
+uint32_t batch_i, batch_opens, batch_wraps, reading;
+uint32_t batch_length[BATCH_SIZE];
+uint64_t batch_offset[BATCH_SIZE], batch_bucket_id[BATCH_SIZE], last_batch_offset;
+
+static inline uint8_t batch_byte(uint32_t i, uint32_t j) { return (uint8_t)(batch_i * 31 + i * 7 + j); }
+
+static void buffered_fini(int rc) {
+    for (uint32_t i = 0; i < BATCH_SIZE; i++) kv_storage_free(read_buf[i]);
+    kv_storage_free(batch_buf);
+    kv_value_log_fini(&small_log);
+    kv_value_log_fini(&value_log);
+    kv_storage_fini(&storage);
+    kv_storage_free(buf);
+    kv_app_stop(rc);
+}
+
+// --- full log ---
+// Values nobody discards fill the small log: once no segment can be reclaimed, the waiting write fails on its own.
+#define FULL_VALUE_LENGTH (2 * storage.block_size)
+uint64_t full_offset, full_blocks;
+
+static void codec_start(void);
+static void full_write(void *arg);
+static void full_write_cb(bool success, void *cb_arg) {
+    if (success) {
+        kv_value_log_commit(&small_log, full_offset);
+        full_blocks += 2;
+        kv_value_log_wait_space(&small_log, FULL_VALUE_LENGTH, full_write, NULL);
+        return;
+    }
+    if (small_log.stats.write_fails != 1 || full_blocks + 2 * small_log.segment_blks < SMALL_LOG_SIZE) {
+        fprintf(stderr, "FULL write failed after %lu blocks, with %lu write fails.\n", full_blocks,
+                small_log.stats.write_fails);
+        buffered_fini(-1);
+        return;
+    }
+    printf("FULL successfully, the write failed after %lu blocks.\n", full_blocks);
+    codec_start();
+}
+
+static void full_write(void *arg) {
+    if (full_blocks > 2 * SMALL_LOG_SIZE) {
+        fprintf(stderr, "FULL wrote more than the log holds.\n");
+        buffered_fini(-1);
+        return;
+    }
+    full_offset = kv_value_log_write(&small_log, full_blocks, batch_buf, FULL_VALUE_LENGTH, full_write_cb, NULL);
+}
+
+// --- compression ---
+// A value of repeated phrases is stored compressed and read back whole, random bytes are kept raw.
+#define CODEC_VALUE_LENGTH 3000
+uint8_t *codec_value, *codec_record, *codec_read;
+uint32_t codec_record_length, codec_read_length;
+uint64_t codec_offset;
+
+static void codec_fini(int rc) {
+    kv_storage_free(codec_value);
+    kv_storage_free(codec_record);
+    kv_storage_free(codec_read);
+    buffered_fini(rc);
+}
+
+static void codec_read_cb(bool success, void *cb_arg) {
+    kv_value_log_commit(&value_log, codec_offset);
+    if (!success || codec_read_length != CODEC_VALUE_LENGTH || memcmp(codec_read, codec_value, CODEC_VALUE_LENGTH)) {
+        fprintf(stderr, "CODEC read back a corrupted value.\n");
+        codec_fini(-1);
+        return;
+    }
+    printf("CODEC successfully, %u B stored in %u B.\n", CODEC_VALUE_LENGTH, codec_record_length);
+    codec_fini(0);
+}
+
+static void codec_write_cb(bool success, void *cb_arg) {
+    if (!success) {
+        fprintf(stderr, "CODEC write failed.\n");
+        codec_fini(-1);
+        return;
+    }
+    codec_read_length = 0;
+    kv_value_log_read_value(&value_log, codec_offset, codec_record_length, KV_CODEC_LZ, codec_read, &codec_read_length,
+                            codec_read_cb, NULL);
+}
+
+static void codec_start(void) {
+    static const char phrase[] = "the values of a key-value store ";
+    codec_value = kv_storage_blk_alloc(&storage, 8);
+    codec_record = kv_storage_blk_alloc(&storage, 8);
+    codec_read = kv_storage_blk_alloc(&storage, 8);
+    for (uint32_t i = 0; i < CODEC_VALUE_LENGTH; i++) codec_value[i] = random();
+    if (kv_value_log_compress(&value_log, codec_value, CODEC_VALUE_LENGTH, codec_record)) {
+        fprintf(stderr, "CODEC compressed random bytes.\n");
+        codec_fini(-1);
+        return;
+    }
+    for (uint32_t i = 0; i < CODEC_VALUE_LENGTH; i++) codec_value[i] = phrase[i % (sizeof(phrase) - 1)] + i / 1000;
+    codec_record_length = kv_value_log_compress(&value_log, codec_value, CODEC_VALUE_LENGTH, codec_record);
+    if (codec_record_length == 0 || kv_value_log_codec_length(codec_record) != CODEC_VALUE_LENGTH) {
+        fprintf(stderr, "CODEC kept repeated phrases raw.\n");
+        codec_fini(-1);
+        return;
+    }
+    codec_offset = kv_value_log_write(&value_log, 2, codec_record, codec_record_length, codec_write_cb, NULL);
+}
+
+static void buffered_write(void *arg);
+static void buffered_read_cb(bool success, void *cb_arg) {
+    uint32_t i = (uint32_t)(uintptr_t)cb_arg;
+    if (!success) {
+        fprintf(stderr, "BUFFERED read %u of batch %u failed.\n", i, batch_i);
+        buffered_fini(-1);
+        return;
+    }
+    for (uint32_t j = 0; j < batch_length[i]; j++) {
+        if (read_buf[i][j] != batch_byte(i, j)) {
+            fprintf(stderr, "BUFFERED value %u of batch %u is corrupted at byte %u.\n", i, batch_i, j);
+            buffered_fini(-1);
+            return;
+        }
+    }
+    if (read_buf[i][batch_length[i]] != 0xA5) {
+        fprintf(stderr, "BUFFERED read %u of batch %u overran the value buffer.\n", i, batch_i);
+        buffered_fini(-1);
+        return;
+    }
+    if (--reading) return;
+    // nothing is compacted on this log, release the whole batch.
+    kv_value_log_commit(&small_log, batch_offset[0]);
+    for (uint32_t j = 0; j < BATCH_SIZE; j++) kv_value_log_discard(&small_log, batch_offset[j], batch_length[j]);
+    batch_i++;
+    kv_value_log_wait_space(&small_log, 16 * storage.block_size, buffered_write, NULL);
+}
+
+static void buffered_write_cb(bool success, void *cb_arg) {
+    if (!success) {
+        fprintf(stderr, "BUFFERED write of batch %u failed.\n", batch_i);
+        buffered_fini(-1);
+        return;
+    }
+    // the stream went back to a segment before the one of the previous batch.
+    if (batch_i && batch_offset[0] < last_batch_offset) batch_wraps++;
+    last_batch_offset = batch_offset[0];
+    reading = BATCH_SIZE;
+    for (uint32_t i = 0; i < BATCH_SIZE; i++) {
+        kv_memset(read_buf[i], 0xA5, 3 * storage.block_size);
+        kv_value_log_read(&small_log, batch_offset[i], read_buf[i], batch_length[i], buffered_read_cb,
+                          (void *)(uintptr_t)i);
+    }
+}
+
+static void buffered_write(void *arg) {
+    if (batch_i == BATCH_NUM) {
+        if (small_log.stats.gc_segments == 0) {
+            fprintf(stderr, "BUFFERED batches never reused a segment.\n");
+            buffered_fini(-1);
+            return;
+        }
+        if (batch_wraps == 0) {
+            fprintf(stderr, "BUFFERED batches never wrapped around the log.\n");
+            buffered_fini(-1);
+            return;
+        }
+        printf("BUFFERED successfully, %u batches opened new segments, %u wrapped around the log, %lu segments reused.\n",
+               batch_opens, batch_wraps, small_log.stats.gc_segments);
+        kv_value_log_wait_space(&small_log, FULL_VALUE_LENGTH, full_write, NULL);
+        return;
+    }
+    for (uint32_t i = 0; i < BATCH_SIZE; i++) {
+        batch_length[i] = 100 + (batch_i * 53 + i * 331) % 925;
+        batch_bucket_id[i] = batch_i * BATCH_SIZE + i;
+    }
+    uint64_t size = kv_value_log_buffered_layout(batch_length, batch_offset, BATCH_SIZE);
+    assert(size <= 16 * storage.block_size);
+    for (uint32_t i = 0; i < BATCH_SIZE; i++)
+        for (uint32_t j = 0; j < batch_length[i]; j++) batch_buf[batch_offset[i] + j] = batch_byte(i, j);
+    uint64_t blocks = (size + storage.block_size - 1) / storage.block_size;
+    if (small_log.streams[KV_VALUE_LOG_HOT].tail + blocks > small_log.segment_blks) batch_opens++;
+    kv_value_log_buffered_write(&small_log, batch_offset, batch_bucket_id, batch_buf, batch_length, BATCH_SIZE,
+                                buffered_write_cb, NULL);
+}
+
+static void buffered_start(void) {
+    kv_value_log_init(&small_log, &storage, NULL, storage.num_blocks - 2 * SMALL_LOG_SIZE, SMALL_LOG_SIZE,
+                      16 * storage.block_size, 1);
+    batch_buf = kv_storage_blk_alloc(&storage, 16);
+    for (uint32_t i = 0; i < BATCH_SIZE; i++) read_buf[i] = kv_storage_blk_alloc(&storage, 3);
+    buffered_write(NULL);
+}
+
 static void test_cb(bool success, void *cb_arg) {
     // mehcached_print_bucket(table.buckets);
     if (!success) {
@@ -20,8 +222,7 @@ static void test_cb(bool success, void *cb_arg) {
     printf("%s successfully.\n", op_str[(int)state]);
     switch (state) {
         case WRITE1:
-            offset = kv_value_log_offset(&value_log);
-            kv_value_log_write(&value_log, 1, buf + 3 * storage.block_size / 2, 5 * storage.block_size, test_cb, NULL);
+            offset = kv_value_log_write(&value_log, 1, buf + 3 * storage.block_size / 2, 5 * storage.block_size, test_cb, NULL);
             state = READ0;
             break;
         case READ0:
@@ -31,22 +232,34 @@ static void test_cb(bool success, void *cb_arg) {
         case READ1:
             puts(buf);  //     3. hello
             kv_value_log_read(&value_log, 260, buf, 5 * storage.block_size, test_cb, NULL);
-            state = DONE;
+            state = READ2;
             break;
-        case DONE:
+        case READ2:
             puts(buf);                               // 1. hello
             puts(buf + storage.block_size / 2);      // 2. hello
             puts(buf + 3 * storage.block_size / 2);  // 3. hello
-            kv_value_log_fini(&value_log);
-            kv_storage_fini(&storage);
-            kv_storage_free(buf);
-            kv_app_stop(0);
+            // an unaligned read must not write past the end of the value
+            kv_memset(buf, 0xA5, 2 * storage.block_size);
+            kv_value_log_read(&value_log, 260, buf, 600, test_cb, NULL);
+            state = DONE;
+            break;
+        case DONE:
+            for (uint32_t i = 600; i < 2 * storage.block_size; i++) {
+                if (buf[i] != 0xA5) {
+                    fprintf(stderr, "READ2 overran the value buffer.\n");
+                    kv_app_stop(-1);
+                    return;
+                }
+            }
+            buf[600] = 0;
+            puts(buf);  // 1. hello
+            buffered_start();
     }
 }
 static void start(void *arg) {
     kv_storage_init(&storage, 0);
     kv_value_log_init(&value_log, &storage, NULL,  storage.num_blocks / 3,
-                       storage.num_blocks / 3, 1);
+                       storage.num_blocks / 3, 5 * storage.block_size, 1);
     buf = kv_storage_blk_alloc(&storage, 10);
     for (uint32_t i = 0; i < 20; i++) sprintf(buf + i * storage.block_size / 2, "    %u. hello", i);
 
@@ -0,0 +1,112 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define MF_LIMIT 12      // no match starts in the last MF_LIMIT bytes
+#define LAST_LITERALS 5  // the last bytes are always literals
+#define MAX_DISTANCE 65535
+#define SKIP_TRIGGER 6  // the step grows by one every 1 << SKIP_TRIGGER misses in a row
+
+static __thread uint32_t table[1 << HASH_LOG];  // positions in the current src, stale ones are checked against it
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+static inline uint32_t hash(uint32_t v) { return (v * 2654435761U) >> (32 - HASH_LOG); }
+
+// the part of a length past the 15 of its nibble, in bytes of 255.
+static inline uint8_t *put_length(uint8_t *op, uint32_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+// the room a sequence of lit literals and a match of match_len extra bytes takes, at most.
+static inline uint32_t sequence_size(uint32_t lit, uint32_t match_len) {
+    return 1 + lit / 255 + 1 + lit + 2 + match_len / 255 + 1;
+}
+
+uint32_t lz_compress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_cap) {
+    const uint8_t *ip = src, *anchor = src, *end = src + src_len;
+    uint8_t *op = dst, *op_end = dst + dst_cap;
+    if (src_len > MF_LIMIT) {
+        const uint8_t *match_limit = end - LAST_LITERALS, *ip_limit = end - MF_LIMIT;
+        uint32_t misses = 0;
+        while (ip < ip_limit) {
+            uint32_t h = hash(read32(ip));
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) ip--, ref--;
+            const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+            while (m < match_limit && *m == *r) m++, r++;
+            uint32_t lit = (uint32_t)(ip - anchor), match_len = (uint32_t)(m - ip) - MIN_MATCH;
+            if (sequence_size(lit, match_len) > (uint32_t)(op_end - op)) return 0;
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit < 15 ? lit : 15) << 4 | (match_len < 15 ? match_len : 15));
+            if (lit >= 15) op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            uint32_t offset = (uint32_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            if (match_len >= 15) op = put_length(op, match_len - 15);
+            ip = anchor = m;
+        }
+    }
+    uint32_t lit = (uint32_t)(end - anchor);
+    if (1 + lit / 255 + 1 + lit > (uint32_t)(op_end - op)) return 0;
+    *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (uint32_t)(op - dst);
+}
+
+// a length continued past the 15 of its nibble, false if src ends first.
+static inline bool get_length(const uint8_t **ip, const uint8_t *ip_end, uint32_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= ip_end) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len) {
+    const uint8_t *ip = src, *ip_end = src + src_len;
+    uint8_t *op = dst, *op_end = dst + dst_len;
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        uint32_t lit = token >> 4, match_len = token & 0xF;
+        if (lit == 15 && !get_length(&ip, ip_end, &lit)) return false;
+        if (lit > (uint32_t)(ip_end - ip) || lit > (uint32_t)(op_end - op)) return false;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == ip_end) break;  // the last sequence has no match
+        if (ip_end - ip < 2) return false;
+        uint32_t offset = ip[0] | (uint32_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) return false;
+        if (match_len == 15 && !get_length(&ip, ip_end, &match_len)) return false;
+        match_len += MIN_MATCH;
+        if (match_len > (uint32_t)(op_end - op)) return false;
+        const uint8_t *ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+        } else {  // the match overlaps its own output and repeats the last offset bytes
+            for (uint32_t i = 0; i < match_len; i++) op[i] = ref[i];
+        }
+        op += match_len;
+    }
+    return op == op_end;
+}
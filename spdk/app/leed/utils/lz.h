@@ -0,0 +1,24 @@
+// lz.h - a compressor of the LZ4 block format
+//
+// Byte-oriented LZ77 with a single-probe hash table: fast and light on CPU, at the cost of the ratio. The output is a
+// plain LZ4 block (no frame), which any LZ4 decoder reads.
+#ifndef _LZ_H_
+#define _LZ_H_
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Compresses src into dst and returns the compressed length, or 0 if it would take more than dst_cap bytes, so that
+// dst_cap also bounds the ratio worth keeping. Not reentrant: the hash table is per thread.
+uint32_t lz_compress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_cap);
+// Decompresses the block src into dst, false unless it decodes to exactly dst_len bytes without reading or writing
+// out of bounds.
+bool lz_decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+#endif
@@ -30,19 +30,23 @@ void kv_ycsb_init(kv_ycsb_handle *self, char *propertyfile, uint64_t *record_cnt
 
 void kv_ycsb_fini(kv_ycsb_handle self) { delete reinterpret_cast<CoreWorkload *>(self); }
 
-enum kv_ycsb_operation kv_ycsb_next(kv_ycsb_handle self, bool is_seq, uint8_t *key, uint8_t *value) {
+enum kv_ycsb_operation kv_ycsb_next(kv_ycsb_handle self, bool is_seq, uint8_t *key, uint8_t key_length, uint8_t *value) {
     CoreWorkload *wl = reinterpret_cast<CoreWorkload *>(self);
     enum kv_ycsb_operation op = is_seq ? YCSB_SEQ : (enum kv_ycsb_operation)(wl->NextOperation());
-    assert(op != YCSB_SCAN);
     const std::string &key_str = is_seq ? wl->NextSequenceKey() : wl->NextTransactionKey();
-    const uint128 &key_128 = CityHash128(key_str.c_str(), key_str.size());
-    kv_memcpy(key, &key_128, 16);
+    uint128 key_128 = CityHash128(key_str.c_str(), key_str.size());
+    for (uint32_t i = 0; i < key_length; i += 16) {
+        if (i) key_128 = CityHash128WithSeed(key_str.c_str(), key_str.size(), key_128);
+        kv_memcpy(key + i, &key_128, key_length - i < 16 ? key_length - i : 16);
+    }
 
-    if (op != YCSB_READ && value) {
+    if (op != YCSB_READ && op != YCSB_SCAN && value) {
         std::vector<DB::KVPair> values;
         wl->BuildValues(values);
         assert(values.size() == 1);
         kv_memcpy(value, values[0].second.c_str(), values[0].second.size());
     }
     return op;
-}
\ No newline at end of file
+}
+
+uint32_t kv_ycsb_scan_length(kv_ycsb_handle self) { return reinterpret_cast<CoreWorkload *>(self)->NextScanLength(); }
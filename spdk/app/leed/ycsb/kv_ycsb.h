@@ -10,7 +10,10 @@ void kv_ycsb_init(kv_ycsb_handle *self, char *propertyfile, uint64_t *record_cnt
                   uint32_t *value_size);
 void kv_ycsb_fini(kv_ycsb_handle self);
 
-enum kv_ycsb_operation kv_ycsb_next(kv_ycsb_handle self, bool is_seq, uint8_t *key, uint8_t *value);
+// Fills key_length bytes of key, a hash of the YCSB key stretched to the length asked for.
+enum kv_ycsb_operation kv_ycsb_next(kv_ycsb_handle self, bool is_seq, uint8_t *key, uint8_t key_length, uint8_t *value);
+// The number of records of a YCSB_SCAN, whose key is the first one.
+uint32_t kv_ycsb_scan_length(kv_ycsb_handle self);
 
 #ifdef __cplusplus
 }